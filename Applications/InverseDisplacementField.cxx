@@ -108,10 +108,26 @@ int main(int argc, char *argv[])
 {
   try
     {
-    if( argc < 3 )
+    if( argc < 4 )
       {
       std::cerr << "Usage:" << std::endl;
-      std::cerr << argv[0] << " input output number_of_iterations" << std::endl;
+      std::cerr << argv[0] << " input output number_of_iterations [number_of_integration_steps] [tolerance]"
+                << " [anderson_window]" << std::endl;
+      std::cerr << "  number_of_integration_steps: Euler steps of the exponentials of the log (default: 500),"
+                << " 0 for scaling and squaring" << std::endl;
+      std::cerr << "  tolerance: RMS of the correction of the log below which the iterations stop (default: 0)"
+                << std::endl;
+      std::cerr << "  anderson_window: previous iterates combined by Anderson acceleration (default: 0, off)"
+                << std::endl;
+      return -1;
+      }
+    const int    numberOfIntegrationSteps = ( argc > 4 ) ? atoi(argv[4]) : 500;
+    const double tolerance = ( argc > 5 ) ? atof(argv[5]) : 0.0;
+    const int    andersonWindowSize = ( argc > 6 ) ? atoi(argv[6]) : 0;
+    if( numberOfIntegrationSteps < 0 )
+      {
+      std::cerr << "Usage error: number_of_integration_steps must be positive,"
+                << " or 0 for scaling and squaring" << std::endl;
       return -1;
       }
 
@@ -150,9 +166,23 @@ int main(int argc, char *argv[])
       VelocitorFilterType::Pointer velocitor = VelocitorFilterType::New();
       velocitor->SetInput(displacement);
       velocitor->SetNumberOfIterations( atoi(argv[3]) );
+      velocitor->SetTolerance( tolerance );
+      if( andersonWindowSize > 0 )
+        {
+        velocitor->UseAndersonAccelerationOn();
+        velocitor->SetAndersonWindowSize( andersonWindowSize );
+        }
       velocitor->SmoothVelocityFieldOn();
       velocitor->SetSigma(2.0);
-      velocitor->SetNumberOfExponentialIntegrationSteps(500);
+      if( numberOfIntegrationSteps > 0 )
+        {
+        velocitor->SetNumberOfExponentialIntegrationSteps(numberOfIntegrationSteps);
+        }
+      else
+        {
+        velocitor->SetExponentialIntegrationMethod(VelocitorFilterType::ExponentialCompositionFilterType
+                                                   ::ScalingAndSquaringIntegration);
+        }
       velocitor->SetNumberOfBCHApproximationTerms(3);
 
       CommandIterationUpdate<double, 3>::Pointer observer = CommandIterationUpdate<double, 3>::New();
@@ -35,6 +35,8 @@ struct arguments
   std::string movingImageFile;    /* -m option */
   std::string inputFieldFile;     /* -b option */
   std::string inputTransformFile; /* -p option */
+  std::string fixedMaskFile;      /* --mask option */
+  std::string movingMaskFile;     /* --moving-mask option */
   std::string outputImageFile;    /* -o option */
   std::string outputDeformationFieldFile;
   std::string outputInverseDisplacementFieldFile;
@@ -48,6 +50,21 @@ struct arguments
   unsigned int gradientType;                  /* -t option */
   unsigned int NumberOfBCHApproximationTerms; /* -c option */
   bool useHistogramMatching;                  /* -e option */
+  unsigned int smoothingEngine;               /* --smoothing-engine option */
+  unsigned int convergenceWindowSize;         /* --convergence-window option */
+  float convergenceTolerance;                 /* --convergence-tolerance option */
+  float timeBudget;                           /* --time-budget option */
+  float narrowBandThreshold;                  /* --narrow-band option */
+  unsigned int narrowBandInterval;            /* --narrow-band-interval option */
+  bool useLazyPyramid;                        /* --lazy-pyramid option */
+  bool useIsotropicSchedule;                  /* --isotropic-schedule option */
+  bool reserveBuffers;                        /* --reserve-buffers option */
+  unsigned int velocityShrinkFactor;          /* --velocity-shrink-factor option */
+  bool doublePrecisionExponential;            /* --double-precision-exponential option */
+  bool useSymmetricForces;                    /* --symmetric-forces option */
+  std::string checkpointFile;                 /* --checkpoint option */
+  unsigned int checkpointInterval;            /* --checkpoint-interval option */
+  std::string resumeFile;                     /* --resume option */
   unsigned int verbosity;                     /* -d option */
 
   friend std::ostream & operator<<(std::ostream& o, const arguments& args)
@@ -95,12 +112,42 @@ struct arguments
 
     std::string histoMatchStr = (args.useHistogramMatching ? "true" : "false");
 
+    std::string smoothingStr;
+
+    switch( args.smoothingEngine )
+      {
+      case 0:
+        smoothingStr = "Gaussian operator";
+        break;
+      case 1:
+        smoothingStr = "recursive Gaussian";
+        break;
+      case 2:
+        smoothingStr = "Gaussian kernel with line buffers";
+        break;
+      default:
+        smoothingStr = "unsuported";
+      }
+
+    std::ostringstream convstr;
+    if( args.convergenceWindowSize > 0 )
+      {
+      convstr << "window of " << args.convergenceWindowSize << " iterations, tolerance "
+              << args.convergenceTolerance;
+      }
+    else
+      {
+      convstr << "off";
+      }
+
     return o
            << "Arguments structure:" << std::endl
            << "  Fixed image file: " << args.fixedImageFile << std::endl
            << "  Moving image file: " << args.movingImageFile << std::endl
            << "  Input velocity field file: " << args.inputFieldFile << std::endl
            << "  Input transform file: " << args.inputTransformFile << std::endl
+           << "  Fixed image mask file: " << args.fixedMaskFile << std::endl
+           << "  Moving image mask file: " << args.movingMaskFile << std::endl
            << "  Output image file: " << args.outputImageFile << std::endl
            << "  Output deformation field file: " << args.outputDeformationFieldFile << std::endl
            << "  Output inverse deformation field file: " << args.outputInverseDisplacementFieldFile << std::endl
@@ -115,6 +162,20 @@ struct arguments
            << "  Type of gradient: " << gtypeStr << std::endl
            << "  Number of terms in the BCH expansion: " << args.NumberOfBCHApproximationTerms << std::endl
            << "  Use histogram matching: " << histoMatchStr << std::endl
+           << "  Smoothing engine: " << smoothingStr << std::endl
+           << "  Convergence criterion: " << convstr.str() << std::endl
+           << "  Time budget (s): " << args.timeBudget << std::endl
+           << "  Narrow band threshold at the finest level: " << args.narrowBandThreshold << std::endl
+           << "  Narrow band update interval: " << args.narrowBandInterval << std::endl
+           << "  Compute pyramid levels on demand: " << (args.useLazyPyramid ? "true" : "false") << std::endl
+           << "  Spacing-aware shrink schedule: " << (args.useIsotropicSchedule ? "true" : "false") << std::endl
+           << "  Reserve buffers for the finest level: " << (args.reserveBuffers ? "true" : "false") << std::endl
+           << "  Velocity field shrink factor: " << args.velocityShrinkFactor << std::endl
+           << "  Double precision exponential: " << (args.doublePrecisionExponential ? "true" : "false") << std::endl
+           << "  Symmetric forces in one traversal: " << (args.useSymmetricForces ? "true" : "false") << std::endl
+           << "  Checkpoint file: " << args.checkpointFile << std::endl
+           << "  Checkpoint interval: " << args.checkpointInterval << std::endl
+           << "  Resume from checkpoint file: " << args.resumeFile << std::endl
            << "  Algorithm verbosity (debug level): " << args.verbosity;
   }
 
@@ -220,6 +281,15 @@ void parseOpts(int argc, char * *argv, struct arguments & args)
   command.SetOptionLongTag("InputTransformFile", "input-transform");
   command.AddOptionField("InputTransformFile", "filename", MetaCommand::STRING, true);
 
+  command.SetOption("FixedMaskFile", "", false,
+                    "Fixed image mask filename. The forces are only computed around the non zero voxels of the masks");
+  command.SetOptionLongTag("FixedMaskFile", "mask");
+  command.AddOptionField("FixedMaskFile", "filename", MetaCommand::STRING, true);
+
+  command.SetOption("MovingMaskFile", "", false, "Moving image mask filename");
+  command.SetOptionLongTag("MovingMaskFile", "moving-mask");
+  command.AddOptionField("MovingMaskFile", "filename", MetaCommand::STRING, true);
+
   command.SetOption("OutputImageFile", "o", false, "Output image filename");
   command.SetOptionLongTag("OutputImageFile", "output-image");
   command.AddOptionField("OutputImageFile", "filename", MetaCommand::STRING, true, "output.mha");
@@ -292,6 +362,93 @@ void parseOpts(int argc, char * *argv, struct arguments & args)
   command.SetOptionLongTag("UseHistogramMatching", "use-histogram-matching");
   command.AddOptionField("UseHistogramMatching", "boolval", MetaCommand::FLAG, false);
 
+  command.SetOption(
+    "SmoothingEngine", "", false,
+    "Engine used to smooth the fields. 0 is a truncated Gaussian kernel, 1 is a recursive Gaussian whose cost does not depend on sigma, 2 is a truncated Gaussian kernel applied in place with line buffers");
+  command.SetOptionLongTag("SmoothingEngine", "smoothing-engine");
+  command.AddOptionField("SmoothingEngine", "type", MetaCommand::INT, true, "0");
+  command.SetOptionRange("SmoothingEngine", "type", "0", "2");
+
+  command.SetOption(
+    "ConvergenceWindowSize", "", false,
+    "Stop a level when neither the metric nor the RMS change decreased over this number of iterations. The number of iterations of each level is then a maximum. 0 disables the convergence criterion");
+  command.SetOptionLongTag("ConvergenceWindowSize", "convergence-window");
+  command.AddOptionField("ConvergenceWindowSize", "intval", MetaCommand::INT, true, "0");
+  command.SetOptionRange("ConvergenceWindowSize", "intval", "0", "1000");
+
+  command.SetOption(
+    "ConvergenceTolerance", "", false,
+    "Relative decrease per iteration of the metric and of the RMS change below which a level is considered converged");
+  command.SetOptionLongTag("ConvergenceTolerance", "convergence-tolerance");
+  command.AddOptionField("ConvergenceTolerance", "floatval", MetaCommand::FLOAT, true, "0.001");
+
+  command.SetOption(
+    "TimeBudget", "", false,
+    "Complete the registration within this wall-clock time in seconds by reducing the number of iterations of the levels. 0 disables the time budget");
+  command.SetOptionLongTag("TimeBudget", "time-budget");
+  command.AddOptionField("TimeBudget", "floatval", MetaCommand::FLOAT, true, "0");
+
+  command.SetOption(
+    "NarrowBandThreshold", "", false,
+    "At the finest level, only compute the forces where the intensity difference between the images is above this threshold, the band being rebuilt every narrow-band-interval iterations. 0 disables the narrow band");
+  command.SetOptionLongTag("NarrowBandThreshold", "narrow-band");
+  command.AddOptionField("NarrowBandThreshold", "floatval", MetaCommand::FLOAT, true, "0");
+
+  command.SetOption("NarrowBandInterval", "", false,
+                    "Number of iterations between two updates of the narrow band");
+  command.SetOptionLongTag("NarrowBandInterval", "narrow-band-interval");
+  command.AddOptionField("NarrowBandInterval", "intval", MetaCommand::INT, true, "5");
+  command.SetOptionRange("NarrowBandInterval", "intval", "1", "1000");
+
+  command.SetOption("UseLazyPyramid", "", false,
+                    "Compute each pyramid level when the registration reaches it instead of all of them up front");
+  command.SetOptionLongTag("UseLazyPyramid", "lazy-pyramid");
+  command.AddOptionField("UseLazyPyramid", "boolval", MetaCommand::FLAG, false);
+
+  command.SetOption(
+    "UseIsotropicSchedule", "", false,
+    "Choose the shrink factors of each level along each axis so that the voxels are close to isotropic, and smooth isotropically in physical space. The sigmas are then given in units of the smallest spacing of the fixed image");
+  command.SetOptionLongTag("UseIsotropicSchedule", "isotropic-schedule");
+  command.AddOptionField("UseIsotropicSchedule", "boolval", MetaCommand::FLAG, false);
+
+  command.SetOption("ReserveBuffers", "", false,
+                    "Allocate the registration buffers once for the finest level and reuse them at all levels");
+  command.SetOptionLongTag("ReserveBuffers", "reserve-buffers");
+  command.AddOptionField("ReserveBuffers", "boolval", MetaCommand::FLAG, false);
+
+  command.SetOption(
+    "VelocityShrinkFactor", "", false,
+    "Store the velocity field on a grid coarser than the fixed image by this factor along each dimension. The forces are still computed at the resolution of the fixed image. Requires the log-domain update rule (-a 0)");
+  command.SetOptionLongTag("VelocityShrinkFactor", "velocity-shrink-factor");
+  command.AddOptionField("VelocityShrinkFactor", "intval", MetaCommand::INT, true, "1");
+  command.SetOptionRange("VelocityShrinkFactor", "intval", "1", "16");
+
+  command.SetOption("DoublePrecisionExponential", "", false,
+                    "Compute the squarings of the exponentials in double precision, the fields being stored in float");
+  command.SetOptionLongTag("DoublePrecisionExponential", "double-precision-exponential");
+  command.AddOptionField("DoublePrecisionExponential", "boolval", MetaCommand::FLAG, false);
+
+  command.SetOption("UseSymmetricForceFunction", "", false,
+                    "Compute the forward and backward forces of the symmetric log-domain demons in a single traversal");
+  command.SetOptionLongTag("UseSymmetricForceFunction", "symmetric-forces");
+  command.AddOptionField("UseSymmetricForceFunction", "boolval", MetaCommand::FLAG, false);
+
+  command.SetOption("CheckpointFile", "", false,
+                    "Checkpoint the registration to this file at each level boundary, in the background");
+  command.SetOptionLongTag("CheckpointFile", "checkpoint");
+  command.AddOptionField("CheckpointFile", "filename", MetaCommand::STRING, true);
+
+  command.SetOption("CheckpointInterval", "", false,
+                    "Also checkpoint every given number of iterations within a level. 0 only checkpoints at level boundaries");
+  command.SetOptionLongTag("CheckpointInterval", "checkpoint-interval");
+  command.AddOptionField("CheckpointInterval", "intval", MetaCommand::INT, true, "0");
+  command.SetOptionRange("CheckpointInterval", "intval", "0", "100000");
+
+  command.SetOption("ResumeFile", "", false,
+                    "Resume the registration from this checkpoint file, skipping the levels it already went through. The same images and options must be given");
+  command.SetOptionLongTag("ResumeFile", "resume");
+  command.AddOptionField("ResumeFile", "filename", MetaCommand::STRING, true);
+
   command.SetOption("AlgorithmVerbosity", "d", false, "Algorithm verbosity (debug level)");
   command.SetOptionLongTag("AlgorithmVerbosity", "verbose");
   command.AddOptionField("AlgorithmVerbosity", "intval", MetaCommand::INT, false, "1");
@@ -308,6 +465,8 @@ void parseOpts(int argc, char * *argv, struct arguments & args)
   args.movingImageFile = command.GetValueAsString("MovingImageFile", "filename");
   args.inputFieldFile = command.GetValueAsString("InputFieldFile", "filename");
   args.inputTransformFile = command.GetValueAsString("InputTransformFile", "filename");
+  args.fixedMaskFile = command.GetValueAsString("FixedMaskFile", "filename");
+  args.movingMaskFile = command.GetValueAsString("MovingMaskFile", "filename");
   args.outputImageFile = command.GetValueAsString("OutputImageFile", "filename");
 
   args.outputDeformationFieldFile = command.GetValueAsString("OutputDeformationFieldFile", "filename");
@@ -379,6 +538,46 @@ void parseOpts(int argc, char * *argv, struct arguments & args)
   args.gradientType = command.GetValueAsInt("GradientType", "type");
   args.NumberOfBCHApproximationTerms = command.GetValueAsInt("NumberOfBCHApproximationTerms", "intval");
   args.useHistogramMatching = command.GetValueAsBool("UseHistogramMatching", "boolval");
+  args.smoothingEngine = command.GetValueAsInt("SmoothingEngine", "type");
+  args.convergenceWindowSize = command.GetValueAsInt("ConvergenceWindowSize", "intval");
+  args.convergenceTolerance = command.GetValueAsFloat("ConvergenceTolerance", "floatval");
+  args.timeBudget = command.GetValueAsFloat("TimeBudget", "floatval");
+  args.narrowBandThreshold = command.GetValueAsFloat("NarrowBandThreshold", "floatval");
+  args.narrowBandInterval = command.GetValueAsInt("NarrowBandInterval", "intval");
+  args.useLazyPyramid = command.GetValueAsBool("UseLazyPyramid", "boolval");
+  args.useIsotropicSchedule = command.GetValueAsBool("UseIsotropicSchedule", "boolval");
+  args.reserveBuffers = command.GetValueAsBool("ReserveBuffers", "boolval");
+  args.velocityShrinkFactor = command.GetValueAsInt("VelocityShrinkFactor", "intval");
+  args.doublePrecisionExponential = command.GetValueAsBool("DoublePrecisionExponential", "boolval");
+  args.useSymmetricForces = command.GetValueAsBool("UseSymmetricForceFunction", "boolval");
+  args.checkpointFile = command.GetValueAsString("CheckpointFile", "filename");
+  args.checkpointInterval = command.GetValueAsInt("CheckpointInterval", "intval");
+  args.resumeFile = command.GetValueAsString("ResumeFile", "filename");
+
+  if( args.timeBudget < 0.0 )
+    {
+    std::cout << "TimeBudget.floatval : Value (" << args.timeBudget << ") should not be negative" << std::endl;
+    exit( EXIT_FAILURE );
+    }
+
+  if( args.narrowBandThreshold < 0.0 )
+    {
+    std::cout << "NarrowBandThreshold.floatval : Value (" << args.narrowBandThreshold
+              << ") should not be negative" << std::endl;
+    exit( EXIT_FAILURE );
+    }
+
+  if( args.convergenceWindowSize == 1 )
+    {
+    std::cout << "ConvergenceWindowSize.intval : Value (1) should be 0 or at least 2" << std::endl;
+    exit( EXIT_FAILURE );
+    }
+
+  if( args.velocityShrinkFactor > 1 && args.updateRule != 0 )
+    {
+    std::cout << "A velocity field shrink factor requires the log-domain update rule (-a 0)" << std::endl;
+    exit( EXIT_FAILURE );
+    }
 
   args.verbosity = 0;
   if( command.GetOptionWasSet("AlgorithmVerbosity") )
@@ -652,6 +851,30 @@ private:
   typename WarpGradientCalculatorType::Pointer m_CompWarpGradientCalculator;
 };
 
+// Read a mask image, exit on failure
+template <class TMaskImage>
+typename TMaskImage::Pointer ReadMaskImage( const std::string & filename )
+{
+  typedef itk::ImageFileReader<TMaskImage> MaskReaderType;
+  typename MaskReaderType::Pointer maskReader = MaskReaderType::New();
+  maskReader->SetFileName( filename.c_str() );
+
+  try
+    {
+    maskReader->Update();
+    }
+  catch( itk::ExceptionObject& err )
+    {
+    std::cout << "Could not read the mask " << filename << std::endl;
+    std::cout << err << std::endl;
+    exit( EXIT_FAILURE );
+    }
+
+  typename TMaskImage::Pointer mask = maskReader->GetOutput();
+  mask->DisconnectPipeline();
+  return mask;
+}
+
 template <unsigned int Dimension>
 void LogDomainDemonsRegistrationFunction( arguments args )
 {
@@ -882,6 +1105,7 @@ void LogDomainDemonsRegistrationFunction( arguments args )
           actualfilter->SetUseGradientType(
             static_cast<GradientType>(args.gradientType) );
           actualfilter->SetNumberOfBCHApproximationTerms(args.NumberOfBCHApproximationTerms);
+          actualfilter->SetUseSymmetricForceFunction( args.useSymmetricForces );
           filter = actualfilter;
           }
         break;
@@ -910,6 +1134,12 @@ void LogDomainDemonsRegistrationFunction( arguments args )
       filter->SmoothUpdateFieldOff();
       }
 
+    filter->SetSmoothingEngine(
+      static_cast<typename BaseRegistrationFilterType::SmoothingEngineType>(args.smoothingEngine) );
+
+    filter->SetVelocityFieldShrinkFactor( args.velocityShrinkFactor );
+    filter->SetUseDoublePrecisionExponential( args.doublePrecisionExponential );
+
     // filter->SetIntensityDifferenceThreshold( 0.001 );
 
     if( args.verbosity > 0 )
@@ -967,6 +1197,52 @@ void LogDomainDemonsRegistrationFunction( arguments args )
 
     multires->SetNumberOfIterations( &args.numIterations[0] );
 
+    multires->SetUseLazyPyramid( args.useLazyPyramid );
+    multires->SetTimeBudget( args.timeBudget );
+
+    if( args.narrowBandThreshold > 0.0 )
+      {
+      multires->UseNarrowBandAtFinestLevelOn();
+      multires->SetNarrowBandThreshold( args.narrowBandThreshold );
+      multires->SetNarrowBandUpdateInterval( args.narrowBandInterval );
+      }
+
+    if( args.useIsotropicSchedule )
+      {
+      // The sigmas are in units of the smallest spacing at the finest level
+      double minimumSpacing = fixedImage->GetSpacing()[0];
+      for( unsigned int j = 1; j < Dimension; j++ )
+        {
+        minimumSpacing = vnl_math_min( minimumSpacing, static_cast<double>( fixedImage->GetSpacing()[j] ) );
+        }
+      filter->StandardDeviationsInPhysicalUnitsOn();
+      filter->SetStandardDeviations( args.sigmaVel * minimumSpacing );
+      filter->SetUpdateFieldStandardDeviations( args.sigmaUp * minimumSpacing );
+      multires->UseSpacingAwareScheduleOn();
+      }
+    multires->SetReserveRegistrationBuffers( args.reserveBuffers );
+
+    multires->SetCheckpointFileName( args.checkpointFile );
+    multires->SetCheckpointInterval( args.checkpointInterval );
+    multires->SetResumeFileName( args.resumeFile );
+
+    typedef typename MultiResRegistrationFilterType::MaskImageType MaskImageType;
+    if( !args.fixedMaskFile.empty() )
+      {
+      multires->SetFixedImageMask( ReadMaskImage<MaskImageType>( args.fixedMaskFile ) );
+      }
+    if( !args.movingMaskFile.empty() )
+      {
+      multires->SetMovingImageMask( ReadMaskImage<MaskImageType>( args.movingMaskFile ) );
+      }
+
+    if( args.convergenceWindowSize > 0 )
+      {
+      multires->UseConvergenceCriterionOn();
+      multires->SetConvergenceWindowSize( args.convergenceWindowSize );
+      multires->SetConvergenceTolerance( args.convergenceTolerance );
+      }
+
     multires->SetFixedImage( fixedImage );
     multires->SetMovingImage( movingImage );
     multires->SetArbitraryInitialVelocityField( inputVelField );
@@ -991,6 +1267,40 @@ void LogDomainDemonsRegistrationFunction( arguments args )
       exit( EXIT_FAILURE );
       }
 
+    if( args.verbosity > 0 )
+      {
+      std::cout << "Peak pyramid memory: "
+                << static_cast<double>( multires->GetPeakPyramidMemory() ) / ( 1024.0 * 1024.0 )
+                << " MB" << std::endl;
+      std::cout << "Registration buffer allocations: "
+                << filter->GetNumberOfBufferAllocations() + filter->GetNumberOfScratchAllocations()
+                << std::endl;
+      if( !args.checkpointFile.empty() )
+        {
+        std::cout << "Number of checkpoints: " << multires->GetNumberOfCheckpoints() << std::endl;
+        }
+      }
+
+    if( args.verbosity > 0 && ( args.convergenceWindowSize > 0 || args.timeBudget > 0.0 ) )
+      {
+      std::cout << "Number of iterations run at each level:";
+      for( unsigned int i = 0; i < args.numIterations.size(); ++i )
+        {
+        std::cout << " " << multires->GetElapsedIterations()[i];
+        }
+      std::cout << std::endl;
+      }
+
+    if( args.verbosity > 0 )
+      {
+      std::cout << "Time spent on each level (s):";
+      for( unsigned int i = 0; i < args.numIterations.size(); ++i )
+        {
+        std::cout << " " << multires->GetLevelTimes()[i];
+        }
+      std::cout << std::endl;
+      }
+
     // Get various outputs
 
     // Final deformation field
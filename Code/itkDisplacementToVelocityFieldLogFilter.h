@@ -7,6 +7,9 @@
 #include "itkVelocityFieldBCHCompositionFilter.h"
 #include "itkVelocityFieldExponentialComposedWithDisplacementFieldFilter.h"
 #include <itkRecursiveGaussianImageFilter.h>
+#include <itkFixedArray.h>
+
+#include <vector>
 
 namespace itk
 {
@@ -17,6 +20,27 @@ namespace itk
  * M. N. Bossa, S. Olmos Gasso."A new algorithm for the computation of the group
  * logarithm of diffeomorphisms". In Proc. MFCA 2008.
  *
+ * The iterations start from v_0 = Phi - Id, or from the field given with
+ * SetInitialVelocityField, which must have the region of the input, e.g.
+ * the upsampled logarithm of a coarser level, see
+ * MultiResolutionDisplacementToVelocityFieldLogFilter.
+ *
+ * Each iteration computes the correction delta_n = exp(-v_n) o Phi - Id
+ * and stops the fixed-point iterations once the root mean square of
+ * delta_n falls below Tolerance, before the correction is applied, or
+ * after NumberOfIterations iterations. The root mean squares of the
+ * corrections are kept in the residual history. The optional smoothing
+ * of the fields is done along every dimension of the image.
+ *
+ * With UseAndersonAcceleration, each iterate is the Anderson mixing of the
+ * last outputs of the fixed-point map G(v_n) = BCH(v_n, delta_n): the
+ * differences of the last AndersonWindowSize outputs and residuals
+ * G(v_n) - v_n are kept, and the combination that minimizes the residual in
+ * the least-squares sense is taken instead of G(v_n). The differences are
+ * stored in float fields from a pool that is kept between updates. The
+ * window is emptied whenever the residual grows, which falls back to a
+ * plain iteration.
+ *
  * \author Pierre Fillard, INRIA Paris
  */
 
@@ -36,6 +60,13 @@ public:
   typedef TInputImage  InputImageType;
   typedef TOutputImage OutputImageType;
 
+  /** Dimension of the fields. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+  /** Float fields of the Anderson window. */
+  typedef Image<Vector<float, itkGetStaticConstMacro(ImageDimension)>,
+                itkGetStaticConstMacro(ImageDimension)> AndersonFieldType;
+
   typedef VelocityFieldBCHCompositionFilter<OutputImageType, OutputImageType> BCHFilterType;
   typedef VelocityFieldExponentialComposedWithDisplacementFieldFilter<TOutputImage, TInputImage, TInputImage>
   ExponentialCompositionFilterType;
@@ -49,6 +80,40 @@ public:
 
   itkGetMacro(ElapsedIterations, unsigned int);
 
+  /** Set/Get the velocity field the iterations start from. If none is
+   * set, the displacement field is used. */
+  itkSetObjectMacro(InitialVelocityField, OutputImageType);
+  itkGetObjectMacro(InitialVelocityField, OutputImageType);
+
+  /**
+   *  Set/Get the root mean square of the correction delta_n, in physical
+   *  units, below which the iterations stop (default: 0, i.e. all the
+   *  iterations are run).
+   */
+  itkSetMacro(Tolerance, double);
+  itkGetConstMacro(Tolerance, double);
+
+  /**
+   *  Accelerate the fixed-point iterations by Anderson mixing (default: off).
+   */
+  itkSetMacro(UseAndersonAcceleration, bool);
+  itkGetConstMacro(UseAndersonAcceleration, bool);
+  itkBooleanMacro(UseAndersonAcceleration);
+
+  /**
+   *  Set/Get the number of previous iterates combined by the Anderson
+   *  mixing (default: 3).
+   */
+  itkSetClampMacro(AndersonWindowSize, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro(AndersonWindowSize, unsigned int);
+
+  /** Root mean square of the correction delta_n at each iteration of the
+   * last update, including the one that met the tolerance. */
+  const std::vector<double> & GetResidualHistory() const
+  {
+    return m_ResidualHistory;
+  }
+
   /**
    *  Set/Get the number of integration steps when computing the exponential
    *  of the velocity field (default: 500).
@@ -63,6 +128,37 @@ public:
     return m_ExpComp->GetNumberOfIntegrationSteps();
   }
 
+  /**
+   *  Set/Get the method used to integrate the velocity field at each
+   *  iteration (default: Euler). Scaling and squaring makes an iteration
+   *  cost a few interpolations per voxel instead of one per integration
+   *  step, see VelocityFieldExponentialComposedWithDisplacementFieldFilter.
+   */
+  typedef typename ExponentialCompositionFilterType::IntegrationMethodType IntegrationMethodType;
+  void SetExponentialIntegrationMethod(IntegrationMethodType method)
+  {
+    m_ExpComp->SetIntegrationMethod(method);
+  }
+
+  IntegrationMethodType GetExponentialIntegrationMethod(void) const
+  {
+    return m_ExpComp->GetIntegrationMethod();
+  }
+
+  /**
+   *  Set/Get the local error tolerance of the adaptive Runge-Kutta
+   *  integration of the velocity field (default: 1e-3).
+   */
+  void SetExponentialIntegrationTolerance(double tolerance)
+  {
+    m_ExpComp->SetIntegrationTolerance(tolerance);
+  }
+
+  double GetExponentialIntegrationTolerance(void) const
+  {
+    return m_ExpComp->GetIntegrationTolerance();
+  }
+
   /**
    * Set/Get the number of approximation terms when computing
    * the BCH (default: 3). */
@@ -86,15 +182,16 @@ public:
 
   void SetSigma(double sigma)
   {
-    m_LeftSmootherX->SetSigma(sigma);
-    m_LeftSmootherY->SetSigma(sigma);
-    m_RightSmootherX->SetSigma(sigma);
-    m_RightSmootherY->SetSigma(sigma);
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      m_LeftSmoothers[j]->SetSigma(sigma);
+      m_RightSmoothers[j]->SetSigma(sigma);
+      }
   }
 
   double GetSigma(void) const
   {
-    return m_LeftSmootherX->GetSigma();
+    return m_LeftSmoothers[0]->GetSigma();
   }
 
 protected:
@@ -105,19 +202,50 @@ protected:
 
   void GenerateData(void);
 
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Smooth the field along every dimension with the given chain. */
+  typename InputImageType::Pointer SmoothField(InputImageType * field,
+                                                const FixedArray<typename GaussianFilterType::Pointer,
+                                                                 ImageDimension> & smoothers) const;
+
+  /** Root mean square of the vectors of the field. */
+  double ComputeRootMeanSquare(const InputImageType * field) const;
+
+  /** Replace the output of the fixed-point map, computed from the given
+   * iterate, by its Anderson mixing with the previous ones. */
+  void AndersonMix(InputImageType * output, const InputImageType * iterate);
+
+  /** Field of the pool, allocated on the region of the reference field. */
+  AndersonFieldType * GetAndersonField(unsigned int i, const InputImageType * reference);
+
 private:
   DisplacementToVelocityFieldLogFilter(const Self &);
   void operator=(const Self &);
 
   unsigned int m_NumberOfIterations;
   unsigned int m_ElapsedIterations;
+  double       m_Tolerance;
+
+  typename OutputImageType::Pointer m_InitialVelocityField;
+
+  std::vector<double> m_ResidualHistory;
+
+  bool         m_UseAndersonAcceleration;
+  unsigned int m_AndersonWindowSize;
+
+  /** Previous output and residual, then the columns of differences of
+   * outputs and of residuals. */
+  std::vector<typename AndersonFieldType::Pointer> m_AndersonFields;
+  unsigned int                                     m_AndersonNumberOfColumns;
+  unsigned int                                     m_AndersonNextColumn;
+  bool                                             m_AndersonHasPrevious;
+  double                                           m_AndersonPreviousResidual;
 
   typename ExponentialCompositionFilterType::Pointer m_ExpComp;
   typename BCHFilterType::Pointer m_BCHCalculator;
-  typename GaussianFilterType::Pointer m_LeftSmootherX;
-  typename GaussianFilterType::Pointer m_LeftSmootherY;
-  typename GaussianFilterType::Pointer m_RightSmootherX;
-  typename GaussianFilterType::Pointer m_RightSmootherY;
+  FixedArray<typename GaussianFilterType::Pointer, ImageDimension> m_LeftSmoothers;
+  FixedArray<typename GaussianFilterType::Pointer, ImageDimension> m_RightSmoothers;
 
   bool m_SmoothVelocityField;
 };
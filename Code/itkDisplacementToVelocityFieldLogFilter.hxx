@@ -7,6 +7,11 @@
 
 #include "itkImage.h"
 #include "itkImageFileWriter.h"
+#include "itkImageRegionConstIterator.h"
+
+#include "vnl/vnl_matrix.h"
+#include "vnl/vnl_vector.h"
+#include "vnl/algo/vnl_svd.h"
 
 namespace itk
 {
@@ -16,38 +21,223 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
 {
   m_NumberOfIterations  = 10;
   m_ElapsedIterations   = 0;
+  m_Tolerance           = 0.0;
+  m_InitialVelocityField = 0;
+  m_UseAndersonAcceleration = false;
+  m_AndersonWindowSize = 3;
+  m_AndersonNumberOfColumns = 0;
+  m_AndersonNextColumn = 0;
+  m_AndersonHasPrevious = false;
+  m_AndersonPreviousResidual = 0.0;
   m_SmoothVelocityField = false;
   m_ExpComp       = ExponentialCompositionFilterType::New();
   m_BCHCalculator = BCHFilterType::New();
-  m_LeftSmootherX      = GaussianFilterType::New();
-  m_LeftSmootherY      = GaussianFilterType::New();
-  m_RightSmootherX     = GaussianFilterType::New();
-  m_RightSmootherY     = GaussianFilterType::New();
 
   m_ExpComp->ComputeInverseOn();
   m_ExpComp->SetNumberOfIntegrationSteps(500);
 
   m_BCHCalculator->SetNumberOfApproximationTerms(3);
 
-  m_LeftSmootherX->SetDirection(0);
-  m_LeftSmootherY->SetDirection(1);
-  m_RightSmootherX->SetDirection(0);
-  m_RightSmootherY->SetDirection(1);
-
-  m_LeftSmootherX->SetOrder(GaussianFilterType::ZeroOrder);
-  m_LeftSmootherY->SetOrder(GaussianFilterType::ZeroOrder);
-  m_RightSmootherX->SetOrder(GaussianFilterType::ZeroOrder);
-  m_RightSmootherY->SetOrder(GaussianFilterType::ZeroOrder);
-
-  m_LeftSmootherX->SetNormalizeAcrossScale(false);
-  m_LeftSmootherY->SetNormalizeAcrossScale(false);
-  m_RightSmootherX->SetNormalizeAcrossScale(false);
-  m_RightSmootherY->SetNormalizeAcrossScale(false);
-
-  m_LeftSmootherX->SetSigma(2.0);
-  m_LeftSmootherY->SetSigma(2.0);
-  m_RightSmootherX->SetSigma(2.0);
-  m_RightSmootherY->SetSigma(2.0);
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    m_LeftSmoothers[j] = GaussianFilterType::New();
+    m_RightSmoothers[j] = GaussianFilterType::New();
+
+    m_LeftSmoothers[j]->SetDirection(j);
+    m_RightSmoothers[j]->SetDirection(j);
+
+    m_LeftSmoothers[j]->SetOrder(GaussianFilterType::ZeroOrder);
+    m_RightSmoothers[j]->SetOrder(GaussianFilterType::ZeroOrder);
+
+    m_LeftSmoothers[j]->SetNormalizeAcrossScale(false);
+    m_RightSmoothers[j]->SetNormalizeAcrossScale(false);
+
+    m_LeftSmoothers[j]->SetSigma(2.0);
+    m_RightSmoothers[j]->SetSigma(2.0);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+typename DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>::InputImageType::Pointer
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::SmoothField(InputImageType * field,
+              const FixedArray<typename GaussianFilterType::Pointer, ImageDimension> & smoothers) const
+{
+  smoothers[0]->SetInput(field);
+  for( unsigned int j = 1; j < ImageDimension; j++ )
+    {
+    smoothers[j]->SetInput( smoothers[j - 1]->GetOutput() );
+    }
+
+  typename InputImageType::Pointer smoothed = smoothers[ImageDimension - 1]->GetOutput();
+  return smoothed;
+}
+
+template <class TInputImage, class TOutputImage>
+double
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::ComputeRootMeanSquare(const InputImageType * field) const
+{
+  typedef ImageRegionConstIterator<InputImageType> ConstIteratorType;
+
+  double       sum = 0.0;
+  unsigned int count = 0;
+  for( ConstIteratorType it( field, field->GetBufferedRegion() ); !it.IsAtEnd(); ++it )
+    {
+    sum += it.Get().GetSquaredNorm();
+    ++count;
+    }
+
+  if( count == 0 )
+    {
+    return 0.0;
+    }
+  return vcl_sqrt( sum / count );
+}
+
+template <class TInputImage, class TOutputImage>
+typename DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>::AndersonFieldType *
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::GetAndersonField(unsigned int i, const InputImageType * reference)
+{
+  if( m_AndersonFields.size() <= i )
+    {
+    m_AndersonFields.resize(i + 1);
+    }
+
+  typename AndersonFieldType::Pointer & field = m_AndersonFields[i];
+  if( field.IsNull() || field->GetBufferedRegion() != reference->GetBufferedRegion() )
+    {
+    field = AndersonFieldType::New();
+    field->SetRegions( reference->GetBufferedRegion() );
+    field->Allocate();
+    }
+  return field;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::AndersonMix(InputImageType * output, const InputImageType * iterate)
+{
+  typedef typename AndersonFieldType::PixelType AndersonPixelType;
+  typedef typename InputImageType::PixelType    PixelType;
+
+  // The buffers are combined voxel by voxel
+  if( iterate->GetBufferedRegion() != output->GetBufferedRegion() )
+    {
+    m_AndersonHasPrevious = false;
+    m_AndersonNumberOfColumns = 0;
+    m_AndersonNextColumn = 0;
+    return;
+    }
+
+  const unsigned int  windowSize = m_AndersonWindowSize;
+  const unsigned long numberOfPixels = output->GetBufferedRegion().GetNumberOfPixels();
+
+  // Pool: previous output, previous residual, then the windowSize columns
+  // of differences of outputs followed by those of residuals
+  AndersonPixelType * previousOutput = this->GetAndersonField(0, output)->GetBufferPointer();
+  AndersonPixelType * previousResidual = this->GetAndersonField(1, output)->GetBufferPointer();
+  std::vector<AndersonPixelType *> outputDifferences(windowSize);
+  std::vector<AndersonPixelType *> residualDifferences(windowSize);
+  for( unsigned int k = 0; k < windowSize; k++ )
+    {
+    outputDifferences[k] = this->GetAndersonField(2 + k, output)->GetBufferPointer();
+    residualDifferences[k] = this->GetAndersonField(2 + windowSize + k, output)->GetBufferPointer();
+    }
+
+  // The residual G(v_n) - v_n and the new column of differences
+  PixelType *         outputBuffer = output->GetBufferPointer();
+  const PixelType *   iterateBuffer = iterate->GetBufferPointer();
+  AndersonPixelType * newOutputDifference = outputDifferences[m_AndersonNextColumn];
+  AndersonPixelType * newResidualDifference = residualDifferences[m_AndersonNextColumn];
+  double              residualNorm = 0.0;
+  for( unsigned long p = 0; p < numberOfPixels; p++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      const double residual = outputBuffer[p][j] - iterateBuffer[p][j];
+      residualNorm += residual * residual;
+      if( m_AndersonHasPrevious )
+        {
+        newOutputDifference[p][j] = outputBuffer[p][j] - previousOutput[p][j];
+        newResidualDifference[p][j] = residual - previousResidual[p][j];
+        }
+      previousOutput[p][j] = outputBuffer[p][j];
+      previousResidual[p][j] = residual;
+      }
+    }
+  residualNorm = vcl_sqrt(residualNorm);
+
+  if( m_AndersonHasPrevious )
+    {
+    if( residualNorm > m_AndersonPreviousResidual )
+      {
+      // Restart from a plain iteration
+      m_AndersonNumberOfColumns = 0;
+      m_AndersonNextColumn = 0;
+      }
+    else
+      {
+      m_AndersonNumberOfColumns = vnl_math_min(m_AndersonNumberOfColumns + 1, windowSize);
+      m_AndersonNextColumn = ( m_AndersonNextColumn + 1 ) % windowSize;
+      }
+    }
+  m_AndersonHasPrevious = true;
+  m_AndersonPreviousResidual = residualNorm;
+
+  const unsigned int numberOfColumns = m_AndersonNumberOfColumns;
+  if( numberOfColumns == 0 )
+    {
+    return;
+    }
+
+  // Least-squares weights gamma minimizing | r_n - dR gamma |
+  vnl_matrix<double> gram(numberOfColumns, numberOfColumns, 0.0);
+  vnl_vector<double> rhs(numberOfColumns, 0.0);
+  std::vector<double> differences(numberOfColumns);
+  for( unsigned long p = 0; p < numberOfPixels; p++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      for( unsigned int k = 0; k < numberOfColumns; k++ )
+        {
+        differences[k] = residualDifferences[k][p][j];
+        }
+      for( unsigned int k = 0; k < numberOfColumns; k++ )
+        {
+        rhs[k] += differences[k] * previousResidual[p][j];
+        for( unsigned int l = k; l < numberOfColumns; l++ )
+          {
+          gram[k][l] += differences[k] * differences[l];
+          }
+        }
+      }
+    }
+  for( unsigned int k = 0; k < numberOfColumns; k++ )
+    {
+    for( unsigned int l = 0; l < k; l++ )
+      {
+      gram[k][l] = gram[l][k];
+      }
+    }
+
+  vnl_svd<double> svd(gram);
+  svd.zero_out_relative(1e-10);
+  const vnl_vector<double> gamma = svd.solve(rhs);
+
+  // v_n+1 = G(v_n) - dG gamma
+  for( unsigned long p = 0; p < numberOfPixels; p++ )
+    {
+    for( unsigned int k = 0; k < numberOfColumns; k++ )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        outputBuffer[p][j] -= gamma[k] * outputDifferences[k][p][j];
+        }
+      }
+    }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -60,8 +250,21 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
   // intial value = displacement field
   // v_0 = Phi - Id (Following Bossa's notation)
   typename InputImageType::Pointer current = const_cast<InputImageType *>( this->GetInput() );
+  if( m_InitialVelocityField.IsNotNull() )
+    {
+    if( m_InitialVelocityField->GetLargestPossibleRegion() != current->GetLargestPossibleRegion() )
+      {
+      itkExceptionMacro(<< "The initial velocity field must have the region of the displacement field");
+      }
+    current = m_InitialVelocityField;
+    }
 
   m_ElapsedIterations   = 0;
+  m_ResidualHistory.clear();
+
+  m_AndersonNumberOfColumns = 0;
+  m_AndersonNextColumn = 0;
+  m_AndersonHasPrevious = false;
 
   ProgressReporter progress(this, 0, m_NumberOfIterations);
   for( unsigned int i = 0; i < m_NumberOfIterations; i++ )
@@ -75,19 +278,20 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
     typename InputImageType::Pointer leftField  = m_ExpComp->GetOutput();
     typename InputImageType::Pointer rightField = current;
 
+    // v_n is kept once the correction is small enough
+    const double residual = this->ComputeRootMeanSquare(leftField);
+    m_ResidualHistory.push_back(residual);
+    if( residual < m_Tolerance )
+      {
+      break;
+      }
+
     // Smoothing helps stabilizing the computation
     // This was not in Bossa's paper
     if( m_SmoothVelocityField )
       {
-      m_LeftSmootherX->SetInput(leftField);
-      m_LeftSmootherY->SetInput( m_LeftSmootherX->GetOutput() );
-
-      leftField = m_LeftSmootherY->GetOutput();
-
-      m_RightSmootherX->SetInput(rightField);
-      m_RightSmootherY->SetInput( m_RightSmootherX->GetOutput() );
-
-      rightField = m_RightSmootherY->GetOutput();
+      leftField = this->SmoothField(leftField, m_LeftSmoothers);
+      rightField = this->SmoothField(rightField, m_RightSmoothers);
       }
 
     // Still following Bossa's notation
@@ -99,8 +303,15 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
 
     m_BCHCalculator->Update();
 
-    current = m_BCHCalculator->GetOutput();
-    current->DisconnectPipeline();
+    typename InputImageType::Pointer next = m_BCHCalculator->GetOutput();
+    next->DisconnectPipeline();
+
+    if( m_UseAndersonAcceleration )
+      {
+      this->AndersonMix(next, current);
+      }
+
+    current = next;
 
     this->GraftOutput(current);
 
@@ -110,9 +321,52 @@ DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
     this->InvokeEvent( IterationEvent() );
     }
 
+  // Without any new field, current is the input or the initial velocity
+  // field, whose buffer is copied rather than shared with the output
+  if( m_ElapsedIterations == 0 )
+    {
+    typename OutputImageType::Pointer copy = OutputImageType::New();
+    copy->CopyInformation( current );
+    copy->SetBufferedRegion( current->GetBufferedRegion() );
+    copy->SetRequestedRegion( current->GetRequestedRegion() );
+    copy->Allocate();
+
+    ImageRegionConstIterator<InputImageType> inIt( current, current->GetBufferedRegion() );
+    ImageRegionIterator<OutputImageType>     outIt( copy, copy->GetBufferedRegion() );
+    for( ; !inIt.IsAtEnd(); ++inIt, ++outIt )
+      {
+      outIt.Set( inIt.Get() );
+      }
+
+    this->GraftOutput( copy );
+    return;
+    }
+
   this->GraftOutput(current);
 }
 
+template <class TInputImage, class TOutputImage>
+void
+DisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfIterations: " << m_NumberOfIterations << std::endl;
+  os << indent << "ElapsedIterations: " << m_ElapsedIterations << std::endl;
+  os << indent << "Tolerance: " << m_Tolerance << std::endl;
+  os << indent << "InitialVelocityField: " << m_InitialVelocityField.GetPointer() << std::endl;
+  os << indent << "SmoothVelocityField: " << m_SmoothVelocityField << std::endl;
+  os << indent << "Sigma: " << this->GetSigma() << std::endl;
+  os << indent << "UseAndersonAcceleration: " << m_UseAndersonAcceleration << std::endl;
+  os << indent << "AndersonWindowSize: " << m_AndersonWindowSize << std::endl;
+  os << indent << "ResidualHistory:";
+  for( unsigned int i = 0; i < m_ResidualHistory.size(); ++i )
+    {
+    os << " " << m_ResidualHistory[i];
+    }
+  os << std::endl;
+}
+
 } // end namespace itk
 
 #endif
@@ -0,0 +1,203 @@
+#ifndef __itkForwardInverseExponentialDisplacementFieldImageFilter_h
+#define __itkForwardInverseExponentialDisplacementFieldImageFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
+
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class ForwardInverseExponentialDisplacementFieldImageFilter
+ * \brief Computes the deformation fields associated with exp(v) and exp(-v)
+ * for a given velocity field v using a single scaling and squaring pass.
+ *
+ * The result is the same as running two ExponentialDisplacementFieldImageFilter,
+ * one of them with ComputeInverseOn, on the same velocity field. Since the
+ * norm of v and -v are identical, both exponentials use the same number of
+ * squarings. This filter therefore computes the maximum norm once, writes
+ * both scaled fields in one traversal and performs each squaring step for
+ * both fields within the same multithreaded traversal so that the thread
+ * partitioning and the index to physical space bookkeeping are shared.
+ *
+ * The compositions use a linear interpolation with nearest neighbor
+ * extrapolation as done by ExponentialDisplacementFieldImageFilter.
+ *
+ * Output 0 (GetOutput()) holds exp(v) and output 1 (GetInverseOutput())
+ * holds exp(-v).
+ *
+ * With UseDoublePrecisionSquaring on, the scaled fields and the squarings
+ * are stored in double precision and only the result is rounded to the
+ * pixel type of the output. A float output then no longer accumulates a
+ * rounding error at each squaring, at the cost of four double precision
+ * fields during the update. They are released at the end of the update.
+ *
+ * \sa ExponentialDisplacementFieldImageFilter
+ * \ingroup ImageToImageFilter MultiThreaded
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT ForwardInverseExponentialDisplacementFieldImageFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef ForwardInverseExponentialDisplacementFieldImageFilter Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage>         Superclass;
+  typedef SmartPointer<Self>                                    Pointer;
+  typedef SmartPointer<const Self>                              ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( ForwardInverseExponentialDisplacementFieldImageFilter, ImageToImageFilter );
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                                InputImageType;
+  typedef typename InputImageType::ConstPointer      InputImageConstPointer;
+  typedef typename InputImageType::PixelType         InputPixelType;
+  typedef typename InputImageType::RegionType        InputImageRegionType;
+  typedef TOutputImage                               OutputImageType;
+  typedef typename OutputImageType::Pointer          OutputImagePointer;
+  typedef typename OutputImageType::PixelType        OutputPixelType;
+  typedef typename OutputPixelType::ValueType        OutputPixelValueType;
+  typedef typename OutputImageType::RegionType       OutputImageRegionType;
+  typedef typename OutputImageType::IndexType        IndexType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+  /** Interpolator used for the compositions. */
+  typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+    OutputImageType, double>                               FieldInterpolatorType;
+  typedef typename FieldInterpolatorType::Pointer          FieldInterpolatorPointer;
+  typedef typename FieldInterpolatorType::ContinuousIndexType ContinuousIndexType;
+
+  /** Field and interpolator used by the double precision squarings. */
+  typedef Image<Vector<double, itkGetStaticConstMacro(ImageDimension)>,
+                itkGetStaticConstMacro(ImageDimension)>    PrecisionFieldType;
+  typedef typename PrecisionFieldType::Pointer             PrecisionFieldPointer;
+  typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+    PrecisionFieldType, double>                            PrecisionInterpolatorType;
+  typedef typename PrecisionInterpolatorType::Pointer      PrecisionInterpolatorPointer;
+
+  /** Get the inverse deformation field exp(-v). */
+  OutputImageType * GetInverseOutput();
+
+  /** Specify the maximum number of iteration. */
+  itkSetMacro(MaximumNumberOfIterations, unsigned int);
+  itkGetConstMacro(MaximumNumberOfIterations, unsigned int);
+
+  /** If AutomaticNumberOfIterations is off, the number of iterations is
+   * given by MaximumNumberOfIterations. If it is on, we try to get
+   * the lowest good number (which may not be larger than
+   * MaximumNumberOfIterations ) */
+  itkSetMacro(AutomaticNumberOfIterations, bool);
+  itkGetConstMacro(AutomaticNumberOfIterations, bool);
+  itkBooleanMacro(AutomaticNumberOfIterations);
+
+  /** Get the number of squarings used by the last update. */
+  itkGetConstMacro(NumberOfIterations, unsigned int);
+
+  /** Set/Get whether the squarings are computed in double precision
+   * whatever the pixel type of the output. Default is off. */
+  itkSetMacro(UseDoublePrecisionSquaring, bool);
+  itkGetConstMacro(UseDoublePrecisionSquaring, bool);
+  itkBooleanMacro(UseDoublePrecisionSquaring);
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(OutputHasNumericTraitsCheck,
+                  (Concept::HasNumericTraits<OutputPixelValueType>) );
+  /** End concept checking */
+#endif
+protected:
+  ForwardInverseExponentialDisplacementFieldImageFilter();
+  ~ForwardInverseExponentialDisplacementFieldImageFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The whole velocity field is needed to compute the compositions. */
+  virtual void GenerateInputRequestedRegion();
+
+  virtual void EnlargeOutputRequestedRegion(DataObject *);
+
+  /** Run the norm, scaling and squaring stages. */
+  virtual void GenerateData();
+
+  /** Run the current stage over a region supplied by the
+   * multithreading mechanism. */
+  virtual void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                                    ThreadIdType threadId );
+
+  /** Processing stages run by the threads. */
+  typedef enum
+    {
+    MaximumNormStage = 0,
+    ScalingStage,
+    SquaringStage,
+    CastingStage
+    } StageType;
+
+  /** Execute the given stage with the multithreader. */
+  void ExecuteStage(StageType stage);
+
+  /** Write v/2^N and -v/2^N in the given fields. */
+  template <class TField>
+  void ThreadedScale(TField * fwdPtr, TField * invPtr, const OutputImageRegionType & region);
+
+  /** Write phi(x) + phi(x + phi(x)) of both fields in the scratch fields. */
+  template <class TField, class TInterpolator>
+  void ThreadedSquare(const TField * fwdPtr, const TField * invPtr, TField * fwdOutPtr, TField * invOutPtr,
+                      const TInterpolator * fwdInterpolator, const TInterpolator * invInterpolator,
+                      const OutputImageRegionType & region);
+
+  /** Allocate the given field on the grid of the output. */
+  template <class TField>
+  void AllocateLikeOutput(TField * field);
+
+private:
+  ForwardInverseExponentialDisplacementFieldImageFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                                        // purposely not implemented
+
+  bool         m_AutomaticNumberOfIterations;
+  unsigned int m_MaximumNumberOfIterations;
+  unsigned int m_NumberOfIterations;
+  bool         m_UseDoublePrecisionSquaring;
+
+  StageType           m_Stage;
+  double              m_ScalingFactor;
+  std::vector<double> m_ThreadMaximumSquaredNorms;
+
+  /** Maps a physical displacement to a continuous index offset. */
+  Matrix<double, ImageDimension, ImageDimension> m_PhysicalToIndexMatrix;
+
+  OutputImagePointer m_ScratchField;
+  OutputImagePointer m_InverseScratchField;
+
+  FieldInterpolatorPointer m_Interpolator;
+  FieldInterpolatorPointer m_InverseInterpolator;
+
+  /** Double precision fields, allocated only when used. */
+  PrecisionFieldPointer        m_PrecisionField;
+  PrecisionFieldPointer        m_InversePrecisionField;
+  PrecisionFieldPointer        m_PrecisionScratchField;
+  PrecisionFieldPointer        m_InversePrecisionScratchField;
+  PrecisionInterpolatorPointer m_PrecisionInterpolator;
+  PrecisionInterpolatorPointer m_InversePrecisionInterpolator;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkForwardInverseExponentialDisplacementFieldImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,458 @@
+#ifndef __itkForwardInverseExponentialDisplacementFieldImageFilter_txx
+#define __itkForwardInverseExponentialDisplacementFieldImageFilter_txx
+
+#include "itkForwardInverseExponentialDisplacementFieldImageFilter.h"
+
+#include <itkImageRegionIterator.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ForwardInverseExponentialDisplacementFieldImageFilter()
+{
+  // The second output holds the inverse deformation
+  this->SetNumberOfRequiredOutputs( 2 );
+  OutputImagePointer inverseOutput = OutputImageType::New();
+  this->SetNthOutput( 1, inverseOutput.GetPointer() );
+
+  m_AutomaticNumberOfIterations = true;
+  m_MaximumNumberOfIterations = 20;
+  m_NumberOfIterations = 0;
+  m_UseDoublePrecisionSquaring = false;
+
+  m_Stage = MaximumNormStage;
+  m_ScalingFactor = 1.0;
+  m_PhysicalToIndexMatrix.SetIdentity();
+
+  m_ScratchField = OutputImageType::New();
+  m_InverseScratchField = OutputImageType::New();
+
+  m_Interpolator = FieldInterpolatorType::New();
+  m_InverseInterpolator = FieldInterpolatorType::New();
+
+  m_PrecisionInterpolator = PrecisionInterpolatorType::New();
+  m_InversePrecisionInterpolator = PrecisionInterpolatorType::New();
+}
+
+template <class TInputImage, class TOutputImage>
+typename ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>::OutputImageType
+* ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::GetInverseOutput()
+  {
+  return static_cast<OutputImageType *>( this->ProcessObject::GetOutput( 1 ) );
+  }
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "AutomaticNumberOfIterations: " << m_AutomaticNumberOfIterations << std::endl;
+  os << indent << "MaximumNumberOfIterations:   " << m_MaximumNumberOfIterations << std::endl;
+  os << indent << "NumberOfIterations:          " << m_NumberOfIterations << std::endl;
+  os << indent << "UseDoublePrecisionSquaring:  " << m_UseDoublePrecisionSquaring << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  // The compositions may access any voxel of the field
+  InputImageType * inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+
+  for( unsigned int idx = 0; idx < this->GetNumberOfOutputs(); ++idx )
+    {
+    if( this->ProcessObject::GetOutput( idx ) )
+      {
+      this->ProcessObject::GetOutput( idx )->SetRequestedRegionToLargestPossibleRegion();
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ExecuteStage(StageType stage)
+{
+  m_Stage = stage;
+
+  typename Superclass::ThreadStruct str;
+  str.Filter = this;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+template <class TInputImage, class TOutputImage>
+template <class TField>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::AllocateLikeOutput(TField * field)
+{
+  const OutputImageType * outputPtr = this->GetOutput();
+
+  field->CopyInformation( outputPtr );
+  field->SetRequestedRegion( outputPtr->GetRequestedRegion() );
+  field->SetBufferedRegion( outputPtr->GetBufferedRegion() );
+  field->Allocate();
+}
+
+/**
+ * GenerateData()
+ */
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::GenerateData()
+{
+  InputImageConstPointer inputPtr = this->GetInput();
+
+  this->AllocateOutputs();
+
+  OutputImageType * outputPtr = this->GetOutput();
+  OutputImageType * inversePtr = this->GetInverseOutput();
+
+  // Precompute the mapping from a physical displacement to a continuous
+  // index offset. It is shared by all the compositions.
+  Matrix<double, ImageDimension, ImageDimension> indexToPhysical;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      indexToPhysical(i, j) = outputPtr->GetDirection()(i, j) * outputPtr->GetSpacing()[j];
+      }
+    }
+  m_PhysicalToIndexMatrix = indexToPhysical.GetInverse();
+
+  unsigned int numiter = 0;
+  if( m_AutomaticNumberOfIterations )
+    {
+    // Compute a good number of iterations based on the rationale
+    // that the initial first order approximation,
+    // exp(Phi/2^N) = Phi/2^N,
+    // needs to be diffeomorphic. For this we simply impose to have
+    // max(norm(Phi)/2^N) < 0.5*pixelspacing
+    // The norm is the same for v and -v so it is computed only once.
+    m_ThreadMaximumSquaredNorms.assign( this->GetNumberOfThreads(), 0.0 );
+    this->ExecuteStage( MaximumNormStage );
+
+    double maxnorm2 = 0.0;
+    for( unsigned int i = 0; i < m_ThreadMaximumSquaredNorms.size(); ++i )
+      {
+      maxnorm2 = vnl_math_max( maxnorm2, m_ThreadMaximumSquaredNorms[i] );
+      }
+
+    double minpixelspacing = inputPtr->GetSpacing()[0];
+    for( unsigned int i = 1; i < ImageDimension; ++i )
+      {
+      minpixelspacing = vnl_math_min( minpixelspacing,
+                                      static_cast<double>( inputPtr->GetSpacing()[i] ) );
+      }
+
+    // Divide the norm by the minimum pixel spacing
+    maxnorm2 /= vnl_math_sqr( minpixelspacing );
+
+    const double numiterfloat = 2.0 + 0.5 * vcl_log( maxnorm2 ) / vnl_math::ln2;
+    if( numiterfloat >= 0.0 )
+      {
+      // take the ceil and threshold
+      numiter = vnl_math_min( static_cast<unsigned int>( numiterfloat + 1.0 ),
+                              m_MaximumNumberOfIterations );
+      }
+    else
+      {
+      // We may end up with negative nb of iterations if maxnorm2 is null
+      numiter = 0;
+      }
+    }
+  else
+    {
+    numiter = m_MaximumNumberOfIterations;
+    }
+  m_NumberOfIterations = numiter;
+
+  if( m_UseDoublePrecisionSquaring )
+    {
+    if( m_PrecisionField.IsNull() )
+      {
+      m_PrecisionField = PrecisionFieldType::New();
+      m_InversePrecisionField = PrecisionFieldType::New();
+      m_PrecisionScratchField = PrecisionFieldType::New();
+      m_InversePrecisionScratchField = PrecisionFieldType::New();
+      }
+    this->AllocateLikeOutput( m_PrecisionField.GetPointer() );
+    this->AllocateLikeOutput( m_InversePrecisionField.GetPointer() );
+    }
+
+  // Get the first order approximations v/2^N and -v/2^N in one traversal
+  m_ScalingFactor = 1.0 / static_cast<double>( 1u << numiter );
+  this->ExecuteStage( ScalingStage );
+  this->UpdateProgress( 1.0f / static_cast<float>( numiter + 1 ) );
+
+  if( numiter > 0 )
+    {
+    // The squarings cannot be done in place
+    if( m_UseDoublePrecisionSquaring )
+      {
+      this->AllocateLikeOutput( m_PrecisionScratchField.GetPointer() );
+      this->AllocateLikeOutput( m_InversePrecisionScratchField.GetPointer() );
+      }
+    else
+      {
+      this->AllocateLikeOutput( m_ScratchField.GetPointer() );
+      this->AllocateLikeOutput( m_InverseScratchField.GetPointer() );
+      }
+    }
+
+  typedef typename OutputImageType::PixelContainerPointer    PixelContainerPointer;
+  typedef typename PrecisionFieldType::PixelContainerPointer PrecisionPixelContainerPointer;
+
+  // Compose both fields with themselves numiter times
+  for( unsigned int i = 0; i < numiter; i++ )
+    {
+    if( m_UseDoublePrecisionSquaring )
+      {
+      m_PrecisionInterpolator->SetInputImage( m_PrecisionField );
+      m_InversePrecisionInterpolator->SetInputImage( m_InversePrecisionField );
+
+      this->ExecuteStage( SquaringStage );
+
+      PrecisionPixelContainerPointer swapPtr = m_PrecisionField->GetPixelContainer();
+      m_PrecisionField->SetPixelContainer( m_PrecisionScratchField->GetPixelContainer() );
+      m_PrecisionScratchField->SetPixelContainer( swapPtr );
+
+      swapPtr = m_InversePrecisionField->GetPixelContainer();
+      m_InversePrecisionField->SetPixelContainer( m_InversePrecisionScratchField->GetPixelContainer() );
+      m_InversePrecisionScratchField->SetPixelContainer( swapPtr );
+      }
+    else
+      {
+      m_Interpolator->SetInputImage( outputPtr );
+      m_InverseInterpolator->SetInputImage( inversePtr );
+
+      this->ExecuteStage( SquaringStage );
+
+      // swap the containers
+      PixelContainerPointer swapPtr = outputPtr->GetPixelContainer();
+      outputPtr->SetPixelContainer( m_ScratchField->GetPixelContainer() );
+      m_ScratchField->SetPixelContainer( swapPtr );
+
+      swapPtr = inversePtr->GetPixelContainer();
+      inversePtr->SetPixelContainer( m_InverseScratchField->GetPixelContainer() );
+      m_InverseScratchField->SetPixelContainer( swapPtr );
+      }
+
+    this->UpdateProgress( static_cast<float>( i + 2 ) / static_cast<float>( numiter + 1 ) );
+    }
+
+  if( m_UseDoublePrecisionSquaring )
+    {
+    // Round the result once
+    this->ExecuteStage( CastingStage );
+
+    // The double precision fields are only needed during the update
+    m_PrecisionField->Initialize();
+    m_InversePrecisionField->Initialize();
+    m_PrecisionScratchField->Initialize();
+    m_InversePrecisionScratchField->Initialize();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+template <class TField>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ThreadedScale(TField * fwdPtr, TField * invPtr, const OutputImageRegionType & region)
+{
+  typedef ImageRegionConstIterator<InputImageType> InputIteratorType;
+  typedef ImageRegionIterator<TField>              FieldIteratorType;
+  typedef typename TField::PixelType               FieldPixelType;
+  typedef typename FieldPixelType::ValueType       FieldValueType;
+
+  InputIteratorType inIt( this->GetInput(), region );
+  FieldIteratorType outIt( fwdPtr, region );
+  FieldIteratorType invIt( invPtr, region );
+  for( ; !inIt.IsAtEnd(); ++inIt, ++outIt, ++invIt )
+    {
+    const InputPixelType & vel = inIt.Value();
+    FieldPixelType &       fwd = outIt.Value();
+    FieldPixelType &       inv = invIt.Value();
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      fwd[j] = static_cast<FieldValueType>( m_ScalingFactor * vel[j] );
+      inv[j] = static_cast<FieldValueType>( -m_ScalingFactor * vel[j] );
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+template <class TField, class TInterpolator>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ThreadedSquare(const TField * fwdPtr, const TField * invPtr, TField * fwdOutPtr, TField * invOutPtr,
+                 const TInterpolator * fwdInterpolator, const TInterpolator * invInterpolator,
+                 const OutputImageRegionType & region)
+{
+  typedef ImageRegionIterator<TField>               FieldIteratorType;
+  typedef ImageRegionConstIterator<TField>          FieldConstIteratorType;
+  typedef ImageRegionConstIteratorWithIndex<TField> FieldConstIteratorWithIndexType;
+  typedef typename TField::PixelType                FieldPixelType;
+  typedef typename FieldPixelType::ValueType        FieldValueType;
+  typedef typename TInterpolator::OutputType        InterpolatedType;
+
+  // phi(x) <- phi(x) + phi(x + phi(x)) for both fields
+  FieldConstIteratorWithIndexType fwdIt( fwdPtr, region );
+  FieldConstIteratorType          invIt( invPtr, region );
+  FieldIteratorType               fwdOutIt( fwdOutPtr, region );
+  FieldIteratorType               invOutIt( invOutPtr, region );
+
+  ContinuousIndexType fwdIndex, invIndex;
+  for( ; !fwdIt.IsAtEnd(); ++fwdIt, ++invIt, ++fwdOutIt, ++invOutIt )
+    {
+    const IndexType &      index = fwdIt.GetIndex();
+    const FieldPixelType & fwd = fwdIt.Value();
+    const FieldPixelType & inv = invIt.Value();
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      double fwdOffset = 0.0;
+      double invOffset = 0.0;
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        fwdOffset += m_PhysicalToIndexMatrix(i, j) * fwd[j];
+        invOffset += m_PhysicalToIndexMatrix(i, j) * inv[j];
+        }
+      fwdIndex[i] = static_cast<double>( index[i] ) + fwdOffset;
+      invIndex[i] = static_cast<double>( index[i] ) + invOffset;
+      }
+
+    const InterpolatedType fwdWarped = fwdInterpolator->EvaluateAtContinuousIndex( fwdIndex );
+    const InterpolatedType invWarped = invInterpolator->EvaluateAtContinuousIndex( invIndex );
+
+    FieldPixelType & fwdOut = fwdOutIt.Value();
+    FieldPixelType & invOut = invOutIt.Value();
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      fwdOut[j] = fwd[j] + static_cast<FieldValueType>( fwdWarped[j] );
+      invOut[j] = inv[j] + static_cast<FieldValueType>( invWarped[j] );
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+ForwardInverseExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId)
+{
+  typedef ImageRegionConstIterator<InputImageType>     InputIteratorType;
+  typedef ImageRegionIterator<OutputImageType>         OutputIteratorType;
+  typedef ImageRegionConstIterator<PrecisionFieldType> PrecisionConstIteratorType;
+
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImageType *      outputPtr = this->GetOutput();
+  OutputImageType *      inversePtr = this->GetInverseOutput();
+
+  switch( m_Stage )
+    {
+    case MaximumNormStage:
+      {
+      double maxnorm2 = 0.0;
+      for( InputIteratorType inIt( inputPtr, outputRegionForThread ); !inIt.IsAtEnd(); ++inIt )
+        {
+        const InputPixelType & vel = inIt.Value();
+        double                 norm2 = 0.0;
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          norm2 += vnl_math_sqr( static_cast<double>( vel[j] ) );
+          }
+        maxnorm2 = vnl_math_max( maxnorm2, norm2 );
+        }
+      m_ThreadMaximumSquaredNorms[threadId] = maxnorm2;
+      break;
+      }
+    case ScalingStage:
+      {
+      if( m_UseDoublePrecisionSquaring )
+        {
+        this->ThreadedScale( m_PrecisionField.GetPointer(), m_InversePrecisionField.GetPointer(),
+                             outputRegionForThread );
+        }
+      else
+        {
+        this->ThreadedScale( outputPtr, inversePtr, outputRegionForThread );
+        }
+      break;
+      }
+    case SquaringStage:
+      {
+      if( m_UseDoublePrecisionSquaring )
+        {
+        this->ThreadedSquare( m_PrecisionField.GetPointer(), m_InversePrecisionField.GetPointer(),
+                              m_PrecisionScratchField.GetPointer(), m_InversePrecisionScratchField.GetPointer(),
+                              m_PrecisionInterpolator.GetPointer(), m_InversePrecisionInterpolator.GetPointer(),
+                              outputRegionForThread );
+        }
+      else
+        {
+        this->ThreadedSquare( static_cast<const OutputImageType *>( outputPtr ),
+                              static_cast<const OutputImageType *>( inversePtr ),
+                              m_ScratchField.GetPointer(), m_InverseScratchField.GetPointer(),
+                              m_Interpolator.GetPointer(), m_InverseInterpolator.GetPointer(),
+                              outputRegionForThread );
+        }
+      break;
+      }
+    case CastingStage:
+      {
+      PrecisionConstIteratorType fwdIt( m_PrecisionField, outputRegionForThread );
+      PrecisionConstIteratorType invIt( m_InversePrecisionField, outputRegionForThread );
+      OutputIteratorType         outIt( outputPtr, outputRegionForThread );
+      OutputIteratorType         invOutIt( inversePtr, outputRegionForThread );
+      for( ; !fwdIt.IsAtEnd(); ++fwdIt, ++invIt, ++outIt, ++invOutIt )
+        {
+        OutputPixelType & fwd = outIt.Value();
+        OutputPixelType & inv = invOutIt.Value();
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          fwd[j] = static_cast<OutputPixelValueType>( fwdIt.Value()[j] );
+          inv[j] = static_cast<OutputPixelValueType>( invIt.Value()[j] );
+          }
+        }
+      break;
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef __itkIncrementalExponentialDisplacementFieldImageFilter_h
+#define __itkIncrementalExponentialDisplacementFieldImageFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <itkExponentialDisplacementFieldImageFilter.h>
+#include <itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h>
+
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class IncrementalExponentialDisplacementFieldImageFilter
+ * \brief Computes the deformation field associated with exp(v) by
+ * updating the result obtained for a previous velocity field.
+ *
+ * This filter is meant to be called repeatedly on a velocity field that
+ * only changes slightly between two updates, as happens across the
+ * iterations of a log-domain demons registration. It keeps a copy of the
+ * previous velocity field v' and of its exponential. Given the new field
+ * v = v' + d, the symmetric splitting
+ *
+ *   exp(v) ~ exp(d/2) o exp(v') o exp(d/2)
+ *
+ * is used so that only the exponential of the small field d/2 needs to be
+ * computed, which requires far fewer squarings than exp(v).
+ *
+ * The full scaling and squaring is used instead whenever
+ * - no previous result is available or the geometry changed,
+ * - the maximum norm of d (in voxels) exceeds MaximumIncrementalUpdateNorm,
+ * - MaximumNumberOfIncrementalSteps incremental updates were done in a row,
+ *   which bounds the accumulation of the approximation error.
+ *
+ * In both cases, the number of squarings is derived from the maximum norm
+ * of the field being exponentiated, which is computed in the same pass as
+ * the update d. The counters NumberOfIncrementalExponentials and
+ * NumberOfFullExponentials report how often each path was taken.
+ *
+ * If ComputeInverse is on, exp(-v) is computed instead.
+ *
+ * \sa ExponentialDisplacementFieldImageFilter
+ * \ingroup ImageToImageFilter MultiThreaded
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT IncrementalExponentialDisplacementFieldImageFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef IncrementalExponentialDisplacementFieldImageFilter Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage>      Superclass;
+  typedef SmartPointer<Self>                                 Pointer;
+  typedef SmartPointer<const Self>                           ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( IncrementalExponentialDisplacementFieldImageFilter, ImageToImageFilter );
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                           InputImageType;
+  typedef typename InputImageType::Pointer      InputImagePointer;
+  typedef typename InputImageType::ConstPointer InputImageConstPointer;
+  typedef typename InputImageType::PixelType    InputPixelType;
+  typedef typename InputImageType::RegionType   InputImageRegionType;
+  typedef TOutputImage                          OutputImageType;
+  typedef typename OutputImageType::Pointer     OutputImagePointer;
+  typedef typename OutputImageType::PixelType   OutputPixelType;
+  typedef typename OutputPixelType::ValueType   OutputPixelValueType;
+  typedef typename OutputImageType::RegionType  OutputImageRegionType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+  /** Specify the maximum number of squarings. */
+  itkSetMacro(MaximumNumberOfIterations, unsigned int);
+  itkGetConstMacro(MaximumNumberOfIterations, unsigned int);
+
+  /** Maximum norm of the velocity update, in voxels, for which the
+   * incremental update is used. Default is 0.5. */
+  itkSetMacro(MaximumIncrementalUpdateNorm, double);
+  itkGetConstMacro(MaximumIncrementalUpdateNorm, double);
+
+  /** Maximum number of consecutive incremental updates before a full
+   * computation is enforced. Default is 5. */
+  itkSetMacro(MaximumNumberOfIncrementalSteps, unsigned int);
+  itkGetConstMacro(MaximumNumberOfIncrementalSteps, unsigned int);
+
+  /** Compute exp(-v) instead of exp(v). Toggling this flag discards the
+   * previous result. */
+  itkSetMacro(ComputeInverse, bool);
+  itkGetConstMacro(ComputeInverse, bool);
+  itkBooleanMacro(ComputeInverse);
+
+  /** Number of times the cheap incremental path was taken since the last
+   * Reset. */
+  itkGetConstMacro(NumberOfIncrementalExponentials, unsigned long);
+
+  /** Number of times a full scaling and squaring was done since the last
+   * Reset. */
+  itkGetConstMacro(NumberOfFullExponentials, unsigned long);
+
+  /** Number of squarings used by the last update. */
+  itkGetConstMacro(NumberOfSquarings, unsigned int);
+
+  /** Whether the last update took the incremental path. */
+  itkGetConstMacro(LastUpdateWasIncremental, bool);
+
+  /** Discard the stored velocity and deformation fields so that the next
+   * update does a full computation. The counters are also reset. */
+  void Reset();
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(OutputHasNumericTraitsCheck,
+                  (Concept::HasNumericTraits<OutputPixelValueType>) );
+  /** End concept checking */
+#endif
+protected:
+  IncrementalExponentialDisplacementFieldImageFilter();
+  ~IncrementalExponentialDisplacementFieldImageFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The whole velocity field is needed to compute the compositions. */
+  virtual void GenerateInputRequestedRegion();
+
+  virtual void EnlargeOutputRequestedRegion(DataObject *);
+
+  /** Select the incremental or the full path and run it. */
+  virtual void GenerateData();
+
+  /** Run the current stage over a region supplied by the
+   * multithreading mechanism. */
+  virtual void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                                    ThreadIdType threadId );
+
+  /** Processing stages run by the threads.
+   * UpdateStage computes half of the velocity update, the maximum norms of
+   * the update and of the velocity field, and stores the velocity field for
+   * the next call. CopyStage copies the full exponential to the output.
+   * The composition stages compute exp(v') o exp(d/2) and then
+   * exp(d/2) o exp(v') o exp(d/2). */
+  typedef enum
+    {
+    UpdateStage = 0,
+    CopyStage,
+    RightCompositionStage,
+    LeftCompositionStage
+    } StageType;
+
+  /** Execute the given stage with the multithreader. */
+  void ExecuteStage(StageType stage);
+
+  /** Number of squarings required for a field of given maximum norm. */
+  unsigned int ComputeNumberOfSquarings(double maxnorm2) const;
+
+  /** Check whether the stored fields match the geometry of the input. */
+  bool PreviousFieldsAreCompatible() const;
+
+  typedef ExponentialDisplacementFieldImageFilter<InputImageType, OutputImageType> ExponentiatorType;
+  typedef typename ExponentiatorType::Pointer                                       ExponentiatorPointer;
+
+  typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+    OutputImageType, double>                                  FieldInterpolatorType;
+  typedef typename FieldInterpolatorType::Pointer             FieldInterpolatorPointer;
+  typedef typename FieldInterpolatorType::ContinuousIndexType ContinuousIndexType;
+
+private:
+  IncrementalExponentialDisplacementFieldImageFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                                     // purposely not implemented
+
+  unsigned int m_MaximumNumberOfIterations;
+  double       m_MaximumIncrementalUpdateNorm;
+  unsigned int m_MaximumNumberOfIncrementalSteps;
+  bool         m_ComputeInverse;
+
+  unsigned long m_NumberOfIncrementalExponentials;
+  unsigned long m_NumberOfFullExponentials;
+  unsigned int  m_NumberOfSquarings;
+  bool          m_LastUpdateWasIncremental;
+  unsigned int  m_NumberOfConsecutiveIncrementalSteps;
+
+  /** Whether m_PreviousVelocityField holds a valid field for the update. */
+  bool m_HasPreviousFields;
+  bool m_PreviousComputeInverse;
+
+  StageType           m_Stage;
+  std::vector<double> m_ThreadMaximumSquaredUpdateNorms;
+  std::vector<double> m_ThreadMaximumSquaredNorms;
+
+  /** Maps a physical displacement to a continuous index offset. */
+  Matrix<double, ImageDimension, ImageDimension> m_PhysicalToIndexMatrix;
+
+  InputImagePointer  m_PreviousVelocityField;
+  InputImagePointer  m_HalfUpdateField;
+  OutputImagePointer m_PreviousDeformationField;
+  OutputImagePointer m_SpareDeformationField;
+  OutputImagePointer m_ScratchField;
+
+  /** Field read by the current stage (full or update exponential). */
+  OutputImagePointer m_ExponentialField;
+
+  ExponentiatorPointer     m_Exponentiator;
+  ExponentiatorPointer     m_UpdateExponentiator;
+  FieldInterpolatorPointer m_PreviousInterpolator;
+  FieldInterpolatorPointer m_UpdateInterpolator;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkIncrementalExponentialDisplacementFieldImageFilter.hxx"
+#endif
+
+#endif
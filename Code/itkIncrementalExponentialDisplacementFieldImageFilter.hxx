@@ -0,0 +1,440 @@
+#ifndef __itkIncrementalExponentialDisplacementFieldImageFilter_txx
+#define __itkIncrementalExponentialDisplacementFieldImageFilter_txx
+
+#include "itkIncrementalExponentialDisplacementFieldImageFilter.h"
+
+#include <itkImageRegionIterator.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::IncrementalExponentialDisplacementFieldImageFilter()
+{
+  m_MaximumNumberOfIterations = 20;
+  m_MaximumIncrementalUpdateNorm = 0.5;
+  m_MaximumNumberOfIncrementalSteps = 5;
+  m_ComputeInverse = false;
+
+  m_NumberOfIncrementalExponentials = 0;
+  m_NumberOfFullExponentials = 0;
+  m_NumberOfSquarings = 0;
+  m_LastUpdateWasIncremental = false;
+  m_NumberOfConsecutiveIncrementalSteps = 0;
+
+  m_HasPreviousFields = false;
+  m_PreviousComputeInverse = false;
+
+  m_Stage = UpdateStage;
+  m_PhysicalToIndexMatrix.SetIdentity();
+
+  m_PreviousVelocityField = InputImageType::New();
+  m_HalfUpdateField = InputImageType::New();
+  m_PreviousDeformationField = OutputImageType::New();
+  m_SpareDeformationField = OutputImageType::New();
+  m_ScratchField = OutputImageType::New();
+  m_ExponentialField = 0;
+
+  m_Exponentiator = ExponentiatorType::New();
+  m_Exponentiator->AutomaticNumberOfIterationsOff();
+
+  m_UpdateExponentiator = ExponentiatorType::New();
+  m_UpdateExponentiator->AutomaticNumberOfIterationsOff();
+
+  m_PreviousInterpolator = FieldInterpolatorType::New();
+  m_UpdateInterpolator = FieldInterpolatorType::New();
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "MaximumNumberOfIterations:       " << m_MaximumNumberOfIterations << std::endl;
+  os << indent << "MaximumIncrementalUpdateNorm:    " << m_MaximumIncrementalUpdateNorm << std::endl;
+  os << indent << "MaximumNumberOfIncrementalSteps: " << m_MaximumNumberOfIncrementalSteps << std::endl;
+  os << indent << "ComputeInverse:                  " << m_ComputeInverse << std::endl;
+  os << indent << "NumberOfIncrementalExponentials: " << m_NumberOfIncrementalExponentials << std::endl;
+  os << indent << "NumberOfFullExponentials:        " << m_NumberOfFullExponentials << std::endl;
+  os << indent << "NumberOfSquarings:               " << m_NumberOfSquarings << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::Reset()
+{
+  m_HasPreviousFields = false;
+  m_NumberOfConsecutiveIncrementalSteps = 0;
+  m_NumberOfIncrementalExponentials = 0;
+  m_NumberOfFullExponentials = 0;
+  m_NumberOfSquarings = 0;
+  m_LastUpdateWasIncremental = false;
+
+  // Release the memory of the internal buffers
+  m_PreviousVelocityField->Initialize();
+  m_HalfUpdateField->Initialize();
+  m_PreviousDeformationField->Initialize();
+  m_SpareDeformationField->Initialize();
+  m_ScratchField->Initialize();
+  m_ExponentialField = 0;
+
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  // The update is computed over the whole field
+  InputImageType * inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+  output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TInputImage, class TOutputImage>
+unsigned int
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ComputeNumberOfSquarings(double maxnorm2) const
+{
+  // Same rationale as in ExponentialDisplacementFieldImageFilter: the
+  // initial first order approximation exp(Phi/2^N) = Phi/2^N needs to be
+  // diffeomorphic, we thus impose max(norm(Phi)/2^N) < 0.5*pixelspacing
+  InputImageConstPointer inputPtr = this->GetInput();
+
+  double minpixelspacing = inputPtr->GetSpacing()[0];
+  for( unsigned int i = 1; i < ImageDimension; ++i )
+    {
+    minpixelspacing = vnl_math_min( minpixelspacing,
+                                    static_cast<double>( inputPtr->GetSpacing()[i] ) );
+    }
+
+  // Divide the norm by the minimum pixel spacing
+  maxnorm2 /= vnl_math_sqr( minpixelspacing );
+
+  const double numiterfloat = 2.0 + 0.5 * vcl_log( maxnorm2 ) / vnl_math::ln2;
+  if( numiterfloat >= 0.0 )
+    {
+    // take the ceil and threshold
+    return vnl_math_min( static_cast<unsigned int>( numiterfloat + 1.0 ),
+                         m_MaximumNumberOfIterations );
+    }
+
+  // We may end up with negative nb of iterations if maxnorm2 is null
+  return 0;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::PreviousFieldsAreCompatible() const
+{
+  InputImageConstPointer inputPtr = this->GetInput();
+
+  return m_PreviousVelocityField->GetLargestPossibleRegion() == inputPtr->GetLargestPossibleRegion()
+         && m_PreviousVelocityField->GetBufferedRegion() == inputPtr->GetBufferedRegion()
+         && m_PreviousVelocityField->GetSpacing() == inputPtr->GetSpacing()
+         && m_PreviousVelocityField->GetOrigin() == inputPtr->GetOrigin()
+         && m_PreviousVelocityField->GetDirection() == inputPtr->GetDirection();
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ExecuteStage(StageType stage)
+{
+  m_Stage = stage;
+
+  typename Superclass::ThreadStruct str;
+  str.Filter = this;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+/**
+ * GenerateData()
+ */
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::GenerateData()
+{
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImageType *      outputPtr = this->GetOutput();
+
+  if( m_HasPreviousFields
+      && ( m_ComputeInverse != m_PreviousComputeInverse || !this->PreviousFieldsAreCompatible() ) )
+    {
+    m_HasPreviousFields = false;
+    }
+
+  // The previous deformation field is needed by the compositions,
+  // the output is thus computed in the spare buffer
+  outputPtr->SetPixelContainer( m_SpareDeformationField->GetPixelContainer() );
+  this->AllocateOutputs();
+
+  if( !m_HasPreviousFields )
+    {
+    m_NumberOfConsecutiveIncrementalSteps = 0;
+
+    m_PreviousVelocityField->CopyInformation( inputPtr );
+    m_PreviousVelocityField->SetRegions( inputPtr->GetBufferedRegion() );
+    m_PreviousVelocityField->Allocate();
+
+    m_HalfUpdateField->CopyInformation( inputPtr );
+    m_HalfUpdateField->SetRegions( inputPtr->GetBufferedRegion() );
+    m_HalfUpdateField->Allocate();
+    }
+
+  // Precompute the mapping from a physical displacement to a continuous
+  // index offset. It is shared by all the compositions.
+  Matrix<double, ImageDimension, ImageDimension> indexToPhysical;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      indexToPhysical(i, j) = outputPtr->GetDirection()(i, j) * outputPtr->GetSpacing()[j];
+      }
+    }
+  m_PhysicalToIndexMatrix = indexToPhysical.GetInverse();
+
+  // Get the half update and the norms in one traversal. This also stores
+  // the current velocity field for the next call.
+  m_ThreadMaximumSquaredNorms.assign( this->GetNumberOfThreads(), 0.0 );
+  m_ThreadMaximumSquaredUpdateNorms.assign( this->GetNumberOfThreads(), 0.0 );
+  this->ExecuteStage( UpdateStage );
+
+  double maxnorm2 = 0.0;
+  double maxupdatenorm2 = 0.0;
+  for( unsigned int i = 0; i < m_ThreadMaximumSquaredNorms.size(); ++i )
+    {
+    maxnorm2 = vnl_math_max( maxnorm2, m_ThreadMaximumSquaredNorms[i] );
+    maxupdatenorm2 = vnl_math_max( maxupdatenorm2, m_ThreadMaximumSquaredUpdateNorms[i] );
+    }
+
+  double minpixelspacing = inputPtr->GetSpacing()[0];
+  for( unsigned int i = 1; i < ImageDimension; ++i )
+    {
+    minpixelspacing = vnl_math_min( minpixelspacing,
+                                    static_cast<double>( inputPtr->GetSpacing()[i] ) );
+    }
+
+  // The stage stored d/2, compare the norm of d in voxels
+  const double updatenorm2 = 4.0 * maxupdatenorm2 / vnl_math_sqr( minpixelspacing );
+
+  m_LastUpdateWasIncremental =
+    m_HasPreviousFields
+    && m_NumberOfConsecutiveIncrementalSteps < m_MaximumNumberOfIncrementalSteps
+    && updatenorm2 <= vnl_math_sqr( m_MaximumIncrementalUpdateNorm );
+
+  if( m_LastUpdateWasIncremental )
+    {
+    // exp(d/2), only a few squarings are needed for a small update
+    m_NumberOfSquarings = this->ComputeNumberOfSquarings( maxupdatenorm2 );
+
+    m_UpdateExponentiator->SetInput( m_HalfUpdateField );
+    m_UpdateExponentiator->SetComputeInverse( m_ComputeInverse );
+    m_UpdateExponentiator->SetMaximumNumberOfIterations( m_NumberOfSquarings );
+    // The half update was modified in place
+    m_UpdateExponentiator->Modified();
+    m_UpdateExponentiator->Update();
+    m_ExponentialField = m_UpdateExponentiator->GetOutput();
+
+    m_ScratchField->CopyInformation( outputPtr );
+    m_ScratchField->SetRequestedRegion( outputPtr->GetRequestedRegion() );
+    m_ScratchField->SetBufferedRegion( outputPtr->GetBufferedRegion() );
+    m_ScratchField->Allocate();
+
+    m_PreviousInterpolator->SetInputImage( m_PreviousDeformationField );
+    m_UpdateInterpolator->SetInputImage( m_ExponentialField );
+
+    // exp(v') o exp(d/2)
+    this->ExecuteStage( RightCompositionStage );
+    this->UpdateProgress( 0.5f );
+
+    // exp(d/2) o exp(v') o exp(d/2)
+    this->ExecuteStage( LeftCompositionStage );
+
+    ++m_NumberOfConsecutiveIncrementalSteps;
+    ++m_NumberOfIncrementalExponentials;
+    }
+  else
+    {
+    m_NumberOfSquarings = this->ComputeNumberOfSquarings( maxnorm2 );
+
+    m_Exponentiator->SetInput( inputPtr );
+    m_Exponentiator->SetComputeInverse( m_ComputeInverse );
+    m_Exponentiator->SetMaximumNumberOfIterations( m_NumberOfSquarings );
+    m_Exponentiator->Modified();
+    m_Exponentiator->Update();
+    m_ExponentialField = m_Exponentiator->GetOutput();
+
+    this->ExecuteStage( CopyStage );
+
+    m_NumberOfConsecutiveIncrementalSteps = 0;
+    ++m_NumberOfFullExponentials;
+    }
+
+  // The output becomes the previous deformation field and the buffer
+  // of the former previous deformation field is kept for the next call
+  m_SpareDeformationField->SetPixelContainer( m_PreviousDeformationField->GetPixelContainer() );
+  m_PreviousDeformationField->CopyInformation( outputPtr );
+  m_PreviousDeformationField->SetRegions( outputPtr->GetBufferedRegion() );
+  m_PreviousDeformationField->SetPixelContainer( outputPtr->GetPixelContainer() );
+
+  m_HasPreviousFields = true;
+  m_PreviousComputeInverse = m_ComputeInverse;
+
+  this->UpdateProgress( 1.0f );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IncrementalExponentialDisplacementFieldImageFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId)
+{
+  typedef ImageRegionConstIterator<InputImageType>           InputConstIteratorType;
+  typedef ImageRegionIterator<InputImageType>                InputIteratorType;
+  typedef ImageRegionIterator<OutputImageType>               OutputIteratorType;
+  typedef ImageRegionConstIteratorWithIndex<OutputImageType> OutputConstIteratorWithIndexType;
+  typedef typename InputPixelType::ValueType                 InputPixelValueType;
+  typedef typename FieldInterpolatorType::OutputType         InterpolatedType;
+
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImageType *      outputPtr = this->GetOutput();
+
+  switch( m_Stage )
+    {
+    case UpdateStage:
+      {
+      InputConstIteratorType inIt( inputPtr, outputRegionForThread );
+      InputIteratorType      prevIt( m_PreviousVelocityField, outputRegionForThread );
+
+      double maxnorm2 = 0.0;
+      double maxupdatenorm2 = 0.0;
+      if( m_HasPreviousFields )
+        {
+        InputIteratorType halfIt( m_HalfUpdateField, outputRegionForThread );
+        for( ; !inIt.IsAtEnd(); ++inIt, ++prevIt, ++halfIt )
+          {
+          const InputPixelType & vel = inIt.Value();
+          InputPixelType &       prev = prevIt.Value();
+          InputPixelType &       half = halfIt.Value();
+          double                 norm2 = 0.0;
+          double                 updatenorm2 = 0.0;
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            const double vj = static_cast<double>( vel[j] );
+            const double hj = 0.5 * ( vj - static_cast<double>( prev[j] ) );
+            half[j] = static_cast<InputPixelValueType>( hj );
+            prev[j] = vel[j];
+            norm2 += vj * vj;
+            updatenorm2 += hj * hj;
+            }
+          maxnorm2 = vnl_math_max( maxnorm2, norm2 );
+          maxupdatenorm2 = vnl_math_max( maxupdatenorm2, updatenorm2 );
+          }
+        }
+      else
+        {
+        for( ; !inIt.IsAtEnd(); ++inIt, ++prevIt )
+          {
+          const InputPixelType & vel = inIt.Value();
+          double                 norm2 = 0.0;
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            norm2 += vnl_math_sqr( static_cast<double>( vel[j] ) );
+            }
+          prevIt.Value() = vel;
+          maxnorm2 = vnl_math_max( maxnorm2, norm2 );
+          }
+        }
+      m_ThreadMaximumSquaredNorms[threadId] = maxnorm2;
+      m_ThreadMaximumSquaredUpdateNorms[threadId] = maxupdatenorm2;
+      break;
+      }
+    case CopyStage:
+      {
+      OutputIteratorType expIt( m_ExponentialField, outputRegionForThread );
+      OutputIteratorType outIt( outputPtr, outputRegionForThread );
+      for( ; !outIt.IsAtEnd(); ++expIt, ++outIt )
+        {
+        outIt.Value() = expIt.Value();
+        }
+      break;
+      }
+    case RightCompositionStage:
+    case LeftCompositionStage:
+      {
+      // Right: a(x) = e(x) + phi'(x + e(x)) is written to the scratch field
+      // Left:  phi(x) = a(x) + e(x + a(x)) is written to the output
+      const bool             right = ( m_Stage == RightCompositionStage );
+      OutputImageType *      inField = right ? m_ExponentialField.GetPointer() : m_ScratchField.GetPointer();
+      OutputImageType *      outField = right ? m_ScratchField.GetPointer() : outputPtr;
+      FieldInterpolatorType *interpolator =
+        right ? m_PreviousInterpolator.GetPointer() : m_UpdateInterpolator.GetPointer();
+
+      OutputConstIteratorWithIndexType inIt( inField, outputRegionForThread );
+      OutputIteratorType               outIt( outField, outputRegionForThread );
+
+      ContinuousIndexType cindex;
+      for( ; !inIt.IsAtEnd(); ++inIt, ++outIt )
+        {
+        const typename OutputImageType::IndexType & index = inIt.GetIndex();
+        const OutputPixelType &                     disp = inIt.Value();
+        for( unsigned int i = 0; i < ImageDimension; i++ )
+          {
+          double offset = 0.0;
+          for( unsigned int j = 0; j < ImageDimension; j++ )
+            {
+            offset += m_PhysicalToIndexMatrix(i, j) * disp[j];
+            }
+          cindex[i] = static_cast<double>( index[i] ) + offset;
+          }
+
+        const InterpolatedType warped = interpolator->EvaluateAtContinuousIndex( cindex );
+
+        OutputPixelType & out = outIt.Value();
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          out[j] = disp[j] + static_cast<OutputPixelValueType>( warped[j] );
+          }
+        }
+      break;
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif
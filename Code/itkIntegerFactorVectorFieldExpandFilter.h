@@ -0,0 +1,159 @@
+#ifndef __itkIntegerFactorVectorFieldExpandFilter_h
+#define __itkIntegerFactorVectorFieldExpandFilter_h
+
+#include <itkImageToImageFilter.h>
+
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class IntegerFactorVectorFieldExpandFilter
+ * \brief Upsamples a vector field by integer factors with linear
+ * interpolation.
+ *
+ * The output grid is given as for VectorResampleImageFilter by its size,
+ * start index, origin, spacing and direction. It must have the direction
+ * of the input grid and a spacing that divides the input spacing by an
+ * integer factor along each dimension, which is the case between the
+ * levels of a multi-resolution pyramid. The origins are arbitrary.
+ *
+ * Along each dimension, the input continuous index of an output voxel is
+ * then an affine function of its index, so that the interpolation
+ * weights and the input neighbors are tabulated once per dimension
+ * instead of transforming every output voxel into a physical point. The
+ * output is computed row by row: the input rows surrounding an output row
+ * are first blended into a line buffer, which is then interpolated along
+ * the row. Both loops run over contiguous arrays of components.
+ *
+ * The result is the one of a VectorResampleImageFilter with an identity
+ * transform and a VectorLinearInterpolateNearestNeighborExtrapolateImageFunction:
+ * the input field is extended by replicating its border values.
+ *
+ * \sa VectorResampleImageFilter
+ * \sa VectorLinearInterpolateNearestNeighborExtrapolateImageFunction
+ * \ingroup ImageToImageFilter MultiThreaded
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT IntegerFactorVectorFieldExpandFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs. */
+  typedef IntegerFactorVectorFieldExpandFilter          Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
+  typedef SmartPointer<Self>                            Pointer;
+  typedef SmartPointer<const Self>                      ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( IntegerFactorVectorFieldExpandFilter, ImageToImageFilter );
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                            InputImageType;
+  typedef typename InputImageType::ConstPointer  InputImageConstPointer;
+  typedef typename InputImageType::PixelType     InputPixelType;
+  typedef TOutputImage                           OutputImageType;
+  typedef typename OutputImageType::Pointer      OutputImagePointer;
+  typedef typename OutputImageType::PixelType    OutputPixelType;
+  typedef typename OutputPixelType::ValueType    ScalarType;
+  typedef typename OutputImageType::RegionType   OutputImageRegionType;
+  typedef typename OutputImageType::SizeType     SizeType;
+  typedef typename OutputImageType::IndexType    IndexType;
+  typedef typename OutputImageType::PointType    PointType;
+  typedef typename OutputImageType::SpacingType  SpacingType;
+  typedef typename OutputImageType::DirectionType DirectionType;
+  typedef typename OutputImageType::OffsetValueType OffsetValueType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+  itkStaticConstMacro(VectorDimension, unsigned int, OutputPixelType::Dimension);
+
+  /** Set/Get the size of the output image. */
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+
+  /** Set/Get the start index of the output largest possible region. */
+  itkSetMacro( OutputStartIndex, IndexType );
+  itkGetConstReferenceMacro( OutputStartIndex, IndexType );
+
+  /** Set/Get the output image origin. */
+  itkSetMacro( OutputOrigin, PointType );
+  itkGetConstReferenceMacro( OutputOrigin, PointType );
+
+  /** Set/Get the output image spacing. */
+  itkSetMacro( OutputSpacing, SpacingType );
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+
+  /** Set/Get the output image direction. */
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Check whether the output grid can be computed from the grid of the
+   * given field by this filter, i.e. whether both have the same direction
+   * and the spacings are related by integer factors. */
+  bool CanExpand(const InputImageType * input) const;
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(SameDimensionCheck,
+                  (Concept::SameDimension<TInputImage::ImageDimension, TOutputImage::ImageDimension>) );
+  itkConceptMacro(ScalarHasNumericTraitsCheck,
+                  (Concept::HasNumericTraits<ScalarType>) );
+  /** End concept checking */
+#endif
+protected:
+  IntegerFactorVectorFieldExpandFilter();
+  ~IntegerFactorVectorFieldExpandFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The output geometry is the one given by the parameters. */
+  virtual void GenerateOutputInformation();
+
+  /** The whole input is needed. */
+  virtual void GenerateInputRequestedRegion();
+
+  /** Tabulate the neighbors and weights along each dimension. */
+  virtual void BeforeThreadedGenerateData();
+
+  /** Compute the rows of the given region. */
+  virtual void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                                    ThreadIdType threadId);
+
+private:
+  IntegerFactorVectorFieldExpandFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                       // purposely not implemented
+
+  SizeType      m_Size;
+  IndexType     m_OutputStartIndex;
+  PointType     m_OutputOrigin;
+  SpacingType   m_OutputSpacing;
+  DirectionType m_OutputDirection;
+
+  /** For each output index along each dimension (relative to the start of
+   * the output buffer), the offsets in voxels of its two input neighbors
+   * from the start of the input buffer and the weight of the second one. */
+  std::vector<OffsetValueType> m_LowerNeighbors[ImageDimension];
+  std::vector<OffsetValueType> m_UpperNeighbors[ImageDimension];
+  std::vector<ScalarType>      m_Weights[ImageDimension];
+
+  /** Per thread line buffers, kept across updates. */
+  std::vector<std::vector<ScalarType> > m_LineBuffers;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkIntegerFactorVectorFieldExpandFilter.hxx"
+#endif
+
+#endif
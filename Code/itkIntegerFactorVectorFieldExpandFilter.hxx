@@ -0,0 +1,299 @@
+#ifndef __itkIntegerFactorVectorFieldExpandFilter_txx
+#define __itkIntegerFactorVectorFieldExpandFilter_txx
+
+#include "itkIntegerFactorVectorFieldExpandFilter.h"
+
+#include "itkContinuousIndex.h"
+#include "itkProgressReporter.h"
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TInputImage, class TOutputImage>
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::IntegerFactorVectorFieldExpandFilter()
+{
+  m_Size.Fill( 0 );
+  m_OutputStartIndex.Fill( 0 );
+  m_OutputOrigin.Fill( 0.0 );
+  m_OutputSpacing.Fill( 1.0 );
+  m_OutputDirection.SetIdentity();
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TInputImage, class TOutputImage>
+void
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "Size: " << m_Size << std::endl;
+  os << indent << "OutputStartIndex: " << m_OutputStartIndex << std::endl;
+  os << indent << "OutputOrigin: " << m_OutputOrigin << std::endl;
+  os << indent << "OutputSpacing: " << m_OutputSpacing << std::endl;
+  os << indent << "OutputDirection: " << m_OutputDirection << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::CanExpand(const InputImageType * input) const
+{
+  const double tolerance = 1e-6;
+
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( vnl_math_abs( input->GetDirection()(i, j) - m_OutputDirection(i, j) ) > tolerance )
+        {
+        return false;
+        }
+      }
+
+    const double ratio = input->GetSpacing()[i] / m_OutputSpacing[i];
+    const double factor = vnl_math_rnd( ratio );
+    if( factor < 1.0 || vnl_math_abs( ratio - factor ) > tolerance * ratio )
+      {
+      return false;
+      }
+    }
+
+  return true;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::GenerateOutputInformation()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  OutputImagePointer outputPtr = this->GetOutput();
+  if( !outputPtr )
+    {
+    return;
+    }
+
+  OutputImageRegionType outputLargestPossibleRegion;
+  outputLargestPossibleRegion.SetSize( m_Size );
+  outputLargestPossibleRegion.SetIndex( m_OutputStartIndex );
+
+  outputPtr->SetLargestPossibleRegion( outputLargestPossibleRegion );
+  outputPtr->SetSpacing( m_OutputSpacing );
+  outputPtr->SetOrigin( m_OutputOrigin );
+  outputPtr->SetDirection( m_OutputDirection );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  InputImageType * inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImageType *      outputPtr = this->GetOutput();
+
+  if( !this->CanExpand( inputPtr ) )
+    {
+    itkExceptionMacro( << "The output grid is not an integer factor expansion of the input grid" );
+    }
+
+  // Continuous index in the input of the output voxel of index zero
+  ContinuousIndex<double, ImageDimension> origin;
+  inputPtr->TransformPhysicalPointToContinuousIndex( outputPtr->GetOrigin(), origin );
+
+  const typename InputImageType::RegionType & inputRegion = inputPtr->GetBufferedRegion();
+  const OutputImageRegionType &               outputRegion = outputPtr->GetBufferedRegion();
+
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    // The output index is an affine function of the input one
+    const double step = 1.0 / vnl_math_rnd( inputPtr->GetSpacing()[j] / outputPtr->GetSpacing()[j] );
+
+    const OffsetValueType first = inputRegion.GetIndex()[j];
+    const OffsetValueType last = first + static_cast<OffsetValueType>( inputRegion.GetSize()[j] ) - 1;
+    const unsigned long   size = outputRegion.GetSize()[j];
+
+    m_LowerNeighbors[j].resize( size );
+    m_UpperNeighbors[j].resize( size );
+    m_Weights[j].resize( size );
+    for( unsigned long i = 0; i < size; ++i )
+      {
+      const double c = origin[j] + step * static_cast<double>( outputRegion.GetIndex()[j] + static_cast<OffsetValueType>( i ) );
+      const double base = vcl_floor( c );
+
+      // Nearest neighbor extrapolation outside of the input
+      OffsetValueType lower = static_cast<OffsetValueType>( base );
+      OffsetValueType upper = lower + 1;
+      lower = vnl_math_min( vnl_math_max( lower, first ), last );
+      upper = vnl_math_min( vnl_math_max( upper, first ), last );
+
+      m_LowerNeighbors[j][i] = lower - first;
+      m_UpperNeighbors[j][i] = upper - first;
+      m_Weights[j][i] = static_cast<ScalarType>( c - base );
+      }
+    }
+
+  m_LineBuffers.resize( this->GetNumberOfThreads() );
+  for( unsigned int i = 0; i < m_LineBuffers.size(); ++i )
+    {
+    m_LineBuffers[i].resize( inputRegion.GetSize()[0] * VectorDimension );
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+IntegerFactorVectorFieldExpandFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread,
+                       ThreadIdType threadId)
+{
+  typedef typename InputPixelType::ValueType InputScalarType;
+
+  const unsigned int numberOfComponents = VectorDimension;
+  const unsigned int numberOfCorners = 1u << ( ImageDimension - 1 );
+
+  InputImageConstPointer inputPtr = this->GetInput();
+  OutputImageType *      outputPtr = this->GetOutput();
+
+  const typename InputImageType::RegionType & inputRegion = inputPtr->GetBufferedRegion();
+  const OutputImageRegionType &               outputRegion = outputPtr->GetBufferedRegion();
+
+  const InputScalarType * inputBuffer =
+    reinterpret_cast<const InputScalarType *>( inputPtr->GetBufferPointer() );
+  ScalarType * outputBuffer = reinterpret_cast<ScalarType *>( outputPtr->GetBufferPointer() );
+
+  OffsetValueType inputStrides[ImageDimension];
+  OffsetValueType outputStrides[ImageDimension];
+  inputStrides[0] = 1;
+  outputStrides[0] = 1;
+  for( unsigned int j = 1; j < ImageDimension; j++ )
+    {
+    inputStrides[j] = inputStrides[j - 1] * static_cast<OffsetValueType>( inputRegion.GetSize()[j - 1] );
+    outputStrides[j] = outputStrides[j - 1] * static_cast<OffsetValueType>( outputRegion.GetSize()[j - 1] );
+    }
+
+  // Position of the current row relative to the output buffer
+  OffsetValueType position[ImageDimension];
+  OffsetValueType begin[ImageDimension];
+  OffsetValueType end[ImageDimension];
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    begin[j] = outputRegionForThread.GetIndex()[j] - outputRegion.GetIndex()[j];
+    end[j] = begin[j] + static_cast<OffsetValueType>( outputRegionForThread.GetSize()[j] );
+    position[j] = begin[j];
+    }
+
+  const OffsetValueType inputRowLength =
+    static_cast<OffsetValueType>( inputRegion.GetSize()[0] * numberOfComponents );
+  const unsigned long numberOfRows =
+    outputRegionForThread.GetNumberOfPixels() / outputRegionForThread.GetSize()[0];
+
+  ScalarType * line = &( m_LineBuffers[threadId][0] );
+
+  ProgressReporter progress( this, threadId, numberOfRows );
+
+  for( unsigned long row = 0; row < numberOfRows; ++row )
+    {
+    // Blend the input rows surrounding the output row
+    bool firstCorner = true;
+    for( unsigned int corner = 0; corner < numberOfCorners; ++corner )
+      {
+      ScalarType      weight = NumericTraits<ScalarType>::One;
+      OffsetValueType inputOffset = 0;
+      for( unsigned int j = 1; j < ImageDimension; j++ )
+        {
+        const OffsetValueType p = position[j];
+        if( corner & ( 1u << ( j - 1 ) ) )
+          {
+          weight *= m_Weights[j][p];
+          inputOffset += m_UpperNeighbors[j][p] * inputStrides[j];
+          }
+        else
+          {
+          weight *= NumericTraits<ScalarType>::One - m_Weights[j][p];
+          inputOffset += m_LowerNeighbors[j][p] * inputStrides[j];
+          }
+        }
+      // The weights are in [0,1) so that the first corner is never skipped
+      if( weight == NumericTraits<ScalarType>::Zero )
+        {
+        continue;
+        }
+
+      const InputScalarType * inputRow = inputBuffer + inputOffset * numberOfComponents;
+      if( firstCorner )
+        {
+        for( OffsetValueType k = 0; k < inputRowLength; ++k )
+          {
+          line[k] = weight * static_cast<ScalarType>( inputRow[k] );
+          }
+        firstCorner = false;
+        }
+      else
+        {
+        for( OffsetValueType k = 0; k < inputRowLength; ++k )
+          {
+          line[k] += weight * static_cast<ScalarType>( inputRow[k] );
+          }
+        }
+      }
+
+    // Interpolate the blended row along the first dimension
+    OffsetValueType outputOffset = begin[0];
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      outputOffset += position[j] * outputStrides[j];
+      }
+    ScalarType * outputRow = outputBuffer + outputOffset * numberOfComponents;
+
+    for( OffsetValueType x = begin[0]; x < end[0]; ++x )
+      {
+      const ScalarType   w = m_Weights[0][x];
+      const ScalarType * lower = line + m_LowerNeighbors[0][x] * numberOfComponents;
+      const ScalarType * upper = line + m_UpperNeighbors[0][x] * numberOfComponents;
+      for( unsigned int k = 0; k < numberOfComponents; ++k )
+        {
+        outputRow[k] = lower[k] + w * ( upper[k] - lower[k] );
+        }
+      outputRow += numberOfComponents;
+      }
+
+    // Move to the next row
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      if( ++position[j] < end[j] )
+        {
+        break;
+        }
+      position[j] = begin[j];
+      }
+
+    progress.CompletedPixel();
+    }
+}
+
+} // end namespace itk
+
+#endif
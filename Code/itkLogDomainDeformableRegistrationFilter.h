@@ -3,7 +3,19 @@
 
 #include "itkDenseFiniteDifferenceImageFilter.h"
 #include "itkExponentialDisplacementFieldImageFilter.h"
+#include "itkForwardInverseExponentialDisplacementFieldImageFilter.h"
+#include "itkIncrementalExponentialDisplacementFieldImageFilter.h"
 #include "itkPDEDeformableRegistrationFunction.h"
+#include "itkGaussianOperator.h"
+#include "itkVectorNeighborhoodOperatorImageFilter.h"
+#include "itkRecursiveGaussianImageFilter.h"
+#include "itkSeparableVectorFieldSmoothingFilter.h"
+#include "itkIntegerFactorVectorFieldExpandFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+
+#include <vector>
+#include <deque>
+#include <list>
 
 
 typedef enum {
@@ -14,6 +26,10 @@ typedef enum {
 
 namespace itk
 {
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
 
 /**
  * \class LogDomainDeformableRegistrationFilter
@@ -58,6 +74,13 @@ namespace itk
  * smoothing the velocity field. Both buffers are the same type and size as the
  * output velocity field.
  *
+ * The velocity field may be stored on a grid coarser than the fixed image,
+ * see SetVelocityFieldShrinkFactor.
+ *
+ * The forces may be restricted to masks of the fixed and moving images,
+ * see SetFixedImageMask, and to a narrow band of the voxels that are not
+ * matched yet, see SetUseNarrowBand.
+ *
  * This class make use of the finite difference solver hierarchy. Update
  * for each iteration is computed using a PDEDeformableRegistrationFunction.
  *
@@ -102,6 +125,8 @@ public:
   typedef TField                              VelocityFieldType;
   typedef typename VelocityFieldType::Pointer VelocityFieldPointer;
 
+  typedef typename VelocityFieldType::SizeType::SizeValueType SizeValueType;
+
   /** Deformation field type. */
   typedef TField                                 DeformationFieldType;
   typedef typename DeformationFieldType::Pointer DeformationFieldPointer;
@@ -147,6 +172,112 @@ public:
   /** Get output inverse deformation field. */
   DeformationFieldPointer GetInverseDisplacementField();
 
+  /** Set/Get whether exp(v) and exp(-v) are computed together by a
+   * ForwardInverseExponentialDisplacementFieldImageFilter. When on,
+   * GetDeformationField() computes both fields in a single pass and a
+   * subsequent call to GetInverseDisplacementField() reuses the inverse
+   * computed alongside as long as the velocity field is unchanged.
+   * Default is off. */
+  itkSetMacro( UseForwardInverseExponentiator, bool );
+  itkGetConstMacro( UseForwardInverseExponentiator, bool );
+  itkBooleanMacro( UseForwardInverseExponentiator );
+
+  /** Set/Get whether the squarings of the exponentials are computed in
+   * double precision, the fields being stored in the precision of TField.
+   * This lets float fields be used without accumulating a rounding error
+   * at each squaring. When on, the exponentials are computed by the
+   * ForwardInverseExponentialDisplacementFieldImageFilter, unless
+   * UseIncrementalExponential is on. Default is off. */
+  itkSetMacro( UseDoublePrecisionExponential, bool );
+  itkGetConstMacro( UseDoublePrecisionExponential, bool );
+  itkBooleanMacro( UseDoublePrecisionExponential );
+
+  /** Set/Get whether the exponentials are computed incrementally from the
+   * ones obtained at the previous iteration, see
+   * IncrementalExponentialDisplacementFieldImageFilter. When on, this takes
+   * precedence over UseForwardInverseExponentiator. Default is off. */
+  itkSetMacro( UseIncrementalExponential, bool );
+  itkGetConstMacro( UseIncrementalExponential, bool );
+  itkBooleanMacro( UseIncrementalExponential );
+
+  /** Number of exponentials (forward and inverse) that took the cheap
+   * incremental path since the filter was last initialized, i.e. at the
+   * last level of a multi-resolution registration. */
+  unsigned long GetNumberOfIncrementalExponentials() const;
+
+  /** Number of exponentials (forward and inverse) that were fully
+   * recomputed since the filter was last initialized, i.e. at the last
+   * level of a multi-resolution registration. */
+  unsigned long GetNumberOfFullExponentials() const;
+
+  /** Set/Get the factor by which the grid of the velocity field is
+   * coarser than the one of the fixed image along each dimension. With a
+   * factor f > 1, the velocity field, the update buffers, the exponentials
+   * and the Lie brackets live on a grid whose spacing is f times the fixed
+   * image spacing. The forces are still computed at each voxel of the fixed
+   * image, around the deformation field upsampled from the velocity grid,
+   * and averaged over the fixed image voxels of each cell of the velocity
+   * grid. GetDeformationField and GetInverseDisplacementField return fields
+   * on the grid of the fixed image. An initial velocity field given on
+   * another grid is resampled. The smoothing standard deviations remain
+   * expressed in voxels of the fixed image. The update computation of
+   * SymmetricLogDomainDemonsRegistrationFilter does not support it.
+   * Default is 1. */
+  itkSetClampMacro( VelocityFieldShrinkFactor, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( VelocityFieldShrinkFactor, unsigned int );
+
+  /** Mask type. Non zero voxels are inside of the mask. */
+  typedef Image<unsigned char, itkGetStaticConstMacro(ImageDimension)> MaskImageType;
+  typedef typename MaskImageType::ConstPointer                          MaskImageConstPointer;
+
+  /** Set/Get optional masks of the fixed and moving images. The masks may
+   * have any grid, a voxel x of the fixed image being in the fixed mask
+   * when its center falls in a non zero voxel of the mask, and in the
+   * moving mask when x + u(x) does. When a mask is set, the forces and the
+   * updates are only computed in an active set made of the voxels of the
+   * fixed image that lie in either mask, dilated by the support of the
+   * smoothing kernels. The active set is stored as runs of voxels along
+   * the first dimension. It is built when the registration starts and,
+   * with a moving mask, rebuilt every NarrowBandUpdateInterval iterations
+   * from the current deformation field. With LineBufferGaussianSmoothing, the fields are also only
+   * smoothed in the bounding box of the active set, with the values a
+   * smoothing of the whole field gives there. */
+  itkSetConstObjectMacro( FixedImageMask, MaskImageType );
+  itkGetConstObjectMacro( FixedImageMask, MaskImageType );
+  itkSetConstObjectMacro( MovingImageMask, MaskImageType );
+  itkGetConstObjectMacro( MovingImageMask, MaskImageType );
+
+  /** Set/Get whether the active set is further restricted to a narrow
+   * band of the voxels that are not matched yet, i.e. whose residual
+   * |F(x) - M(x + u(x))| is above NarrowBandThreshold or that map outside
+   * of the moving image. The band is dilated like the masks and rebuilt
+   * every NarrowBandUpdateInterval iterations from the current
+   * deformation field. Outside of the band the update is zero, so that the
+   * velocity field is only changed there by the smoothing. The demons
+   * forces being proportional to the residual, the forces neglected are
+   * at most those of a residual of NarrowBandThreshold. Default is off. */
+  itkSetMacro( UseNarrowBand, bool );
+  itkGetConstMacro( UseNarrowBand, bool );
+  itkBooleanMacro( UseNarrowBand );
+
+  /** Set/Get the residual intensity below which a voxel is left out of
+   * the narrow band. Default is 1.0. */
+  itkSetClampMacro( NarrowBandThreshold, double, 0.0, NumericTraits<double>::max() );
+  itkGetConstMacro( NarrowBandThreshold, double );
+
+  /** Set/Get the number of iterations between two updates of the narrow
+   * band and of the moving mask. Default is 5. */
+  itkSetClampMacro( NarrowBandUpdateInterval, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( NarrowBandUpdateInterval, unsigned int );
+
+  /** Number of voxels of the fixed image in the active set, or zero if
+   * neither a mask nor the narrow band is used. */
+  itkGetConstMacro( NumberOfActivePixels, SizeValueType );
+
+  /** Time in seconds spent building the active set, including the
+   * rebuilds of the narrow band, since the registration was initialized. */
+  itkGetConstMacro( ActiveSetBuildTime, double );
+
   /** Get the number of valid inputs.  For LogDomainDeformableRegistration,
    * this checks whether the fixed and moving images have been
    * set. While LogDomainDeformableRegistration can take a third input as an
@@ -164,7 +295,8 @@ public:
 
   /** Set the Gaussian smoothing standard deviations for the
    * velocity field. The values are set with respect to pixel
-   * coordinates. */
+   * coordinates, or in physical units if
+   * StandardDeviationsInPhysicalUnits is on. */
   itkSetVectorMacro( StandardDeviations, double, ImageDimension );
   virtual void SetStandardDeviations( double value );
 
@@ -185,7 +317,8 @@ public:
   itkBooleanMacro( SmoothUpdateField );
 
   /** Set the Gaussian smoothing standard deviations for the update
-   * field. The values are set with respect to pixel coordinates. */
+   * field. The values are set with respect to pixel coordinates, or in
+   * physical units if StandardDeviationsInPhysicalUnits is on. */
   itkSetVectorMacro( UpdateFieldStandardDeviations, double, ImageDimension );
   virtual void SetUpdateFieldStandardDeviations( double value );
 
@@ -196,12 +329,67 @@ public:
     return static_cast<const double *>(m_UpdateFieldStandardDeviations);
   }
 
+  /** Set/Get whether the standard deviations of the velocity and update
+   * field smoothing are given in physical units instead of voxels of the
+   * fixed image. They are then divided by the spacing of the fixed image
+   * along each axis, so that the smoothing is isotropic in physical space
+   * for anisotropic images. Default is off. */
+  itkSetMacro( StandardDeviationsInPhysicalUnits, bool );
+  itkGetConstMacro( StandardDeviationsInPhysicalUnits, bool );
+  itkBooleanMacro( StandardDeviationsInPhysicalUnits );
+
   /** Stop the registration after the current iteration. */
   virtual void StopRegistration()
   {
     m_StopRegistrationFlag = true;
   }
 
+  /** Set/Get whether the registration stops as soon as it converged, the
+   * number of iterations then being a maximum. The registration is deemed
+   * converged when, over the last ConvergenceWindowSize iterations, neither
+   * the metric nor the RMS change decrease anymore: the least squares
+   * slopes of their values, relative to their mean over the window, are
+   * both above -ConvergenceTolerance. Default is off. */
+  itkSetMacro( UseConvergenceCriterion, bool );
+  itkGetConstMacro( UseConvergenceCriterion, bool );
+  itkBooleanMacro( UseConvergenceCriterion );
+
+  /** Set/Get the number of iterations over which the slopes of the metric
+   * and of the RMS change are estimated. Default is 10. */
+  itkSetClampMacro( ConvergenceWindowSize, unsigned int, 2, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( ConvergenceWindowSize, unsigned int );
+
+  /** Set/Get the relative decrease per iteration below which the metric
+   * and the RMS change are considered stalled. Default is 1e-3. */
+  itkSetMacro( ConvergenceTolerance, double );
+  itkGetConstMacro( ConvergenceTolerance, double );
+
+  /** Whether the last run was stopped by the convergence criterion. */
+  itkGetConstMacro( Converged, bool );
+
+  /** Values of the metric and of the RMS change over the last iterations,
+   * on which the convergence criterion is evaluated. */
+  const std::deque<double> & GetMetricHistory() const
+  {
+    return m_MetricHistory;
+  }
+
+  const std::deque<double> & GetRMSChangeHistory() const
+  {
+    return m_RMSChangeHistory;
+  }
+
+  /** Set the values of the metric and of the RMS change the next run starts
+   * from instead of an empty history. This is used to resume an interrupted
+   * registration, the values being discarded after the next run. */
+  void SetInitialConvergenceHistory(const std::deque<double> & metric, const std::deque<double> & rmsChange)
+  {
+    m_MetricHistory = metric;
+    m_RMSChangeHistory = rmsChange;
+    m_UseInitialConvergenceHistory = true;
+    this->Modified();
+  }
+
   /** Set/Get the desired maximum error of the Gaussian kernel approximate.
    * \sa GaussianOperator. */
   itkSetMacro( MaximumError, double );
@@ -212,6 +400,65 @@ public:
   itkSetMacro( MaximumKernelWidth, unsigned int );
   itkGetConstMacro( MaximumKernelWidth, unsigned int );
 
+  /** Engines available to smooth the velocity and update fields.
+   * GaussianOperatorSmoothing convolves with truncated Gaussian kernels
+   * whose width grows with the standard deviation. RecursiveGaussianSmoothing
+   * uses a recursive (IIR) approximation of the Gaussian whose cost does not
+   * depend on the standard deviation; MaximumError and MaximumKernelWidth
+   * are then ignored, except along the dimensions of less than 4 voxels
+   * which are smoothed with the operator. LineBufferGaussianSmoothing uses the same kernels as
+   * GaussianOperatorSmoothing but smooths the field in place by blocks of
+   * lines, see SeparableVectorFieldSmoothingFilter. */
+  typedef enum
+    {
+    GaussianOperatorSmoothing = 0,
+    RecursiveGaussianSmoothing,
+    LineBufferGaussianSmoothing
+    } SmoothingEngineType;
+
+  /** Set/Get the engine used to smooth the fields.
+   * Default is GaussianOperatorSmoothing. */
+  itkSetMacro( SmoothingEngine, SmoothingEngineType );
+  itkGetConstMacro( SmoothingEngine, SmoothingEngineType );
+
+  /** Set/Get whether the scratch fields are kept once the registration
+   * has run. Keeping them avoids reallocating them when the filter is run
+   * again, e.g. at the next level of a multi-resolution registration.
+   * Default is off. */
+  itkSetMacro( KeepScratchFields, bool );
+  itkGetConstMacro( KeepScratchFields, bool );
+  itkBooleanMacro( KeepScratchFields );
+
+  /** Release the memory held by the scratch fields and the reference to
+   * the buffer of the previous output velocity field. */
+  void ReleaseScratchFields();
+
+  /** Number of times a scratch field buffer had to be (re)allocated since
+   * the filter was created. Once the registration reached its steady
+   * state, this count does not change from one iteration to the next. */
+  itkGetConstMacro( NumberOfScratchAllocations, unsigned long );
+
+  /** Set/Get the number of pixels the buffers of the registration are
+   * reserved for. When a buffer is too small, it is reallocated with at
+   * least this capacity. Together with KeepScratchFields, the next run
+   * also computes its output velocity field in the buffer of the previous
+   * output, which is thus overwritten, see DisconnectOutputBuffer. Running
+   * the filter on fields of increasing size up to this number of pixels,
+   * e.g. at the levels of a multi-resolution registration, thus allocates
+   * each buffer only once. Default is 0 (buffers sized to the current
+   * field). */
+  itkSetMacro( ReservedNumberOfPixels, SizeValueType );
+  itkGetConstMacro( ReservedNumberOfPixels, SizeValueType );
+
+  /** Keep the buffer of the last output velocity field from being reused
+   * by the next run. */
+  void DisconnectOutputBuffer();
+
+  /** Number of times the buffer of the output velocity field or of an
+   * update buffer had to be (re)allocated since the filter was created.
+   * \sa GetNumberOfScratchAllocations */
+  itkGetConstMacro( NumberOfBufferAllocations, unsigned long );
+
   /** Get the metric value. The metric value is the mean square difference
    * in intensity between the fixed image and transforming moving image
    * computed over the the overlapping region between the two images.
@@ -237,18 +484,33 @@ protected:
   itkSetObjectMacro( Exponentiator, FieldExponentiatorType );
   itkGetObjectMacro( Exponentiator, FieldExponentiatorType );
 
-  /** Supplies the halting criteria for this class of filters.  The
-   * algorithm will stop after a user-specified number of iterations. */
-  virtual bool Halt()
-  {
+  /** Combined forward and inverse exponential type */
+  typedef ForwardInverseExponentialDisplacementFieldImageFilter<
+    VelocityFieldType, DeformationFieldType>      FieldForwardInverseExponentiatorType;
 
-    if( m_StopRegistrationFlag )
-      {
-      return true;
-      }
+  typedef typename FieldForwardInverseExponentiatorType::Pointer FieldForwardInverseExponentiatorPointer;
 
-    return this->Superclass::Halt();
-  }
+  itkGetObjectMacro( ForwardInverseExponentiator, FieldForwardInverseExponentiatorType );
+
+  /** Incremental exponential type */
+  typedef IncrementalExponentialDisplacementFieldImageFilter<
+    VelocityFieldType, DeformationFieldType>      FieldIncrementalExponentiatorType;
+
+  typedef typename FieldIncrementalExponentiatorType::Pointer FieldIncrementalExponentiatorPointer;
+
+  itkGetObjectMacro( IncrementalExponentiator, FieldIncrementalExponentiatorType );
+  itkGetObjectMacro( InverseIncrementalExponentiator, FieldIncrementalExponentiatorType );
+
+  /** Supplies the halting criteria for this class of filters.  The
+   * algorithm will stop after a user-specified number of iterations,
+   * or earlier if UseConvergenceCriterion is on and the registration
+   * converged. */
+  virtual bool Halt();
+
+  /** Least squares slope of the given values, taken at consecutive
+   * iterations, divided by the absolute value of their mean. Returns zero
+   * if the mean is zero. */
+  static double ComputeRelativeSlope(const std::deque<double> & values);
 
   /** A simple method to copy the data from the input to the output.
    * If the input does not exist, a zero field is written to the output. */
@@ -290,6 +552,111 @@ protected:
    * StandardDeviations. */
   virtual void SmoothGivenField(VelocityFieldType * field, const double StandardDeviations[ImageDimension]);
 
+  /** Convert the given standard deviations to voxels of the fixed image,
+   * see StandardDeviationsInPhysicalUnits. */
+  void GetStandardDeviationsInFixedImageVoxels(const double standardDeviations[ImageDimension],
+                                               double voxelStandardDeviations[ImageDimension]) const;
+
+  /** Identifiers of the scratch fields shared by this class hierarchy. */
+  typedef enum
+    {
+    SmoothingScratchField = 0,
+    UpdateScratchField
+    } ScratchFieldIdentifierType;
+
+  /** Get the scratch field with the given identifier, with the same
+   * geometry as the reference field. The scratch fields are kept across
+   * iterations, so that their buffer is only reallocated when it is too
+   * small. The content of the returned field is undefined. */
+  VelocityFieldType * GetScratchField(ScratchFieldIdentifierType id,
+                                      const VelocityFieldType * reference);
+
+  /** Make sure the container of the field can hold its buffered region
+   * before it is allocated. The container is reallocated with a capacity
+   * of at least ReservedNumberOfPixels when it is too small, in which case
+   * true is returned. */
+  bool ReserveBuffer(VelocityFieldType * field) const;
+
+  typedef IntegerFactorVectorFieldExpandFilter<
+    VelocityFieldType, DeformationFieldType>   FieldExpanderType;
+  typedef typename FieldExpanderType::Pointer FieldExpanderPointer;
+
+  /** Resample a field given on the grid of the velocity field onto the
+   * grid of the fixed image with the given expander. The field is returned
+   * as is when both grids are the same. */
+  DeformationFieldPointer ExpandToFixedImageGrid(DeformationFieldType * field,
+                                                 FieldExpanderType * expander);
+
+  typedef typename VelocityFieldType::RegionType ThreadRegionType;
+
+  /** With a coarse velocity grid, compute the forces at the voxels of the
+   * fixed image lying in the cells of the given region of the velocity
+   * grid and average them in these cells. */
+  virtual TimeStepType ThreadedCalculateChange(const ThreadRegionType & regionToProcess,
+                                               ThreadIdType threadId);
+
+  typedef std::list<ThreadRegionType> ActiveRunListType;
+
+  /** Append to the list the parts of the runs of the active set that lie
+   * in the given region of the fixed image grid, as regions of one row.
+   * Returns false, leaving the list empty, if neither a mask nor the
+   * narrow band is used so that the whole region is to be processed. */
+  bool GetActiveRuns(const ThreadRegionType & region, ActiveRunListType & runs) const;
+
+  /** Build the active set from the masks, see SetFixedImageMask, and from
+   * the narrow band, see SetUseNarrowBand. The moving mask and the narrow
+   * band are given by the deformation field, if any, the moving mask being
+   * otherwise tested at the voxels of the fixed image. */
+  void BuildActiveSet(const DeformationFieldType * field = 0);
+
+  /** Rebuild the active set with the narrow band and the moving mask of
+   * the given deformation field of the current iteration, every
+   * NarrowBandUpdateInterval iterations. */
+  void UpdateNarrowBand(const DeformationFieldType * field);
+
+  typedef LinearInterpolateImageFunction<MovingImageType, double> ActiveSetInterpolatorType;
+
+  /** Mark the voxels of the fixed image between the given linear offsets,
+   * that lie in either mask and, with an interpolator of the moving image,
+   * outside the narrow band. Without a deformation field, the voxels are
+   * not moved. Called by the threads of BuildActiveSet. */
+  void ThreadedScanActiveSet(SizeValueType firstVoxel, SizeValueType endVoxel,
+                             const DeformationFieldType * field,
+                             const ActiveSetInterpolatorType * movingInterpolator);
+
+  /** Structure passed to ActiveSetScanThreaderCallback. */
+  struct ActiveSetScanStruct
+    {
+    Self *                            Filter;
+    const DeformationFieldType *      Field;
+    const ActiveSetInterpolatorType * MovingInterpolator;
+    };
+
+  /** Split the scan of BuildActiveSet in slabs along the last dimension. */
+  static ITK_THREAD_RETURN_TYPE ActiveSetScanThreaderCallback(void *arg);
+
+  /** Increment the count returned by GetNumberOfBufferAllocations. */
+  void CountBufferAllocation()
+  {
+    ++m_NumberOfBufferAllocations;
+  }
+
+  /** The output velocity field reuses the buffer of the previous output
+   * when possible, see SetReservedNumberOfPixels. */
+  virtual void AllocateOutputs();
+
+  /** Reserve the update buffer before the superclass allocates it. */
+  virtual void AllocateUpdateBuffer();
+
+  typedef typename VelocityFieldType::PixelType::ValueType  SmoothingScalarType;
+  typedef GaussianOperator<SmoothingScalarType,
+                           itkGetStaticConstMacro(ImageDimension)> SmoothingOperatorType;
+
+  /** Get the Gaussian operator for the given direction and variance (in
+   * voxel units). The operators are cached so that their coefficients are
+   * only computed once. */
+  const SmoothingOperatorType & GetSmoothingOperator(unsigned int direction, double variance);
+
   /** This method is called after the solution has been generated. In this case,
    * the filter release the memory of the internal buffers. */
   virtual void PostProcessOutput();
@@ -317,13 +684,59 @@ private:
   /** Standard deviation for Gaussian smoothing */
   double m_StandardDeviations[ImageDimension];
   double m_UpdateFieldStandardDeviations[ImageDimension];
+  bool   m_StandardDeviationsInPhysicalUnits;
+
+  /** Grid of the velocity field and upsamplers of the exponentials. */
+  unsigned int         m_VelocityFieldShrinkFactor;
+  FieldExpanderPointer m_DeformationFieldExpander;
+  FieldExpanderPointer m_InverseDisplacementFieldExpander;
+
+  /** Masks and active set as runs along the first dimension of the fixed
+   * image grid, with the bounding box of the active set on the velocity
+   * grid. */
+  typedef typename ThreadRegionType::IndexType ActiveIndexType;
+  MaskImageConstPointer        m_FixedImageMask;
+  MaskImageConstPointer        m_MovingImageMask;
+  std::vector<ActiveIndexType> m_ActiveRunStarts;
+  std::vector<SizeValueType>   m_ActiveRunLengths;
+  SizeValueType                m_NumberOfActivePixels;
+  ThreadRegionType             m_ActiveBoundingBox;
+  bool                         m_UseActiveSet;
+  std::vector<unsigned char>   m_ActiveVoxels;
+  double                       m_ActiveSetBuildTime;
+
+  /** Narrow band of the voxels not matched yet. */
+  bool         m_UseNarrowBand;
+  double       m_NarrowBandThreshold;
+  unsigned int m_NarrowBandUpdateInterval;
 
   /** Modes to control smoothing of the update and velocity fields */
   bool m_SmoothVelocityField;
   bool m_SmoothUpdateField;
 
-  /** Temporary field used for smoothing the velocity field. */
-  VelocityFieldPointer m_TempField;
+  /** Scratch fields, see GetScratchField. */
+  std::vector<VelocityFieldPointer> m_ScratchFields;
+  unsigned long                     m_NumberOfScratchAllocations;
+  bool                              m_KeepScratchFields;
+
+  /** Buffer reservation, see SetReservedNumberOfPixels. */
+  typedef typename VelocityFieldType::PixelContainerPointer VelocityFieldContainerPointer;
+  SizeValueType                 m_ReservedNumberOfPixels;
+  unsigned long                 m_NumberOfBufferAllocations;
+  VelocityFieldContainerPointer m_VelocityFieldArena;
+
+  /** Persistent smoothing mini-pipelines and cached operators. */
+  typedef VectorNeighborhoodOperatorImageFilter<
+    VelocityFieldType, VelocityFieldType>                OperatorSmootherType;
+  typedef RecursiveGaussianImageFilter<
+    VelocityFieldType, VelocityFieldType>                RecursiveSmootherType;
+
+  typename OperatorSmootherType::Pointer  m_OperatorSmoother;
+  typename RecursiveSmootherType::Pointer m_RecursiveSmoother;
+
+  typedef SeparableVectorFieldSmoothingFilter<VelocityFieldType> LineBufferSmootherType;
+  typename LineBufferSmootherType::Pointer m_LineBufferSmoother;
+  std::vector<SmoothingOperatorType>      m_SmoothingOperators;
 
   /** Maximum error for Gaussian operator approximation. */
   double m_MaximumError;
@@ -331,11 +744,32 @@ private:
   /** Limits of Gaussian kernel width. */
   unsigned int m_MaximumKernelWidth;
 
+  /** Engine used to smooth the velocity and update fields. */
+  SmoothingEngineType m_SmoothingEngine;
+
   /** Flag to indicate user stop registration request. */
   bool m_StopRegistrationFlag;
 
+  /** Convergence criterion and the values it is evaluated on. */
+  bool               m_UseConvergenceCriterion;
+  unsigned int       m_ConvergenceWindowSize;
+  double             m_ConvergenceTolerance;
+  bool               m_Converged;
+  std::deque<double> m_MetricHistory;
+  std::deque<double> m_RMSChangeHistory;
+  bool               m_UseInitialConvergenceHistory;
+
   FieldExponentiatorPointer m_Exponentiator;
   FieldExponentiatorPointer m_InverseExponentiator;
+
+  FieldForwardInverseExponentiatorPointer m_ForwardInverseExponentiator;
+  bool                                    m_UseForwardInverseExponentiator;
+  bool                                    m_UseDoublePrecisionExponential;
+  unsigned long                           m_ForwardInverseElapsedIterations;
+
+  FieldIncrementalExponentiatorPointer m_IncrementalExponentiator;
+  FieldIncrementalExponentiatorPointer m_InverseIncrementalExponentiator;
+  bool                                 m_UseIncrementalExponential;
 };
 
 } // end namespace itk
@@ -6,12 +6,15 @@
 #include "itkExceptionObject.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageLinearIteratorWithIndex.h"
+#include "itkImageRegionIteratorWithIndex.h"
 #include "itkDataObject.h"
-
-#include "itkGaussianOperator.h"
-#include "itkVectorNeighborhoodOperatorImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkNeighborhoodAlgorithm.h"
+#include "itkVectorResampleImageFilter.h"
+#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
 
 #include "vnl/vnl_math.h"
+#include "itksys/SystemTools.hxx"
 
 namespace itk
 {
@@ -38,12 +41,41 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
     m_StandardDeviations[j] = 1.0;
     m_UpdateFieldStandardDeviations[j] = 1.0;
     }
+  m_StandardDeviationsInPhysicalUnits = false;
+
+  m_NumberOfScratchAllocations = 0;
+  m_KeepScratchFields = false;
+  m_ReservedNumberOfPixels = 0;
+  m_NumberOfBufferAllocations = 0;
+
+  // The outputs of the smoothers are grafted onto scratch fields before
+  // each update. Their buffers should thus not be released by the pipeline.
+  m_OperatorSmoother = OperatorSmootherType::New();
+  m_OperatorSmoother->ReleaseDataBeforeUpdateFlagOff();
+
+  m_RecursiveSmoother = RecursiveSmootherType::New();
+  m_RecursiveSmoother->SetOrder( RecursiveSmootherType::ZeroOrder );
+  m_RecursiveSmoother->SetNormalizeAcrossScale( false );
+  m_RecursiveSmoother->ReleaseDataBeforeUpdateFlagOff();
+
+  m_LineBufferSmoother = LineBufferSmootherType::New();
 
-  m_TempField = VelocityFieldType::New();
   m_MaximumError = 0.1;
   m_MaximumKernelWidth = 30;
+  m_SmoothingEngine = GaussianOperatorSmoothing;
   m_StopRegistrationFlag = false;
 
+  m_UseConvergenceCriterion = false;
+  m_ConvergenceWindowSize = 10;
+  m_ConvergenceTolerance = 1e-3;
+  m_Converged = false;
+  m_UseInitialConvergenceHistory = false;
+
+  m_UseActiveSet = false;
+  m_UseNarrowBand = false;
+  m_NarrowBandThreshold = 1.0;
+  m_NarrowBandUpdateInterval = 5;
+
   m_SmoothVelocityField = true;
   m_SmoothUpdateField = false;
 
@@ -52,6 +84,25 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   m_InverseExponentiator = FieldExponentiatorType::New();
   m_InverseExponentiator->ComputeInverseOn();
+
+  m_ForwardInverseExponentiator = FieldForwardInverseExponentiatorType::New();
+  m_UseForwardInverseExponentiator = false;
+  m_UseDoublePrecisionExponential = false;
+  m_ForwardInverseElapsedIterations = NumericTraits<unsigned long>::max();
+
+  m_IncrementalExponentiator = FieldIncrementalExponentiatorType::New();
+  m_IncrementalExponentiator->ComputeInverseOff();
+
+  m_InverseIncrementalExponentiator = FieldIncrementalExponentiatorType::New();
+  m_InverseIncrementalExponentiator->ComputeInverseOn();
+
+  m_UseIncrementalExponential = false;
+
+  m_VelocityFieldShrinkFactor = 1;
+  m_NumberOfActivePixels = 0;
+  m_ActiveSetBuildTime = 0.0;
+  m_DeformationFieldExpander = FieldExpanderType::New();
+  m_InverseDisplacementFieldExpander = FieldExpanderType::New();
 }
 
 
@@ -234,16 +285,74 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
     os << m_UpdateFieldStandardDeviations[j] << ", ";
     }
   os << m_UpdateFieldStandardDeviations[j] << "]" << std::endl;
+  os << indent << "StandardDeviationsInPhysicalUnits: ";
+  os << m_StandardDeviationsInPhysicalUnits << std::endl;
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
+  os << indent << "UseConvergenceCriterion: ";
+  os << m_UseConvergenceCriterion << std::endl;
+  os << indent << "ConvergenceWindowSize: ";
+  os << m_ConvergenceWindowSize << std::endl;
+  os << indent << "ConvergenceTolerance: ";
+  os << m_ConvergenceTolerance << std::endl;
+  os << indent << "Converged: ";
+  os << m_Converged << std::endl;
   os << indent << "MaximumError: ";
   os << m_MaximumError << std::endl;
   os << indent << "MaximumKernelWidth: ";
   os << m_MaximumKernelWidth << std::endl;
+  os << indent << "SmoothingEngine: ";
+  switch( m_SmoothingEngine )
+    {
+    case RecursiveGaussianSmoothing:
+      os << "RecursiveGaussian" << std::endl;
+      break;
+    case LineBufferGaussianSmoothing:
+      os << "LineBufferGaussian" << std::endl;
+      break;
+    default:
+      os << "GaussianOperator" << std::endl;
+    }
+  os << indent << "KeepScratchFields: ";
+  os << m_KeepScratchFields << std::endl;
+  os << indent << "NumberOfScratchAllocations: ";
+  os << m_NumberOfScratchAllocations << std::endl;
+  os << indent << "VelocityFieldShrinkFactor: ";
+  os << m_VelocityFieldShrinkFactor << std::endl;
+  os << indent << "FixedImageMask: ";
+  os << m_FixedImageMask.GetPointer() << std::endl;
+  os << indent << "MovingImageMask: ";
+  os << m_MovingImageMask.GetPointer() << std::endl;
+  os << indent << "UseNarrowBand: ";
+  os << m_UseNarrowBand << std::endl;
+  os << indent << "NarrowBandThreshold: ";
+  os << m_NarrowBandThreshold << std::endl;
+  os << indent << "NarrowBandUpdateInterval: ";
+  os << m_NarrowBandUpdateInterval << std::endl;
+  os << indent << "NumberOfActivePixels: ";
+  os << m_NumberOfActivePixels << std::endl;
+  os << indent << "ActiveSetBuildTime: ";
+  os << m_ActiveSetBuildTime << std::endl;
+  os << indent << "ReservedNumberOfPixels: ";
+  os << m_ReservedNumberOfPixels << std::endl;
+  os << indent << "NumberOfBufferAllocations: ";
+  os << m_NumberOfBufferAllocations << std::endl;
   os << indent << "Exponentiator: ";
   os << m_Exponentiator << std::endl;
   os << indent << "InverseExponentiator: ";
   os << m_InverseExponentiator << std::endl;
+  os << indent << "UseForwardInverseExponentiator: ";
+  os << m_UseForwardInverseExponentiator << std::endl;
+  os << indent << "UseDoublePrecisionExponential: ";
+  os << m_UseDoublePrecisionExponential << std::endl;
+  os << indent << "ForwardInverseExponentiator: ";
+  os << m_ForwardInverseExponentiator << std::endl;
+  os << indent << "UseIncrementalExponential: ";
+  os << m_UseIncrementalExponential << std::endl;
+  os << indent << "IncrementalExponentiator: ";
+  os << m_IncrementalExponentiator << std::endl;
+  os << indent << "InverseIncrementalExponentiator: ";
+  os << m_InverseIncrementalExponentiator << std::endl;
 
 }
 
@@ -275,6 +384,13 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
   f->SetFixedImage( fixedPtr );
   f->SetMovingImage( movingPtr );
 
+  // The deformation field of the iteration was given to the function
+#if (ITK_VERSION_MAJOR < 4)
+  this->UpdateNarrowBand( f->GetDeformationField() );
+#else
+  this->UpdateNarrowBand( f->GetDisplacementField() );
+#endif
+
   this->Superclass::InitializeIteration();
 
 }
@@ -295,7 +411,38 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
   typename Superclass::InputImageType::ConstPointer  inputPtr  = this->GetInput(VELOCITYFIELD_IMAGE_CODE);
 #endif
 
-  if( inputPtr )
+  VelocityFieldPointer output = this->GetVelocityField();
+
+  if( inputPtr && m_VelocityFieldShrinkFactor > 1
+      && ( inputPtr->GetLargestPossibleRegion() != output->GetLargestPossibleRegion()
+           || inputPtr->GetSpacing() != output->GetSpacing()
+           || inputPtr->GetOrigin() != output->GetOrigin() ) )
+    {
+    // The initial velocity field is given on another grid
+    typedef VectorResampleImageFilter<VelocityFieldType, VelocityFieldType> ResamplerType;
+    typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+      VelocityFieldType, double>                                          InterpolatorType;
+
+    typename ResamplerType::Pointer resampler = ResamplerType::New();
+    resampler->SetInterpolator( InterpolatorType::New() );
+    resampler->SetInput( inputPtr );
+    resampler->SetSize( output->GetLargestPossibleRegion().GetSize() );
+    resampler->SetOutputStartIndex( output->GetLargestPossibleRegion().GetIndex() );
+    resampler->SetOutputOrigin( output->GetOrigin() );
+    resampler->SetOutputSpacing( output->GetSpacing() );
+    resampler->SetOutputDirection( output->GetDirection() );
+    resampler->SetNumberOfThreads( this->GetNumberOfThreads() );
+    resampler->GetOutput()->SetRequestedRegion( output->GetRequestedRegion() );
+    resampler->Update();
+
+    ImageRegionConstIterator<VelocityFieldType> in( resampler->GetOutput(), output->GetRequestedRegion() );
+    ImageRegionIterator<VelocityFieldType>      out( output, output->GetRequestedRegion() );
+    for( ; !out.IsAtEnd(); ++in, ++out )
+      {
+      out.Value() = in.Get();
+      }
+    }
+  else if( inputPtr )
     {
     this->Superclass::CopyInputToOutput();
     }
@@ -307,8 +454,6 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
       zeros[j] = 0;
       }
 
-    typename OutputImageType::Pointer output = this->GetVelocityField();
-
     ImageRegionIterator<OutputImageType> out(output, output->GetRequestedRegion() );
 
     while( !out.IsAtEnd() )
@@ -327,10 +472,38 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
   // std::cout<<"LogDomainDeformableRegistrationFilter::GenerateOutputInformation"<<std::endl;
   typename DataObject::Pointer output;
 
+  if( m_VelocityFieldShrinkFactor > 1 && this->GetFixedImage() )
+    {
+    // The velocity grid is derived from the fixed image grid: its cells
+    // gather shrink factor voxels of the fixed image along each dimension
+    // and are centered on them.
+    const FixedImageType *                      fixedPtr = this->GetFixedImage();
+    const typename FixedImageType::RegionType & fixedRegion = fixedPtr->GetLargestPossibleRegion();
+
+    typename VelocityFieldType::RegionType  region;
+    typename VelocityFieldType::SpacingType spacing;
+    ContinuousIndex<double, ImageDimension> firstCellCenter;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      region.SetIndex( j, 0 );
+      region.SetSize( j, ( fixedRegion.GetSize()[j] + m_VelocityFieldShrinkFactor - 1 )
+                      / m_VelocityFieldShrinkFactor );
+      spacing[j] = fixedPtr->GetSpacing()[j] * m_VelocityFieldShrinkFactor;
+      firstCellCenter[j] = fixedRegion.GetIndex()[j] + 0.5 * ( m_VelocityFieldShrinkFactor - 1.0 );
+      }
+    typename VelocityFieldType::PointType origin;
+    fixedPtr->TransformContinuousIndexToPhysicalPoint( firstCellCenter, origin );
+
+    VelocityFieldPointer outputPtr = this->GetVelocityField();
+    outputPtr->SetLargestPossibleRegion( region );
+    outputPtr->SetSpacing( spacing );
+    outputPtr->SetOrigin( origin );
+    outputPtr->SetDirection( fixedPtr->GetDirection() );
+    }
 #if (ITK_VERSION_MAJOR < 4)
-  if( this->GetInput(VELOCITYFIELD_IMAGE_CODE) )
+  else if( this->GetInput(VELOCITYFIELD_IMAGE_CODE) )
 #else
-  if( this->GetInput(VELOCITYFIELD_IMAGE_CODE) )
+  else if( this->GetInput(VELOCITYFIELD_IMAGE_CODE) )
 #endif
     {
     // Initial velocity field is set.
@@ -385,6 +558,20 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
   VelocityFieldPointer outputPtr = this->GetVelocityField();
   FixedImagePointer    fixedPtr = const_cast<FixedImageType *>( this->GetFixedImage() );
 
+  if( m_VelocityFieldShrinkFactor > 1 )
+    {
+    // The grids differ, the whole images are used
+    if( inputPtr )
+      {
+      inputPtr->SetRequestedRegionToLargestPossibleRegion();
+      }
+    if( fixedPtr )
+      {
+      fixedPtr->SetRequestedRegionToLargestPossibleRegion();
+      }
+    return;
+    }
+
   if( inputPtr )
     {
     inputPtr->SetRequestedRegion( outputPtr->GetRequestedRegion() );
@@ -403,7 +590,183 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::PostProcessOutput()
 {
   this->Superclass::PostProcessOutput();
-  m_TempField->Initialize();
+  if( !m_KeepScratchFields )
+    {
+    this->ReleaseScratchFields();
+    }
+  else if( m_ReservedNumberOfPixels > 0 )
+    {
+    // The smoothing may have swapped the buffer of the output with the
+    // one of a scratch field: remember the one the output ended up with
+    m_VelocityFieldArena = this->GetOutput()->GetPixelContainer();
+    }
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ReleaseScratchFields()
+{
+  for( unsigned int i = 0; i < m_ScratchFields.size(); ++i )
+    {
+    if( m_ScratchFields[i].IsNotNull() )
+      {
+      m_ScratchFields[i]->Initialize();
+      }
+    }
+  this->DisconnectOutputBuffer();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::DisconnectOutputBuffer()
+{
+  m_VelocityFieldArena = 0;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>::VelocityFieldType
+* LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GetScratchField(ScratchFieldIdentifierType id, const VelocityFieldType * reference)
+{
+  if( static_cast<unsigned int>( id ) >= m_ScratchFields.size() )
+    {
+    m_ScratchFields.resize( id + 1 );
+    }
+  if( m_ScratchFields[id].IsNull() )
+    {
+    m_ScratchFields[id] = VelocityFieldType::New();
+    }
+
+  VelocityFieldType * scratch = m_ScratchFields[id];
+  scratch->SetOrigin( reference->GetOrigin() );
+  scratch->SetSpacing( reference->GetSpacing() );
+  scratch->SetDirection( reference->GetDirection() );
+  scratch->SetLargestPossibleRegion( reference->GetLargestPossibleRegion() );
+  scratch->SetRequestedRegion( reference->GetRequestedRegion() );
+  scratch->SetBufferedRegion( reference->GetBufferedRegion() );
+
+  // Allocate only reallocates the container when its capacity is too small
+  if( this->ReserveBuffer( scratch ) )
+    {
+    ++m_NumberOfScratchAllocations;
+    }
+  scratch->Allocate();
+
+  return scratch;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+bool
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ReserveBuffer(VelocityFieldType * field) const
+{
+  typename VelocityFieldType::PixelContainer * container = field->GetPixelContainer();
+  const SizeValueType numberOfPixels = field->GetBufferedRegion().GetNumberOfPixels();
+
+  if( container->Capacity() >= numberOfPixels )
+    {
+    return false;
+    }
+  container->Reserve( vnl_math_max( numberOfPixels, m_ReservedNumberOfPixels ) );
+  return true;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::AllocateOutputs()
+{
+  VelocityFieldType * output = this->GetOutput();
+
+  if( m_VelocityFieldArena.IsNotNull() )
+    {
+    // Reuse the buffer of the previous output
+    if( m_ReservedNumberOfPixels > 0 )
+      {
+      output->SetPixelContainer( m_VelocityFieldArena );
+      }
+    m_VelocityFieldArena = 0;
+    }
+
+  output->SetBufferedRegion( output->GetRequestedRegion() );
+  if( this->ReserveBuffer( output ) )
+    {
+    ++m_NumberOfBufferAllocations;
+    }
+
+  this->Superclass::AllocateOutputs();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::AllocateUpdateBuffer()
+{
+  // The update buffer looks just like the output
+  VelocityFieldType * update = this->GetUpdateBuffer();
+
+  update->SetBufferedRegion( this->GetOutput()->GetBufferedRegion() );
+  if( this->ReserveBuffer( update ) )
+    {
+    ++m_NumberOfBufferAllocations;
+    }
+
+  this->Superclass::AllocateUpdateBuffer();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+const typename LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>::SmoothingOperatorType
+& LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GetSmoothingOperator(unsigned int direction, double variance)
+{
+  for( unsigned int i = 0; i < m_SmoothingOperators.size(); ++i )
+    {
+    const SmoothingOperatorType & oper = m_SmoothingOperators[i];
+    if( oper.GetDirection() == direction
+        && oper.GetVariance() == variance
+        && oper.GetMaximumError() == m_MaximumError
+        && oper.GetMaximumKernelWidth() == m_MaximumKernelWidth )
+      {
+      return oper;
+      }
+    }
+
+  // Only a few different operators are used during a registration. Start
+  // over if the parameters changed too many times.
+  if( m_SmoothingOperators.size() >= 4 * ImageDimension )
+    {
+    m_SmoothingOperators.clear();
+    }
+
+  SmoothingOperatorType oper;
+  oper.SetDirection( direction );
+  oper.SetVariance( variance );
+  oper.SetMaximumError( m_MaximumError );
+  oper.SetMaximumKernelWidth( m_MaximumKernelWidth );
+  oper.CreateDirectional();
+
+  m_SmoothingOperators.push_back( oper );
+  return m_SmoothingOperators.back();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+unsigned long
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GetNumberOfIncrementalExponentials() const
+{
+  return m_IncrementalExponentiator->GetNumberOfIncrementalExponentials()
+         + m_InverseIncrementalExponentiator->GetNumberOfIncrementalExponentials();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+unsigned long
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GetNumberOfFullExponentials() const
+{
+  return m_IncrementalExponentiator->GetNumberOfFullExponentials()
+         + m_InverseIncrementalExponentiator->GetNumberOfFullExponentials();
 }
 
 // Initialize flags
@@ -415,6 +778,108 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
   // std::cout<<"LogDomainDeformableRegistrationFilter::Initialize"<<std::endl;
   this->Superclass::Initialize();
   m_StopRegistrationFlag = false;
+
+  m_Converged = false;
+  if( !m_UseInitialConvergenceHistory )
+    {
+    m_MetricHistory.clear();
+    m_RMSChangeHistory.clear();
+    }
+  m_UseInitialConvergenceHistory = false;
+
+  // Do not warm-start from a previous registration
+  m_IncrementalExponentiator->Reset();
+  m_InverseIncrementalExponentiator->Reset();
+
+  m_ActiveSetBuildTime = 0.0;
+  this->BuildActiveSet();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::UpdateNarrowBand(const DeformationFieldType * field)
+{
+  if( ( m_UseNarrowBand || m_MovingImageMask.IsNotNull() ) && field
+      && this->GetElapsedIterations() % m_NarrowBandUpdateInterval == 0 )
+    {
+    this->BuildActiveSet( field );
+    itkDebugMacro( "Narrow band of " << m_NumberOfActivePixels << " voxels, built in "
+                   << m_ActiveSetBuildTime << " s so far" );
+    }
+}
+
+// Check the user request and the convergence
+template <class TFixedImage, class TMovingImage, class TField>
+bool
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::Halt()
+{
+  if( m_StopRegistrationFlag )
+    {
+    return true;
+    }
+
+  if( m_UseConvergenceCriterion && this->GetElapsedIterations() > 0 )
+    {
+    // The metric and RMS change were computed by the last iteration
+    m_MetricHistory.push_back( this->GetMetric() );
+    m_RMSChangeHistory.push_back( this->GetRMSChange() );
+    while( m_MetricHistory.size() > m_ConvergenceWindowSize )
+      {
+      m_MetricHistory.pop_front();
+      m_RMSChangeHistory.pop_front();
+      }
+
+    if( m_MetricHistory.size() == m_ConvergenceWindowSize
+        && ComputeRelativeSlope( m_MetricHistory ) > -m_ConvergenceTolerance
+        && ComputeRelativeSlope( m_RMSChangeHistory ) > -m_ConvergenceTolerance )
+      {
+      itkDebugMacro( "Converged after " << this->GetElapsedIterations() << " iterations" );
+      m_Converged = true;
+      this->UpdateProgress( 1.0 );
+      return true;
+      }
+    }
+
+  return this->Superclass::Halt();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+double
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ComputeRelativeSlope(const std::deque<double> & values)
+{
+  const double n = static_cast<double>( values.size() );
+  if( values.size() < 2 )
+    {
+    return 0.0;
+    }
+
+  double mean = 0.0;
+  for( unsigned int i = 0; i < values.size(); i++ )
+    {
+    mean += values[i];
+    }
+  mean /= n;
+
+  if( mean == 0.0 )
+    {
+    return 0.0;
+    }
+
+  // Least squares fit of values[i] = a + slope * i
+  const double meanIteration = 0.5 * ( n - 1.0 );
+  double       covariance = 0.0;
+  double       variance = 0.0;
+  for( unsigned int i = 0; i < values.size(); i++ )
+    {
+    const double di = static_cast<double>( i ) - meanIteration;
+    covariance += di * ( values[i] - mean );
+    variance += di * di;
+    }
+
+  return covariance / ( variance * vnl_math_abs( mean ) );
 }
 
 // Smooth velocity using a separable Gaussian kernel
@@ -423,8 +888,16 @@ void
 LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::SmoothVelocityField()
 {
+  // The velocity field may be coarser than the fixed image
+  double standardDeviations[ImageDimension];
+  this->GetStandardDeviationsInFixedImageVoxels( m_StandardDeviations, standardDeviations );
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    standardDeviations[j] /= m_VelocityFieldShrinkFactor;
+    }
+
   // The output buffer will be overwritten with new data.
-  this->SmoothGivenField(this->GetVelocityField(), this->m_StandardDeviations);
+  this->SmoothGivenField(this->GetVelocityField(), standardDeviations);
 }
 
 // Smooth update field using a separable Gaussian kernel
@@ -433,84 +906,122 @@ void
 LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::SmoothUpdateField()
 {
+  // The update field may be coarser than the fixed image
+  double standardDeviations[ImageDimension];
+  this->GetStandardDeviationsInFixedImageVoxels( m_UpdateFieldStandardDeviations, standardDeviations );
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    standardDeviations[j] /= m_VelocityFieldShrinkFactor;
+    }
+
   // The update buffer will be overwritten with new data.
-  this->SmoothGivenField(this->GetUpdateBuffer(), this->m_UpdateFieldStandardDeviations);
+  this->SmoothGivenField(this->GetUpdateBuffer(), standardDeviations);
 }
 
-// Smooth velocity using a separable Gaussian kernel
 template <class TFixedImage, class TMovingImage, class TField>
 void
 LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
-::SmoothGivenField(VelocityFieldType * field, const double StandardDeviations[ImageDimension])
+::GetStandardDeviationsInFixedImageVoxels(const double standardDeviations[ImageDimension],
+                                          double voxelStandardDeviations[ImageDimension]) const
 {
-  typedef typename VelocityFieldType::PixelType        VectorType;
-  typedef typename VectorType::ValueType               ScalarType;
+  const FixedImageType * fixedPtr = this->GetFixedImage();
 
-  // copy field to TempField
-  m_TempField->SetOrigin( field->GetOrigin() );
-  m_TempField->SetSpacing( field->GetSpacing() );
-  m_TempField->SetDirection( field->GetDirection() );
-  m_TempField->SetLargestPossibleRegion( field->GetLargestPossibleRegion() );
-  m_TempField->SetRequestedRegion( field->GetRequestedRegion() );
-  m_TempField->SetBufferedRegion( field->GetBufferedRegion() );
-  m_TempField->Allocate();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
     {
-    VectorType zeroVec;
-    zeroVec.Fill( 0.0 );
-    m_TempField->FillBuffer( zeroVec );
+    voxelStandardDeviations[j] = standardDeviations[j];
+    if( m_StandardDeviationsInPhysicalUnits && fixedPtr )
+      {
+      voxelStandardDeviations[j] /= fixedPtr->GetSpacing()[j];
+      }
     }
+}
 
-  typedef GaussianOperator<ScalarType, ImageDimension> OperatorType;
-  OperatorType * const oper = new OperatorType;
+// Smooth velocity using a separable Gaussian kernel
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::SmoothGivenField(VelocityFieldType * field, const double StandardDeviations[ImageDimension])
+{
+  typedef ImageToImageFilter<VelocityFieldType, VelocityFieldType> SmootherType;
+  typedef typename VelocityFieldType::PixelContainerPointer        PixelContainerPointer;
+
+  const typename VelocityFieldType::RegionType requestedRegion = field->GetRequestedRegion();
+  const typename VelocityFieldType::SizeType & size = field->GetBufferedRegion().GetSize();
+  const typename VelocityFieldType::SpacingType & spacing = field->GetSpacing();
 
-  typedef VectorNeighborhoodOperatorImageFilter<
-    VelocityFieldType, VelocityFieldType>              SmootherType;
-  typename SmootherType::Pointer smoother = SmootherType::New();
+  if( m_SmoothingEngine == LineBufferGaussianSmoothing )
+    {
+    // smooth the field in place, or only the bounding box of the active
+    // set and its halo in the scratch field of the smoother
+    m_LineBufferSmoother->SetStandardDeviations( const_cast<double *>( StandardDeviations ) );
+    m_LineBufferSmoother->SetMaximumError( m_MaximumError );
+    m_LineBufferSmoother->SetMaximumKernelWidth( m_MaximumKernelWidth );
+    m_LineBufferSmoother->SetNumberOfThreads( this->GetNumberOfThreads() );
+    // nothing needs to be smoothed outside of the active set
+    m_LineBufferSmoother->SetSmoothingRegion( m_ActiveBoundingBox );
+    m_LineBufferSmoother->SetInput( field );
+    m_LineBufferSmoother->Modified();
+    m_LineBufferSmoother->Update();
+
+    // do not keep references to the field in the mini-pipeline
+    m_LineBufferSmoother->SetInput( NULL );
+    m_LineBufferSmoother->GetOutput()->ReleaseData();
+
+    field->SetRequestedRegion( requestedRegion );
+    return;
+    }
 
-  typedef typename VelocityFieldType::PixelContainerPointer
-  PixelContainerPointer;
-  PixelContainerPointer swapPtr;
+  // The smoothed data ping-pongs between the field and a scratch field
+  VelocityFieldType * scratch = this->GetScratchField( SmoothingScratchField, field );
 
-  // graft the output field onto the mini-pipeline
-  smoother->GraftOutput( m_TempField );
   for( unsigned int j = 0; j < ImageDimension; j++ )
     {
-    // smooth along this dimension
-    oper->SetDirection( j );
-    double variance = vnl_math_sqr( StandardDeviations[j] );
-    oper->SetVariance( variance );
-    oper->SetMaximumError( m_MaximumError );
-    oper->SetMaximumKernelWidth( m_MaximumKernelWidth );
-    oper->CreateDirectional();
+    if( StandardDeviations[j] <= 0.0 )
+      {
+      continue;
+      }
+
+    SmootherType * smoother;
+
+    // smooth along this dimension. The recursive filter needs at least 4
+    // pixels along the direction, the operator is used along shorter ones.
+    if( m_SmoothingEngine == RecursiveGaussianSmoothing && size[j] >= 4 )
+      {
+      m_RecursiveSmoother->SetDirection( j );
+      // the standard deviations are given in voxel units
+      m_RecursiveSmoother->SetSigma( StandardDeviations[j] * spacing[j] );
+      smoother = m_RecursiveSmoother.GetPointer();
+      }
+    else
+      {
+      // todo: make sure we only smooth within the buffered region
+      m_OperatorSmoother->SetOperator(
+        this->GetSmoothingOperator( j, vnl_math_sqr( StandardDeviations[j] ) ) );
+      smoother = m_OperatorSmoother.GetPointer();
+      }
 
-    // todo: make sure we only smooth within the buffered region
-    smoother->SetOperator( *oper );
     smoother->SetInput( field );
+    smoother->GraftOutput( scratch );
+    smoother->Modified();
     smoother->Update();
 
-    if( j < ImageDimension - 1 )
+    // The smoothed data normally lies in the scratch buffer. Swap the
+    // containers so that the field holds it.
+    PixelContainerPointer smoothedPtr = smoother->GetOutput()->GetPixelContainer();
+    if( smoothedPtr != scratch->GetPixelContainer() )
       {
-      // swap the containers
-      swapPtr = smoother->GetOutput()->GetPixelContainer();
-      smoother->GraftOutput( field );
-      field->SetPixelContainer( swapPtr );
-      smoother->Modified();
+      ++m_NumberOfScratchAllocations;
       }
+    scratch->SetPixelContainer( field->GetPixelContainer() );
+    field->SetPixelContainer( smoothedPtr );
 
+    // do not keep references to the fields in the mini-pipeline
+    smoother->SetInput( NULL );
+    smoother->GetOutput()->ReleaseData();
     }
 
-  // graft the output back to field
-  m_TempField->SetPixelContainer( field->GetPixelContainer() );
-
-  // field to contain the final smoothed data, do the equivalent of a graft
-  field->SetPixelContainer( smoother->GetOutput()->GetPixelContainer() );
-  field->SetRequestedRegion( smoother->GetOutput()->GetRequestedRegion() );
-  field->SetBufferedRegion( smoother->GetOutput()->GetBufferedRegion() );
-  field->SetLargestPossibleRegion( smoother->GetOutput()->GetLargestPossibleRegion() );
-  field->CopyInformation( smoother->GetOutput() );
-
-  delete oper;
-
+  // the smoother may have modified the requested region of its input
+  field->SetRequestedRegion( requestedRegion );
 }
 
 template <class TFixedImage, class TMovingImage, class TField>
@@ -520,10 +1031,36 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::GetDeformationField()
 {
   // std::cout<<"LogDomainDeformableRegistration::GetDeformationField"<<std::endl;
+  if( m_UseIncrementalExponential )
+    {
+    // The velocity field is updated in place, always recompute
+    m_IncrementalExponentiator->SetInput( this->GetVelocityField() );
+    m_IncrementalExponentiator->GetOutput()->SetRequestedRegion(
+      this->GetVelocityField()->GetRequestedRegion() );
+    m_IncrementalExponentiator->Modified();
+    m_IncrementalExponentiator->Update();
+    return this->ExpandToFixedImageGrid( m_IncrementalExponentiator->GetOutput(),
+                                         m_DeformationFieldExpander );
+    }
+
+  if( m_UseForwardInverseExponentiator || m_UseDoublePrecisionExponential )
+    {
+    m_ForwardInverseExponentiator->SetUseDoublePrecisionSquaring( m_UseDoublePrecisionExponential );
+    // Always recompute, the inverse is then available at no extra cost
+    m_ForwardInverseExponentiator->SetInput( this->GetVelocityField() );
+    m_ForwardInverseExponentiator->GetOutput()->SetRequestedRegion(
+      this->GetVelocityField()->GetRequestedRegion() );
+    m_ForwardInverseExponentiator->Modified();
+    m_ForwardInverseExponentiator->Update();
+    m_ForwardInverseElapsedIterations = this->GetElapsedIterations();
+    return this->ExpandToFixedImageGrid( m_ForwardInverseExponentiator->GetOutput(),
+                                         m_DeformationFieldExpander );
+    }
+
   m_Exponentiator->SetInput( this->GetVelocityField() );
   m_Exponentiator->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
   m_Exponentiator->Update();
-  return m_Exponentiator->GetOutput();
+  return this->ExpandToFixedImageGrid( m_Exponentiator->GetOutput(), m_DeformationFieldExpander );
 }
 
 template <class TFixedImage, class TMovingImage, class TField>
@@ -533,10 +1070,561 @@ LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::GetInverseDisplacementField()
 {
   // std::cout<<"LogDomainDeformableRegistration::GetInverseDisplacementField"<<std::endl;
+  if( m_UseIncrementalExponential )
+    {
+    m_InverseIncrementalExponentiator->SetInput( this->GetVelocityField() );
+    m_InverseIncrementalExponentiator->GetOutput()->SetRequestedRegion(
+      this->GetVelocityField()->GetRequestedRegion() );
+    m_InverseIncrementalExponentiator->Modified();
+    m_InverseIncrementalExponentiator->Update();
+    return this->ExpandToFixedImageGrid( m_InverseIncrementalExponentiator->GetOutput(),
+                                         m_InverseDisplacementFieldExpander );
+    }
+
+  if( m_UseForwardInverseExponentiator || m_UseDoublePrecisionExponential )
+    {
+    m_ForwardInverseExponentiator->SetUseDoublePrecisionSquaring( m_UseDoublePrecisionExponential );
+    // The velocity field is updated in place, so only reuse the inverse
+    // computed by GetDeformationField() during the same iteration
+    m_ForwardInverseExponentiator->SetInput( this->GetVelocityField() );
+    m_ForwardInverseExponentiator->GetOutput()->SetRequestedRegion(
+      this->GetVelocityField()->GetRequestedRegion() );
+    if( m_ForwardInverseElapsedIterations != this->GetElapsedIterations() )
+      {
+      m_ForwardInverseExponentiator->Modified();
+      }
+    m_ForwardInverseExponentiator->Update();
+    m_ForwardInverseElapsedIterations = this->GetElapsedIterations();
+    return this->ExpandToFixedImageGrid( m_ForwardInverseExponentiator->GetInverseOutput(),
+                                         m_InverseDisplacementFieldExpander );
+    }
+
   m_InverseExponentiator->SetInput( this->GetVelocityField() );
   m_InverseExponentiator->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
   m_InverseExponentiator->Update();
-  return m_InverseExponentiator->GetOutput();
+  return this->ExpandToFixedImageGrid( m_InverseExponentiator->GetOutput(),
+                                       m_InverseDisplacementFieldExpander );
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::DeformationFieldPointer
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ExpandToFixedImageGrid(DeformationFieldType * field, FieldExpanderType * expander)
+{
+  if( m_VelocityFieldShrinkFactor == 1 )
+    {
+    return field;
+    }
+
+  const FixedImageType * fixedPtr = this->GetFixedImage();
+
+  expander->SetInput( field );
+  expander->SetSize( fixedPtr->GetLargestPossibleRegion().GetSize() );
+  expander->SetOutputStartIndex( fixedPtr->GetLargestPossibleRegion().GetIndex() );
+  expander->SetOutputOrigin( fixedPtr->GetOrigin() );
+  expander->SetOutputSpacing( fixedPtr->GetSpacing() );
+  expander->SetOutputDirection( fixedPtr->GetDirection() );
+  expander->SetNumberOfThreads( this->GetNumberOfThreads() );
+  expander->UpdateLargestPossibleRegion();
+  return expander->GetOutput();
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+typename LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::TimeStepType
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ThreadedCalculateChange(const ThreadRegionType & regionToProcess, ThreadIdType threadId)
+{
+  if( m_VelocityFieldShrinkFactor == 1 && !m_UseActiveSet )
+    {
+    return this->Superclass::ThreadedCalculateChange( regionToProcess, threadId );
+    }
+
+  typedef typename VelocityFieldType::IndexType      IndexType;
+  typedef typename VelocityFieldType::IndexValueType IndexValueType;
+  typedef typename VelocityFieldType::PixelType      PixelType;
+  typedef typename PixelType::ValueType              ScalarType;
+  typedef typename
+  FiniteDifferenceFunctionType::NeighborhoodType    NeighborhoodIteratorType;
+  typedef NeighborhoodAlgorithm::ImageBoundaryFacesCalculator<DeformationFieldType>
+  FaceCalculatorType;
+
+  const IndexValueType factor = static_cast<IndexValueType>( m_VelocityFieldShrinkFactor );
+
+  // With a coarse velocity grid, the forces are computed around the
+  // deformation field on the fixed image grid, as obtained by the last
+  // call to GetDeformationField
+  VelocityFieldType *          update = this->GetUpdateBuffer();
+  const DeformationFieldType * fineField = this->GetVelocityField();
+  if( factor > 1 )
+    {
+    fineField = m_DeformationFieldExpander->GetOutput();
+    }
+
+  const ThreadRegionType & fineLargest = fineField->GetLargestPossibleRegion();
+  const ThreadRegionType & coarseLargest = update->GetLargestPossibleRegion();
+
+  // Voxels of the fixed image that lie in the cells to process
+  ThreadRegionType fineRegion;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    const IndexValueType fineEnd = fineLargest.GetIndex()[j]
+      + static_cast<IndexValueType>( fineLargest.GetSize()[j] );
+    const IndexValueType first = fineLargest.GetIndex()[j]
+      + factor * ( regionToProcess.GetIndex()[j] - coarseLargest.GetIndex()[j] );
+    const IndexValueType last = vnl_math_min( fineEnd, first
+                                              + factor * static_cast<IndexValueType>( regionToProcess.GetSize()[j] ) );
+    fineRegion.SetIndex( j, first );
+    fineRegion.SetSize( j, last - first );
+    }
+
+  // The update is zero outside of the active set
+  PixelType zero;
+  zero.Fill( 0 );
+  for( ImageRegionIterator<VelocityFieldType> uIt( update, regionToProcess ); !uIt.IsAtEnd(); ++uIt )
+    {
+    uIt.Set( zero );
+    }
+
+  const typename FiniteDifferenceFunctionType::Pointer df = this->GetDifferenceFunction();
+  const typename FiniteDifferenceFunctionType::RadiusType radius = df->GetRadius();
+
+  void *globalData = df->GetGlobalDataPointer();
+
+  // The neighborhood iterators check the boundary conditions by
+  // themselves, the runs of the active set need not be split into faces
+  ActiveRunListType regions;
+  if( !this->GetActiveRuns( fineRegion, regions ) )
+    {
+    FaceCalculatorType faceCalculator;
+    regions = faceCalculator( fineField, fineRegion, radius );
+    }
+
+  for( typename ActiveRunListType::const_iterator rIt = regions.begin(); rIt != regions.end(); ++rIt )
+    {
+    NeighborhoodIteratorType nD( radius, fineField, *rIt );
+    if( factor == 1 )
+      {
+      ImageRegionIterator<VelocityFieldType> uIt( update, *rIt );
+      for( nD.GoToBegin(); !nD.IsAtEnd(); ++nD, ++uIt )
+        {
+        uIt.Value() = df->ComputeUpdate( nD, globalData );
+        }
+      continue;
+      }
+
+    // Sum the forces of the voxels of each cell
+    for( nD.GoToBegin(); !nD.IsAtEnd(); ++nD )
+      {
+      const IndexType index = nD.GetIndex();
+      IndexType       cell;
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        cell[j] = coarseLargest.GetIndex()[j] + ( index[j] - fineLargest.GetIndex()[j] ) / factor;
+        }
+      update->GetPixel( cell ) += df->ComputeUpdate( nD, globalData );
+      }
+    }
+
+  // Ask the finite difference function to compute the time step for
+  // this iteration.  We give it the global data pointer to use, then
+  // ask it to free the global data memory.
+  const TimeStepType timeStep = df->ComputeGlobalTimeStep( globalData );
+  df->ReleaseGlobalDataPointer( globalData );
+
+  if( factor == 1 )
+    {
+    return timeStep;
+    }
+
+  // Average the forces, the cells on the border may be partially filled
+  for( ImageRegionIteratorWithIndex<VelocityFieldType> uIt( update, regionToProcess ); !uIt.IsAtEnd(); ++uIt )
+    {
+    const IndexType & cell = uIt.GetIndex();
+    IndexValueType    count = 1;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      const IndexValueType first = fineLargest.GetIndex()[j]
+        + factor * ( cell[j] - coarseLargest.GetIndex()[j] );
+      const IndexValueType fineEnd = fineLargest.GetIndex()[j]
+        + static_cast<IndexValueType>( fineLargest.GetSize()[j] );
+      count *= vnl_math_min( factor, fineEnd - first );
+      }
+    uIt.Set( uIt.Get() / static_cast<ScalarType>( count ) );
+    }
+
+  return timeStep;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+bool
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::GetActiveRuns(const ThreadRegionType & region, ActiveRunListType & runs) const
+{
+  typedef typename ThreadRegionType::IndexValueType IndexValueType;
+
+  if( !m_UseActiveSet )
+    {
+    return false;
+    }
+
+  const ActiveIndexType & first = region.GetIndex();
+  IndexValueType          end[ImageDimension];
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    end[j] = first[j] + static_cast<IndexValueType>( region.GetSize()[j] );
+    }
+
+  // The runs are sorted along the last dimension, along which the regions
+  // of the threads are split
+  const unsigned int last = ImageDimension - 1;
+  const SizeValueType numberOfRuns = m_ActiveRunStarts.size();
+  SizeValueType       lower = 0;
+  SizeValueType       upper = numberOfRuns;
+  while( last > 0 && lower < upper )
+    {
+    const SizeValueType middle = ( lower + upper ) / 2;
+    if( m_ActiveRunStarts[middle][last] < first[last] )
+      {
+      lower = middle + 1;
+      }
+    else
+      {
+      upper = middle;
+      }
+    }
+
+  for( SizeValueType k = lower; k < numberOfRuns; ++k )
+    {
+    const ActiveIndexType & start = m_ActiveRunStarts[k];
+    if( last > 0 && start[last] >= end[last] )
+      {
+      break;
+      }
+
+    bool inside = true;
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      if( start[j] < first[j] || start[j] >= end[j] )
+        {
+        inside = false;
+        break;
+        }
+      }
+
+    const IndexValueType runBegin = vnl_math_max( start[0], first[0] );
+    const IndexValueType runEnd = vnl_math_min(
+        start[0] + static_cast<IndexValueType>( m_ActiveRunLengths[k] ), end[0] );
+    if( !inside || runBegin >= runEnd )
+      {
+      continue;
+      }
+
+    ThreadRegionType run;
+    run.SetIndex( start );
+    run.SetIndex( 0, runBegin );
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      run.SetSize( j, 1 );
+      }
+    run.SetSize( 0, runEnd - runBegin );
+    runs.push_back( run );
+    }
+
+  return true;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::BuildActiveSet(const DeformationFieldType * field)
+{
+  typedef typename ThreadRegionType::IndexValueType IndexValueType;
+  typedef typename ThreadRegionType::SizeType       RegionSizeType;
+
+  m_ActiveRunStarts.clear();
+  m_ActiveRunLengths.clear();
+  m_NumberOfActivePixels = 0;
+  m_ActiveBoundingBox = ThreadRegionType();
+
+  const bool hasMasks = m_FixedImageMask.IsNotNull() || m_MovingImageMask.IsNotNull();
+  const bool useNarrowBand = m_UseNarrowBand && field;
+  m_UseActiveSet = hasMasks || useNarrowBand;
+  if( !m_UseActiveSet )
+    {
+    return;
+    }
+
+  const double startTime = itksys::SystemTools::GetTime();
+
+  const FixedImageType * fixedPtr = this->GetFixedImage();
+  const ThreadRegionType fixedRegion = fixedPtr->GetLargestPossibleRegion();
+  const RegionSizeType & size = fixedRegion.GetSize();
+
+  typename ActiveSetInterpolatorType::Pointer movingInterpolator = ActiveSetInterpolatorType::New();
+  if( useNarrowBand )
+    {
+    movingInterpolator->SetInputImage( this->GetMovingImage() );
+    }
+
+  // Voxels of the fixed image that lie in either mask and are not matched,
+  // scanned by slabs along the last dimension. The buffer is kept from one
+  // rebuild to the next.
+  m_ActiveVoxels.assign( fixedRegion.GetNumberOfPixels(), hasMasks ? 0 : 1 );
+  std::vector<unsigned char> & active = m_ActiveVoxels;
+
+  ActiveSetScanStruct str;
+  str.Filter = this;
+  str.Field = field;
+  str.MovingInterpolator = useNarrowBand ? movingInterpolator.GetPointer() : 0;
+
+  const SizeValueType numberOfSlabs = size[ImageDimension - 1];
+  this->GetMultiThreader()->SetNumberOfThreads(
+    static_cast<int>( vnl_math_min( static_cast<SizeValueType>( this->GetNumberOfThreads() ), numberOfSlabs ) ) );
+  this->GetMultiThreader()->SetSingleMethod( this->ActiveSetScanThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // Dilate by the support of the smoothing kernels and of the function
+  // with a box, one dimension after the other
+  const typename FiniteDifferenceFunctionType::RadiusType functionRadius =
+    this->GetDifferenceFunction()->GetRadius();
+  double standardDeviations[ImageDimension];
+  double updateFieldStandardDeviations[ImageDimension];
+  this->GetStandardDeviationsInFixedImageVoxels( m_StandardDeviations, standardDeviations );
+  this->GetStandardDeviationsInFixedImageVoxels( m_UpdateFieldStandardDeviations, updateFieldStandardDeviations );
+  SizeValueType stride = 1;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    SizeValueType radius = functionRadius[j];
+    if( m_SmoothVelocityField )
+      {
+      radius += static_cast<SizeValueType>( vcl_ceil( 3.0 * standardDeviations[j] ) );
+      }
+    if( m_SmoothUpdateField )
+      {
+      radius += static_cast<SizeValueType>( vcl_ceil( 3.0 * updateFieldStandardDeviations[j] ) );
+      }
+
+    const SizeValueType length = size[j];
+    if( radius > 0 && length > 1 )
+      {
+      std::vector<unsigned char> line( length );
+      const SizeValueType        numberOfLines = active.size() / length;
+      for( SizeValueType l = 0; l < numberOfLines; ++l )
+        {
+        const SizeValueType firstVoxel = ( l / stride ) * stride * length + l % stride;
+        for( SizeValueType i = 0; i < length; ++i )
+          {
+          line[i] = active[firstVoxel + i * stride];
+          }
+
+        // Number of active voxels in the window [i - radius, i + radius]
+        SizeValueType count = 0;
+        for( SizeValueType i = 0; i <= radius && i < length; ++i )
+          {
+          count += line[i];
+          }
+        for( SizeValueType i = 0; i < length; ++i )
+          {
+          active[firstVoxel + i * stride] = ( count > 0 );
+          if( i + radius + 1 < length )
+            {
+            count += line[i + radius + 1];
+            }
+          if( i >= radius )
+            {
+            count -= line[i - radius];
+            }
+          }
+        }
+      }
+    stride *= length;
+    }
+
+  // Run length encoding along the first dimension
+  IndexValueType lowerBound[ImageDimension];
+  IndexValueType upperBound[ImageDimension];
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    lowerBound[j] = NumericTraits<IndexValueType>::max();
+    upperBound[j] = NumericTraits<IndexValueType>::NonpositiveMin();
+    }
+
+  const SizeValueType rowLength = size[0];
+  ActiveIndexType     rowIndex = fixedRegion.GetIndex();
+  for( SizeValueType rowStart = 0; rowStart < active.size(); rowStart += rowLength )
+    {
+    SizeValueType i = 0;
+    while( i < rowLength )
+      {
+      if( !active[rowStart + i] )
+        {
+        ++i;
+        continue;
+        }
+      SizeValueType runEnd = i + 1;
+      while( runEnd < rowLength && active[rowStart + runEnd] )
+        {
+        ++runEnd;
+        }
+
+      ActiveIndexType start = rowIndex;
+      start[0] += static_cast<IndexValueType>( i );
+      m_ActiveRunStarts.push_back( start );
+      m_ActiveRunLengths.push_back( runEnd - i );
+      m_NumberOfActivePixels += runEnd - i;
+
+      lowerBound[0] = vnl_math_min( lowerBound[0], start[0] );
+      upperBound[0] = vnl_math_max( upperBound[0], start[0] + static_cast<IndexValueType>( runEnd - i ) - 1 );
+      for( unsigned int j = 1; j < ImageDimension; j++ )
+        {
+        lowerBound[j] = vnl_math_min( lowerBound[j], start[j] );
+        upperBound[j] = vnl_math_max( upperBound[j], start[j] );
+        }
+      i = runEnd;
+      }
+
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      if( ++rowIndex[j] < fixedRegion.GetIndex()[j] + static_cast<IndexValueType>( size[j] ) )
+        {
+        break;
+        }
+      rowIndex[j] = fixedRegion.GetIndex()[j];
+      }
+    }
+
+  m_ActiveSetBuildTime += itksys::SystemTools::GetTime() - startTime;
+
+  if( m_NumberOfActivePixels == 0 )
+    {
+    return;
+    }
+
+  // Cells of the velocity grid covering the active set
+  const IndexValueType     factor = static_cast<IndexValueType>( m_VelocityFieldShrinkFactor );
+  const ThreadRegionType & velocityRegion = this->GetVelocityField()->GetLargestPossibleRegion();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    const IndexValueType lowerCell = velocityRegion.GetIndex()[j]
+      + ( lowerBound[j] - fixedRegion.GetIndex()[j] ) / factor;
+    const IndexValueType upperCell = velocityRegion.GetIndex()[j]
+      + ( upperBound[j] - fixedRegion.GetIndex()[j] ) / factor;
+    m_ActiveBoundingBox.SetIndex( j, lowerCell );
+    m_ActiveBoundingBox.SetSize( j, upperCell - lowerCell + 1 );
+    }
+  m_ActiveBoundingBox.Crop( velocityRegion );
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+ITK_THREAD_RETURN_TYPE
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ActiveSetScanThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const ThreadIdType    threadId = info->ThreadID;
+  const ThreadIdType    threadCount = info->NumberOfThreads;
+  ActiveSetScanStruct * str = static_cast<ActiveSetScanStruct *>( info->UserData );
+
+  // Whole slabs along the last dimension, as the regions given to
+  // ThreadedCalculateChange
+  const typename ThreadRegionType::SizeType & size =
+    str->Filter->GetFixedImage()->GetLargestPossibleRegion().GetSize();
+  const SizeValueType numberOfSlabs = size[ImageDimension - 1];
+  SizeValueType       slabSize = 1;
+  for( unsigned int j = 0; j + 1 < ImageDimension; j++ )
+    {
+    slabSize *= size[j];
+    }
+  const SizeValueType firstSlab = ( numberOfSlabs * threadId ) / threadCount;
+  const SizeValueType endSlab = ( numberOfSlabs * ( threadId + 1 ) ) / threadCount;
+
+  str->Filter->ThreadedScanActiveSet( firstSlab * slabSize, endSlab * slabSize,
+                                      str->Field, str->MovingInterpolator );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDeformableRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ThreadedScanActiveSet(SizeValueType firstVoxel, SizeValueType endVoxel,
+                        const DeformationFieldType * field,
+                        const ActiveSetInterpolatorType * movingInterpolator)
+{
+  typedef typename ThreadRegionType::IndexValueType IndexValueType;
+  typedef typename FixedImageType::PointType        PointType;
+  typedef typename MaskImageType::IndexType         MaskIndexType;
+
+  if( firstVoxel >= endVoxel )
+    {
+    return;
+    }
+
+  const FixedImageType *   fixedPtr = this->GetFixedImage();
+  const ThreadRegionType & fixedRegion = fixedPtr->GetLargestPossibleRegion();
+  const typename ThreadRegionType::SizeType & size = fixedRegion.GetSize();
+
+  // Index of the first voxel
+  ActiveIndexType index;
+  SizeValueType   offset = firstVoxel;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    index[j] = fixedRegion.GetIndex()[j] + static_cast<IndexValueType>( offset % size[j] );
+    offset /= size[j];
+    }
+
+  std::vector<unsigned char> & active = m_ActiveVoxels;
+  const MaskImageType *        masks[2] = { m_FixedImageMask, m_MovingImageMask };
+  PointType                    point;
+  PointType                    mappedPoint;
+  const PointType *            maskPoints[2] = { &point, &mappedPoint };
+  MaskIndexType                maskIndex;
+  for( SizeValueType n = firstVoxel; n < endVoxel; ++n )
+    {
+    fixedPtr->TransformIndexToPhysicalPoint( index, point );
+    mappedPoint = point;
+    if( field )
+      {
+      const typename DeformationFieldType::PixelType & displacement = field->GetPixel( index );
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        mappedPoint[j] += displacement[j];
+        }
+      }
+
+    // The moving mask is tested where the voxel is mapped to
+    for( unsigned int m = 0; m < 2; ++m )
+      {
+      if( masks[m] && masks[m]->TransformPhysicalPointToIndex( *maskPoints[m], maskIndex )
+          && masks[m]->GetBufferedRegion().IsInside( maskIndex )
+          && masks[m]->GetPixel( maskIndex ) != 0 )
+        {
+        active[n] = 1;
+        break;
+        }
+      }
+
+    if( active[n] && movingInterpolator )
+      {
+      if( movingInterpolator->IsInsideBuffer( mappedPoint )
+          && vnl_math_abs( static_cast<double>( fixedPtr->GetPixel( index ) )
+                           - movingInterpolator->Evaluate( mappedPoint ) ) <= m_NarrowBandThreshold )
+        {
+        active[n] = 0;
+        }
+      }
+
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( ++index[j] < fixedRegion.GetIndex()[j] + static_cast<IndexValueType>( size[j] ) )
+        {
+        break;
+        }
+      index[j] = fixedRegion.GetIndex()[j];
+      }
+    }
 }
 
 } // end namespace itk
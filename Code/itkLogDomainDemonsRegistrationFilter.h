@@ -6,6 +6,7 @@
 
 #include "itkMultiplyImageFilter.h"
 #include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkVectorCentralDifferenceImageFunction.h"
 
 namespace itk
 {
@@ -40,6 +41,12 @@ namespace itk
  * This class make use of the finite difference solver hierarchy. Update
  * for each iteration is computed using a PDEDeformableRegistrationFunction.
  *
+ * By default the update of the velocity field is computed with a
+ * mini-pipeline (time step multiplication and BCH composition filter).
+ * When UseFusedUpdate is on and at most 3 BCH terms are used, the time
+ * step scaling, the BCH composition and the write-back of the velocity
+ * field are instead performed in a single multithreaded traversal.
+ *
  * \warning This filter assumes that the fixed image type, moving image type
  * and velocity field type all have the same number of dimensions.
  *
@@ -84,6 +91,9 @@ public:
   /** Types inherithed from the superclass */
   typedef typename Superclass::OutputImageType OutputImageType;
 
+  /** Type used to count pixels and bytes. */
+  typedef typename VelocityFieldType::SizeType::SizeValueType SizeValueType;
+
   /** FiniteDifferenceFunction type. */
   typedef typename Superclass::FiniteDifferenceFunctionType FiniteDifferenceFunctionType;
 
@@ -128,6 +138,22 @@ public:
   virtual void SetNumberOfBCHApproximationTerms(unsigned int);
   virtual unsigned int GetNumberOfBCHApproximationTerms() const;
 
+  /** Set/Get whether the update is applied in a single fused pass.
+   * When on, the time step scaling, the 2 or 3 terms BCH composition and
+   * the write-back of the velocity field are done in one multithreaded
+   * traversal of the fields instead of running the multiplier and BCH
+   * mini-pipelines. The results are the same up to floating point
+   * rounding. The 4 terms approximation always uses the mini-pipeline.
+   * Default is off. */
+  itkSetMacro( UseFusedUpdate, bool );
+  itkGetConstMacro( UseFusedUpdate, bool );
+  itkBooleanMacro( UseFusedUpdate );
+
+  /** Get the number of bytes read and written by the last velocity field
+   * update, not including the optional smoothing steps. Each full sweep
+   * over a field counts once; neighborhood accesses are not counted. */
+  itkGetConstMacro( UpdateBytesPerIteration, SizeValueType );
+
 #if defined(USE_DEBUG_TEMP_VELOCITY)
   itkSetObjectMacro(TempVelocityField,VelocityFieldType);
   itkGetObjectMacro(TempVelocityField,VelocityFieldType);
@@ -153,6 +179,19 @@ protected:
   virtual void ApplyUpdate(const TimeStepType& dt);
 #endif
 
+  typedef typename VelocityFieldType::RegionType ThreadRegionType;
+  typedef typename Superclass::ActiveRunListType ActiveRunListType;
+
+  /** Fused update of the velocity field over a region supplied by the
+   * multithreading mechanism. Only used when UseFusedUpdate is on. With a
+   * mask, only the active set is updated. */
+#if (ITK_VERSION_MAJOR < 4)
+  virtual void ThreadedApplyUpdate(TimeStepType dt, const ThreadRegionType & regionToProcess, int threadId);
+#else
+  virtual void ThreadedApplyUpdate(const TimeStepType& dt, const ThreadRegionType & regionToProcess,
+                                   ThreadIdType threadId);
+#endif
+
 private:
   LogDomainDemonsRegistrationFilter(const Self &); // purposely not implemented
   void operator=(const Self &);                    // purposely not implemented
@@ -174,8 +213,19 @@ private:
   typedef typename MultiplyByConstantType::Pointer MultiplyByConstantPointer;
   typedef typename BCHFilterType::Pointer          BCHFilterPointer;
 
+  /** Jacobian calculator used by the fused update */
+  typedef VectorCentralDifferenceImageFunction<VelocityFieldType> FieldGradientCalculatorType;
+  typedef typename FieldGradientCalculatorType::Pointer           FieldGradientCalculatorPointer;
+  typedef typename FieldGradientCalculatorType::OutputType        FieldGradientType;
+
   MultiplyByConstantPointer  m_Multiplier;
   BCHFilterPointer           m_BCHFilter;
+
+  bool                           m_UseFusedUpdate;
+  SizeValueType                  m_UpdateBytesPerIteration;
+  VelocityFieldPointer           m_FusedVelocityField;
+  FieldGradientCalculatorPointer m_VelocityGradientCalculator;
+  FieldGradientCalculatorPointer m_UpdateGradientCalculator;
 #if defined(USE_DEBUG_TEMP_VELOCITY)
   typename VelocityFieldType::Pointer m_TempVelocityField;
 #endif
@@ -3,6 +3,9 @@
 
 #include "itkLogDomainDemonsRegistrationFilter.h"
 
+#include "itkImageRegionIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+
 namespace itk
 {
 
@@ -23,6 +26,12 @@ LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   // Set number of terms in the BCH approximation to default value
   m_BCHFilter->SetNumberOfApproximationTerms( 2 );
+
+  m_UseFusedUpdate = false;
+  m_UpdateBytesPerIteration = 0;
+  m_FusedVelocityField = 0;
+  m_VelocityGradientCalculator = FieldGradientCalculatorType::New();
+  m_UpdateGradientCalculator = FieldGradientCalculatorType::New();
 }
 
 // Checks whether the DifferenceFunction is of type DemonsRegistrationFunction.
@@ -192,43 +201,96 @@ LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
     this->SmoothUpdateField();
     }
 
-  // Use time step if necessary. In many cases
-  // the time step is one so this will be skipped
-  if( fabs(dt - 1.0) > 1.0e-4 )
-    {
-    itkDebugMacro( "Using timestep: " << dt );
-    m_Multiplier->SetConstant( dt );
-    m_Multiplier->SetInput( this->GetUpdateBuffer() );
-    m_Multiplier->GraftOutput( this->GetUpdateBuffer() );
-    // in place update
-    m_Multiplier->Update();
-    // graft output back to this->GetUpdateBuffer()
-    this->GetUpdateBuffer()->Graft( m_Multiplier->GetOutput() );
-    }
+  const unsigned int numberOfTerms = m_BCHFilter->GetNumberOfApproximationTerms();
+  const SizeValueType fieldBytes =
+    this->GetVelocityField()->GetBufferedRegion().GetNumberOfPixels()
+    * sizeof( typename VelocityFieldType::PixelType );
 
-  // Apply update by using BCH approximation
-  m_BCHFilter->SetInput( 0, this->GetVelocityField() );
-  m_BCHFilter->SetInput( 1, this->GetUpdateBuffer() );
-  if( m_BCHFilter->GetInPlace() )
+  if( m_UseFusedUpdate && numberOfTerms <= 3 )
     {
-    m_BCHFilter->GraftOutput( this->GetVelocityField() );
+    VelocityFieldPointer velocityField = this->GetVelocityField();
+
+    if( numberOfTerms == 3 )
+      {
+      // The Lie bracket reads the neighbors of the current velocity field
+      // so the result cannot be written in place. It is written to a
+      // temporary field whose container is swapped with the output one.
+      m_FusedVelocityField = this->GetScratchField( Superclass::UpdateScratchField, velocityField );
+
+      m_VelocityGradientCalculator->SetInputImage( velocityField );
+      m_UpdateGradientCalculator->SetInputImage( this->GetUpdateBuffer() );
+      }
+
+    // Multithreaded traversal, see ThreadedApplyUpdate
+    Superclass::ApplyUpdate( dt );
+
+    if( numberOfTerms == 3 )
+      {
+      typename VelocityFieldType::PixelContainerPointer swapPtr = velocityField->GetPixelContainer();
+      velocityField->SetPixelContainer( m_FusedVelocityField->GetPixelContainer() );
+      m_FusedVelocityField->SetPixelContainer( swapPtr );
+      }
+
+    // read velocity and update, write velocity
+    m_UpdateBytesPerIteration = 3 * fieldBytes;
     }
   else
     {
-    // Work-around for http://www.itk.org/Bug/view.php?id=8672
-    m_BCHFilter->GraftOutput( DeformationFieldType::New() );
-    }
-  m_BCHFilter->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
+    m_UpdateBytesPerIteration = 0;
+
+    // Use time step if necessary. In many cases
+    // the time step is one so this will be skipped
+    if( fabs(dt - 1.0) > 1.0e-4 )
+      {
+      itkDebugMacro( "Using timestep: " << dt );
+      m_Multiplier->SetConstant( dt );
+      m_Multiplier->SetInput( this->GetUpdateBuffer() );
+      m_Multiplier->GraftOutput( this->GetUpdateBuffer() );
+      // in place update
+      m_Multiplier->Update();
+      // graft output back to this->GetUpdateBuffer()
+      this->GetUpdateBuffer()->Graft( m_Multiplier->GetOutput() );
+      m_UpdateBytesPerIteration += 2 * fieldBytes;
+      }
+
+    // Apply update by using BCH approximation
+    m_BCHFilter->SetInput( 0, this->GetVelocityField() );
+    m_BCHFilter->SetInput( 1, this->GetUpdateBuffer() );
+    if( m_BCHFilter->GetInPlace() )
+      {
+      m_BCHFilter->GraftOutput( this->GetVelocityField() );
+      }
+    else
+      {
+      // Work-around for http://www.itk.org/Bug/view.php?id=8672
+      m_BCHFilter->GraftOutput( DeformationFieldType::New() );
+      }
+    m_BCHFilter->GetOutput()->SetRequestedRegion( this->GetVelocityField()->GetRequestedRegion() );
 
-  // Triggers in place update
-  m_BCHFilter->Update();
+    // Triggers in place update
+    m_BCHFilter->Update();
 
-  // Region passing stuff
-  this->GraftOutput( m_BCHFilter->GetOutput() );
+    // Region passing stuff
+    this->GraftOutput( m_BCHFilter->GetOutput() );
 #if 0
-  this->m_TempVelocityField = this->GetVelocityField();
+    this->m_TempVelocityField = this->GetVelocityField();
 #endif
 
+    // Sweeps of the BCH filter: adder or fused evaluation (2 inputs +
+    // output), plus the first order Lie bracket with 4 terms (2 inputs +
+    // output) which is read again by the fused evaluation
+    switch( numberOfTerms )
+      {
+      case 2:
+      case 3:
+        m_UpdateBytesPerIteration += 3 * fieldBytes;
+        break;
+      default:
+        m_UpdateBytesPerIteration += ( 3 + 4 ) * fieldBytes;
+        break;
+      }
+    }
+
   // Smooth the velocity field
   if( this->GetSmoothVelocityField() )
     {
@@ -236,6 +298,90 @@ LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
     }
 }
 
+// Fused time step scaling, BCH composition and write-back
+template <class TFixedImage, class TMovingImage, class TField>
+void
+LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+#if (ITK_VERSION_MAJOR < 4)
+::ThreadedApplyUpdate(TimeStepType dt, const ThreadRegionType & regionToProcess, int)
+#else
+::ThreadedApplyUpdate(const TimeStepType& dt, const ThreadRegionType & regionToProcess, ThreadIdType)
+#endif
+{
+  typedef typename VelocityFieldType::PixelType                PixelType;
+  typedef typename PixelType::ValueType                        ValueType;
+  typedef ImageRegionIterator<VelocityFieldType>               FieldIteratorType;
+  typedef ImageRegionConstIterator<VelocityFieldType>          FieldConstIteratorType;
+  typedef ImageRegionConstIteratorWithIndex<VelocityFieldType> FieldConstIteratorWithIndexType;
+
+  VelocityFieldPointer velocityField = this->GetVelocityField();
+
+  // With a mask, the update is only applied in the active set
+  ActiveRunListType regions;
+  if( this->GetVelocityFieldShrinkFactor() > 1 || !this->GetActiveRuns( regionToProcess, regions ) )
+    {
+    regions.push_back( regionToProcess );
+    }
+  else if( m_BCHFilter->GetNumberOfApproximationTerms() >= 3 )
+    {
+    // The velocity field is unchanged outside of the active set
+    FieldConstIteratorType velocityIter( velocityField, regionToProcess );
+    FieldIteratorType      outputIter( m_FusedVelocityField, regionToProcess );
+    for( ; !outputIter.IsAtEnd(); ++velocityIter, ++outputIter )
+      {
+      outputIter.Value() = velocityIter.Value();
+      }
+    }
+
+  for( typename ActiveRunListType::const_iterator rIt = regions.begin(); rIt != regions.end(); ++rIt )
+    {
+    FieldConstIteratorType updateIter( this->GetUpdateBuffer(), *rIt );
+
+    if( m_BCHFilter->GetNumberOfApproximationTerms() < 3 )
+      {
+      // v <- v + dt.u
+      FieldIteratorType velocityIter( velocityField, *rIt );
+      while( !velocityIter.IsAtEnd() )
+        {
+        velocityIter.Value() += static_cast<PixelType>( updateIter.Value() * dt );
+        ++velocityIter;
+        ++updateIter;
+        }
+      }
+    else
+      {
+      // v <- v + dt.u + 0.5*dt*[v,u]
+      FieldConstIteratorWithIndexType velocityIter( velocityField, *rIt );
+      FieldIteratorType               outputIter( m_FusedVelocityField, *rIt );
+
+      FieldGradientType velocityGrad, updateGrad;
+      const double      halfdt = 0.5 * dt;
+      while( !velocityIter.IsAtEnd() )
+        {
+        velocityGrad = m_VelocityGradientCalculator->EvaluateAtIndex( velocityIter.GetIndex() );
+        updateGrad = m_UpdateGradientCalculator->EvaluateAtIndex( velocityIter.GetIndex() );
+
+        const PixelType & velocityVal = velocityIter.Value();
+        const PixelType & updateVal = updateIter.Value();
+        PixelType &       outVal = outputIter.Value();
+        for( unsigned int d = 0; d < VelocityFieldType::ImageDimension; d++ )
+          {
+          double bracket = 0.0;
+          for( unsigned int dd = 0; dd < VelocityFieldType::ImageDimension; dd++ )
+            {
+            bracket += velocityGrad(d, dd) * updateVal[dd] - updateGrad(d, dd) * velocityVal[dd];
+            }
+          outVal[d] = static_cast<ValueType>( halfdt * bracket + velocityVal[d] + dt * updateVal[d] );
+          }
+
+        ++velocityIter;
+        ++updateIter;
+        ++outputIter;
+        }
+      }
+    }
+}
+
 template <class TFixedImage, class TMovingImage, class TField>
 void
 LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
@@ -245,6 +391,8 @@ LogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   os << indent << "Multiplier: " << m_Multiplier << std::endl;
   os << indent << "BCHFilter: " << m_BCHFilter << std::endl;
+  os << indent << "UseFusedUpdate: " << m_UseFusedUpdate << std::endl;
+  os << indent << "UpdateBytesPerIteration: " << m_UpdateBytesPerIteration << std::endl;
 }
 
 } // end namespace itk
@@ -0,0 +1,144 @@
+#ifndef __itkMultiResolutionDisplacementToVelocityFieldLogFilter_h
+#define __itkMultiResolutionDisplacementToVelocityFieldLogFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkDisplacementToVelocityFieldLogFilter.h"
+#include "itkMultiResolutionPyramidImageFilter.h"
+#include "itkVectorResampleImageFilter.h"
+
+#include <vector>
+
+namespace itk
+{
+/** \class MultiResolutionDisplacementToVelocityFieldLogFilter
+ * \brief Compute the logarithm of a displacement field from coarse to fine
+ *
+ * The displacement field is downsampled by a MultiResolutionPyramidImageFilter,
+ * as the images of MultiResolutionLogDomainDeformableRegistration. The
+ * logarithm of the coarsest level is computed by a
+ * DisplacementToVelocityFieldLogFilter, then upsampled by the field expander
+ * onto the next level where it is the initial velocity field of the
+ * iterations, and so on. The finest level uses the input displacement field
+ * itself, so that a few iterations refine the upsampled logarithm.
+ *
+ * The displacements are given in physical units and do not need to be
+ * rescaled between the levels. The number of iterations of each level is set
+ * with SetNumberOfIterations, from the coarsest to the finest one; the other
+ * parameters (tolerance, smoothing, acceleration, exponential integration)
+ * are those of the log filter given by GetLogFilter.
+ *
+ * \sa DisplacementToVelocityFieldLogFilter
+ * \sa MultiResolutionLogDomainDeformableRegistration
+ */
+template <class TInputImage, class TOutputImage>
+class ITK_EXPORT MultiResolutionDisplacementToVelocityFieldLogFilter :
+  public ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  /** Standard class typedefs */
+  typedef MultiResolutionDisplacementToVelocityFieldLogFilter Self;
+  typedef ImageToImageFilter<TInputImage, TOutputImage>       Superclass;
+  typedef SmartPointer<Self>                                  Pointer;
+  typedef SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(MultiResolutionDisplacementToVelocityFieldLogFilter, ImageToImageFilter);
+
+  typedef TInputImage                       InputImageType;
+  typedef typename InputImageType::Pointer  InputImagePointer;
+  typedef TOutputImage                      OutputImageType;
+  typedef typename OutputImageType::Pointer OutputImagePointer;
+
+  /** Dimension of the fields. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TOutputImage::ImageDimension);
+
+  /** The log filter run at each level. */
+  typedef DisplacementToVelocityFieldLogFilter<InputImageType, OutputImageType> LogFilterType;
+  typedef typename LogFilterType::Pointer                                      LogFilterPointer;
+
+  /** The pyramid of the displacement field. */
+  typedef MultiResolutionPyramidImageFilter<InputImageType, InputImageType> DisplacementPyramidType;
+  typedef typename DisplacementPyramidType::Pointer                         DisplacementPyramidPointer;
+
+  /** The velocity field expander. */
+  typedef VectorResampleImageFilter<OutputImageType, OutputImageType> FieldExpanderType;
+  typedef typename FieldExpanderType::Pointer                         FieldExpanderPointer;
+
+  /** Set/Get the log filter. */
+  itkSetObjectMacro( LogFilter, LogFilterType );
+  itkGetObjectMacro( LogFilter, LogFilterType );
+
+  /** Set/Get the pyramid of the displacement field. */
+  itkSetObjectMacro( DisplacementPyramid, DisplacementPyramidType );
+  itkGetObjectMacro( DisplacementPyramid, DisplacementPyramidType );
+
+  /** Set/Get the velocity field expander. */
+  itkSetObjectMacro( FieldExpander, FieldExpanderType );
+  itkGetObjectMacro( FieldExpander, FieldExpanderType );
+
+  /** Set/Get the number of levels (default: 3). */
+  virtual void SetNumberOfLevels( unsigned int num );
+
+  itkGetConstReferenceMacro( NumberOfLevels, unsigned int );
+
+  /** Get the current level, during the update. */
+  itkGetConstReferenceMacro( CurrentLevel, unsigned int );
+
+  /** Set/Get the number of iterations of each level, from the coarsest to
+   * the finest one (default: 10 for all levels). */
+  itkSetVectorMacro( NumberOfIterations, unsigned int, m_NumberOfLevels );
+  virtual const unsigned int * GetNumberOfIterations() const
+  {
+    return &(m_NumberOfIterations[0]);
+  }
+
+  /** Get the number of iterations run at each level by the last update. */
+  virtual const unsigned int * GetElapsedIterations() const
+  {
+    return &(m_ElapsedIterations[0]);
+  }
+
+protected:
+  MultiResolutionDisplacementToVelocityFieldLogFilter();
+  ~MultiResolutionDisplacementToVelocityFieldLogFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Generate output data by computing the logarithm of each level. */
+  void GenerateData();
+
+  /** The pyramid needs the whole displacement field. */
+  virtual void GenerateInputRequestedRegion();
+
+  /** The logarithm is computed on the whole field. */
+  virtual void EnlargeOutputRequestedRegion( DataObject * ptr );
+
+  /** Resample the given velocity field onto the grid of the reference
+   * displacement field. */
+  OutputImagePointer ExpandField(OutputImageType * field, const InputImageType * reference);
+
+private:
+  MultiResolutionDisplacementToVelocityFieldLogFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                                      // purposely not implemented
+
+  LogFilterPointer           m_LogFilter;
+  DisplacementPyramidPointer m_DisplacementPyramid;
+  FieldExpanderPointer       m_FieldExpander;
+
+  unsigned int              m_NumberOfLevels;
+  unsigned int              m_CurrentLevel;
+  std::vector<unsigned int> m_NumberOfIterations;
+  std::vector<unsigned int> m_ElapsedIterations;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMultiResolutionDisplacementToVelocityFieldLogFilter.hxx"
+#endif
+
+#endif
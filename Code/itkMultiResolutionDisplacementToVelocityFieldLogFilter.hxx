@@ -0,0 +1,193 @@
+#ifndef __itkMultiResolutionDisplacementToVelocityFieldLogFilter_txx
+#define __itkMultiResolutionDisplacementToVelocityFieldLogFilter_txx
+
+#include "itkMultiResolutionDisplacementToVelocityFieldLogFilter.h"
+
+#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
+
+namespace itk
+{
+
+template <class TInputImage, class TOutputImage>
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::MultiResolutionDisplacementToVelocityFieldLogFilter()
+{
+  m_LogFilter = LogFilterType::New();
+  m_DisplacementPyramid = DisplacementPyramidType::New();
+
+  // Extrapolate the velocities at the border of the coarser grid
+  typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<OutputImageType, double>
+  ExtrapolatingInterpolatorType;
+  m_FieldExpander = FieldExpanderType::New();
+  m_FieldExpander->SetInterpolator( ExtrapolatingInterpolatorType::New() );
+
+  m_NumberOfLevels = 3;
+  m_CurrentLevel = 0;
+  m_NumberOfIterations.resize( m_NumberOfLevels, 10 );
+  m_ElapsedIterations.resize( m_NumberOfLevels, 0 );
+  m_DisplacementPyramid->SetNumberOfLevels( m_NumberOfLevels );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::SetNumberOfLevels( unsigned int num )
+{
+  if( m_NumberOfLevels != num )
+    {
+    this->Modified();
+    m_NumberOfLevels = num;
+    m_NumberOfIterations.resize( m_NumberOfLevels, 10 );
+    m_ElapsedIterations.resize( m_NumberOfLevels, 0 );
+    }
+
+  if( m_DisplacementPyramid.IsNotNull() && m_DisplacementPyramid->GetNumberOfLevels() != num )
+    {
+    m_DisplacementPyramid->SetNumberOfLevels( m_NumberOfLevels );
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "NumberOfLevels: " << m_NumberOfLevels << std::endl;
+  os << indent << "CurrentLevel: " << m_CurrentLevel << std::endl;
+  os << indent << "NumberOfIterations: [";
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    os << ( level ? ", " : "" ) << m_NumberOfIterations[level];
+    }
+  os << "]" << std::endl;
+  os << indent << "ElapsedIterations: [";
+  for( unsigned int level = 0; level < m_NumberOfLevels; level++ )
+    {
+    os << ( level ? ", " : "" ) << m_ElapsedIterations[level];
+    }
+  os << "]" << std::endl;
+  os << indent << "LogFilter: " << m_LogFilter.GetPointer() << std::endl;
+  os << indent << "DisplacementPyramid: " << m_DisplacementPyramid.GetPointer() << std::endl;
+  os << indent << "FieldExpander: " << m_FieldExpander.GetPointer() << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+typename MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>::OutputImagePointer
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::ExpandField(OutputImageType * field, const InputImageType * reference)
+{
+  m_FieldExpander->SetInput( field );
+  m_FieldExpander->SetSize( reference->GetLargestPossibleRegion().GetSize() );
+  m_FieldExpander->SetOutputStartIndex( reference->GetLargestPossibleRegion().GetIndex() );
+  m_FieldExpander->SetOutputOrigin( reference->GetOrigin() );
+  m_FieldExpander->SetOutputSpacing( reference->GetSpacing() );
+  m_FieldExpander->SetOutputDirection( reference->GetDirection() );
+
+  m_FieldExpander->UpdateLargestPossibleRegion();
+  m_FieldExpander->SetInput( NULL );
+  OutputImagePointer expandedField = m_FieldExpander->GetOutput();
+  expandedField->DisconnectPipeline();
+  return expandedField;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::GenerateData()
+{
+  if( m_LogFilter.IsNull() || m_DisplacementPyramid.IsNull() || m_FieldExpander.IsNull() )
+    {
+    itkExceptionMacro(<< "Log filter, displacement pyramid or field expander not set");
+    }
+  if( m_NumberOfLevels == 0 )
+    {
+    itkExceptionMacro(<< "The number of levels must be positive");
+    }
+
+  InputImagePointer input = const_cast<InputImageType *>( this->GetInput() );
+
+  // Only the coarser levels are taken from the pyramid
+  m_DisplacementPyramid->SetInput( input );
+  if( m_NumberOfLevels > 1 )
+    {
+    m_DisplacementPyramid->UpdateLargestPossibleRegion();
+    }
+
+  OutputImagePointer velocity;
+  for( m_CurrentLevel = 0; m_CurrentLevel < m_NumberOfLevels; m_CurrentLevel++ )
+    {
+    InputImagePointer displacement = input;
+    if( m_CurrentLevel + 1 < m_NumberOfLevels )
+      {
+      displacement = m_DisplacementPyramid->GetOutput( m_CurrentLevel );
+      }
+
+    // Start from the upsampled logarithm of the previous level
+    OutputImagePointer initialVelocity;
+    if( velocity.IsNotNull() )
+      {
+      initialVelocity = this->ExpandField( velocity, displacement );
+      }
+
+    m_LogFilter->SetInput( displacement );
+    m_LogFilter->SetInitialVelocityField( initialVelocity );
+    m_LogFilter->SetNumberOfIterations( m_NumberOfIterations[m_CurrentLevel] );
+    m_LogFilter->UpdateLargestPossibleRegion();
+
+    velocity = m_LogFilter->GetOutput();
+    velocity->DisconnectPipeline();
+    m_ElapsedIterations[m_CurrentLevel] = m_LogFilter->GetElapsedIterations();
+
+    this->UpdateProgress( static_cast<float>( m_CurrentLevel + 1 )
+                          / static_cast<float>( m_NumberOfLevels ) );
+    }
+  m_CurrentLevel = m_NumberOfLevels - 1;
+
+  // Release the pyramid and the references to the levels
+  m_LogFilter->SetInput( NULL );
+  m_LogFilter->SetInitialVelocityField( NULL );
+  m_DisplacementPyramid->SetInput( NULL );
+  for( unsigned int level = 0; level < m_DisplacementPyramid->GetNumberOfOutputs(); level++ )
+    {
+    m_DisplacementPyramid->GetOutput( level )->ReleaseData();
+    }
+
+  this->GraftOutput( velocity );
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass's implementation
+  Superclass::GenerateInputRequestedRegion();
+
+  // request the largest possible region for the displacement field
+  InputImagePointer inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MultiResolutionDisplacementToVelocityFieldLogFilter<TInputImage, TOutputImage>
+::EnlargeOutputRequestedRegion( DataObject * ptr )
+{
+  // call the superclass's implementation
+  Superclass::EnlargeOutputRequestedRegion( ptr );
+
+  // set the output requested region to largest possible.
+  OutputImageType * outputPtr = dynamic_cast<OutputImageType *>( ptr );
+  if( outputPtr )
+    {
+    outputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -1,14 +1,19 @@
 #ifndef __itkMultiResolutionLogDomainDeformableRegistration_h
 #define __itkMultiResolutionLogDomainDeformableRegistration_h
 
+#include "itkCommand.h"
 #include "itkExponentialDisplacementFieldImageFilter.h"
 #include "itkImage.h"
 #include "itkImageToImageFilter.h"
+#include "itkIntegerFactorVectorFieldExpandFilter.h"
 #include "itkLogDomainDeformableRegistrationFilter.h"
 #include "itkLogDomainDemonsRegistrationFilter.h"
 #include "itkMultiResolutionPyramidImageFilter.h"
 #include "itkVectorResampleImageFilter.h"
+#include "itkVelocityFieldCheckpoint.h"
 
+#include <deque>
+#include <string>
 #include <vector>
 
 namespace itk
@@ -52,6 +57,41 @@ namespace itk
  * and moving images. A VectorExpandImageFilter is used to upsample
  * the velocity field as we move from a coarse to fine solution.
  *
+ * By default all the levels of the pyramids are computed before the first
+ * iteration. With UseLazyPyramid on, a level is only computed when the
+ * registration reaches it and the previous level is freed beforehand, so
+ * that a single level of each pyramid is resident at a time. Since the
+ * levels are visited from coarse to fine, each level is computed from the
+ * input image, which needs transient buffers at full resolution.
+ *
+ * With UseSpacingAwareSchedule on, the shrink factors of the pyramids are
+ * chosen along each axis from the spacing of their input, see
+ * ComputeSpacingAwareSchedule, instead of being the same along all axes.
+ *
+ * With UseNarrowBandAtFinestLevel on, the forces of the finest level are
+ * only computed where the images do not match yet, see
+ * LogDomainDeformableRegistrationFilter::SetUseNarrowBand.
+ *
+ * With a TimeBudget, the number of iterations of the levels is reduced so
+ * that the registration completes within the given wall-clock time. The
+ * time per iteration is measured at each level and extrapolated to the
+ * next levels in proportion to their number of voxels. At the start of
+ * each level, the iterations left at this and the next levels are scaled
+ * by the same factor to fit in the remaining time, and the current level
+ * is given its share. The registration is stopped through
+ * StopRegistration when the next iteration would end after the deadline,
+ * the output then being the field of the last iteration. The budget of
+ * such a level is kept, the level being incomplete, and the iteration it
+ * was stopped at is given by GetDeadlineIterations.
+ *
+ * When a CheckpointFileName is set, the state of the registration (see
+ * VelocityFieldCheckpoint) is written to this file at each level boundary
+ * and, if CheckpointInterval is not zero, every CheckpointInterval
+ * iterations within a level. The files are written in a separate thread
+ * while the registration goes on. A registration given a ResumeFileName
+ * restarts from the level and iteration the checkpoint was taken at
+ * instead of from the coarsest level.
+ *
  * This class is templated over the fixed image type, the moving image type,
  * and the velocity/deformation Field type.
  *
@@ -110,6 +150,8 @@ public:
   itkStaticConstMacro(ImageDimension, unsigned int,
                       FixedImageType::ImageDimension);
 
+  typedef typename VelocityFieldType::SizeType::SizeValueType SizeValueType;
+
   /** Internal float image type. */
   typedef Image<TRealType, itkGetStaticConstMacro(ImageDimension)> FloatImageType;
 
@@ -137,6 +179,11 @@ public:
   FieldExpanderType;
   typedef typename FieldExpanderType::Pointer FieldExpanderPointer;
 
+  /** The velocity field expander used for integer expansion factors. */
+  typedef IntegerFactorVectorFieldExpandFilter<VelocityFieldType, VelocityFieldType>
+  IntegerFactorFieldExpanderType;
+  typedef typename IntegerFactorFieldExpanderType::Pointer IntegerFactorFieldExpanderPointer;
+
   /** Set the fixed image. */
   virtual void SetFixedImage( const FixedImageType * ptr );
 
@@ -223,12 +270,188 @@ public:
   /** Get the moving image pyramid. */
   itkGetObjectMacro( FieldExpander, FieldExpanderType );
 
+  /** Set/Get whether the velocity field is expanded with an
+   * IntegerFactorVectorFieldExpandFilter when the levels are related by
+   * integer factors. This is only done if the field expander uses an
+   * identity transform and a
+   * VectorLinearInterpolateNearestNeighborExtrapolateImageFunction, whose
+   * result is the same. Default is on. */
+  itkSetMacro( UseIntegerFactorExpander, bool );
+  itkGetConstMacro( UseIntegerFactorExpander, bool );
+  itkBooleanMacro( UseIntegerFactorExpander );
+
+  /** Get the number of expansions of the velocity field done by the
+   * IntegerFactorVectorFieldExpandFilter during the last registration. */
+  itkGetConstMacro( NumberOfIntegerFactorExpansions, unsigned int );
+
+  /** Schedule type of the pyramids. */
+  typedef typename FixedImagePyramidType::ScheduleType ScheduleType;
+  typedef typename FixedImageType::SpacingType         SpacingType;
+
+  /** Set/Get whether the schedules of the pyramids are computed from the
+   * spacings of the fixed and moving images with
+   * ComputeSpacingAwareSchedule when the registration starts, replacing
+   * the ones set on the pyramids. If the registration filter has its
+   * StandardDeviationsInPhysicalUnits on, its standard deviations are then
+   * taken as those of the finest level and are multiplied at each level by
+   * the shrink factor of the smallest spacing, so that the smoothing spans
+   * the same number of voxels at all levels as with a uniform schedule.
+   * Default is off. */
+  itkSetMacro( UseSpacingAwareSchedule, bool );
+  itkGetConstMacro( UseSpacingAwareSchedule, bool );
+  itkBooleanMacro( UseSpacingAwareSchedule );
+
+  /** Compute the shrink factors of a pyramid such that its voxels are as
+   * close to isotropic as possible at each level. At level l, counted from
+   * the coarsest one, the target spacing is the smallest input spacing
+   * times 2^(numberOfLevels - 1 - l), and the shrink factor along each
+   * axis is the ratio of the target to the input spacing, rounded and at
+   * least one. For an isotropic image this is the default schedule of the
+   * pyramids. For a spacing of 0.7x0.7x3 and three levels the factors are
+   * 4x4x1, 2x2x1 and 1x1x1. */
+  static ScheduleType ComputeSpacingAwareSchedule(const SpacingType & spacing, unsigned int numberOfLevels);
+
   /** Get number of iterations per multi-resolution levels. */
   virtual const unsigned int * GetNumberOfIterations() const
   {
     return &(m_NumberOfIterations[0]);
   }
 
+  /** Set/Get whether each level stops as soon as the registration
+   * converged, the number of iterations of the level then being a maximum.
+   * These settings are passed to the registration filter, see
+   * LogDomainDeformableRegistrationFilter::SetUseConvergenceCriterion.
+   * Default is off. */
+  itkSetMacro( UseConvergenceCriterion, bool );
+  itkGetConstMacro( UseConvergenceCriterion, bool );
+  itkBooleanMacro( UseConvergenceCriterion );
+
+  /** Set/Get the number of iterations over which the convergence is
+   * estimated. Default is 10. */
+  itkSetClampMacro( ConvergenceWindowSize, unsigned int, 2, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( ConvergenceWindowSize, unsigned int );
+
+  /** Set/Get the convergence tolerance. Default is 1e-3. */
+  itkSetMacro( ConvergenceTolerance, double );
+  itkGetConstMacro( ConvergenceTolerance, double );
+
+  /** Set/Get whether the forces of the finest level are only computed in
+   * a narrow band of the voxels that are not matched yet, the coarser
+   * levels having brought most of the image in place. These settings are
+   * passed to the registration filter, see
+   * LogDomainDeformableRegistrationFilter::SetUseNarrowBand. Default is
+   * off. */
+  itkSetMacro( UseNarrowBandAtFinestLevel, bool );
+  itkGetConstMacro( UseNarrowBandAtFinestLevel, bool );
+  itkBooleanMacro( UseNarrowBandAtFinestLevel );
+
+  /** Set/Get the residual intensity below which a voxel is left out of
+   * the narrow band. Default is 1.0. */
+  itkSetClampMacro( NarrowBandThreshold, double, 0.0, NumericTraits<double>::max() );
+  itkGetConstMacro( NarrowBandThreshold, double );
+
+  /** Set/Get the number of iterations between two updates of the narrow
+   * band. Default is 5. */
+  itkSetClampMacro( NarrowBandUpdateInterval, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( NarrowBandUpdateInterval, unsigned int );
+
+  /** Set/Get whether the pyramid levels are computed when the
+   * registration reaches them instead of all at once. Default is off. */
+  itkSetMacro( UseLazyPyramid, bool );
+  itkGetConstMacro( UseLazyPyramid, bool );
+  itkBooleanMacro( UseLazyPyramid );
+
+  /** Get the largest amount of memory, in bytes, held at once by the
+   * resident levels of the fixed and moving pyramids during the last
+   * registration. Only the outputs of the pyramids are counted: the
+   * transient buffers of the casting and smoothing, which are at full
+   * resolution when a level is computed on demand, are not. */
+  itkGetConstMacro( PeakPyramidMemory, SizeValueType );
+
+  /** Set/Get whether the buffers of the registration filter are reserved
+   * for the finest level before the first level is run. The coarser levels
+   * then use part of the same memory and the buffers of the registration
+   * filter are not reallocated from one level to the next.
+   * \sa LogDomainDeformableRegistrationFilter::SetReservedNumberOfPixels
+   * Default is off. */
+  itkSetMacro( ReserveRegistrationBuffers, bool );
+  itkGetConstMacro( ReserveRegistrationBuffers, bool );
+  itkBooleanMacro( ReserveRegistrationBuffers );
+
+  /** Mask type of the registration filter. */
+  typedef typename RegistrationType::MaskImageType MaskImageType;
+
+  /** Set/Get optional masks of the fixed and moving images, given at full
+   * resolution. They are passed to the registration filter at each level,
+   * which samples them at the centers of the voxels of the level, i.e.
+   * resamples them with a nearest neighbor interpolation, and restricts
+   * the computations to the dilated masks.
+   * \sa LogDomainDeformableRegistrationFilter::SetFixedImageMask */
+  itkSetConstObjectMacro( FixedImageMask, MaskImageType );
+  itkGetConstObjectMacro( FixedImageMask, MaskImageType );
+  itkSetConstObjectMacro( MovingImageMask, MaskImageType );
+  itkGetConstObjectMacro( MovingImageMask, MaskImageType );
+
+  /** The checkpoint type. */
+  typedef VelocityFieldCheckpoint<VelocityFieldType> CheckpointType;
+  typedef typename CheckpointType::Pointer           CheckpointPointer;
+
+  /** Set/Get the file the registration is checkpointed to. No checkpoint is
+   * taken when it is empty, which is the default. */
+  itkSetStringMacro( CheckpointFileName );
+  itkGetStringMacro( CheckpointFileName );
+
+  /** Set/Get the number of iterations between two checkpoints within a
+   * level. With zero, checkpoints are only taken at level boundaries.
+   * Default is 0. */
+  itkSetMacro( CheckpointInterval, unsigned int );
+  itkGetConstMacro( CheckpointInterval, unsigned int );
+
+  /** Set/Get the checkpoint file the registration is resumed from. The
+   * levels before the one of the checkpoint are skipped and the
+   * iterations already run at this level are deducted from its number of
+   * iterations. The initial velocity field, if any, is then ignored. No
+   * checkpoint is read when it is empty, which is the default. */
+  itkSetStringMacro( ResumeFileName );
+  itkGetStringMacro( ResumeFileName );
+
+  /** Get the number of checkpoints taken by the last registration. */
+  itkGetConstMacro( NumberOfCheckpoints, unsigned int );
+
+  /** Set/Get the wall-clock time, in seconds, the registration should
+   * complete in. Zero disables the time budget, which is the default. */
+  itkSetClampMacro( TimeBudget, double, 0.0, NumericTraits<double>::max() );
+  itkGetConstMacro( TimeBudget, double );
+
+  /** Get the number of iterations each level was given by the time budget
+   * during the last registration. Without time budget, this is the
+   * number of iterations. */
+  virtual const unsigned int * GetBudgetedIterations() const
+  {
+    return &(m_BudgetedIterations[0]);
+  }
+
+  /** Get the iteration each level was stopped at by the deadline during
+   * the last registration, zero for the levels that were not stopped. */
+  virtual const unsigned int * GetDeadlineIterations() const
+  {
+    return &(m_DeadlineIterations[0]);
+  }
+
+  /** Get the wall-clock time, in seconds, spent on each level by the last
+   * registration. */
+  virtual const double * GetLevelTimes() const
+  {
+    return &(m_LevelTimes[0]);
+  }
+
+  /** Get the number of iterations actually run at each level by the
+   * last registration. */
+  virtual const unsigned int * GetElapsedIterations() const
+  {
+    return &(m_ElapsedIterations[0]);
+  }
+
   /** Stop the registration after the current iteration. */
   virtual void StopRegistration();
 
@@ -271,6 +494,38 @@ protected:
    * terminate at the current resolution level. */
   virtual bool Halt();
 
+  /** Compute a single level of the given pyramid with a pyramid of the
+   * same class whose only level has the schedule of the requested one. The
+   * number of threads, the maximum error of the smoothing and the use of the
+   * shrink filter are copied from the given pyramid. */
+  template <class TPyramid>
+  typename FloatImageType::Pointer ComputePyramidLevel(TPyramid * pyramid, unsigned int level);
+
+  /** Resample the given velocity field onto the grid of the reference
+   * image, with the IntegerFactorVectorFieldExpandFilter when possible and
+   * with the field expander otherwise. */
+  VelocityFieldPointer ExpandField(VelocityFieldType * field,
+                                   const ImageBase<ImageDimension> * reference);
+
+  /** Copy the given field with the current level, elapsed iterations and
+   * convergence history into the checkpoint and start writing it. */
+  void WriteCheckpoint(const VelocityFieldType * field, const std::deque<double> & metricHistory,
+                       const std::deque<double> & rmsChangeHistory);
+
+  /** Get the wall-clock time, in seconds, the time budget is measured
+   * with. Subclasses may override it to simulate the cost of the
+   * iterations. */
+  virtual double GetWallClockTime() const;
+
+  /** Share the time left before the deadline between the iterations left
+   * at the current and next levels, given the number of iterations already
+   * run at the current level. */
+  void PlanTimeBudget(unsigned int elapsedIterations, double now);
+
+  /** Observer of the iterations of the registration filter, enforcing the
+   * time budget and taking the checkpoints within a level. */
+  void RegistrationIterationCallback(Object * caller, const EventObject & event);
+
 private:
   MultiResolutionLogDomainDeformableRegistration(const Self &); // purposely not implemented
   void operator=(const Self &);                                 // purposely not implemented
@@ -279,11 +534,51 @@ private:
   FixedImagePyramidPointer  m_FixedImagePyramid;
   MovingImagePyramidPointer m_MovingImagePyramid;
   FieldExpanderPointer      m_FieldExpander;
+  IntegerFactorFieldExpanderPointer m_IntegerFactorExpander;
+  bool                              m_UseIntegerFactorExpander;
+  unsigned int                      m_NumberOfIntegerFactorExpansions;
   VelocityFieldPointer      m_InitialVelocityField;
 
   unsigned int              m_NumberOfLevels;
   unsigned int              m_CurrentLevel;
   std::vector<unsigned int> m_NumberOfIterations;
+  std::vector<unsigned int> m_ElapsedIterations;
+
+  /** Time budget. The times are in seconds, the cost is the time per
+   * iteration and per voxel of the current level. */
+  double                    m_TimeBudget;
+  std::vector<unsigned int> m_BudgetedIterations;
+  std::vector<unsigned int> m_DeadlineIterations;
+  std::vector<double>       m_LevelTimes;
+  double                    m_Deadline;
+  double                    m_LevelStartTime;
+  double                    m_CostPerVoxelIteration;
+
+  bool          m_UseLazyPyramid;
+  bool          m_UseSpacingAwareSchedule;
+  SizeValueType m_PeakPyramidMemory;
+  bool          m_ReserveRegistrationBuffers;
+
+  typename MaskImageType::ConstPointer m_FixedImageMask;
+  typename MaskImageType::ConstPointer m_MovingImageMask;
+
+  /** Convergence criterion passed to the registration filter. */
+  bool         m_UseConvergenceCriterion;
+  unsigned int m_ConvergenceWindowSize;
+  double       m_ConvergenceTolerance;
+
+  /** Narrow band of the finest level passed to the registration filter. */
+  bool         m_UseNarrowBandAtFinestLevel;
+  double       m_NarrowBandThreshold;
+  unsigned int m_NarrowBandUpdateInterval;
+
+  /** Checkpointing and resuming. */
+  CheckpointPointer m_Checkpoint;
+  std::string       m_CheckpointFileName;
+  unsigned int      m_CheckpointInterval;
+  std::string       m_ResumeFileName;
+  unsigned int      m_NumberOfCheckpoints;
+  unsigned int      m_ResumedIterations;
 
   /** Flag to indicate user stop registration request. */
   bool m_StopRegistrationFlag;
@@ -5,7 +5,12 @@
 #include "itkRecursiveGaussianImageFilter.h"
 #include "itkRecursiveMultiResolutionPyramidImageFilter.h"
 #include "itkImageRegionIterator.h"
+#include "itkIdentityTransform.h"
+#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
 #include "vnl/vnl_math.h"
+#include "itksys/SystemTools.hxx"
+
+#include <algorithm>
 
 namespace itk
 {
@@ -48,10 +53,17 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
   m_MovingImagePyramid  = ActualMovingImagePyramidType::New();
   m_FixedImagePyramid     = ActualFixedImagePyramidType::New();
   m_FieldExpander     = FieldExpanderType::New();
+  m_IntegerFactorExpander = IntegerFactorFieldExpanderType::New();
+  m_UseIntegerFactorExpander = true;
+  m_NumberOfIntegerFactorExpansions = 0;
   m_InitialVelocityField = NULL;
 
   m_NumberOfLevels = 3;
   m_NumberOfIterations.resize( m_NumberOfLevels );
+  m_ElapsedIterations.resize( m_NumberOfLevels, 0 );
+  m_BudgetedIterations.resize( m_NumberOfLevels, 0 );
+  m_DeadlineIterations.resize( m_NumberOfLevels, 0 );
+  m_LevelTimes.resize( m_NumberOfLevels, 0.0 );
   m_FixedImagePyramid->SetNumberOfLevels( m_NumberOfLevels );
   m_MovingImagePyramid->SetNumberOfLevels( m_NumberOfLevels );
 
@@ -62,6 +74,29 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     }
   m_CurrentLevel = 0;
 
+  m_UseLazyPyramid = false;
+  m_UseSpacingAwareSchedule = false;
+  m_PeakPyramidMemory = 0;
+  m_ReserveRegistrationBuffers = false;
+
+  m_UseConvergenceCriterion = false;
+  m_ConvergenceWindowSize = 10;
+  m_ConvergenceTolerance = 1e-3;
+
+  m_UseNarrowBandAtFinestLevel = false;
+  m_NarrowBandThreshold = 1.0;
+  m_NarrowBandUpdateInterval = 5;
+
+  m_TimeBudget = 0.0;
+  m_Deadline = 0.0;
+  m_LevelStartTime = 0.0;
+  m_CostPerVoxelIteration = 0.0;
+
+  m_Checkpoint = CheckpointType::New();
+  m_CheckpointInterval = 0;
+  m_NumberOfCheckpoints = 0;
+  m_ResumedIterations = 0;
+
   m_StopRegistrationFlag = false;
 
   m_Exponentiator = FieldExponentiatorType::New();
@@ -157,6 +192,10 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     this->Modified();
     m_NumberOfLevels = num;
     m_NumberOfIterations.resize( m_NumberOfLevels );
+    m_ElapsedIterations.resize( m_NumberOfLevels, 0 );
+    m_BudgetedIterations.resize( m_NumberOfLevels, 0 );
+    m_DeadlineIterations.resize( m_NumberOfLevels, 0 );
+    m_LevelTimes.resize( m_NumberOfLevels, 0.0 );
     }
 
   if( m_MovingImagePyramid && m_MovingImagePyramid->GetNumberOfLevels() != num )
@@ -188,6 +227,70 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     }
   os << m_NumberOfIterations[ilevel] << "]" << std::endl;
 
+  os << indent << "ElapsedIterations: [";
+  for( ilevel = 0; ilevel < m_NumberOfLevels - 1; ilevel++ )
+    {
+    os << m_ElapsedIterations[ilevel] << ", ";
+    }
+  os << m_ElapsedIterations[ilevel] << "]" << std::endl;
+
+  os << indent << "TimeBudget: " << m_TimeBudget << std::endl;
+  os << indent << "BudgetedIterations: [";
+  for( ilevel = 0; ilevel < m_NumberOfLevels - 1; ilevel++ )
+    {
+    os << m_BudgetedIterations[ilevel] << ", ";
+    }
+  os << m_BudgetedIterations[ilevel] << "]" << std::endl;
+
+  os << indent << "DeadlineIterations: [";
+  for( ilevel = 0; ilevel < m_NumberOfLevels - 1; ilevel++ )
+    {
+    os << m_DeadlineIterations[ilevel] << ", ";
+    }
+  os << m_DeadlineIterations[ilevel] << "]" << std::endl;
+
+  os << indent << "LevelTimes: [";
+  for( ilevel = 0; ilevel < m_NumberOfLevels - 1; ilevel++ )
+    {
+    os << m_LevelTimes[ilevel] << ", ";
+    }
+  os << m_LevelTimes[ilevel] << "]" << std::endl;
+
+  os << indent << "UseLazyPyramid: ";
+  os << m_UseLazyPyramid << std::endl;
+  os << indent << "UseSpacingAwareSchedule: ";
+  os << m_UseSpacingAwareSchedule << std::endl;
+  os << indent << "PeakPyramidMemory: ";
+  os << m_PeakPyramidMemory << std::endl;
+  os << indent << "ReserveRegistrationBuffers: ";
+  os << m_ReserveRegistrationBuffers << std::endl;
+  os << indent << "FixedImageMask: ";
+  os << m_FixedImageMask.GetPointer() << std::endl;
+  os << indent << "MovingImageMask: ";
+  os << m_MovingImageMask.GetPointer() << std::endl;
+
+  os << indent << "UseConvergenceCriterion: ";
+  os << m_UseConvergenceCriterion << std::endl;
+  os << indent << "ConvergenceWindowSize: ";
+  os << m_ConvergenceWindowSize << std::endl;
+  os << indent << "ConvergenceTolerance: ";
+  os << m_ConvergenceTolerance << std::endl;
+  os << indent << "UseNarrowBandAtFinestLevel: ";
+  os << m_UseNarrowBandAtFinestLevel << std::endl;
+  os << indent << "NarrowBandThreshold: ";
+  os << m_NarrowBandThreshold << std::endl;
+  os << indent << "NarrowBandUpdateInterval: ";
+  os << m_NarrowBandUpdateInterval << std::endl;
+
+  os << indent << "CheckpointFileName: ";
+  os << m_CheckpointFileName << std::endl;
+  os << indent << "CheckpointInterval: ";
+  os << m_CheckpointInterval << std::endl;
+  os << indent << "ResumeFileName: ";
+  os << m_ResumeFileName << std::endl;
+  os << indent << "NumberOfCheckpoints: ";
+  os << m_NumberOfCheckpoints << std::endl;
+
   os << indent << "RegistrationFilter: ";
   os << m_RegistrationFilter.GetPointer() << std::endl;
   os << indent << "MovingImagePyramid: ";
@@ -197,6 +300,10 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
 
   os << indent << "FieldExpander: ";
   os << m_FieldExpander.GetPointer() << std::endl;
+  os << indent << "UseIntegerFactorExpander: ";
+  os << m_UseIntegerFactorExpander << std::endl;
+  os << indent << "NumberOfIntegerFactorExpansions: ";
+  os << m_NumberOfIntegerFactorExpansions << std::endl;
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
@@ -241,6 +348,9 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     itkExceptionMacro( << "Registration filter not set" );
     }
 
+  // The time budget includes the computation of the pyramids
+  m_Deadline = this->GetWallClockTime() + m_TimeBudget;
+
 #if (ITK_VERSION_MAJOR < 4)
   if( this->m_InitialVelocityField && this->GetInput(VELOCITYFIELD_IMAGE_CODE) )
 #else
@@ -253,15 +363,47 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
                        << "or SetInput.");
     }
 
+  // Shrink the images more along the axes of smaller spacing
+  if( m_UseSpacingAwareSchedule )
+    {
+    m_MovingImagePyramid->SetSchedule(
+      ComputeSpacingAwareSchedule( movingImage->GetSpacing(), m_MovingImagePyramid->GetNumberOfLevels() ) );
+    m_FixedImagePyramid->SetSchedule(
+      ComputeSpacingAwareSchedule( fixedImage->GetSpacing(), m_FixedImagePyramid->GetNumberOfLevels() ) );
+    }
+
   // Create the image pyramids.
   m_MovingImagePyramid->SetInput( movingImage );
-  m_MovingImagePyramid->UpdateLargestPossibleRegion();
-
   m_FixedImagePyramid->SetInput( fixedImage );
-  m_FixedImagePyramid->UpdateLargestPossibleRegion();
+  m_PeakPyramidMemory = 0;
+
+  if( m_UseLazyPyramid )
+    {
+    // Only the geometry of the levels is needed up front
+    m_MovingImagePyramid->UpdateOutputInformation();
+    m_FixedImagePyramid->UpdateOutputInformation();
+    }
+  else
+    {
+    m_MovingImagePyramid->UpdateLargestPossibleRegion();
+    m_FixedImagePyramid->UpdateLargestPossibleRegion();
+
+    // All the levels are resident until the registration reaches them
+    for( unsigned int level = 0; level < m_MovingImagePyramid->GetNumberOfLevels(); level++ )
+      {
+      m_PeakPyramidMemory += m_MovingImagePyramid->GetOutput( level )->GetBufferedRegion().GetNumberOfPixels()
+        * sizeof( TRealType );
+      }
+    for( unsigned int level = 0; level < m_FixedImagePyramid->GetNumberOfLevels(); level++ )
+      {
+      m_PeakPyramidMemory += m_FixedImagePyramid->GetOutput( level )->GetBufferedRegion().GetNumberOfPixels()
+        * sizeof( TRealType );
+      }
+    }
 
   // Initializations
   m_CurrentLevel = 0;
+  m_NumberOfIntegerFactorExpansions = 0;
   m_StopRegistrationFlag = false;
 
   unsigned int movingLevel = vnl_math_min( (int) m_CurrentLevel,
@@ -315,28 +457,128 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
       }
 
     // Now resample
-    m_FieldExpander->SetInput( tempField );
-
-    typename FloatImageType::Pointer fi =
-      m_FixedImagePyramid->GetOutput( fixedLevel );
-    m_FieldExpander->SetSize(
-      fi->GetLargestPossibleRegion().GetSize() );
-    m_FieldExpander->SetOutputStartIndex(
-      fi->GetLargestPossibleRegion().GetIndex() );
-    m_FieldExpander->SetOutputOrigin( fi->GetOrigin() );
-    m_FieldExpander->SetOutputSpacing( fi->GetSpacing() );
-    m_FieldExpander->SetOutputDirection( fi->GetDirection() );
-
-    m_FieldExpander->UpdateLargestPossibleRegion();
-    m_FieldExpander->SetInput( NULL );
-    tempField = m_FieldExpander->GetOutput();
-    tempField->DisconnectPipeline();
+    tempField = this->ExpandField( tempField,
+                                   m_FixedImagePyramid->GetOutput( fixedLevel ) );
     }
 
   bool lastShrinkFactorsAllOnes = false;
 
+  // Keep the scratch fields of the registration filter across the levels
+  const bool keepScratchFields = m_RegistrationFilter->GetKeepScratchFields();
+  m_RegistrationFilter->KeepScratchFieldsOn();
+
+  // Reserve the buffers of the registration filter for the largest level
+  const SizeValueType reservedNumberOfPixels = m_RegistrationFilter->GetReservedNumberOfPixels();
+  if( m_ReserveRegistrationBuffers )
+    {
+    SizeValueType numberOfPixels = 0;
+    for( unsigned int level = 0; level < m_FixedImagePyramid->GetNumberOfLevels(); level++ )
+      {
+      numberOfPixels = vnl_math_max( numberOfPixels, static_cast<SizeValueType>(
+                                       m_FixedImagePyramid->GetOutput( level )
+                                       ->GetLargestPossibleRegion().GetNumberOfPixels() ) );
+      }
+    m_RegistrationFilter->SetReservedNumberOfPixels( numberOfPixels );
+    }
+
+  // The registration filter maps the voxels of each level onto the masks
+  typename MaskImageType::ConstPointer fixedImageMask = m_RegistrationFilter->GetFixedImageMask();
+  typename MaskImageType::ConstPointer movingImageMask = m_RegistrationFilter->GetMovingImageMask();
+  if( m_FixedImageMask.IsNotNull() )
+    {
+    m_RegistrationFilter->SetFixedImageMask( m_FixedImageMask );
+    }
+  if( m_MovingImageMask.IsNotNull() )
+    {
+    m_RegistrationFilter->SetMovingImageMask( m_MovingImageMask );
+    }
+
+  m_RegistrationFilter->SetUseConvergenceCriterion( m_UseConvergenceCriterion );
+  m_RegistrationFilter->SetConvergenceWindowSize( m_ConvergenceWindowSize );
+  m_RegistrationFilter->SetConvergenceTolerance( m_ConvergenceTolerance );
+  m_RegistrationFilter->SetNarrowBandThreshold( m_NarrowBandThreshold );
+  m_RegistrationFilter->SetNarrowBandUpdateInterval( m_NarrowBandUpdateInterval );
+  std::fill( m_ElapsedIterations.begin(), m_ElapsedIterations.end(), 0 );
+  std::copy( m_NumberOfIterations.begin(), m_NumberOfIterations.end(), m_BudgetedIterations.begin() );
+  std::fill( m_DeadlineIterations.begin(), m_DeadlineIterations.end(), 0 );
+  std::fill( m_LevelTimes.begin(), m_LevelTimes.end(), 0.0 );
+  m_CostPerVoxelIteration = 0.0;
+
+  // Restart from the level and iteration of the checkpoint
+  m_NumberOfCheckpoints = 0;
+  m_ResumedIterations = 0;
+  if( !m_ResumeFileName.empty() )
+    {
+    m_Checkpoint->Read( m_ResumeFileName );
+    if( m_Checkpoint->GetElapsedIterations().size() != m_NumberOfLevels
+        || m_Checkpoint->GetLevel() > m_NumberOfLevels )
+      {
+      itkExceptionMacro( << "The checkpoint " << m_ResumeFileName << " was taken with "
+                         << m_Checkpoint->GetElapsedIterations().size() << " levels instead of "
+                         << m_NumberOfLevels );
+      }
+    if( m_Checkpoint->GetFixedImageSize() != fixedImage->GetLargestPossibleRegion().GetSize()
+        || m_Checkpoint->GetFixedImageSpacing() != fixedImage->GetSpacing() )
+      {
+      itkExceptionMacro( << "The checkpoint " << m_ResumeFileName << " was taken with a fixed image of size "
+                         << m_Checkpoint->GetFixedImageSize() << " and spacing "
+                         << m_Checkpoint->GetFixedImageSpacing() << " instead of "
+                         << fixedImage->GetLargestPossibleRegion().GetSize() << " and "
+                         << fixedImage->GetSpacing() );
+      }
+    if( m_Checkpoint->GetSchedule() != m_FixedImagePyramid->GetSchedule() )
+      {
+      itkExceptionMacro( << "The checkpoint " << m_ResumeFileName << " was taken with another schedule" );
+      }
+
+    m_CurrentLevel = m_Checkpoint->GetLevel();
+    std::copy( m_Checkpoint->GetElapsedIterations().begin(), m_Checkpoint->GetElapsedIterations().end(),
+               m_ElapsedIterations.begin() );
+    movingLevel = vnl_math_min( (int) m_CurrentLevel,
+                                (int) m_MovingImagePyramid->GetNumberOfLevels() );
+    fixedLevel = vnl_math_min( (int) m_CurrentLevel,
+                               (int) m_FixedImagePyramid->GetNumberOfLevels() );
+
+    // The checkpoint buffer is reused by the next checkpoints
+    tempField = m_Checkpoint->GetVelocityField();
+    m_Checkpoint->SetVelocityField( NULL );
+
+    if( m_CurrentLevel < m_NumberOfLevels && m_ElapsedIterations[m_CurrentLevel] > 0 )
+      {
+      m_ResumedIterations = vnl_math_min( m_ElapsedIterations[m_CurrentLevel],
+                                          m_NumberOfIterations[m_CurrentLevel] );
+      m_RegistrationFilter->SetInitialConvergenceHistory( m_Checkpoint->GetMetricHistory(),
+                                                          m_Checkpoint->GetRMSChangeHistory() );
+      }
+    }
+
+  // The physical standard deviations are those of the finest level
+  const bool scaleStandardDeviations = m_UseSpacingAwareSchedule
+    && m_RegistrationFilter->GetStandardDeviationsInPhysicalUnits();
+  double     standardDeviations[ImageDimension];
+  double     updateFieldStandardDeviations[ImageDimension];
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    standardDeviations[j] = m_RegistrationFilter->GetStandardDeviations()[j];
+    updateFieldStandardDeviations[j] = m_RegistrationFilter->GetUpdateFieldStandardDeviations()[j];
+    }
+
+  // The time budget and the checkpoints within a level are handled by
+  // observing the registration filter
+  unsigned long iterationObserverTag = 0;
+  const bool    observeIterations = ( !m_CheckpointFileName.empty() && m_CheckpointInterval > 0 )
+    || m_TimeBudget > 0.0;
+  if( observeIterations )
+    {
+    typedef MemberCommand<Self> CommandType;
+    typename CommandType::Pointer command = CommandType::New();
+    command->SetCallbackFunction( this, &Self::RegistrationIterationCallback );
+    iterationObserverTag = m_RegistrationFilter->AddObserver( IterationEvent(), command );
+    }
+
   while( !this->Halt() )
     {
+    const double levelStartTime = this->GetWallClockTime();
 
     if( tempField.IsNull() )
       {
@@ -346,33 +588,68 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
       {
       // Resample the field to be the same size as the fixed image
       // at the current level
-      m_FieldExpander->SetInput( tempField );
-
-      typename FloatImageType::Pointer fi =
-        m_FixedImagePyramid->GetOutput( fixedLevel );
-      m_FieldExpander->SetSize(
-        fi->GetLargestPossibleRegion().GetSize() );
-      m_FieldExpander->SetOutputStartIndex(
-        fi->GetLargestPossibleRegion().GetIndex() );
-      m_FieldExpander->SetOutputOrigin( fi->GetOrigin() );
-      m_FieldExpander->SetOutputSpacing( fi->GetSpacing() );
-      m_FieldExpander->SetOutputDirection( fi->GetDirection() );
-
-      m_FieldExpander->UpdateLargestPossibleRegion();
-      m_FieldExpander->SetInput( NULL );
-      tempField = m_FieldExpander->GetOutput();
-      tempField->DisconnectPipeline();
+      tempField = this->ExpandField( tempField,
+                                     m_FixedImagePyramid->GetOutput( fixedLevel ) );
 
       m_RegistrationFilter->SetInitialVelocityField( tempField );
 
       }
 
     // setup registration filter and pyramids
-    m_RegistrationFilter->SetMovingImage( m_MovingImagePyramid->GetOutput(movingLevel) );
-    m_RegistrationFilter->SetFixedImage( m_FixedImagePyramid->GetOutput(fixedLevel) );
+    if( m_UseLazyPyramid )
+      {
+      // Free the previous level before computing the current one
+      m_RegistrationFilter->SetMovingImage( NULL );
+      m_RegistrationFilter->SetFixedImage( NULL );
+
+      typename FloatImageType::Pointer movingLevelImage =
+        this->ComputePyramidLevel( m_MovingImagePyramid.GetPointer(), movingLevel );
+      typename FloatImageType::Pointer fixedLevelImage =
+        this->ComputePyramidLevel( m_FixedImagePyramid.GetPointer(), fixedLevel );
+
+      const SizeValueType levelMemory =
+        ( movingLevelImage->GetBufferedRegion().GetNumberOfPixels()
+          + fixedLevelImage->GetBufferedRegion().GetNumberOfPixels() ) * sizeof( TRealType );
+      m_PeakPyramidMemory = vnl_math_max( m_PeakPyramidMemory, levelMemory );
+
+      m_RegistrationFilter->SetMovingImage( movingLevelImage );
+      m_RegistrationFilter->SetFixedImage( fixedLevelImage );
+      }
+    else
+      {
+      m_RegistrationFilter->SetMovingImage( m_MovingImagePyramid->GetOutput(movingLevel) );
+      m_RegistrationFilter->SetFixedImage( m_FixedImagePyramid->GetOutput(fixedLevel) );
+      }
+
+    // Once the cost of an iteration is known, the level is given its share
+    // of the remaining time
+    if( m_TimeBudget > 0.0 )
+      {
+      m_LevelStartTime = this->GetWallClockTime();
+      if( m_CostPerVoxelIteration > 0.0 )
+        {
+        this->PlanTimeBudget( m_ResumedIterations, m_LevelStartTime );
+        }
+      }
 
     m_RegistrationFilter->SetNumberOfIterations(
-      m_NumberOfIterations[m_CurrentLevel] );
+      m_BudgetedIterations[m_CurrentLevel] - m_ResumedIterations );
+    m_RegistrationFilter->SetUseNarrowBand( m_UseNarrowBandAtFinestLevel
+                                            && m_CurrentLevel == m_NumberOfLevels - 1 );
+
+    if( scaleStandardDeviations )
+      {
+      const double factor = vcl_pow( 2.0, static_cast<double>( m_NumberOfLevels - 1 - m_CurrentLevel ) );
+      double       levelStandardDeviations[ImageDimension];
+      double       levelUpdateFieldStandardDeviations[ImageDimension];
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        levelStandardDeviations[j] = factor * standardDeviations[j];
+        levelUpdateFieldStandardDeviations[j] = factor * updateFieldStandardDeviations[j];
+        }
+      m_RegistrationFilter->SetStandardDeviations( levelStandardDeviations );
+      m_RegistrationFilter->SetUpdateFieldStandardDeviations( levelUpdateFieldStandardDeviations );
+      }
 
     // cache shrink factors for computing the next expand factors.
     lastShrinkFactorsAllOnes = true;
@@ -390,6 +667,21 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     tempField = m_RegistrationFilter->GetOutput();
     tempField->DisconnectPipeline();
 
+    m_ElapsedIterations[m_CurrentLevel] = m_ResumedIterations
+      + static_cast<unsigned int>( m_RegistrationFilter->GetElapsedIterations() );
+    m_ResumedIterations = 0;
+    m_LevelTimes[m_CurrentLevel] = this->GetWallClockTime() - levelStartTime;
+
+    // A level stopped by the user or at the deadline is not complete
+    const bool levelCompleted = m_RegistrationFilter->GetConverged()
+      || m_ElapsedIterations[m_CurrentLevel] >= m_BudgetedIterations[m_CurrentLevel];
+
+    // No time is left for the next levels
+    if( m_TimeBudget > 0.0 && this->GetWallClockTime() >= m_Deadline )
+      {
+      m_StopRegistrationFlag = true;
+      }
+
     // Increment level counter.
     m_CurrentLevel++;
     movingLevel = vnl_math_min( (int) m_CurrentLevel,
@@ -397,6 +689,13 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
     fixedLevel = vnl_math_min( (int) m_CurrentLevel,
                                (int) m_FixedImagePyramid->GetNumberOfLevels() );
 
+    // Checkpoint the start of the next level, the last checkpoint of an
+    // incomplete level is kept instead
+    if( !m_CheckpointFileName.empty() && m_CurrentLevel < m_NumberOfLevels && levelCompleted )
+      {
+      this->WriteCheckpoint( tempField, std::deque<double>(), std::deque<double>() );
+      }
+
     // Invoke an iteration event.
     this->InvokeEvent( IterationEvent() );
 
@@ -412,24 +711,27 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
 
     } // while not Halt()
 
-  if( !lastShrinkFactorsAllOnes )
+  if( observeIterations )
+    {
+    m_RegistrationFilter->RemoveObserver( iterationObserverTag );
+    }
+  if( scaleStandardDeviations )
+    {
+    m_RegistrationFilter->SetStandardDeviations( standardDeviations );
+    m_RegistrationFilter->SetUpdateFieldStandardDeviations( updateFieldStandardDeviations );
+    }
+  m_Checkpoint->Wait();
+
+  if( !lastShrinkFactorsAllOnes || m_RegistrationFilter->GetVelocityFieldShrinkFactor() > 1 )
     {
-    // Some of the last shrink factors are not one
+    // Some of the last shrink factors are not one or the velocity field
+    // is stored at a reduced resolution
     // graft the output of the expander filter to
     // to output of this filter
 
     // resample the field to the same size as the fixed image
-    m_FieldExpander->SetInput( tempField );
-    m_FieldExpander->SetSize(
-      fixedImage->GetLargestPossibleRegion().GetSize() );
-    m_FieldExpander->SetOutputStartIndex(
-      fixedImage->GetLargestPossibleRegion().GetIndex() );
-    m_FieldExpander->SetOutputOrigin( fixedImage->GetOrigin() );
-    m_FieldExpander->SetOutputSpacing( fixedImage->GetSpacing() );
-    m_FieldExpander->SetOutputDirection( fixedImage->GetDirection() );
-
-    m_FieldExpander->UpdateLargestPossibleRegion();
-    this->GraftOutput( m_FieldExpander->GetOutput() );
+    tempField = this->ExpandField( tempField, fixedImage );
+    this->GraftOutput( tempField );
     }
   else
     {
@@ -444,7 +746,271 @@ MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField
   m_FieldExpander->GetOutput()->ReleaseData();
   m_RegistrationFilter->SetInput( NULL );
   m_RegistrationFilter->GetOutput()->ReleaseData();
+  // The output may share the buffer of the last level
+  m_RegistrationFilter->SetReservedNumberOfPixels( reservedNumberOfPixels );
+  m_RegistrationFilter->DisconnectOutputBuffer();
+  m_RegistrationFilter->SetKeepScratchFields( keepScratchFields );
+  m_RegistrationFilter->SetFixedImageMask( fixedImageMask );
+  m_RegistrationFilter->SetMovingImageMask( movingImageMask );
+  if( !keepScratchFields )
+    {
+    m_RegistrationFilter->ReleaseScratchFields();
+    }
+
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+template <class TPyramid>
+typename MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::FloatImageType::Pointer
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::ComputePyramidLevel(TPyramid * pyramid, unsigned int level)
+{
+  typename TPyramid::Pointer levelPyramid =
+    dynamic_cast<TPyramid *>( pyramid->CreateAnother().GetPointer() );
+  if( levelPyramid.IsNull() )
+    {
+    itkExceptionMacro( << "Could not create a pyramid of the same type as " << pyramid->GetNameOfClass() );
+    }
+
+  typename TPyramid::ScheduleType schedule( 1, ImageDimension );
+  for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+    {
+    schedule[0][idim] = pyramid->GetSchedule()[level][idim];
+    }
+
+  // CreateAnother only gives the default configuration, copy the one of
+  // the given pyramid
+  levelPyramid->SetInput( pyramid->GetInput() );
+  levelPyramid->SetNumberOfLevels( 1 );
+  levelPyramid->SetSchedule( schedule );
+  levelPyramid->SetNumberOfThreads( pyramid->GetNumberOfThreads() );
+#if (ITK_VERSION_MAJOR >= 4)
+  levelPyramid->SetMaximumError( pyramid->GetMaximumError() );
+  levelPyramid->SetUseShrinkImageFilter( pyramid->GetUseShrinkImageFilter() );
+#endif
+  levelPyramid->UpdateLargestPossibleRegion();
+
+  typename FloatImageType::Pointer image = levelPyramid->GetOutput( 0 );
+  image->DisconnectPipeline();
+  return image;
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+typename MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::VelocityFieldPointer
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::ExpandField(VelocityFieldType * field, const ImageBase<ImageDimension> * reference)
+{
+  typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+    VelocityFieldType, double>                             ExtrapolatingInterpolatorType;
+  typedef IdentityTransform<double, ImageDimension> IdentityTransformType;
+
+  VelocityFieldPointer expandedField;
+
+  // The integer factor expander only reproduces this configuration
+  if( m_UseIntegerFactorExpander
+      && dynamic_cast<const ExtrapolatingInterpolatorType *>( m_FieldExpander->GetInterpolator() )
+      && dynamic_cast<const IdentityTransformType *>( m_FieldExpander->GetTransform() ) )
+    {
+    m_IntegerFactorExpander->SetSize( reference->GetLargestPossibleRegion().GetSize() );
+    m_IntegerFactorExpander->SetOutputStartIndex( reference->GetLargestPossibleRegion().GetIndex() );
+    m_IntegerFactorExpander->SetOutputOrigin( reference->GetOrigin() );
+    m_IntegerFactorExpander->SetOutputSpacing( reference->GetSpacing() );
+    m_IntegerFactorExpander->SetOutputDirection( reference->GetDirection() );
+
+    if( m_IntegerFactorExpander->CanExpand( field ) )
+      {
+      m_IntegerFactorExpander->SetInput( field );
+      m_IntegerFactorExpander->UpdateLargestPossibleRegion();
+      m_IntegerFactorExpander->SetInput( NULL );
+      expandedField = m_IntegerFactorExpander->GetOutput();
+      expandedField->DisconnectPipeline();
+      ++m_NumberOfIntegerFactorExpansions;
+      return expandedField;
+      }
+    }
+
+  m_FieldExpander->SetInput( field );
+  m_FieldExpander->SetSize( reference->GetLargestPossibleRegion().GetSize() );
+  m_FieldExpander->SetOutputStartIndex( reference->GetLargestPossibleRegion().GetIndex() );
+  m_FieldExpander->SetOutputOrigin( reference->GetOrigin() );
+  m_FieldExpander->SetOutputSpacing( reference->GetSpacing() );
+  m_FieldExpander->SetOutputDirection( reference->GetDirection() );
+
+  m_FieldExpander->UpdateLargestPossibleRegion();
+  m_FieldExpander->SetInput( NULL );
+  expandedField = m_FieldExpander->GetOutput();
+  expandedField->DisconnectPipeline();
+  return expandedField;
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+typename MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::ScheduleType
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::ComputeSpacingAwareSchedule(const SpacingType & spacing, unsigned int numberOfLevels)
+{
+  double minimumSpacing = spacing[0];
+  for( unsigned int j = 1; j < ImageDimension; j++ )
+    {
+    minimumSpacing = vnl_math_min( minimumSpacing, static_cast<double>( spacing[j] ) );
+    }
+
+  ScheduleType schedule( numberOfLevels, ImageDimension );
+  for( unsigned int level = 0; level < numberOfLevels; level++ )
+    {
+    const double targetSpacing = minimumSpacing * vcl_pow( 2.0, static_cast<double>( numberOfLevels - 1 - level ) );
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      schedule[level][j] = static_cast<unsigned int>( vnl_math_max( 1, vnl_math_rnd( targetSpacing / spacing[j] ) ) );
+      }
+    }
+  return schedule;
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::WriteCheckpoint(const VelocityFieldType * field, const std::deque<double> & metricHistory,
+                  const std::deque<double> & rmsChangeHistory)
+{
+  // The previous checkpoint may still be written from the copy
+  m_Checkpoint->Wait();
+
+  // The registration goes on with the field, so that it is copied
+  VelocityFieldPointer copy = m_Checkpoint->GetVelocityField();
+  if( copy.IsNull() )
+    {
+    copy = VelocityFieldType::New();
+    m_Checkpoint->SetVelocityField( copy );
+    }
+  copy->CopyInformation( field );
+  copy->SetRegions( field->GetBufferedRegion() );
+  copy->Allocate();
+  std::copy( field->GetBufferPointer(),
+             field->GetBufferPointer() + field->GetBufferedRegion().GetNumberOfPixels(),
+             copy->GetBufferPointer() );
+
+  m_Checkpoint->SetFixedImageSize( this->GetFixedImage()->GetLargestPossibleRegion().GetSize() );
+  m_Checkpoint->SetFixedImageSpacing( this->GetFixedImage()->GetSpacing() );
+  m_Checkpoint->SetSchedule( m_FixedImagePyramid->GetSchedule() );
+  m_Checkpoint->SetLevel( m_CurrentLevel );
+  m_Checkpoint->SetElapsedIterations( m_ElapsedIterations );
+  m_Checkpoint->SetConvergenceHistory( metricHistory, rmsChangeHistory );
+  m_Checkpoint->WriteAsynchronously( m_CheckpointFileName );
+  ++m_NumberOfCheckpoints;
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+double
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::GetWallClockTime() const
+{
+  return itksys::SystemTools::GetTime();
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::PlanTimeBudget(unsigned int elapsedIterations, double now)
+{
+  // Number of voxel iterations left with the requested numbers of iterations
+  std::vector<double> remainingIterations( m_NumberOfLevels, 0.0 );
+  double              work = 0.0;
+  for( unsigned int level = m_CurrentLevel; level < m_NumberOfLevels; level++ )
+    {
+    const unsigned int fixedLevel = vnl_math_min( level, m_FixedImagePyramid->GetNumberOfLevels() - 1 );
+    remainingIterations[level] = static_cast<double>( m_NumberOfIterations[level] );
+    if( level == m_CurrentLevel )
+      {
+      remainingIterations[level] -= vnl_math_min( static_cast<double>( elapsedIterations ),
+                                                  remainingIterations[level] );
+      }
+    work += remainingIterations[level] * static_cast<double>(
+        m_FixedImagePyramid->GetOutput( fixedLevel )->GetLargestPossibleRegion().GetNumberOfPixels() );
+    }
+
+  // Scale all the levels left by the same factor to fit in the time left
+  const double remainingTime = vnl_math_max( m_Deadline - now, 0.0 );
+  double       scale = 1.0;
+  if( work * m_CostPerVoxelIteration > remainingTime )
+    {
+    scale = remainingTime / ( work * m_CostPerVoxelIteration );
+    }
+
+  for( unsigned int level = m_CurrentLevel; level < m_NumberOfLevels; level++ )
+    {
+    m_BudgetedIterations[level] = static_cast<unsigned int>( vcl_floor( scale * remainingIterations[level] ) );
+    }
+  m_BudgetedIterations[m_CurrentLevel] += elapsedIterations;
+
+  itkDebugMacro( "Level " << m_CurrentLevel << " budgeted to " << m_BudgetedIterations[m_CurrentLevel]
+                          << " iterations, " << remainingTime << " s left" );
+}
+
+template <class TFixedImage, class TMovingImage, class TField, class TRealType>
+void
+MultiResolutionLogDomainDeformableRegistration<TFixedImage, TMovingImage, TField, TRealType>
+::RegistrationIterationCallback(Object *, const EventObject &)
+{
+  const unsigned int elapsedIterations = m_ResumedIterations
+    + static_cast<unsigned int>( m_RegistrationFilter->GetElapsedIterations() );
+
+  if( m_TimeBudget > 0.0 )
+    {
+    const double now = this->GetWallClockTime();
+    const double iterationTime = ( now - m_LevelStartTime )
+      / static_cast<double>( m_RegistrationFilter->GetElapsedIterations() );
+    const double numberOfPixels = static_cast<double>(
+        m_RegistrationFilter->GetFixedImage()->GetLargestPossibleRegion().GetNumberOfPixels() );
+
+    // The first iteration gives the first estimate of the cost
+    const bool firstEstimate = !( m_CostPerVoxelIteration > 0.0 );
+    m_CostPerVoxelIteration = iterationTime / numberOfPixels;
+    if( firstEstimate )
+      {
+      this->PlanTimeBudget( elapsedIterations, now );
+      }
+
+    if( elapsedIterations >= m_BudgetedIterations[m_CurrentLevel] )
+      {
+      m_RegistrationFilter->StopRegistration();
+      }
+    else if( now + iterationTime > m_Deadline )
+      {
+      // The next iteration would end after the deadline
+      itkDebugMacro( "Stopping at the deadline after " << elapsedIterations
+                     << " iterations of level " << m_CurrentLevel );
+      m_DeadlineIterations[m_CurrentLevel] = elapsedIterations;
+      this->StopRegistration();
+      }
+    }
+
+  // The end of the level is checkpointed at the level boundary
+  if( m_CheckpointFileName.empty() || m_CheckpointInterval == 0
+      || elapsedIterations % m_CheckpointInterval != 0
+      || elapsedIterations >= m_BudgetedIterations[m_CurrentLevel] )
+    {
+    return;
+    }
+
+  std::deque<double> metricHistory = m_RegistrationFilter->GetMetricHistory();
+  std::deque<double> rmsChangeHistory = m_RegistrationFilter->GetRMSChangeHistory();
+  if( m_UseConvergenceCriterion )
+    {
+    // The values of the last iteration are only recorded by the next Halt
+    metricHistory.push_back( m_RegistrationFilter->GetMetric() );
+    rmsChangeHistory.push_back( m_RegistrationFilter->GetRMSChange() );
+    while( metricHistory.size() > m_ConvergenceWindowSize )
+      {
+      metricHistory.pop_front();
+      rmsChangeHistory.pop_front();
+      }
+    }
 
+  m_ElapsedIterations[m_CurrentLevel] = elapsedIterations;
+  this->WriteCheckpoint( m_RegistrationFilter->GetOutput(), metricHistory, rmsChangeHistory );
 }
 
 template <class TFixedImage, class TMovingImage, class TField, class TRealType>
@@ -7,6 +7,7 @@
 #include "itkInterpolateImageFunction.h"
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkCentralDifferenceImageFunction.h"
+#include "itkSimpleFastMutexLock.h"
 
 namespace itk
 {
@@ -120,14 +121,13 @@ public:
   {
     GlobalDataStruct *global = new GlobalDataStruct();
 
+    global->m_SumOfCorrelations = 0.0;
     return global;
   }
 
-  /** Release memory for global data structure. */
-  virtual void ReleaseGlobalDataPointer( void *GlobalData ) const
-  {
-    delete (GlobalDataStruct *) GlobalData;
-  }
+  /** Release memory for global data structure, adding the sum of the
+   * thread to the metric. */
+  virtual void ReleaseGlobalDataPointer( void *GlobalData ) const;
 
   /** Set the object's state before each iteration. */
   virtual void InitializeIteration();
@@ -160,10 +160,12 @@ protected:
   typedef ConstNeighborhoodIterator<FixedImageType> FixedImageNeighborhoodIteratorType;
 
   /** A global data type for this class of equation. Used to store
-   * iterators for the fixed image. */
+   * iterators for the fixed image and the sum of the correlations of the
+   * thread, accumulated in double whatever the pixel type. */
   struct GlobalDataStruct
     {
     FixedImageNeighborhoodIteratorType m_FixedImageIterator;
+    double m_SumOfCorrelations;
     };
 private:
   NCCRegistrationFunction2(const Self &); // purposely not implemented
@@ -184,7 +186,9 @@ private:
   /** Threshold below which the denominator term is considered zero. */
   double m_DenominatorThreshold;
 
-  mutable double m_MetricTotal;
+  /** The threads add their sums to the metric under the lock. */
+  mutable double              m_MetricTotal;
+  mutable SimpleFastMutexLock m_MetricCalculationLock;
 
   bool m_SubtractMean;
 };
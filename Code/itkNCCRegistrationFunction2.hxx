@@ -97,7 +97,7 @@ template <class TFixedImage, class TMovingImage, class TDeformationField>
 typename NCCRegistrationFunction2<TFixedImage, TMovingImage, TDeformationField>
 ::PixelType
 NCCRegistrationFunction2<TFixedImage, TMovingImage, TDeformationField>
-::ComputeUpdate(const NeighborhoodType & it, void * itkNotUsed(globalData),
+::ComputeUpdate(const NeighborhoodType & it, void * gd,
                 const FloatOffsetType & itkNotUsed(offset) )
 {
   const IndexType oindex = it.GetIndex();
@@ -226,8 +226,11 @@ NCCRegistrationFunction2<TFixedImage, TMovingImage, TDeformationField>
       updatenorm += (update[i] * update[i]);
       }
     updatenorm = vcl_sqrt(updatenorm);
-    m_MetricTotal += sfm * factor;
-    this->m_Energy += sfm * factor;
+    // Summed per thread, see ReleaseGlobalDataPointer
+    if( gd )
+      {
+      static_cast<GlobalDataStruct *>( gd )->m_SumOfCorrelations += sfm * factor;
+      }
     }
   else
     {
@@ -242,6 +245,24 @@ NCCRegistrationFunction2<TFixedImage, TMovingImage, TDeformationField>
   return update * this->m_GradientStep;
 }
 
+/*
+ * Add the sum of the thread to the metric and release the global data
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+NCCRegistrationFunction2<TFixedImage, TMovingImage, TDeformationField>
+::ReleaseGlobalDataPointer( void *gd ) const
+{
+  GlobalDataStruct * globalData = (GlobalDataStruct *) gd;
+
+  m_MetricCalculationLock.Lock();
+  m_MetricTotal += globalData->m_SumOfCorrelations;
+  this->m_Energy += globalData->m_SumOfCorrelations;
+  m_MetricCalculationLock.Unlock();
+
+  delete globalData;
+}
+
 } // end namespace itk
 
 #endif
@@ -0,0 +1,187 @@
+#ifndef __itkSeparableVectorFieldSmoothingFilter_h
+#define __itkSeparableVectorFieldSmoothingFilter_h
+
+#include <itkImageToImageFilter.h>
+#include <itkGaussianOperator.h>
+
+#include <vector>
+
+namespace itk
+{
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
+/** \class SeparableVectorFieldSmoothingFilter
+ * \brief Smooths a vector field in place with a separable Gaussian kernel
+ * using contiguous line buffers.
+ *
+ * The field is smoothed along each dimension in turn. For a given
+ * dimension, the lines of pixels along that dimension are processed by
+ * blocks of NumberOfLinesPerBlock neighboring lines. A block is gathered
+ * into a contiguous buffer in which the vector components of all the lines
+ * are interleaved, convolved and scattered back into the field. Except
+ * along the first dimension, the lines of a block are neighbors in memory
+ * so that the field is read and written by contiguous chunks instead of
+ * being strided through at the row or slice distance. The inner loop of
+ * the convolution runs over all the components of the block, which lets
+ * the compiler vectorize it.
+ *
+ * The kernels are the ones of GaussianOperator, the standard deviations
+ * being given in voxel units, and the field is extended by replicating
+ * its border values (zero flux Neumann condition). The result is thus the
+ * same as the one of successive VectorNeighborhoodOperatorImageFilter
+ * passes.
+ *
+ * The filter always runs in place: its output shares the buffer of its
+ * input. Contrary to what InPlaceImageFilter does, the input is not
+ * released afterwards.
+ *
+ * \sa GaussianOperator VectorNeighborhoodOperatorImageFilter
+ * \ingroup ImageToImageFilter MultiThreaded
+ */
+template <class TField>
+class ITK_EXPORT SeparableVectorFieldSmoothingFilter :
+  public ImageToImageFilter<TField, TField>
+{
+public:
+  /** Standard class typedefs. */
+  typedef SeparableVectorFieldSmoothingFilter Self;
+  typedef ImageToImageFilter<TField, TField>  Superclass;
+  typedef SmartPointer<Self>                  Pointer;
+  typedef SmartPointer<const Self>            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( SeparableVectorFieldSmoothingFilter, ImageToImageFilter );
+
+  /** Some convenient typedefs. */
+  typedef TField                              FieldType;
+  typedef typename FieldType::Pointer         FieldPointer;
+  typedef typename FieldType::PixelType       PixelType;
+  typedef typename PixelType::ValueType       ScalarType;
+  typedef typename FieldType::RegionType      RegionType;
+  typedef typename FieldType::SizeType        SizeType;
+  typedef typename FieldType::OffsetValueType OffsetValueType;
+
+  /** ImageDimension constants */
+  itkStaticConstMacro(ImageDimension, unsigned int, TField::ImageDimension);
+  itkStaticConstMacro(VectorDimension, unsigned int, PixelType::Dimension);
+
+  typedef GaussianOperator<ScalarType, itkGetStaticConstMacro(ImageDimension)> OperatorType;
+
+  /** Set/Get the standard deviations of the Gaussian kernel along each
+   * dimension, in voxel units. A non-positive value disables the smoothing
+   * along the corresponding dimension. Default is 1.0. */
+  itkSetVectorMacro( StandardDeviations, double, ImageDimension );
+  void SetStandardDeviations(double value);
+
+  const double * GetStandardDeviations() const
+  {
+    return static_cast<const double *>(m_StandardDeviations);
+  }
+
+  /** Set/Get the desired maximum error of the Gaussian kernel approximate.
+   * \sa GaussianOperator. */
+  itkSetMacro( MaximumError, double );
+  itkGetConstMacro( MaximumError, double );
+
+  /** Set/Get the desired limits of the Gaussian kernel width.
+   * \sa GaussianOperator. */
+  itkSetMacro( MaximumKernelWidth, unsigned int );
+  itkGetConstMacro( MaximumKernelWidth, unsigned int );
+
+  /** Set/Get the number of neighboring lines gathered together in a line
+   * buffer. Default is 16. */
+  itkSetClampMacro( NumberOfLinesPerBlock, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( NumberOfLinesPerBlock, unsigned int );
+
+  /** Set/Get the region of the field to smooth. The voxels of this region
+   * get the values of a smoothing of the whole field: the region is smoothed
+   * in a scratch field together with a halo of the kernel radius read from
+   * the field. The field is left unchanged outside of the region. An empty
+   * region, the default, smooths the whole buffered region in place. */
+  itkSetMacro( SmoothingRegion, RegionType );
+  itkGetConstReferenceMacro( SmoothingRegion, RegionType );
+
+#ifdef ITK_USE_CONCEPT_CHECKING
+  /** Begin concept checking */
+  itkConceptMacro(ScalarHasNumericTraitsCheck,
+                  (Concept::HasNumericTraits<ScalarType>) );
+  /** End concept checking */
+#endif
+protected:
+  SeparableVectorFieldSmoothingFilter();
+  ~SeparableVectorFieldSmoothingFilter()
+  {
+  }
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The whole field is smoothed. */
+  virtual void GenerateInputRequestedRegion();
+
+  virtual void EnlargeOutputRequestedRegion(DataObject *);
+
+  /** Graft the input onto the output so that the filter runs in place. */
+  virtual void AllocateOutputs();
+
+  /** Smooth the field along each dimension in turn. */
+  virtual void GenerateData();
+
+  /** Smooth the blocks of lines in [firstBlock, endBlock) along the
+   * current direction. */
+  void ThreadedSmoothLines(unsigned long firstBlock, unsigned long endBlock,
+                           ThreadIdType threadId);
+
+  /** Static function used as a "callback" by the MultiThreader. The blocks
+   * of lines are split evenly among the threads. */
+  static ITK_THREAD_RETURN_TYPE SmoothLinesThreaderCallback(void *arg);
+
+  /** Compute the kernels whose parameters changed since the last update. */
+  void UpdateKernels();
+
+private:
+  SeparableVectorFieldSmoothingFilter(const Self &); // purposely not implemented
+  void operator=(const Self &);                      // purposely not implemented
+
+  double       m_StandardDeviations[ImageDimension];
+  double       m_MaximumError;
+  unsigned int m_MaximumKernelWidth;
+  unsigned int m_NumberOfLinesPerBlock;
+  RegionType   m_SmoothingRegion;
+
+  /** Kernel coefficients along each dimension and the parameters they
+   * were computed with. */
+  std::vector<ScalarType> m_Kernels[ImageDimension];
+  double                  m_KernelStandardDeviations[ImageDimension];
+  double                  m_KernelMaximumError;
+  unsigned int            m_KernelMaximumKernelWidth;
+
+  /** Description of the current pass, shared by the threads. */
+  ScalarType *    m_Buffer;
+  SizeType        m_Size;
+  OffsetValueType m_Strides[ImageDimension];
+  unsigned int    m_Direction;
+  unsigned int    m_LinesPerBlock;
+  unsigned long   m_NumberOfBlocksAlongLines;
+  unsigned long   m_NumberOfBlocks;
+
+  /** Copy of the smoothing region and its halo, kept across updates. */
+  FieldPointer m_ScratchField;
+
+  /** Per thread line buffers, kept across updates. */
+  std::vector<std::vector<ScalarType> > m_InputLineBuffers;
+  std::vector<std::vector<ScalarType> > m_OutputLineBuffers;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkSeparableVectorFieldSmoothingFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef __itkSeparableVectorFieldSmoothingFilter_txx
+#define __itkSeparableVectorFieldSmoothingFilter_txx
+
+#include "itkSeparableVectorFieldSmoothingFilter.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor.
+ */
+template <class TField>
+SeparableVectorFieldSmoothingFilter<TField>
+::SeparableVectorFieldSmoothingFilter()
+{
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    m_StandardDeviations[j] = 1.0;
+    m_KernelStandardDeviations[j] = -1.0;
+    m_Strides[j] = 0;
+    }
+  m_MaximumError = 0.1;
+  m_MaximumKernelWidth = 30;
+  m_NumberOfLinesPerBlock = 16;
+
+  m_KernelMaximumError = -1.0;
+  m_KernelMaximumKernelWidth = 0;
+
+  m_Buffer = 0;
+  m_Size.Fill( 0 );
+  m_Direction = 0;
+  m_LinesPerBlock = 1;
+  m_NumberOfBlocksAlongLines = 0;
+  m_NumberOfBlocks = 0;
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::SetStandardDeviations(double value)
+{
+  bool modified = false;
+
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    if( value != m_StandardDeviations[j] )
+      {
+      modified = true;
+      m_StandardDeviations[j] = value;
+      }
+    }
+  if( modified )
+    {
+    this->Modified();
+    }
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "StandardDeviations: [";
+  unsigned int j;
+  for( j = 0; j < ImageDimension - 1; j++ )
+    {
+    os << m_StandardDeviations[j] << ", ";
+    }
+  os << m_StandardDeviations[j] << "]" << std::endl;
+  os << indent << "MaximumError: " << m_MaximumError << std::endl;
+  os << indent << "MaximumKernelWidth: " << m_MaximumKernelWidth << std::endl;
+  os << indent << "NumberOfLinesPerBlock: " << m_NumberOfLinesPerBlock << std::endl;
+  os << indent << "SmoothingRegion: " << m_SmoothingRegion << std::endl;
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  FieldType * inputPtr = const_cast<FieldType *>( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::EnlargeOutputRequestedRegion(DataObject * output)
+{
+  Superclass::EnlargeOutputRequestedRegion( output );
+  output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::AllocateOutputs()
+{
+  // Run in place: the output shares the buffer of the input
+  this->GetOutput()->Graft( this->GetInput() );
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::UpdateKernels()
+{
+  if( m_KernelMaximumError != m_MaximumError
+      || m_KernelMaximumKernelWidth != m_MaximumKernelWidth )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      m_KernelStandardDeviations[j] = -1.0;
+      }
+    m_KernelMaximumError = m_MaximumError;
+    m_KernelMaximumKernelWidth = m_MaximumKernelWidth;
+    }
+
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    if( m_StandardDeviations[j] <= 0.0
+        || m_StandardDeviations[j] == m_KernelStandardDeviations[j] )
+      {
+      continue;
+      }
+
+    OperatorType oper;
+    oper.SetDirection( j );
+    oper.SetVariance( vnl_math_sqr( m_StandardDeviations[j] ) );
+    oper.SetMaximumError( m_MaximumError );
+    oper.SetMaximumKernelWidth( m_MaximumKernelWidth );
+    oper.CreateDirectional();
+
+    m_Kernels[j].resize( oper.Size() );
+    for( unsigned int i = 0; i < oper.Size(); ++i )
+      {
+      m_Kernels[j][i] = oper[i];
+      }
+    m_KernelStandardDeviations[j] = m_StandardDeviations[j];
+    }
+}
+
+/**
+ * GenerateData()
+ */
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::GenerateData()
+{
+  this->AllocateOutputs();
+
+  FieldType * field = this->GetOutput();
+
+  this->UpdateKernels();
+
+  // Restrict the writes to the smoothing region if one is given
+  RegionType region = field->GetBufferedRegion();
+  RegionType writeRegion = region;
+  if( m_SmoothingRegion.GetNumberOfPixels() > 0 )
+    {
+    writeRegion = m_SmoothingRegion;
+    if( !writeRegion.Crop( field->GetBufferedRegion() ) )
+      {
+      return;
+      }
+    }
+
+  // The region is smoothed in a scratch field together with a halo of the
+  // kernel radius, so that its voxels see their real neighbors outside of it
+  FieldType * smoothedField = field;
+  if( writeRegion != field->GetBufferedRegion() )
+    {
+    SizeType radius;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      radius[j] = ( m_StandardDeviations[j] > 0.0 ) ? m_Kernels[j].size() / 2 : 0;
+      }
+    region = writeRegion;
+    region.PadByRadius( radius );
+    region.Crop( field->GetBufferedRegion() );
+
+    if( m_ScratchField.IsNull() )
+      {
+      m_ScratchField = FieldType::New();
+      }
+    if( m_ScratchField->GetBufferedRegion() != region )
+      {
+      m_ScratchField->SetRegions( region );
+      m_ScratchField->Allocate();
+      }
+
+    ImageRegionConstIterator<FieldType> fieldIt( field, region );
+    ImageRegionIterator<FieldType>      scratchIt( m_ScratchField, region );
+    for( ; !fieldIt.IsAtEnd(); ++fieldIt, ++scratchIt )
+      {
+      scratchIt.Set( fieldIt.Get() );
+      }
+    smoothedField = m_ScratchField;
+    }
+
+  m_Buffer = reinterpret_cast<ScalarType *>( smoothedField->GetBufferPointer() )
+    + smoothedField->ComputeOffset( region.GetIndex() ) * VectorDimension;
+  m_Size = region.GetSize();
+  const OffsetValueType * offsetTable = smoothedField->GetOffsetTable();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    m_Strides[j] = offsetTable[j] * VectorDimension;
+    }
+
+  const unsigned int numberOfThreads =
+    vnl_math_max( 1u, static_cast<unsigned int>( this->GetNumberOfThreads() ) );
+  if( m_InputLineBuffers.size() < numberOfThreads )
+    {
+    m_InputLineBuffers.resize( numberOfThreads );
+    m_OutputLineBuffers.resize( numberOfThreads );
+    }
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( m_StandardDeviations[d] <= 0.0 || m_Size[d] < 2 )
+      {
+      continue;
+      }
+
+    m_Direction = d;
+
+    // The lines of a block are neighbors along the first dimension, or
+    // along the second one when smoothing along the first dimension
+    const unsigned int blockDimension = ( d == 0 ) ? 1 : 0;
+    if( blockDimension < ImageDimension )
+      {
+      m_LinesPerBlock = vnl_math_min( m_NumberOfLinesPerBlock,
+                                      static_cast<unsigned int>( m_Size[blockDimension] ) );
+      m_NumberOfBlocksAlongLines =
+        ( m_Size[blockDimension] + m_LinesPerBlock - 1 ) / m_LinesPerBlock;
+      }
+    else
+      {
+      m_LinesPerBlock = 1;
+      m_NumberOfBlocksAlongLines = 1;
+      }
+
+    m_NumberOfBlocks = m_NumberOfBlocksAlongLines;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( j != d && j != blockDimension )
+        {
+        m_NumberOfBlocks *= m_Size[j];
+        }
+      }
+
+    // grow the line buffers if needed
+    const unsigned long radius = m_Kernels[d].size() / 2;
+    const unsigned long inputLength =
+      ( m_Size[d] + 2 * radius ) * m_LinesPerBlock * VectorDimension;
+    const unsigned long outputLength = m_Size[d] * m_LinesPerBlock * VectorDimension;
+    for( unsigned int i = 0; i < numberOfThreads; ++i )
+      {
+      if( m_InputLineBuffers[i].size() < inputLength )
+        {
+        m_InputLineBuffers[i].resize( inputLength );
+        }
+      if( m_OutputLineBuffers[i].size() < outputLength )
+        {
+        m_OutputLineBuffers[i].resize( outputLength );
+        }
+      }
+
+    this->GetMultiThreader()->SetNumberOfThreads(
+      static_cast<int>( vnl_math_min( static_cast<unsigned long>( numberOfThreads ), m_NumberOfBlocks ) ) );
+    this->GetMultiThreader()->SetSingleMethod( this->SmoothLinesThreaderCallback, this );
+    this->GetMultiThreader()->SingleMethodExecute();
+    }
+
+  m_Buffer = 0;
+
+  // Only the smoothing region is written back
+  if( smoothedField != field )
+    {
+    ImageRegionConstIterator<FieldType> scratchIt( m_ScratchField, writeRegion );
+    ImageRegionIterator<FieldType>      fieldIt( field, writeRegion );
+    for( ; !scratchIt.IsAtEnd(); ++scratchIt, ++fieldIt )
+      {
+      fieldIt.Set( scratchIt.Get() );
+      }
+    }
+}
+
+template <class TField>
+ITK_THREAD_RETURN_TYPE
+SeparableVectorFieldSmoothingFilter<TField>
+::SmoothLinesThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  const ThreadIdType threadId = info->ThreadID;
+  const ThreadIdType threadCount = info->NumberOfThreads;
+  Self *             filter = static_cast<Self *>( info->UserData );
+
+  const unsigned long numberOfBlocks = filter->m_NumberOfBlocks;
+  const unsigned long firstBlock = ( numberOfBlocks * threadId ) / threadCount;
+  const unsigned long endBlock = ( numberOfBlocks * ( threadId + 1 ) ) / threadCount;
+
+  filter->ThreadedSmoothLines( firstBlock, endBlock, threadId );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TField>
+void
+SeparableVectorFieldSmoothingFilter<TField>
+::ThreadedSmoothLines(unsigned long firstBlock, unsigned long endBlock,
+                      ThreadIdType threadId)
+{
+  const unsigned int d = m_Direction;
+  const unsigned int blockDimension = ( d == 0 ) ? 1 : 0;
+  const bool         hasBlockDimension = ( blockDimension < ImageDimension );
+
+  const unsigned long   length = m_Size[d];
+  const OffsetValueType lineStride = m_Strides[d];
+  const OffsetValueType blockStride = hasBlockDimension ? m_Strides[blockDimension] : 0;
+  const unsigned long   blockSize = hasBlockDimension ? m_Size[blockDimension] : 1;
+
+  const ScalarType * const kernel = &( m_Kernels[d][0] );
+  const unsigned long      kernelSize = m_Kernels[d].size();
+  const unsigned long      radius = kernelSize / 2;
+
+  ScalarType * const inputLines = &( m_InputLineBuffers[threadId][0] );
+  ScalarType * const outputLines = &( m_OutputLineBuffers[threadId][0] );
+
+  for( unsigned long block = firstBlock; block < endBlock; ++block )
+    {
+    // Locate the first pixel of the block
+    unsigned long       remainder = block / m_NumberOfBlocksAlongLines;
+    const unsigned long firstLine = ( block % m_NumberOfBlocksAlongLines ) * m_LinesPerBlock;
+    OffsetValueType     offset = static_cast<OffsetValueType>( firstLine ) * blockStride;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( j != d && j != blockDimension )
+        {
+        offset += static_cast<OffsetValueType>( remainder % m_Size[j] ) * m_Strides[j];
+        remainder /= m_Size[j];
+        }
+      }
+
+    const unsigned long numberOfLines =
+      vnl_math_min( static_cast<unsigned long>( m_LinesPerBlock ), blockSize - firstLine );
+    const unsigned long rowLength = numberOfLines * VectorDimension;
+
+    // Gather the lines, the components of the pixels of a row are interleaved
+    for( unsigned long k = 0; k < length; ++k )
+      {
+      const ScalarType * src = m_Buffer + offset + k * lineStride;
+      ScalarType *       dst = inputLines + ( k + radius ) * rowLength;
+      for( unsigned long l = 0; l < numberOfLines; ++l, src += blockStride )
+        {
+        for( unsigned int c = 0; c < VectorDimension; ++c )
+          {
+          *dst++ = src[c];
+          }
+        }
+      }
+
+    // Replicate the border values
+    const ScalarType * const firstRow = inputLines + radius * rowLength;
+    const ScalarType * const lastRow = inputLines + ( radius + length - 1 ) * rowLength;
+    for( unsigned long k = 0; k < radius; ++k )
+      {
+      ScalarType * before = inputLines + k * rowLength;
+      ScalarType * after = inputLines + ( radius + length + k ) * rowLength;
+      for( unsigned long i = 0; i < rowLength; ++i )
+        {
+        before[i] = firstRow[i];
+        after[i] = lastRow[i];
+        }
+      }
+
+    // Convolve, the inner loops run over contiguous components
+    for( unsigned long k = 0; k < length; ++k )
+      {
+      ScalarType *             out = outputLines + k * rowLength;
+      const ScalarType * const in = inputLines + k * rowLength;
+      const ScalarType         w0 = kernel[0];
+      for( unsigned long i = 0; i < rowLength; ++i )
+        {
+        out[i] = w0 * in[i];
+        }
+      for( unsigned long t = 1; t < kernelSize; ++t )
+        {
+        const ScalarType         w = kernel[t];
+        const ScalarType * const shifted = in + t * rowLength;
+        for( unsigned long i = 0; i < rowLength; ++i )
+          {
+          out[i] += w * shifted[i];
+          }
+        }
+      }
+
+    // Scatter the smoothed lines back into the field
+    for( unsigned long k = 0; k < length; ++k )
+      {
+      const ScalarType * src = outputLines + k * rowLength;
+      ScalarType *       dst = m_Buffer + offset + k * lineStride;
+      for( unsigned long l = 0; l < numberOfLines; ++l, dst += blockStride )
+        {
+        for( unsigned int c = 0; c < VectorDimension; ++c )
+          {
+          dst[c] = *src++;
+          }
+        }
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef __itkSymmetricESMDemonsRegistrationFunction_h
+#define __itkSymmetricESMDemonsRegistrationFunction_h
+
+#include "itkPDEDeformableRegistrationFunction.h"
+#include "itkESMDemonsRegistrationFunction.h"
+#include "itkCentralDifferenceImageFunction.h"
+#include "itkWarpImageFilter.h"
+#include "itkSimpleFastMutexLock.h"
+
+namespace itk
+{
+
+/**
+ * \class SymmetricESMDemonsRegistrationFunction
+ *
+ * \brief Computes the forward and backward ESM demons forces in a
+ * single traversal.
+ *
+ * The symmetric log-domain demons need, at each voxel, the ESM force
+ * driving the moving image M o exp(v) towards the fixed image F and the
+ * ESM force driving the fixed image F o exp(-v) towards the moving image
+ * M. Using two ESMDemonsRegistrationFunction objects means two calls per
+ * voxel, each one redoing the index bookkeeping, the boundary checks and
+ * the gradient orientation. This class evaluates both forces in one call
+ * to ComputeSymmetricUpdate(). The four images F, M, M o exp(v) and
+ * F o exp(-v) share the same buffered region so that the neighbor
+ * offsets are computed once and the intensities are fetched directly
+ * from the buffers.
+ *
+ * The forces are exactly the ones computed by ESMDemonsRegistrationFunction
+ * with the same settings: the forward function uses F as fixed image and
+ * exp(v) as deformation, the backward one uses M as fixed image and
+ * exp(-v) as deformation.
+ *
+ * ComputeUpdate() returns 0.5*(forward - backward), which is the update
+ * used with a 2-term BCH approximation.
+ *
+ * \warning The fixed and moving images must have the same geometry.
+ *
+ * \sa ESMDemonsRegistrationFunction
+ * \sa SymmetricLogDomainDemonsRegistrationFilter
+ * \ingroup FiniteDifferenceFunctions
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+class ITK_EXPORT SymmetricESMDemonsRegistrationFunction :
+  public PDEDeformableRegistrationFunction<TFixedImage,
+                                           TMovingImage, TDeformationField>
+{
+public:
+  /** Standard class typedefs. */
+  typedef SymmetricESMDemonsRegistrationFunction Self;
+  typedef PDEDeformableRegistrationFunction<TFixedImage,
+                                            TMovingImage, TDeformationField> Superclass;
+  typedef SmartPointer<Self>       Pointer;
+  typedef SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( SymmetricESMDemonsRegistrationFunction,
+                PDEDeformableRegistrationFunction );
+
+  /** MovingImage image type. */
+  typedef typename Superclass::MovingImageType    MovingImageType;
+  typedef typename Superclass::MovingImagePointer MovingImagePointer;
+  typedef typename MovingImageType::PixelType     MovingPixelType;
+
+  /** FixedImage image type. */
+  typedef typename Superclass::FixedImageType    FixedImageType;
+  typedef typename Superclass::FixedImagePointer FixedImagePointer;
+  typedef typename FixedImageType::PixelType     FixedPixelType;
+  typedef typename FixedImageType::IndexType     IndexType;
+  typedef typename FixedImageType::SizeType      SizeType;
+  typedef typename FixedImageType::SpacingType   SpacingType;
+  typedef typename FixedImageType::DirectionType DirectionType;
+  typedef typename FixedImageType::PointType     PointType;
+  typedef typename FixedImageType::OffsetValueType OffsetValueType;
+
+  /** Deformation field type. */
+  typedef TDeformationField                     DeformationFieldType;
+  typedef typename DeformationFieldType::Pointer DeformationFieldTypePointer;
+
+  /** Inherit some enums from the superclass. */
+  itkStaticConstMacro(ImageDimension, unsigned int, Superclass::ImageDimension);
+
+  /** Inherit some enums from the superclass. */
+  typedef typename Superclass::PixelType        PixelType;
+  typedef typename Superclass::RadiusType       RadiusType;
+  typedef typename Superclass::NeighborhoodType NeighborhoodType;
+  typedef typename Superclass::FloatOffsetType  FloatOffsetType;
+  typedef typename Superclass::TimeStepType     TimeStepType;
+
+  /** Covariant vector type. */
+  typedef CovariantVector<double, itkGetStaticConstMacro(ImageDimension)> CovariantVectorType;
+
+  /** Gradient types, shared with ESMDemonsRegistrationFunction. */
+  typedef ESMDemonsRegistrationFunction<FixedImageType, MovingImageType,
+                                        DeformationFieldType> ESMFunctionType;
+  typedef typename ESMFunctionType::GradientType              GradientType;
+
+  /** Warper types. */
+  typedef WarpImageFilter<MovingImageType, MovingImageType,
+                          DeformationFieldType>              MovingImageWarperType;
+  typedef typename MovingImageWarperType::Pointer            MovingImageWarperPointer;
+  typedef WarpImageFilter<FixedImageType, FixedImageType,
+                          DeformationFieldType>              FixedImageWarperType;
+  typedef typename FixedImageWarperType::Pointer             FixedImageWarperPointer;
+
+  /** Gradient calculators used with the MappedMoving gradient type. */
+  typedef CentralDifferenceImageFunction<MovingImageType, double> MovingImageGradientCalculatorType;
+  typedef typename MovingImageGradientCalculatorType::Pointer     MovingImageGradientCalculatorPointer;
+  typedef CentralDifferenceImageFunction<FixedImageType, double>  FixedImageGradientCalculatorType;
+  typedef typename FixedImageGradientCalculatorType::Pointer      FixedImageGradientCalculatorPointer;
+
+  /** Set/Get the deformation field exp(-v) used by the backward force. */
+  void SetInverseDeformationField( DeformationFieldType * ptr )
+  {
+    m_InverseDeformationField = ptr;
+  }
+
+  DeformationFieldType * GetInverseDeformationField() const
+  {
+    return m_InverseDeformationField;
+  }
+
+  /** This class uses a constant timestep of 1. */
+  virtual TimeStepType ComputeGlobalTimeStep(void * itkNotUsed(GlobalData) ) const
+  {
+    return m_TimeStep;
+  }
+
+  /** Return a pointer to a global data structure that is passed to
+   * this object from the solver at each calculation.  */
+  virtual void * GetGlobalDataPointer() const
+  {
+    GlobalDataStruct *global = new GlobalDataStruct();
+
+    for( unsigned int k = 0; k < 2; ++k )
+      {
+      global->m_SumOfSquaredDifference[k] = 0.0;
+      global->m_NumberOfPixelsProcessed[k] = 0L;
+      global->m_SumOfSquaredChange[k] = 0;
+      }
+    return global;
+  }
+
+  /** Update the metric and release the per-thread-global data. */
+  virtual void ReleaseGlobalDataPointer( void *GlobalData ) const;
+
+  /** Set the object's state before each iteration. */
+  virtual void InitializeIteration();
+
+  /** Returns 0.5*(forward - backward) at the center of the neighborhood. */
+  virtual PixelType  ComputeUpdate(const NeighborhoodType & neighborhood,
+                                   void *globalData,
+                                   const FloatOffsetType & offset = FloatOffsetType(0.0) );
+
+  /** Computes the forward and the backward updates at the center of the
+   * neighborhood in one call. */
+  void ComputeSymmetricUpdate(const NeighborhoodType & neighborhood,
+                              void *globalData,
+                              PixelType & forwardUpdate,
+                              PixelType & backwardUpdate);
+
+  /** Mean squared intensity difference of the forward and of the
+   * backward problems, computed over the overlapping regions. */
+  virtual double GetForwardMetric() const
+  {
+    return m_Metric[0];
+  }
+
+  virtual double GetBackwardMetric() const
+  {
+    return m_Metric[1];
+  }
+
+  /** Average of the forward and backward metrics. */
+  virtual double GetMetric() const
+  {
+    return 0.5 * ( m_Metric[0] + m_Metric[1] );
+  }
+
+  /** Average of the forward and backward RMS changes. */
+  virtual double GetRMSChange() const
+  {
+    return 0.5 * ( m_RMSChange[0] + m_RMSChange[1] );
+  }
+
+  /** Set/Get the threshold below which the absolute difference of
+   * intensity yields a match. When the intensities match between a
+   * moving and fixed image pixel, the update vector (for that
+   * iteration) will be the zero vector. Default is 0.001. */
+  virtual void SetIntensityDifferenceThreshold(double);
+
+  virtual double GetIntensityDifferenceThreshold() const;
+
+  /** Set/Get the maximum update step length. In Thirion this is 0.5.
+   *  Setting it to 0 implies no restriction (beware of numerical
+   *  instability in this case. */
+  virtual void SetMaximumUpdateStepLength(double sm)
+  {
+    this->m_MaximumUpdateStepLength = sm;
+  }
+
+  virtual double GetMaximumUpdateStepLength() const
+  {
+    return this->m_MaximumUpdateStepLength;
+  }
+
+  /** Set/Get the type of used image forces */
+  virtual void SetUseGradientType( GradientType gtype )
+  {
+    m_UseGradientType = gtype;
+  }
+
+  virtual GradientType GetUseGradientType() const
+  {
+    return m_UseGradientType;
+  }
+
+protected:
+  SymmetricESMDemonsRegistrationFunction();
+  ~SymmetricESMDemonsRegistrationFunction()
+  {
+  }
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** FixedImage image neighborhood iterator type. */
+  typedef ConstNeighborhoodIterator<FixedImageType> FixedImageNeighborhoodIteratorType;
+
+  /** A global data type for this class of equation. Index 0 holds the
+   * forward values and index 1 the backward ones. */
+  struct GlobalDataStruct
+    {
+    double m_SumOfSquaredDifference[2];
+    unsigned long m_NumberOfPixelsProcessed[2];
+    double m_SumOfSquaredChange[2];
+    };
+
+  /** Position of an index along one dimension. */
+  typedef enum
+    {
+    OutsidePosition = 0,
+    FirstPosition,
+    LastPosition,
+    InteriorPosition
+    } PositionType;
+
+  /** Computes the ESM force of one direction. fixedBuffer and warpedBuffer
+   * point to the current voxel of the image playing the fixed role and of
+   * the warped image playing the moving role. mappedGradient is only used
+   * with the MappedMoving gradient type. */
+  template <class TFixedBufferPixel, class TWarpedBufferPixel>
+  void ComputeDirectionalUpdate(const TFixedBufferPixel * fixedBuffer,
+                                const TWarpedBufferPixel * warpedBuffer,
+                                const PositionType * positions,
+                                const CovariantVectorType & mappedGradient,
+                                GlobalDataStruct * globalData,
+                                unsigned int direction,
+                                PixelType & update) const;
+
+private:
+  SymmetricESMDemonsRegistrationFunction(const Self &); // purposely not implemented
+  void operator=(const Self &);                         // purposely not implemented
+
+  /** Cache fixed image information. */
+  PointType     m_FixedImageOrigin;
+  SpacingType   m_FixedImageSpacing;
+  DirectionType m_FixedImageDirection;
+  double        m_Normalizer;
+
+  /** Buffer strides shared by the four images. */
+  OffsetValueType m_Strides[ImageDimension];
+  IndexType       m_FirstIndex;
+  IndexType       m_LastIndex;
+
+  /** Warped images M o exp(v) and F o exp(-v). */
+  DeformationFieldTypePointer m_InverseDeformationField;
+  MovingImageWarperPointer    m_MovingImageWarper;
+  FixedImageWarperPointer     m_FixedImageWarper;
+
+  MovingImageGradientCalculatorPointer m_MappedMovingImageGradientCalculator;
+  FixedImageGradientCalculatorPointer  m_MappedFixedImageGradientCalculator;
+
+  GradientType m_UseGradientType;
+
+  /** The global timestep. */
+  TimeStepType m_TimeStep;
+
+  /** Threshold below which the denominator term is considered zero. */
+  double m_DenominatorThreshold;
+
+  /** Threshold below which two intensity value are assumed to match. */
+  double m_IntensityDifferenceThreshold;
+
+  /** Maximum update step length in pixels (default is 0.5 as in Thirion). */
+  double m_MaximumUpdateStepLength;
+
+  /** The metric value is the mean square difference in intensity between
+   * the fixed image and transforming moving image computed over the
+   * the overlapping region between the two images. */
+  mutable double        m_Metric[2];
+  mutable double        m_SumOfSquaredDifference[2];
+  mutable unsigned long m_NumberOfPixelsProcessed[2];
+  mutable double        m_RMSChange[2];
+  mutable double        m_SumOfSquaredChange[2];
+
+  /** Mutex lock to protect modification to metric. */
+  mutable SimpleFastMutexLock m_MetricCalculationLock;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkSymmetricESMDemonsRegistrationFunction.hxx"
+#endif
+
+#endif
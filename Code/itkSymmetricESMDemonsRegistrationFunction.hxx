@@ -0,0 +1,577 @@
+#ifndef __itkSymmetricESMDemonsRegistrationFunction_txx
+#define __itkSymmetricESMDemonsRegistrationFunction_txx
+
+#include "itkSymmetricESMDemonsRegistrationFunction.h"
+#include "itkExceptionObject.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::SymmetricESMDemonsRegistrationFunction()
+{
+  RadiusType   r;
+  unsigned int j;
+
+  for( j = 0; j < ImageDimension; j++ )
+    {
+    r[j] = 0;
+    m_Strides[j] = 0;
+    }
+  this->SetRadius(r);
+
+  m_TimeStep = 1.0;
+  m_DenominatorThreshold = 1e-9;
+  m_IntensityDifferenceThreshold = 0.001;
+  m_MaximumUpdateStepLength = 0.5;
+  m_Normalizer = 0.0;
+
+  this->SetMovingImage(NULL);
+  this->SetFixedImage(NULL);
+  m_FixedImageOrigin.Fill( 0.0 );
+  m_FixedImageSpacing.Fill( 1.0 );
+  m_FixedImageDirection.SetIdentity();
+  m_FirstIndex.Fill( 0 );
+  m_LastIndex.Fill( 0 );
+
+  m_UseGradientType = ESMFunctionType::Symmetric;
+
+  m_InverseDeformationField = 0;
+
+  // The padding value flags the voxels mapped outside of the images
+  m_MovingImageWarper = MovingImageWarperType::New();
+  m_MovingImageWarper->SetInterpolator(
+    LinearInterpolateImageFunction<MovingImageType, double>::New() );
+  m_MovingImageWarper->SetEdgePaddingValue( NumericTraits<MovingPixelType>::max() );
+
+  m_FixedImageWarper = FixedImageWarperType::New();
+  m_FixedImageWarper->SetInterpolator(
+    LinearInterpolateImageFunction<FixedImageType, double>::New() );
+  m_FixedImageWarper->SetEdgePaddingValue( NumericTraits<FixedPixelType>::max() );
+
+  m_MappedMovingImageGradientCalculator = MovingImageGradientCalculatorType::New();
+  m_MappedFixedImageGradientCalculator = FixedImageGradientCalculatorType::New();
+#if (ITK_VERSION_MAJOR < 4)
+#ifdef ITK_USE_ORIENTED_IMAGE_DIRECTION
+  m_MappedMovingImageGradientCalculator->UseImageDirectionOff();
+  m_MappedFixedImageGradientCalculator->UseImageDirectionOff();
+#endif
+#else
+  m_MappedMovingImageGradientCalculator->UseImageDirectionOff();
+  m_MappedFixedImageGradientCalculator->UseImageDirectionOff();
+#endif
+
+  for( unsigned int k = 0; k < 2; ++k )
+    {
+    m_Metric[k] = NumericTraits<double>::max();
+    m_SumOfSquaredDifference[k] = 0.0;
+    m_NumberOfPixelsProcessed[k] = 0L;
+    m_RMSChange[k] = NumericTraits<double>::max();
+    m_SumOfSquaredChange[k] = 0.0;
+    }
+}
+
+/**
+ * Standard "PrintSelf" method.
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "UseGradientType: ";
+  os << m_UseGradientType << std::endl;
+  os << indent << "MaximumUpdateStepLength: ";
+  os << m_MaximumUpdateStepLength << std::endl;
+  os << indent << "IntensityDifferenceThreshold: ";
+  os << m_IntensityDifferenceThreshold << std::endl;
+  os << indent << "DenominatorThreshold: ";
+  os << m_DenominatorThreshold << std::endl;
+  os << indent << "Normalizer: ";
+  os << m_Normalizer << std::endl;
+  os << indent << "MovingImageWarper: ";
+  os << m_MovingImageWarper.GetPointer() << std::endl;
+  os << indent << "FixedImageWarper: ";
+  os << m_FixedImageWarper.GetPointer() << std::endl;
+  os << indent << "ForwardMetric: ";
+  os << m_Metric[0] << std::endl;
+  os << indent << "BackwardMetric: ";
+  os << m_Metric[1] << std::endl;
+  os << indent << "ForwardRMSChange: ";
+  os << m_RMSChange[0] << std::endl;
+  os << indent << "BackwardRMSChange: ";
+  os << m_RMSChange[1] << std::endl;
+}
+
+/**
+ * Set the threshold below which the absolute difference of
+ * intensity yields a match. When the intensities match between a
+ * moving and fixed image pixel, the update vector (for that
+ * iteration) will be the zero vector.
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::SetIntensityDifferenceThreshold(double threshold)
+{
+  m_IntensityDifferenceThreshold = threshold;
+}
+
+/**
+ * Get the threshold below which the absolute difference of
+ * intensity yields a match.
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+double
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::GetIntensityDifferenceThreshold() const
+{
+  return m_IntensityDifferenceThreshold;
+}
+
+/**
+ * Set the function state values before each iteration
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::InitializeIteration()
+{
+  const FixedImageType *  fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+#if (ITK_VERSION_MAJOR < 4)
+  DeformationFieldType * deformationField = this->GetDeformationField();
+#else
+  DeformationFieldType * deformationField = this->GetDisplacementField();
+#endif
+
+  if( !movingImage || !fixedImage || !deformationField || !m_InverseDeformationField )
+    {
+    itkExceptionMacro( << "MovingImage, FixedImage, DeformationField and/or InverseDeformationField not set" );
+    }
+
+  // cache fixed image information
+  m_FixedImageOrigin  = fixedImage->GetOrigin();
+  m_FixedImageSpacing = fixedImage->GetSpacing();
+  m_FixedImageDirection = fixedImage->GetDirection();
+
+  // compute the normalizer
+  if( m_MaximumUpdateStepLength > 0.0 )
+    {
+    m_Normalizer = 0.0;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      m_Normalizer += m_FixedImageSpacing[k] * m_FixedImageSpacing[k];
+      }
+    m_Normalizer *= m_MaximumUpdateStepLength * m_MaximumUpdateStepLength
+      / static_cast<double>( ImageDimension );
+    }
+  else
+    {
+    // set it to minus one to denote a special case
+    // ( unrestricted update length )
+    m_Normalizer = -1.0;
+    }
+
+  // Warp the moving image with exp(v)
+  m_MovingImageWarper->SetOutputOrigin( m_FixedImageOrigin );
+  m_MovingImageWarper->SetOutputSpacing( m_FixedImageSpacing );
+  m_MovingImageWarper->SetOutputDirection( m_FixedImageDirection );
+  m_MovingImageWarper->SetInput( movingImage );
+#if (ITK_VERSION_MAJOR < 4)
+  m_MovingImageWarper->SetDeformationField( deformationField );
+#else
+  m_MovingImageWarper->SetDisplacementField( deformationField );
+#endif
+  m_MovingImageWarper->GetOutput()->SetRequestedRegion( deformationField->GetRequestedRegion() );
+  m_MovingImageWarper->Update();
+
+  // Warp the fixed image with exp(-v)
+  m_FixedImageWarper->SetOutputOrigin( m_FixedImageOrigin );
+  m_FixedImageWarper->SetOutputSpacing( m_FixedImageSpacing );
+  m_FixedImageWarper->SetOutputDirection( m_FixedImageDirection );
+  m_FixedImageWarper->SetInput( fixedImage );
+#if (ITK_VERSION_MAJOR < 4)
+  m_FixedImageWarper->SetDeformationField( m_InverseDeformationField );
+#else
+  m_FixedImageWarper->SetDisplacementField( m_InverseDeformationField );
+#endif
+  m_FixedImageWarper->GetOutput()->SetRequestedRegion( m_InverseDeformationField->GetRequestedRegion() );
+  m_FixedImageWarper->Update();
+
+  // The four images are accessed with the same buffer offsets
+  const typename FixedImageType::RegionType & region = fixedImage->GetLargestPossibleRegion();
+  if( fixedImage->GetBufferedRegion() != region
+      || movingImage->GetBufferedRegion() != region
+      || m_MovingImageWarper->GetOutput()->GetBufferedRegion() != region
+      || m_FixedImageWarper->GetOutput()->GetBufferedRegion() != region )
+    {
+    itkExceptionMacro( << "The fixed, moving and warped images must share the same buffered region" );
+    }
+
+  const OffsetValueType *offsetTable = fixedImage->GetOffsetTable();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    m_Strides[j] = offsetTable[j];
+    m_FirstIndex[j] = region.GetIndex()[j];
+    m_LastIndex[j] = region.GetIndex()[j] + static_cast<OffsetValueType>( region.GetSize()[j] );
+    }
+
+  // setup moving image gradient calculators
+  m_MappedMovingImageGradientCalculator->SetInputImage( movingImage );
+  m_MappedFixedImageGradientCalculator->SetInputImage( fixedImage );
+
+  // initialize metric computation variables
+  for( unsigned int k = 0; k < 2; ++k )
+    {
+    m_SumOfSquaredDifference[k] = 0.0;
+    m_NumberOfPixelsProcessed[k] = 0L;
+    m_SumOfSquaredChange[k] = 0.0;
+    }
+}
+
+/**
+ * Compute the ESM force of one direction
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+template <class TFixedBufferPixel, class TWarpedBufferPixel>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::ComputeDirectionalUpdate(const TFixedBufferPixel * fixedBuffer,
+                           const TWarpedBufferPixel * warpedBuffer,
+                           const PositionType * positions,
+                           const CovariantVectorType & mappedGradient,
+                           GlobalDataStruct * globalData,
+                           unsigned int direction,
+                           PixelType & update) const
+{
+  const TWarpedBufferPixel outsideValue = NumericTraits<TWarpedBufferPixel>::max();
+
+  // Note: no need to check if the index is within
+  // fixed image buffer. This is done by the external filter.
+  const double fixedValue = static_cast<double>( *fixedBuffer );
+
+  // check if the point was mapped outside of the image playing the
+  // moving role using the "special value" NumericTraits<PixelType>::max()
+  if( *warpedBuffer == outsideValue )
+    {
+    update.Fill( 0.0 );
+    return;
+    }
+
+  const double warpedValue = static_cast<double>( *warpedBuffer );
+
+  // We compute the gradient more or less by hand.
+  // We first start by ignoring the image orientation and introduce it
+  // afterwards
+  CovariantVectorType usedOrientFreeGradientTimes2;
+
+  if( ( m_UseGradientType == ESMFunctionType::Symmetric )
+      || ( m_UseGradientType == ESMFunctionType::WarpedMoving ) )
+    {
+    // we don't use a CentralDifferenceImageFunction here to be able to
+    // check for NumericTraits<PixelType>::max()
+    CovariantVectorType warpedGradient;
+    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+      {
+      const OffsetValueType stride = m_Strides[dim];
+      switch( positions[dim] )
+        {
+        case OutsidePosition:
+          {
+          warpedGradient[dim] = 0.0;
+          break;
+          }
+        case FirstPosition:
+          {
+          const TWarpedBufferPixel next = warpedBuffer[stride];
+          if( next == outsideValue )
+            {
+            // weird crunched border case
+            warpedGradient[dim] = 0.0;
+            }
+          else
+            {
+            // forward difference
+            warpedGradient[dim] = ( static_cast<double>( next ) - warpedValue ) / m_FixedImageSpacing[dim];
+            }
+          break;
+          }
+        case LastPosition:
+          {
+          const TWarpedBufferPixel prev = warpedBuffer[-stride];
+          if( prev == outsideValue )
+            {
+            // weird crunched border case
+            warpedGradient[dim] = 0.0;
+            }
+          else
+            {
+            // backward difference
+            warpedGradient[dim] = ( warpedValue - static_cast<double>( prev ) ) / m_FixedImageSpacing[dim];
+            }
+          break;
+          }
+        case InteriorPosition:
+          {
+          const TWarpedBufferPixel next = warpedBuffer[stride];
+          const TWarpedBufferPixel prev = warpedBuffer[-stride];
+          if( next == outsideValue )
+            {
+            if( prev == outsideValue )
+              {
+              // weird crunched border case
+              warpedGradient[dim] = 0.0;
+              }
+            else
+              {
+              // backward difference
+              warpedGradient[dim] = ( warpedValue - static_cast<double>( prev ) ) / m_FixedImageSpacing[dim];
+              }
+            }
+          else if( prev == outsideValue )
+            {
+            // forward difference
+            warpedGradient[dim] = ( static_cast<double>( next ) - warpedValue ) / m_FixedImageSpacing[dim];
+            }
+          else
+            {
+            // normal case, central difference
+            warpedGradient[dim] = ( static_cast<double>( next ) - static_cast<double>( prev ) )
+              * 0.5 / m_FixedImageSpacing[dim];
+            }
+          break;
+          }
+        }
+      }
+
+    if( m_UseGradientType == ESMFunctionType::Symmetric )
+      {
+      // Central difference of the image playing the fixed role, zero on
+      // the border of the buffer as done by CentralDifferenceImageFunction
+      for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+        {
+        double fixedGradient = 0.0;
+        if( positions[dim] == InteriorPosition )
+          {
+          const OffsetValueType stride = m_Strides[dim];
+          fixedGradient = ( static_cast<double>( fixedBuffer[stride] ) - static_cast<double>( fixedBuffer[-stride] ) )
+            * 0.5 / m_FixedImageSpacing[dim];
+          }
+        usedOrientFreeGradientTimes2[dim] = fixedGradient + warpedGradient[dim];
+        }
+      }
+    else
+      {
+      usedOrientFreeGradientTimes2 = warpedGradient * 2.0;
+      }
+    }
+  else if( m_UseGradientType == ESMFunctionType::Fixed )
+    {
+    for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+      {
+      double fixedGradient = 0.0;
+      if( positions[dim] == InteriorPosition )
+        {
+        const OffsetValueType stride = m_Strides[dim];
+        fixedGradient = ( static_cast<double>( fixedBuffer[stride] ) - static_cast<double>( fixedBuffer[-stride] ) )
+          * 0.5 / m_FixedImageSpacing[dim];
+        }
+      usedOrientFreeGradientTimes2[dim] = 2.0 * fixedGradient;
+      }
+    }
+  else // MappedMoving
+    {
+    usedOrientFreeGradientTimes2 = mappedGradient * 2.0;
+    }
+
+  // Introduce the image orientation
+  CovariantVectorType usedGradientTimes2;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    double sum = 0.0;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      sum += m_FixedImageDirection[i][j] * usedOrientFreeGradientTimes2[j];
+      }
+    usedGradientTimes2[i] = sum;
+    }
+
+  /**
+   * Compute Update.
+   * We avoid the mismatch in units between the two terms.
+   * and avoid large step using a normalization term.
+   */
+  const double usedGradientTimes2SquaredMagnitude = usedGradientTimes2.GetSquaredNorm();
+
+  const double speedValue = fixedValue - warpedValue;
+  if( vnl_math_abs(speedValue) < m_IntensityDifferenceThreshold )
+    {
+    update.Fill( 0.0 );
+    }
+  else
+    {
+    double denom;
+    if( m_Normalizer > 0.0 )
+      {
+      denom = usedGradientTimes2SquaredMagnitude + ( vnl_math_sqr(speedValue) / m_Normalizer );
+      }
+    else
+      {
+      denom = usedGradientTimes2SquaredMagnitude;
+      }
+
+    if( denom < m_DenominatorThreshold )
+      {
+      update.Fill( 0.0 );
+      }
+    else
+      {
+      const double factor = 2.0 * speedValue / denom;
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        update[j] = factor * usedGradientTimes2[j];
+        }
+      }
+    }
+
+  // WARNING!! We compute the global data without taking into account the current update step.
+  // There are several reasons for that: If an exponential, a smoothing or any other operation
+  // is applied on the update field, we cannot compute the newMappedCenterPoint here; and even
+  // if we could, this would be an often unnecessary time-consuming task.
+  if( globalData )
+    {
+    globalData->m_SumOfSquaredDifference[direction] += vnl_math_sqr( speedValue );
+    globalData->m_NumberOfPixelsProcessed[direction] += 1;
+    globalData->m_SumOfSquaredChange[direction] += update.GetSquaredNorm();
+    }
+}
+
+/**
+ * Compute the forward and backward updates in one call
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::ComputeSymmetricUpdate(const NeighborhoodType & it, void * gd,
+                         PixelType & forwardUpdate, PixelType & backwardUpdate)
+{
+  GlobalDataStruct *globalData = (GlobalDataStruct *)gd;
+  const IndexType   index = it.GetIndex();
+
+  // The buffer offset and the position with respect to the border are
+  // shared by the forward and the backward forces
+  OffsetValueType offset = 0;
+  PositionType    positions[ImageDimension];
+  for( unsigned int dim = 0; dim < ImageDimension; dim++ )
+    {
+    offset += ( index[dim] - m_FirstIndex[dim] ) * m_Strides[dim];
+
+    if( m_LastIndex[dim] - m_FirstIndex[dim] < 2
+        || index[dim] < m_FirstIndex[dim]
+        || index[dim] >= m_LastIndex[dim] )
+      {
+      positions[dim] = OutsidePosition;
+      }
+    else if( index[dim] == m_FirstIndex[dim] )
+      {
+      positions[dim] = FirstPosition;
+      }
+    else if( index[dim] == m_LastIndex[dim] - 1 )
+      {
+      positions[dim] = LastPosition;
+      }
+    else
+      {
+      positions[dim] = InteriorPosition;
+      }
+    }
+
+  const FixedPixelType *  fixedBuffer = this->GetFixedImage()->GetBufferPointer() + offset;
+  const MovingPixelType * movingBuffer = this->GetMovingImage()->GetBufferPointer() + offset;
+  const MovingPixelType * warpedMovingBuffer = m_MovingImageWarper->GetOutput()->GetBufferPointer() + offset;
+  const FixedPixelType *  warpedFixedBuffer = m_FixedImageWarper->GetOutput()->GetBufferPointer() + offset;
+
+  CovariantVectorType mappedMovingGradient;
+  CovariantVectorType mappedFixedGradient;
+  if( m_UseGradientType == ESMFunctionType::MappedMoving )
+    {
+    // As in ESMDemonsRegistrationFunction, the mapped point is obtained
+    // from the center pixel of the neighborhood
+    PointType mappedPoint;
+    this->GetFixedImage()->TransformIndexToPhysicalPoint( index, mappedPoint );
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      mappedPoint[j] += it.GetCenterPixel()[j];
+      }
+    mappedMovingGradient = m_MappedMovingImageGradientCalculator->Evaluate( mappedPoint );
+    mappedFixedGradient = m_MappedFixedImageGradientCalculator->Evaluate( mappedPoint );
+    }
+
+  // Forward force: F is fixed, M o exp(v) is moving
+  this->ComputeDirectionalUpdate( fixedBuffer, warpedMovingBuffer, positions,
+                                  mappedMovingGradient, globalData, 0, forwardUpdate );
+
+  // Backward force: M is fixed, F o exp(-v) is moving
+  this->ComputeDirectionalUpdate( movingBuffer, warpedFixedBuffer, positions,
+                                  mappedFixedGradient, globalData, 1, backwardUpdate );
+}
+
+/**
+ * Compute the averaged update
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+typename SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::PixelType
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::ComputeUpdate(const NeighborhoodType & it, void * gd,
+                const FloatOffsetType & itkNotUsed(offset) )
+{
+  PixelType forwardUpdate;
+  PixelType backwardUpdate;
+
+  this->ComputeSymmetricUpdate( it, gd, forwardUpdate, backwardUpdate );
+
+  return ( forwardUpdate - backwardUpdate ) * 0.5;
+}
+
+/**
+ * Update the metric and release the per-thread-global data.
+ */
+template <class TFixedImage, class TMovingImage, class TDeformationField>
+void
+SymmetricESMDemonsRegistrationFunction<TFixedImage, TMovingImage, TDeformationField>
+::ReleaseGlobalDataPointer( void *gd ) const
+{
+  GlobalDataStruct * globalData = (GlobalDataStruct *) gd;
+
+  m_MetricCalculationLock.Lock();
+  for( unsigned int k = 0; k < 2; ++k )
+    {
+    m_SumOfSquaredDifference[k] += globalData->m_SumOfSquaredDifference[k];
+    m_NumberOfPixelsProcessed[k] += globalData->m_NumberOfPixelsProcessed[k];
+    m_SumOfSquaredChange[k] += globalData->m_SumOfSquaredChange[k];
+    if( m_NumberOfPixelsProcessed[k] )
+      {
+      m_Metric[k] = m_SumOfSquaredDifference[k]
+        / static_cast<double>( m_NumberOfPixelsProcessed[k] );
+      m_RMSChange[k] = vcl_sqrt( m_SumOfSquaredChange[k]
+                                 / static_cast<double>( m_NumberOfPixelsProcessed[k] ) );
+      }
+    }
+  m_MetricCalculationLock.Unlock();
+
+  delete globalData;
+}
+
+} // end namespace itk
+
+#endif
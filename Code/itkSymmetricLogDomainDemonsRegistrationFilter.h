@@ -3,6 +3,7 @@
 
 #include "itkLogDomainDeformableRegistrationFilter.h"
 #include "itkESMDemonsRegistrationFunction.h"
+#include "itkSymmetricESMDemonsRegistrationFunction.h"
 
 #include "itkMultiplyImageFilter.h"
 
@@ -98,6 +99,12 @@ public:
   typedef typename DemonsRegistrationFunctionType::Pointer      DemonsRegistrationFunctionPointer;
   typedef typename DemonsRegistrationFunctionType::GradientType GradientType;
 
+  /** Function computing the forward and backward forces in one call. */
+  typedef SymmetricESMDemonsRegistrationFunction<FixedImageType,
+                                                 MovingImageType,
+                                                 DeformationFieldType>         SymmetricRegistrationFunctionType;
+  typedef typename SymmetricRegistrationFunctionType::Pointer SymmetricRegistrationFunctionPointer;
+
   /** Get the metric value. The metric value is the mean square difference
    * in intensity between the fixed image and transforming moving image
    * computed over the the overlapping region between the two images.
@@ -125,6 +132,14 @@ public:
   /** Set/Get the number of terms used in the Baker-Campbell-Hausdorff approximation. */
   itkSetMacro( NumberOfBCHApproximationTerms, unsigned int );
   itkGetConstMacro( NumberOfBCHApproximationTerms, unsigned int );
+
+  /** Set/Get whether the forward and backward forces are computed in a
+   * single traversal by a SymmetricESMDemonsRegistrationFunction instead
+   * of two ESMDemonsRegistrationFunction. The forces are the same, but the
+   * index bookkeeping and the image fetches are shared. Default is off. */
+  itkSetMacro( UseSymmetricForceFunction, bool );
+  itkGetConstMacro( UseSymmetricForceFunction, bool );
+  itkBooleanMacro( UseSymmetricForceFunction );
 protected:
   SymmetricLogDomainDemonsRegistrationFilter();
   ~SymmetricLogDomainDemonsRegistrationFilter()
@@ -157,11 +172,19 @@ protected:
   virtual void SmoothBackwardUpdateField();
 
   typedef typename VelocityFieldType::RegionType ThreadRegionType;
+  typedef typename Superclass::ActiveRunListType ActiveRunListType;
 
   /** Does the actual work of calculating change over a region supplied by
    * the multithreading mechanism. */
   virtual TimeStepType ThreadedCalculateChange(const ThreadRegionType & regionToProcess, ThreadIdType threadId);
 
+  /** Same as ThreadedCalculateChange but using the symmetric force function. */
+  TimeStepType ThreadedCalculateSymmetricChange(const ThreadRegionType & regionToProcess);
+
+  /** Zero the update buffers over the given region, before the forces are
+   * only computed in the active set. */
+  void ClearUpdateBuffers(const ThreadRegionType & regionToProcess);
+
   /** Apply update. */
 #if (ITK_VERSION_MAJOR < 4)
   virtual void ApplyUpdate(TimeStepType dt);
@@ -205,6 +228,9 @@ private:
 
   typename FiniteDifferenceFunctionType::Pointer        m_BackwardDifferenceFunction;
 
+  SymmetricRegistrationFunctionPointer m_SymmetricDifferenceFunction;
+  bool                                 m_UseSymmetricForceFunction;
+
   MultiplyByConstantPointer m_Multiplier;
   AdderPointer              m_Adder;
   unsigned int              m_NumberOfBCHApproximationTerms;
@@ -22,6 +22,9 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   this->SetBackwardDifferenceFunction( static_cast<FiniteDifferenceFunctionType *>(
                                          drfpb.GetPointer() ) );
 
+  m_SymmetricDifferenceFunction = SymmetricRegistrationFunctionType::New();
+  m_UseSymmetricForceFunction = false;
+
   m_Multiplier = MultiplyByConstantType::New();
   m_Multiplier->InPlaceOn();
 
@@ -32,6 +35,9 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   m_NumberOfBCHApproximationTerms = 2;
 
   m_BackwardUpdateBuffer = 0;
+
+  // exp(v) and exp(-v) are both needed at each iteration
+  this->UseForwardInverseExponentiatorOn();
 }
 
 // Checks whether the DifferenceFunction is of type DemonsRegistrationFunction.
@@ -113,25 +119,58 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::InitializeIteration()
 {
   // update variables in the equation object
+  // Note: when UseForwardInverseExponentiator is on (default), the inverse
+  // field is computed along with the forward one by GetDeformationField()
   DemonsRegistrationFunctionType *f = this->GetForwardRegistrationFunctionType();
 
+  DeformationFieldPointer field = this->GetDeformationField();
 #if (ITK_VERSION_MAJOR < 4)
-  f->SetDeformationField( this->GetDeformationField() );
+  f->SetDeformationField( field );
 #else
-  f->SetDisplacementField( this->GetDeformationField() );
+  f->SetDisplacementField( field );
 #endif
 
-  DemonsRegistrationFunctionType *b = this->GetBackwardRegistrationFunctionType();
-  b->SetFixedImage( this->GetMovingImage() );
-  b->SetMovingImage( this->GetFixedImage() );
+  if( m_UseSymmetricForceFunction )
+    {
+    if( !this->GetMovingImage() || !this->GetFixedImage() )
+      {
+      itkExceptionMacro( << "Fixed and/or moving image not set" );
+      }
+
+    // Both forces are computed by the symmetric function, the backward
+    // function is thus not initialized
+    m_SymmetricDifferenceFunction->SetFixedImage( this->GetFixedImage() );
+    m_SymmetricDifferenceFunction->SetMovingImage( this->GetMovingImage() );
+#if (ITK_VERSION_MAJOR < 4)
+    m_SymmetricDifferenceFunction->SetDeformationField( field );
+#else
+    m_SymmetricDifferenceFunction->SetDisplacementField( field );
+#endif
+    m_SymmetricDifferenceFunction->SetInverseDeformationField( this->GetInverseDisplacementField() );
+    m_SymmetricDifferenceFunction->InitializeIteration();
+
+    // The superclass implementation would initialize f, which warps the
+    // moving image a second time although f computes no force in this
+    // mode: only the narrow band is updated here. The RMS change is taken
+    // from the symmetric function in ApplyUpdate().
+    this->UpdateNarrowBand( field );
+    return;
+    }
+  else
+    {
+    DemonsRegistrationFunctionType *b = this->GetBackwardRegistrationFunctionType();
+    b->SetFixedImage( this->GetMovingImage() );
+    b->SetMovingImage( this->GetFixedImage() );
 #if (ITK_VERSION_MAJOR < 4)
-  b->SetDeformationField( this->GetInverseDisplacementField() );
+    b->SetDeformationField( this->GetInverseDisplacementField() );
 #else
-  b->SetDisplacementField( this->GetInverseDisplacementField() );
+    b->SetDisplacementField( this->GetInverseDisplacementField() );
 #endif
-  b->InitializeIteration();
+    b->InitializeIteration();
+    }
 
-  // call the superclass  implementation ( initializes f )
+  // call the superclass  implementation ( initializes f and updates the
+  // narrow band with its deformation field )
   Superclass::InitializeIteration();
 }
 
@@ -152,6 +191,11 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
     itkExceptionMacro( << "A fixed and a moving image are required" );
     }
 
+  if( this->GetVelocityFieldShrinkFactor() > 1 )
+    {
+    itkExceptionMacro( << "A reduced resolution velocity field is not supported by the symmetric update." );
+    }
+
   if( fixim->GetLargestPossibleRegion() != movim->GetLargestPossibleRegion() )
     {
     itkExceptionMacro( << "Registering images that have diffent sizes is not supported yet." );
@@ -174,6 +218,11 @@ double
 SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::GetMetric() const
 {
+  if( m_UseSymmetricForceFunction )
+    {
+    return m_SymmetricDifferenceFunction->GetMetric();
+    }
+
   const DemonsRegistrationFunctionType *drfpf = this->GetForwardRegistrationFunctionType();
   const DemonsRegistrationFunctionType *drfpb = this->GetBackwardRegistrationFunctionType();
 
@@ -207,6 +256,7 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   drfpf->SetIntensityDifferenceThreshold(threshold);
   drfpb->SetIntensityDifferenceThreshold(threshold);
+  m_SymmetricDifferenceFunction->SetIntensityDifferenceThreshold(threshold);
 }
 
 // Set Maximum Update Step Length
@@ -220,6 +270,7 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   drfpf->SetMaximumUpdateStepLength(step);
   drfpb->SetMaximumUpdateStepLength(step);
+  m_SymmetricDifferenceFunction->SetMaximumUpdateStepLength(step);
 }
 
 // Get Maximum Update Step Length
@@ -265,6 +316,7 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   drfpf->SetUseGradientType(gtype);
   drfpb->SetUseGradientType(gtype);
+  m_SymmetricDifferenceFunction->SetUseGradientType(gtype);
 }
 
 // Allocate storage in m_UpdateBuffer
@@ -303,6 +355,10 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   m_BackwardUpdateBuffer->SetLargestPossibleRegion(output->GetLargestPossibleRegion() );
   m_BackwardUpdateBuffer->SetRequestedRegion(output->GetRequestedRegion() );
   m_BackwardUpdateBuffer->SetBufferedRegion(output->GetBufferedRegion() );
+  if( this->ReserveBuffer( m_BackwardUpdateBuffer ) )
+    {
+    this->CountBufferAllocation();
+    }
   m_BackwardUpdateBuffer->Allocate();
     {
     typedef typename VelocityFieldType::PixelType        VectorType;
@@ -318,8 +374,34 @@ void
 SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::SmoothBackwardUpdateField()
 {
+  double standardDeviations[VelocityFieldType::ImageDimension];
+  this->GetStandardDeviationsInFixedImageVoxels( this->GetUpdateFieldStandardDeviations(), standardDeviations );
+
   // The update buffer will be overwritten with new data.
-  this->SmoothGivenField(this->GetBackwardUpdateBuffer(), this->GetUpdateFieldStandardDeviations() );
+  this->SmoothGivenField(this->GetBackwardUpdateBuffer(), standardDeviations );
+}
+
+// Zero the update buffers outside of the active set
+template <class TFixedImage, class TMovingImage, class TField>
+void
+SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ClearUpdateBuffers(const ThreadRegionType & regionToProcess)
+{
+  typename VelocityFieldType::PixelType zero;
+  zero.Fill( 0 );
+
+  for( ImageRegionIterator<VelocityFieldType> it( this->GetUpdateBuffer(), regionToProcess ); !it.IsAtEnd(); ++it )
+    {
+    it.Set( zero );
+    }
+  if( m_NumberOfBCHApproximationTerms > 2 )
+    {
+    for( ImageRegionIterator<VelocityFieldType> it( this->GetBackwardUpdateBuffer(), regionToProcess );
+         !it.IsAtEnd(); ++it )
+      {
+      it.Set( zero );
+      }
+    }
 }
 
 template <class TFixedImage, class TMovingImage, class TField>
@@ -328,6 +410,11 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::T
 SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::ThreadedCalculateChange(const ThreadRegionType & regionToProcess, ThreadIdType)
 {
+  if( m_UseSymmetricForceFunction )
+    {
+    return this->ThreadedCalculateSymmetricChange( regionToProcess );
+    }
+
   typedef typename VelocityFieldType::RegionType     RegionType;
   typedef typename VelocityFieldType::SizeType       SizeType;
   typedef typename VelocityFieldType::SizeValueType  SizeValueType;
@@ -354,16 +441,24 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 
   // Break the input into a series of regions.  The first region is free
   // of boundary conditions, the rest with boundary conditions.  We operate
-  // on the output region because input has been copied to output.
+  // on the output region because input has been copied to output. With a
+  // mask, the regions are the runs of the active set, the neighborhood
+  // iterators checking the boundary conditions by themselves.
   typedef NeighborhoodAlgorithm::ImageBoundaryFacesCalculator<VelocityFieldType>
   FaceCalculatorType;
 
   typedef typename FaceCalculatorType::FaceListType FaceListType;
 
-  FaceCalculatorType faceCalculator;
-
-  FaceListType faceList = faceCalculator(output, regionToProcess, radius);
-  typename FaceListType::iterator fIt = faceList.begin();
+  FaceListType faceList;
+  if( this->GetActiveRuns( regionToProcess, faceList ) )
+    {
+    this->ClearUpdateBuffers( regionToProcess );
+    }
+  else
+    {
+    FaceCalculatorType faceCalculator;
+    faceList = faceCalculator(output, regionToProcess, radius);
+    }
 
   // Ask the function object for a pointer to a data structure it
   // will use to manage any global values it needs.  We'll pass this
@@ -373,62 +468,30 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   void *globalDataf = dff->GetGlobalDataPointer();
   void *globalDatab = dfb->GetGlobalDataPointer();
 
-  // Process the non-boundary region.
-  NeighborhoodIteratorType nD(radius, output, *fIt);
-  if( m_NumberOfBCHApproximationTerms == 2 )
+  for( typename FaceListType::iterator fIt = faceList.begin(); fIt != faceList.end(); ++fIt )
     {
-    UpdateIteratorType nU(this->GetUpdateBuffer(),  *fIt);
-    while( !nD.IsAtEnd() )
-      {
-      nU.Value() = (dff->ComputeUpdate(nD, globalDataf) - dfb->ComputeUpdate(nD, globalDatab) ) * 0.5;
-      ++nD;
-      ++nU;
-      }
-
-    // Process each of the boundary faces.
-    NeighborhoodIteratorType bD;
-    UpdateIteratorType       bU;
-    for( ++fIt; fIt != faceList.end(); ++fIt )
+    NeighborhoodIteratorType nD(radius, output, *fIt);
+    if( m_NumberOfBCHApproximationTerms == 2 )
       {
-      bD = NeighborhoodIteratorType(radius, output, *fIt);
-      bU = UpdateIteratorType(this->GetUpdateBuffer(), *fIt);
-      while( !bD.IsAtEnd() )
+      UpdateIteratorType nU(this->GetUpdateBuffer(),  *fIt);
+      while( !nD.IsAtEnd() )
         {
-        bU.Value() = (dff->ComputeUpdate(bD, globalDataf) - dfb->ComputeUpdate(bD, globalDatab) ) * 0.5;
-        ++bD;
-        ++bU;
+        nU.Value() = (dff->ComputeUpdate(nD, globalDataf) - dfb->ComputeUpdate(nD, globalDatab) ) * 0.5;
+        ++nD;
+        ++nU;
         }
       }
-    }
-  else
-    {
-    UpdateIteratorType nUF(this->GetUpdateBuffer(),  *fIt);
-    UpdateIteratorType nUB(this->GetBackwardUpdateBuffer(),  *fIt);
-    while( !nD.IsAtEnd() )
-      {
-      nUF.Value() = dff->ComputeUpdate(nD, globalDataf);
-      nUB.Value() = dfb->ComputeUpdate(nD, globalDatab);
-      ++nD;
-      ++nUF;
-      ++nUB;
-      }
-
-    // Process each of the boundary faces.
-    NeighborhoodIteratorType bD;
-    UpdateIteratorType       bUF;
-    UpdateIteratorType       bUB;
-    for( ++fIt; fIt != faceList.end(); ++fIt )
+    else
       {
-      bD = NeighborhoodIteratorType(radius, output, *fIt);
-      bUF = UpdateIteratorType(this->GetUpdateBuffer(), *fIt);
-      bUB = UpdateIteratorType(this->GetBackwardUpdateBuffer(), *fIt);
-      while( !bD.IsAtEnd() )
+      UpdateIteratorType nUF(this->GetUpdateBuffer(),  *fIt);
+      UpdateIteratorType nUB(this->GetBackwardUpdateBuffer(),  *fIt);
+      while( !nD.IsAtEnd() )
         {
-        bUF.Value() = dff->ComputeUpdate(bD, globalDataf);
-        bUB.Value() = dfb->ComputeUpdate(bD, globalDatab);
-        ++bD;
-        ++bUF;
-        ++bUB;
+        nUF.Value() = dff->ComputeUpdate(nD, globalDataf);
+        nUB.Value() = dfb->ComputeUpdate(nD, globalDatab);
+        ++nD;
+        ++nUF;
+        ++nUB;
         }
       }
     }
@@ -444,6 +507,75 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   return timeStep;
 }
 
+template <class TFixedImage, class TMovingImage, class TField>
+typename
+SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>::TimeStepType
+SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
+::ThreadedCalculateSymmetricChange(const ThreadRegionType & regionToProcess)
+{
+  typedef typename VelocityFieldType::SizeType   SizeType;
+  typedef typename VelocityFieldType::PixelType  VelocityPixelType;
+  typedef typename
+  FiniteDifferenceFunctionType::NeighborhoodType NeighborhoodIteratorType;
+  typedef ImageRegionIterator<VelocityFieldType> UpdateIteratorType;
+
+  VelocityFieldPointer output = this->GetVelocityField();
+
+  SymmetricRegistrationFunctionType *dfs = m_SymmetricDifferenceFunction;
+
+  const SizeType radius = dfs->GetRadius();
+
+  // The function only uses the index of the neighborhood center, there
+  // is thus no need to split the region into faces. With a mask, only
+  // the runs of the active set are processed.
+  ActiveRunListType regions;
+  if( this->GetActiveRuns( regionToProcess, regions ) )
+    {
+    this->ClearUpdateBuffers( regionToProcess );
+    }
+  else
+    {
+    regions.push_back( regionToProcess );
+    }
+
+  void *globalData = dfs->GetGlobalDataPointer();
+
+  VelocityPixelType forwardUpdate;
+  VelocityPixelType backwardUpdate;
+  for( typename ActiveRunListType::const_iterator rIt = regions.begin(); rIt != regions.end(); ++rIt )
+    {
+    NeighborhoodIteratorType nD(radius, output, *rIt);
+    if( m_NumberOfBCHApproximationTerms == 2 )
+      {
+      UpdateIteratorType nU(this->GetUpdateBuffer(), *rIt);
+      while( !nD.IsAtEnd() )
+        {
+        dfs->ComputeSymmetricUpdate(nD, globalData, forwardUpdate, backwardUpdate);
+        nU.Value() = (forwardUpdate - backwardUpdate) * 0.5;
+        ++nD;
+        ++nU;
+        }
+      }
+    else
+      {
+      UpdateIteratorType nUF(this->GetUpdateBuffer(), *rIt);
+      UpdateIteratorType nUB(this->GetBackwardUpdateBuffer(), *rIt);
+      while( !nD.IsAtEnd() )
+        {
+        dfs->ComputeSymmetricUpdate(nD, globalData, nUF.Value(), nUB.Value() );
+        ++nD;
+        ++nUF;
+        ++nUB;
+        }
+      }
+    }
+
+  TimeStepType timeStep = dfs->ComputeGlobalTimeStep(globalData);
+  dfs->ReleaseGlobalDataPointer(globalData);
+
+  return timeStep;
+}
+
 // Get the metric value from the difference function
 template <class TFixedImage, class TMovingImage, class TField>
 void
@@ -454,10 +586,17 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
 ::ApplyUpdate(const TimeStepType& dt)
 #endif
 {
-  const DemonsRegistrationFunctionType *drfpf = this->GetForwardRegistrationFunctionType();
-  const DemonsRegistrationFunctionType *drfpb = this->GetBackwardRegistrationFunctionType();
+  if( m_UseSymmetricForceFunction )
+    {
+    this->SetRMSChange( m_SymmetricDifferenceFunction->GetRMSChange() );
+    }
+  else
+    {
+    const DemonsRegistrationFunctionType *drfpf = this->GetForwardRegistrationFunctionType();
+    const DemonsRegistrationFunctionType *drfpb = this->GetBackwardRegistrationFunctionType();
 
-  this->SetRMSChange( 0.5 * (drfpf->GetRMSChange() + drfpb->GetRMSChange() ) );
+    this->SetRMSChange( 0.5 * (drfpf->GetRMSChange() + drfpb->GetRMSChange() ) );
+    }
 
   if( this->m_NumberOfBCHApproximationTerms < 3 )
     {
@@ -600,6 +739,7 @@ SymmetricLogDomainDemonsRegistrationFilter<TFixedImage, TMovingImage, TField>
   os << indent << "Multiplier: " << m_Multiplier << std::endl;
   os << indent << "Adder: " << m_Adder << std::endl;
   os << indent << "NumberOfBCHApproximationTerms: " << m_NumberOfBCHApproximationTerms << std::endl;
+  os << indent << "UseSymmetricForceFunction: " << m_UseSymmetricForceFunction << std::endl;
 }
 
 } // end namespace itk
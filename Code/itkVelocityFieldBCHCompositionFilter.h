@@ -4,10 +4,14 @@
 #include <itkImageToImageFilter.h>
 #include <itkNaryAddImageFilter.h>
 #include <itkVelocityFieldLieBracketFilter.h>
-#include <itkMultiplyImageFilter.h>
 
 namespace itk
 {
+#if ITK_VERSION_MAJOR < 4 && ! defined (ITKv3_THREAD_ID_TYPE_DEFINED)
+#define ITKv3_THREAD_ID_TYPE_DEFINED 1
+    typedef int ThreadIdType;
+#endif
+
 /** \class VelocityFieldBCHCompositionFilter
  * \brief Compute Baker-Campbell-Hausdorff formula on two vector fields.
  *
@@ -27,7 +31,21 @@ namespace itk
  * that the vector elements behave like floating point scalars.
  *
  * The number of approximation terms to used in the BCH approximation is set via
- * SetNumberOfApproximationTerms method.
+ * SetNumberOfApproximationTerms method. With the Lie bracket
+ * [v,u] = Jac(v).u - Jac(u).v of VelocityFieldLieBracketFilter, the
+ * approximations are
+ *  - 2 terms: v + u
+ *  - 3 terms: v + u + 1/2 [v,u]
+ *  - 4 terms: v + u + 1/2 [v,u] + 1/12 [v,[v,u]] + 1/12 [u,[u,v]]
+ *
+ * The 3 terms approximation is computed in a single traversal of the
+ * fields. The 4 terms one first computes b = [v,u] and then evaluates
+ * v + u + 1/2 b + 1/12 [v-u,b] in a second traversal, so that b is the
+ * only intermediate field. The Jacobians are computed with the same
+ * central differences as in VelocityFieldLieBracketFilter.
+ *
+ * Since the Lie brackets read the neighbors of the inputs, the filter only
+ * runs in place with 2 approximation terms.
  *
  * \warning This filter assumes that the input field type and velocity field type
  * both have the same number of dimensions.
@@ -55,6 +73,7 @@ public:
   typedef typename OutputFieldType::PixelType    OutputFieldPixelType;
   typedef typename OutputFieldType::Pointer      OutputFieldPointer;
   typedef typename OutputFieldType::ConstPointer OutputFieldConstPointer;
+  typedef typename OutputFieldType::RegionType   OutputFieldRegionType;
 
   /** Method for creation through the object factory. */
   itkNewMacro(Self);
@@ -65,6 +84,12 @@ public:
   /** Set/Get the NumberOfApproximationTerms used in the BCH approximation. */
   itkSetMacro( NumberOfApproximationTerms, unsigned int );
   itkGetConstMacro( NumberOfApproximationTerms, unsigned int );
+
+  /** ImageDimension constants */
+  itkStaticConstMacro( InputFieldDimension, unsigned int,
+                       TInputImage::ImageDimension);
+  itkStaticConstMacro( OutputFieldDimension, unsigned int,
+                       TOutputImage::ImageDimension);
 protected:
   VelocityFieldBCHCompositionFilter();
   ~VelocityFieldBCHCompositionFilter()
@@ -77,6 +102,20 @@ protected:
    */
   void GenerateData();
 
+  /** The Lie brackets need a larger input requested region than the
+   * output requested region: by one pixel with 3 approximation terms and
+   * by two pixels with 4 approximation terms. */
+  virtual void GenerateInputRequestedRegion()
+  throw (InvalidRequestedRegionError);
+
+  /** Evaluate the 3 or 4 terms approximation on the given region of the
+   * output. */
+  void ThreadedGenerateData(const OutputFieldRegionType& outputRegionForThread, ThreadIdType threadId );
+
+  /** The inputs are only released as in-place inputs with 2 approximation
+   * terms, since the output never shares their buffer otherwise. */
+  virtual void ReleaseInputs();
+
   /** Adder type. */
   typedef NaryAddImageFilter<InputFieldType, InputFieldType> AdderType;
   typedef typename AdderType::Pointer                        AdderPointer;
@@ -85,28 +124,41 @@ protected:
   typedef VelocityFieldLieBracketFilter<InputFieldType, InputFieldType> LieBracketFilterType;
   typedef typename LieBracketFilterType::Pointer                        LieBracketFilterPointer;
 
-  /** Multiplier type. */
-  typedef MultiplyImageFilter<InputFieldType,
-          itk::Image<double,InputFieldType::ImageDimension>, InputFieldType> MultiplierType;
-  typedef typename MultiplierType::Pointer                                   MultiplierPointer;
+  typedef typename InputFieldType::IndexType       InputFieldIndexType;
+  typedef typename InputFieldType::OffsetValueType OffsetValueType;
+  typedef typename InputFieldType::IndexValueType  IndexValueType;
 
   /** Set/Get the adder. */
   itkSetObjectMacro( Adder, AdderType );
   itkGetObjectMacro( Adder, AdderType );
 
-  /** Set/Get the multipliers. */
-  itkSetObjectMacro( MultiplierByHalf, MultiplierType );
-  itkGetObjectMacro( MultiplierByHalf, MultiplierType );
-  itkSetObjectMacro( MultiplierByTwelfth, MultiplierType );
-  itkGetObjectMacro( MultiplierByTwelfth, MultiplierType );
-  itkSetObjectMacro( MultiplierByNegTwelfth, MultiplierType );
-  itkGetObjectMacro( MultiplierByNegTwelfth, MultiplierType );
-
-  /** Set/Get the Lie bracket filters. */
+  /** Set/Get the Lie bracket filter computing the first order bracket
+   * with 4 approximation terms. */
   itkSetObjectMacro( LieBracketFilterFirstOrder, LieBracketFilterType );
   itkGetObjectMacro( LieBracketFilterFirstOrder, LieBracketFilterType );
-  itkSetObjectMacro( LieBracketFilterSecondOrder, LieBracketFilterType );
-  itkGetObjectMacro( LieBracketFilterSecondOrder, LieBracketFilterType );
+
+  /** Description of the geometry of a field used by the fused evaluation. */
+  struct FieldGeometryType
+    {
+    const InputFieldPixelType *m_Buffer;
+    OffsetValueType m_Strides[InputFieldDimension];
+    IndexValueType  m_Start[InputFieldDimension];
+    IndexValueType  m_End[InputFieldDimension];
+    /** m_WeightedDirection[j][k] = direction[k][j] * 0.5 / spacing[j] */
+    double m_WeightedDirection[InputFieldDimension][InputFieldDimension];
+    };
+
+  /** Fill the geometry of a field. */
+  void InitializeFieldGeometry(const InputFieldType * field, FieldGeometryType & geometry) const;
+
+  /** Add scale * Jac(f)(index).vec to acc, f being the field described by
+   * geometry. The derivative along a dimension is zero on the border of
+   * the buffered region of f, as done by VectorCentralDifferenceImageFunction. */
+  inline void AddJacobianProduct(const FieldGeometryType & geometry,
+                                 const InputFieldIndexType & index,
+                                 const double vec[],
+                                 double scale,
+                                 double acc[]) const;
 
 #if ( ITK_VERSION_MAJOR < 3 ) || ( ITK_VERSION_MAJOR == 3 && ITK_VERSION_MINOR < 13 )
   virtual void SetInPlace(const bool b)
@@ -126,12 +178,17 @@ private:
 
   AdderPointer            m_Adder;
   LieBracketFilterPointer m_LieBracketFilterFirstOrder;
-  LieBracketFilterPointer m_LieBracketFilterSecondOrder;
-  MultiplierPointer       m_MultiplierByHalf;
-  MultiplierPointer       m_MultiplierByTwelfth;
-  MultiplierPointer       m_MultiplierByNegTwelfth;
   unsigned int            m_NumberOfApproximationTerms;
 
+  /** Same convention as the gradient calculators of the Lie bracket filter */
+  bool m_UseImageDirection;
+
+  /** Geometries of the inputs and of the first order Lie bracket, shared by
+   * the threads. */
+  FieldGeometryType m_LeftGeometry;
+  FieldGeometryType m_RightGeometry;
+  FieldGeometryType m_BracketGeometry;
+
 };
 
 } // end namespace itk
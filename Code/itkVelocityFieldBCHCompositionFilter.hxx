@@ -3,6 +3,8 @@
 #include "itkVelocityFieldBCHCompositionFilter.h"
 
 #include <itkProgressAccumulator.h>
+#include <itkProgressReporter.h>
+#include <itkImageRegionIteratorWithIndex.h>
 
 namespace itk
 {
@@ -26,19 +28,13 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
   // Declare sub filters
   m_Adder = AdderType::New();
   m_LieBracketFilterFirstOrder = LieBracketFilterType::New();
-  m_LieBracketFilterSecondOrder = LieBracketFilterType::New();
-  m_MultiplierByHalf = MultiplierType::New();
-  m_MultiplierByTwelfth = MultiplierType::New();
-  m_MultiplierByNegTwelfth = MultiplierType::New();
-
-  // Multipliers can always be inplace here
-  m_MultiplierByHalf->InPlaceOn();
-  m_MultiplierByTwelfth->InPlaceOn();
-  m_MultiplierByNegTwelfth->InPlaceOn();
-
-  m_MultiplierByHalf->SetConstant( 0.5 );
-  m_MultiplierByTwelfth->SetConstant( 1.0 / 12.0 );
-  m_MultiplierByNegTwelfth->SetConstant( -1.0 / 12.0 );
+
+  // The first order Lie bracket is the only intermediate field, keep its
+  // buffer across updates
+  m_LieBracketFilterFirstOrder->ReleaseDataBeforeUpdateFlagOff();
+
+  typedef typename LieBracketFilterType::InputFieldGradientCalculatorType GradientCalculatorType;
+  m_UseImageDirection = GradientCalculatorType::New()->GetUseImageDirection();
 }
 
 /**
@@ -53,13 +49,164 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
 
   os << indent << "Adder: " << m_Adder << std::endl;
   os << indent << "LieBracketFilterFirstOrder: " << m_LieBracketFilterFirstOrder << std::endl;
-  os << indent << "LieBracketFilterSecondOrder: " << m_LieBracketFilterSecondOrder << std::endl;
-  os << indent << "MultiplierByHalf: " << m_MultiplierByHalf << std::endl;
-  os << indent << "MultiplierByTwelfth: " << m_MultiplierByTwelfth << std::endl;
-  os << indent << "MultiplierByNegTwelfth: " << m_MultiplierByNegTwelfth << std::endl;
   os << indent << "NumberOfApproximationTerms: " << m_NumberOfApproximationTerms << std::endl;
 }
 
+/**
+ * GenerateInputRequestedRegion()
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::GenerateInputRequestedRegion()
+throw (InvalidRequestedRegionError)
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  // The kernel size of the central differences is one, the second order
+  // brackets need the neighbors of the first order one
+  unsigned long radius = 0;
+  if( m_NumberOfApproximationTerms == 3 )
+    {
+    radius = 1;
+    }
+  else if( m_NumberOfApproximationTerms == 4 )
+    {
+    radius = 2;
+    }
+
+  if( radius == 0 )
+    {
+    return;
+    }
+
+  for( unsigned int i = 0; i < 2; i++ )
+    {
+    InputFieldPointer inputPtr = const_cast<InputFieldType *>( this->GetInput(i) );
+    if( !inputPtr )
+      {
+      continue;
+      }
+
+    // get a copy of the input requested region (should equal the output
+    // requested region)
+    typename InputFieldType::RegionType inputRequestedRegion = inputPtr->GetRequestedRegion();
+
+    // pad the input requested region by the operator radius
+    inputRequestedRegion.PadByRadius( radius );
+
+    // crop the input requested region at the input's largest possible region
+    if( inputRequestedRegion.Crop(inputPtr->GetLargestPossibleRegion() ) )
+      {
+      inputPtr->SetRequestedRegion( inputRequestedRegion );
+      }
+    else
+      {
+      // Couldn't crop the region (requested region is outside the largest
+      // possible region).  Throw an exception.
+
+      // store what we tried to request (prior to trying to crop)
+      inputPtr->SetRequestedRegion( inputRequestedRegion );
+
+      // build an exception
+      InvalidRequestedRegionError e(__FILE__, __LINE__);
+      e.SetLocation(ITK_LOCATION);
+      e.SetDescription("Requested region is (at least partially) outside the largest possible region.");
+      e.SetDataObject(inputPtr);
+      throw e;
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::ReleaseInputs()
+{
+  if( m_NumberOfApproximationTerms == 2 )
+    {
+    Superclass::ReleaseInputs();
+    }
+  else
+    {
+    ProcessObject::ReleaseInputs();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::InitializeFieldGeometry(const InputFieldType * field, FieldGeometryType & geometry) const
+{
+  const typename InputFieldType::RegionType & region = field->GetBufferedRegion();
+  const OffsetValueType *                     offsetTable = field->GetOffsetTable();
+
+  geometry.m_Buffer = field->GetBufferPointer();
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    geometry.m_Strides[j] = offsetTable[j];
+    geometry.m_Start[j] = region.GetIndex()[j];
+    geometry.m_End[j] = region.GetIndex()[j] + static_cast<IndexValueType>( region.GetSize()[j] );
+
+    // Same convention as VectorCentralDifferenceImageFunction
+    const double weight = 0.5 / field->GetSpacing()[j];
+    for( unsigned int k = 0; k < InputFieldDimension; k++ )
+      {
+      double dir;
+      if( m_UseImageDirection )
+        {
+        dir = field->GetDirection()[k][j];
+        }
+      else
+        {
+        dir = ( j == k ) ? 1.0 : 0.0;
+        }
+      geometry.m_WeightedDirection[j][k] = dir * weight;
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+inline void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::AddJacobianProduct(const FieldGeometryType & geometry,
+                     const InputFieldIndexType & index,
+                     const double vec[],
+                     double scale,
+                     double acc[]) const
+{
+  const InputFieldPixelType * center = geometry.m_Buffer;
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    center += ( index[j] - geometry.m_Start[j] ) * geometry.m_Strides[j];
+    }
+
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    if( index[j] <= geometry.m_Start[j] || index[j] + 1 >= geometry.m_End[j] )
+      {
+      // Zero derivative on the border of the buffered region
+      continue;
+      }
+
+    double w = 0.0;
+    for( unsigned int k = 0; k < InputFieldDimension; k++ )
+      {
+      w += geometry.m_WeightedDirection[j][k] * vec[k];
+      }
+    w *= scale;
+
+    const OffsetValueType       stride = geometry.m_Strides[j];
+    const InputFieldPixelType & fwd = center[stride];
+    const InputFieldPixelType & bwd = center[-stride];
+    for( unsigned int d = 0; d < InputFieldDimension; d++ )
+      {
+      acc[d] += w * ( fwd[d] - bwd[d] );
+      }
+    }
+}
+
 /**
  * GenerateData()
  */
@@ -86,77 +233,15 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
       m_Adder->SetInput( 0, leftField );
       m_Adder->SetInput( 1, rightField );
       m_Adder->SetInPlace( this->GetInPlace() );
-      break;
+
+      m_Adder->GraftOutput( this->GetOutput() );
+      m_Adder->Update();
+      this->GraftOutput( m_Adder->GetOutput() );
+      return;
       }
     case 3:
-      {
-      // lf + rf + 0.5*liebracket(lf,rf)
-      progress->RegisterInternalFilter(m_LieBracketFilterFirstOrder, 0.5);
-      progress->RegisterInternalFilter(m_MultiplierByHalf, 0.2);
-      progress->RegisterInternalFilter(m_Adder, 0.3);
-
-      m_LieBracketFilterFirstOrder->SetInput( 0, leftField );
-      m_LieBracketFilterFirstOrder->SetInput( 1, rightField );
-
-      m_MultiplierByHalf->SetInput( m_LieBracketFilterFirstOrder->GetOutput() );
-      // constant set to 0.5 in constructor
-
-      m_Adder->SetInput( 0, m_MultiplierByHalf->GetOutput() );
-      m_Adder->SetInput( 1, leftField );
-      m_Adder->SetInput( 2, rightField );
-#if ( ITK_VERSION_MAJOR < 3 ) || ( ITK_VERSION_MAJOR == 3 && ITK_VERSION_MINOR < 13 )
-      // Work-around for http://www.itk.org/Bug/view.php?id=8672
-      m_Adder->InPlaceOff();
-#else
-      // Adder can be inplace since the 0th input is a temp field
-      m_Adder->InPlaceOn();
-#endif
-      break;
-      }
     case 4:
       {
-      // Note: Although this case is for 4 BCH terms, there really is 5 terms used
-      // to make it a symmetric approximation.
-      // lf + rf + 0.5*liebracket(lf,rf) + (1/12)*liebracket(lf,*liebracket(lf,rf)) 
-      // + (-1/12)*liebracket(rf,*liebracket(rf,lf))
-      progress->RegisterInternalFilter(m_LieBracketFilterFirstOrder, 0.3);
-      progress->RegisterInternalFilter(m_MultiplierByHalf, 0.1);
-      progress->RegisterInternalFilter(m_LieBracketFilterSecondOrder, 0.3);
-      progress->RegisterInternalFilter(m_MultiplierByTwelfth, 0.1);
-      progress->RegisterInternalFilter(m_MultiplierByNegTwelfth, 0.1);
-      progress->RegisterInternalFilter(m_Adder, 0.1);
-
-      m_LieBracketFilterFirstOrder->SetInput( 0, leftField );
-      m_LieBracketFilterFirstOrder->SetInput( 1, rightField );
-
-      m_LieBracketFilterSecondOrder->SetInput( 0, leftField );
-      m_LieBracketFilterSecondOrder->SetInput( 1, m_LieBracketFilterFirstOrder->GetOutput() );
-
-      m_MultiplierByHalf->SetInput( m_LieBracketFilterFirstOrder->GetOutput() );
-      // constant set to 0.5 in constructor
-
-      m_MultiplierByTwelfth->SetInput( m_LieBracketFilterSecondOrder->GetOutput() );
-      // constant set to 1/12 in constructor
-
-      m_LieBracketFilterSecondOrder->SetInput( 0, rightField );
-      m_LieBracketFilterSecondOrder->SetInput( 1, m_LieBracketFilterFirstOrder->GetOutput() );
-      
-      m_MultiplierByNegTwelfth->SetInput( m_LieBracketFilterSecondOrder->GetOutput() );
-      // constant set to -1/12 in constructor
-      //
-      m_Adder->SetInput( 0, m_MultiplierByHalf->GetOutput() );
-      m_Adder->SetInput( 1, leftField );
-      m_Adder->SetInput( 2, rightField );
-      m_Adder->SetInput( 3, m_MultiplierByTwelfth->GetOutput() );
-      m_Adder->SetInput( 4, m_MultiplierByNegTwelfth->GetOutput() );
-
-#if ( ITK_VERSION_MAJOR < 3 ) || ( ITK_VERSION_MAJOR == 3 && ITK_VERSION_MINOR < 13 )
-      // Work-around for http://www.itk.org/Bug/view.php?id=8672
-      m_Adder->InPlaceOff();
-#else
-      // Adder can be inplace since the 0th input is a temp field
-      m_Adder->InPlaceOn();
-#endif
       break;
       }
     default:
@@ -166,9 +251,132 @@ VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
       }
     }
 
-  m_Adder->GraftOutput( this->GetOutput() );
-  m_Adder->Update();
-  this->GraftOutput( m_Adder->GetOutput() );
+  // The Lie brackets read the neighbors of the inputs so the output cannot
+  // share their buffer, even if the filter was asked to run in place
+  OutputFieldType * outputPtr = this->GetOutput();
+  const void *      outputBuffer = outputPtr->GetBufferPointer();
+  if( outputBuffer != 0
+      && ( outputBuffer == static_cast<const void *>( leftField->GetBufferPointer() )
+           || outputBuffer == static_cast<const void *>( rightField->GetBufferPointer() ) ) )
+    {
+    outputPtr->SetPixelContainer( OutputFieldType::PixelContainer::New() );
+    }
+  outputPtr->SetBufferedRegion( outputPtr->GetRequestedRegion() );
+  outputPtr->Allocate();
+
+  this->InitializeFieldGeometry( leftField, m_LeftGeometry );
+  this->InitializeFieldGeometry( rightField, m_RightGeometry );
+
+  if( m_NumberOfApproximationTerms == 4 )
+    {
+    // First traversal: b = liebracket(lf,rf) on the output requested region
+    // padded by the radius of the central differences
+    progress->RegisterInternalFilter(m_LieBracketFilterFirstOrder, 0.5);
+
+    typename InputFieldType::RegionType bracketRegion = outputPtr->GetRequestedRegion();
+    bracketRegion.PadByRadius( 1 );
+    bracketRegion.Crop( leftField->GetLargestPossibleRegion() );
+
+    m_LieBracketFilterFirstOrder->SetInput( 0, leftField );
+    m_LieBracketFilterFirstOrder->SetInput( 1, rightField );
+    m_LieBracketFilterFirstOrder->SetNumberOfThreads( this->GetNumberOfThreads() );
+    m_LieBracketFilterFirstOrder->GetOutput()->SetRequestedRegion( bracketRegion );
+    m_LieBracketFilterFirstOrder->Update();
+
+    this->InitializeFieldGeometry( m_LieBracketFilterFirstOrder->GetOutput(), m_BracketGeometry );
+    }
+
+  // Last traversal, see ThreadedGenerateData
+  typename Superclass::ThreadStruct str;
+  str.Filter = this;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ThreaderCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+/**
+ * ThreadedGenerateData()
+ */
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldBCHCompositionFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputFieldRegionType& outputRegionForThread, ThreadIdType threadId )
+{
+  typedef typename OutputFieldPixelType::ValueType OutputValueType;
+
+  const bool  fourTerms = ( m_NumberOfApproximationTerms == 4 );
+  const float initialProgress = fourTerms ? 0.5f : 0.0f;
+
+  ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels(),
+                            100, initialProgress, 1.0f - initialProgress);
+
+  ImageRegionIteratorWithIndex<OutputFieldType> outputIt( this->GetOutput(), outputRegionForThread );
+
+  double acc[InputFieldDimension];
+  double left[InputFieldDimension];
+  double right[InputFieldDimension];
+  double bracket[InputFieldDimension];
+  double difference[InputFieldDimension];
+
+  for( outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt )
+    {
+    const InputFieldIndexType & index = outputIt.GetIndex();
+
+    OffsetValueType leftOffset = 0;
+    OffsetValueType rightOffset = 0;
+    for( unsigned int j = 0; j < InputFieldDimension; j++ )
+      {
+      leftOffset += ( index[j] - m_LeftGeometry.m_Start[j] ) * m_LeftGeometry.m_Strides[j];
+      rightOffset += ( index[j] - m_RightGeometry.m_Start[j] ) * m_RightGeometry.m_Strides[j];
+      }
+    const InputFieldPixelType & leftval = m_LeftGeometry.m_Buffer[leftOffset];
+    const InputFieldPixelType & rightval = m_RightGeometry.m_Buffer[rightOffset];
+
+    for( unsigned int d = 0; d < InputFieldDimension; d++ )
+      {
+      left[d] = leftval[d];
+      right[d] = rightval[d];
+      acc[d] = left[d] + right[d];
+      }
+
+    if( fourTerms )
+      {
+      OffsetValueType bracketOffset = 0;
+      for( unsigned int j = 0; j < InputFieldDimension; j++ )
+        {
+        bracketOffset += ( index[j] - m_BracketGeometry.m_Start[j] ) * m_BracketGeometry.m_Strides[j];
+        }
+      const InputFieldPixelType & bracketval = m_BracketGeometry.m_Buffer[bracketOffset];
+
+      for( unsigned int d = 0; d < InputFieldDimension; d++ )
+        {
+        bracket[d] = bracketval[d];
+        difference[d] = left[d] - right[d];
+        acc[d] += 0.5 * bracket[d];
+        }
+
+      // 1/12 [lf,b] + 1/12 [rf,[rf,lf]] = 1/12 [lf-rf,b]
+      //  = 1/12 ( Jac(lf).b - Jac(rf).b - Jac(b).(lf-rf) )
+      this->AddJacobianProduct( m_LeftGeometry, index, bracket, 1.0 / 12.0, acc );
+      this->AddJacobianProduct( m_RightGeometry, index, bracket, -1.0 / 12.0, acc );
+      this->AddJacobianProduct( m_BracketGeometry, index, difference, -1.0 / 12.0, acc );
+      }
+    else
+      {
+      // 1/2 [lf,rf] = 1/2 ( Jac(lf).rf - Jac(rf).lf )
+      this->AddJacobianProduct( m_LeftGeometry, index, right, 0.5, acc );
+      this->AddJacobianProduct( m_RightGeometry, index, left, -0.5, acc );
+      }
+
+    OutputFieldPixelType & out = outputIt.Value();
+    for( unsigned int d = 0; d < InputFieldDimension; d++ )
+      {
+      out[d] = static_cast<OutputValueType>( acc[d] );
+      }
+
+    progress.CompletedPixel();
+    }
 }
 
 } // end namespace itk
@@ -0,0 +1,178 @@
+#ifndef __itkVelocityFieldCheckpoint_h
+#define __itkVelocityFieldCheckpoint_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include "itkArray2D.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+/** \class VelocityFieldCheckpoint
+ * \brief State of a multi-resolution log-domain registration that can be
+ * written to and read from a binary file.
+ *
+ * The state is made of the velocity field at the current level, the level
+ * it belongs to, the number of iterations already run at each level and
+ * the values of the metric and of the RMS change over the last iterations,
+ * on which the convergence criterion is evaluated. The size and spacing
+ * of the fixed image and the schedule of its pyramid are stored as well, so
+ * that a registration is only resumed on the problem it was taken from.
+ *
+ * The file starts with a magic string, a byte order marker and the sizes
+ * of the types, followed by the scalar state, the fixed image geometry and
+ * schedule, the geometry of the field and its raw buffer. Files are read
+ * back on machines with the same byte order only. The element counts read
+ * from the file are checked against its length before any allocation. A file is first written under a temporary name and then
+ * renamed, so that an interrupted write never replaces a valid checkpoint.
+ *
+ * WriteAsynchronously writes the file in a separate thread. The velocity
+ * field must then not be modified until Wait returns.
+ *
+ * \sa MultiResolutionLogDomainDeformableRegistration
+ */
+template <class TField>
+class ITK_EXPORT VelocityFieldCheckpoint : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef VelocityFieldCheckpoint  Self;
+  typedef Object                   Superclass;
+  typedef SmartPointer<Self>       Pointer;
+  typedef SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( VelocityFieldCheckpoint, Object );
+
+  /** Velocity field type. */
+  typedef TField                                VelocityFieldType;
+  typedef typename VelocityFieldType::Pointer   VelocityFieldPointer;
+  typedef typename VelocityFieldType::PixelType PixelType;
+  typedef typename PixelType::ValueType         ScalarType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int, TField::ImageDimension);
+  itkStaticConstMacro(VectorDimension, unsigned int, PixelType::Dimension);
+
+  /** Geometry of the fixed image and schedule of its pyramid. */
+  typedef typename VelocityFieldType::SizeType    SizeType;
+  typedef typename VelocityFieldType::SpacingType SpacingType;
+  typedef Array2D<unsigned int>                   ScheduleType;
+
+  /** Set/Get the velocity field. */
+  itkSetObjectMacro( VelocityField, VelocityFieldType );
+  itkGetObjectMacro( VelocityField, VelocityFieldType );
+
+  /** Set/Get the level the velocity field belongs to. When the field is
+   * the result of a whole level, this is the next level, whose number of
+   * elapsed iterations is zero. */
+  itkSetMacro( Level, unsigned int );
+  itkGetConstMacro( Level, unsigned int );
+
+  /** Set/Get the size and spacing of the fixed image of the registration. */
+  itkSetMacro( FixedImageSize, SizeType );
+  itkGetConstReferenceMacro( FixedImageSize, SizeType );
+  itkSetMacro( FixedImageSpacing, SpacingType );
+  itkGetConstReferenceMacro( FixedImageSpacing, SpacingType );
+
+  /** Set/Get the schedule of the fixed image pyramid. */
+  itkSetMacro( Schedule, ScheduleType );
+  itkGetConstReferenceMacro( Schedule, ScheduleType );
+
+  /** Set/Get the number of iterations already run at each level. */
+  void SetElapsedIterations(const std::vector<unsigned int> & iterations)
+  {
+    m_ElapsedIterations = iterations;
+    this->Modified();
+  }
+
+  const std::vector<unsigned int> & GetElapsedIterations() const
+  {
+    return m_ElapsedIterations;
+  }
+
+  /** Set/Get the values of the metric and of the RMS change over the last
+   * iterations of the current level. */
+  void SetConvergenceHistory(const std::deque<double> & metric, const std::deque<double> & rmsChange)
+  {
+    m_MetricHistory = metric;
+    m_RMSChangeHistory = rmsChange;
+    this->Modified();
+  }
+
+  const std::deque<double> & GetMetricHistory() const
+  {
+    return m_MetricHistory;
+  }
+
+  const std::deque<double> & GetRMSChangeHistory() const
+  {
+    return m_RMSChangeHistory;
+  }
+
+  /** Write the state to the given file. */
+  void Write(const std::string & filename);
+
+  /** Read the state from the given file. A new velocity field is allocated
+   * if none was set. */
+  void Read(const std::string & filename);
+
+  /** Start writing the state to the given file in a separate thread. A
+   * write that is still running is waited for first. */
+  void WriteAsynchronously(const std::string & filename);
+
+  /** Wait for the asynchronous write to finish. An exception is thrown if
+   * it failed. */
+  void Wait();
+
+  /** Whether an asynchronous write is running. */
+  bool IsWriting() const
+  {
+    return m_WriterThreadId >= 0;
+  }
+
+protected:
+  VelocityFieldCheckpoint();
+  ~VelocityFieldCheckpoint();
+
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Write the state, returning an error message on failure. */
+  std::string WriteFile(const std::string & filename) const;
+
+  /** Entry point of the writer thread. */
+  static ITK_THREAD_RETURN_TYPE WriterThreaderCallback(void *arg);
+
+private:
+  VelocityFieldCheckpoint(const Self &); // purposely not implemented
+  void operator=(const Self &);          // purposely not implemented
+
+  VelocityFieldPointer      m_VelocityField;
+  unsigned int              m_Level;
+  std::vector<unsigned int> m_ElapsedIterations;
+  std::deque<double>        m_MetricHistory;
+  std::deque<double>        m_RMSChangeHistory;
+  SizeType                  m_FixedImageSize;
+  SpacingType               m_FixedImageSpacing;
+  ScheduleType              m_Schedule;
+
+  /** Asynchronous write. */
+  MultiThreader::Pointer m_Threader;
+  int                    m_WriterThreadId;
+  std::string            m_PendingFileName;
+  std::string            m_WriteError;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVelocityFieldCheckpoint.hxx"
+#endif
+
+#endif
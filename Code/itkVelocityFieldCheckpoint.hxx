@@ -0,0 +1,421 @@
+#ifndef __itkVelocityFieldCheckpoint_txx
+#define __itkVelocityFieldCheckpoint_txx
+
+#include "itkVelocityFieldCheckpoint.h"
+
+#include "vxl_config.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace itk
+{
+
+namespace
+{
+const char         VelocityFieldCheckpointMagic[8] = { 'L', 'D', 'S', 'V', 'F', 'C', 'K', 'P' };
+const vxl_uint_32  VelocityFieldCheckpointByteOrder = 0x01020304;
+const vxl_uint_32  VelocityFieldCheckpointVersion = 2;
+
+template <class T>
+void WriteCheckpointValue(std::ostream & os, const T & value)
+{
+  os.write( reinterpret_cast<const char *>( &value ), sizeof( T ) );
+}
+
+template <class T>
+void ReadCheckpointValue(std::istream & is, T & value)
+{
+  is.read( reinterpret_cast<char *>( &value ), sizeof( T ) );
+}
+
+// Number of elements of the given size left in the file
+vxl_uint_64 RemainingCheckpointElements(std::istream & is, std::streamoff fileLength, std::size_t elementSize)
+{
+  const std::streamoff position = is.tellg();
+  if( !is || position < 0 || position > fileLength )
+    {
+    return 0;
+    }
+  return static_cast<vxl_uint_64>( fileLength - position ) / elementSize;
+}
+}
+
+/**
+ * Default constructor.
+ */
+template <class TField>
+VelocityFieldCheckpoint<TField>
+::VelocityFieldCheckpoint()
+{
+  m_VelocityField = 0;
+  m_Level = 0;
+  m_FixedImageSize.Fill( 0 );
+  m_FixedImageSpacing.Fill( 1.0 );
+  m_Threader = MultiThreader::New();
+  m_WriterThreadId = -1;
+}
+
+template <class TField>
+VelocityFieldCheckpoint<TField>
+::~VelocityFieldCheckpoint()
+{
+  // Do not leave a thread reading a destroyed object, errors are lost
+  if( m_WriterThreadId >= 0 )
+    {
+    m_Threader->TerminateThread( m_WriterThreadId );
+    }
+}
+
+/**
+ * Standard PrintSelf method.
+ */
+template <class TField>
+void
+VelocityFieldCheckpoint<TField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "VelocityField: " << m_VelocityField.GetPointer() << std::endl;
+  os << indent << "Level: " << m_Level << std::endl;
+  os << indent << "ElapsedIterations: [";
+  for( unsigned int i = 0; i < m_ElapsedIterations.size(); ++i )
+    {
+    os << ( i > 0 ? ", " : "" ) << m_ElapsedIterations[i];
+    }
+  os << "]" << std::endl;
+  os << indent << "FixedImageSize: " << m_FixedImageSize << std::endl;
+  os << indent << "FixedImageSpacing: " << m_FixedImageSpacing << std::endl;
+  os << indent << "Schedule: " << m_Schedule << std::endl;
+  os << indent << "MetricHistory size: " << m_MetricHistory.size() << std::endl;
+  os << indent << "RMSChangeHistory size: " << m_RMSChangeHistory.size() << std::endl;
+  os << indent << "Writing: " << this->IsWriting() << std::endl;
+}
+
+template <class TField>
+std::string
+VelocityFieldCheckpoint<TField>
+::WriteFile(const std::string & filename) const
+{
+  if( !m_VelocityField )
+    {
+    return "No velocity field to write";
+    }
+
+  const std::string temporaryFileName = filename + ".tmp";
+  std::ofstream     os( temporaryFileName.c_str(), std::ios::out | std::ios::binary );
+  if( !os )
+    {
+    return "Could not open " + temporaryFileName + " for writing";
+    }
+
+  os.write( VelocityFieldCheckpointMagic, sizeof( VelocityFieldCheckpointMagic ) );
+  WriteCheckpointValue( os, VelocityFieldCheckpointByteOrder );
+  WriteCheckpointValue( os, VelocityFieldCheckpointVersion );
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( ImageDimension ) );
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( VectorDimension ) );
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( sizeof( ScalarType ) ) );
+
+  // Registration state
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_Level ) );
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_ElapsedIterations.size() ) );
+  for( unsigned int i = 0; i < m_ElapsedIterations.size(); ++i )
+    {
+    WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_ElapsedIterations[i] ) );
+    }
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_MetricHistory.size() ) );
+  for( unsigned int i = 0; i < m_MetricHistory.size(); ++i )
+    {
+    WriteCheckpointValue( os, m_MetricHistory[i] );
+    }
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_RMSChangeHistory.size() ) );
+  for( unsigned int i = 0; i < m_RMSChangeHistory.size(); ++i )
+    {
+    WriteCheckpointValue( os, m_RMSChangeHistory[i] );
+    }
+
+  // Problem the registration was run on
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    WriteCheckpointValue( os, static_cast<vxl_uint_64>( m_FixedImageSize[j] ) );
+    WriteCheckpointValue( os, static_cast<double>( m_FixedImageSpacing[j] ) );
+    }
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_Schedule.rows() ) );
+  WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_Schedule.cols() ) );
+  for( unsigned int i = 0; i < m_Schedule.rows(); ++i )
+    {
+    for( unsigned int j = 0; j < m_Schedule.cols(); ++j )
+      {
+      WriteCheckpointValue( os, static_cast<vxl_uint_32>( m_Schedule(i, j) ) );
+      }
+    }
+
+  // Geometry of the buffered region
+  const typename VelocityFieldType::RegionType & region = m_VelocityField->GetBufferedRegion();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    WriteCheckpointValue( os, static_cast<vxl_int_64>( region.GetIndex()[j] ) );
+    WriteCheckpointValue( os, static_cast<vxl_uint_64>( region.GetSize()[j] ) );
+    WriteCheckpointValue( os, static_cast<double>( m_VelocityField->GetSpacing()[j] ) );
+    WriteCheckpointValue( os, static_cast<double>( m_VelocityField->GetOrigin()[j] ) );
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      WriteCheckpointValue( os, static_cast<double>( m_VelocityField->GetDirection()(j, k) ) );
+      }
+    }
+
+  os.write( reinterpret_cast<const char *>( m_VelocityField->GetBufferPointer() ),
+            region.GetNumberOfPixels() * sizeof( PixelType ) );
+  os.close();
+  if( !os )
+    {
+    std::remove( temporaryFileName.c_str() );
+    return "Could not write " + temporaryFileName;
+    }
+
+  // Replace the previous checkpoint
+  std::remove( filename.c_str() );
+  if( std::rename( temporaryFileName.c_str(), filename.c_str() ) != 0 )
+    {
+    return "Could not rename " + temporaryFileName + " to " + filename;
+    }
+
+  return std::string();
+}
+
+template <class TField>
+void
+VelocityFieldCheckpoint<TField>
+::Write(const std::string & filename)
+{
+  this->Wait();
+
+  const std::string error = this->WriteFile( filename );
+  if( !error.empty() )
+    {
+    itkExceptionMacro( << error );
+    }
+}
+
+template <class TField>
+void
+VelocityFieldCheckpoint<TField>
+::Read(const std::string & filename)
+{
+  this->Wait();
+
+  std::ifstream is( filename.c_str(), std::ios::in | std::ios::binary );
+  if( !is )
+    {
+    itkExceptionMacro( << "Could not open " << filename << " for reading" );
+    }
+  is.seekg( 0, std::ios::end );
+  const std::streamoff fileLength = is.tellg();
+  is.seekg( 0, std::ios::beg );
+
+  char magic[sizeof( VelocityFieldCheckpointMagic )];
+  is.read( magic, sizeof( magic ) );
+  vxl_uint_32 byteOrder = 0;
+  vxl_uint_32 version = 0;
+  vxl_uint_32 imageDimension = 0;
+  vxl_uint_32 vectorDimension = 0;
+  vxl_uint_32 scalarSize = 0;
+  ReadCheckpointValue( is, byteOrder );
+  ReadCheckpointValue( is, version );
+  ReadCheckpointValue( is, imageDimension );
+  ReadCheckpointValue( is, vectorDimension );
+  ReadCheckpointValue( is, scalarSize );
+  if( !is || std::memcmp( magic, VelocityFieldCheckpointMagic, sizeof( magic ) ) != 0 )
+    {
+    itkExceptionMacro( << filename << " is not a velocity field checkpoint" );
+    }
+  if( byteOrder != VelocityFieldCheckpointByteOrder || version != VelocityFieldCheckpointVersion )
+    {
+    itkExceptionMacro( << filename << " was written with another byte order or version" );
+    }
+  if( imageDimension != ImageDimension || vectorDimension != VectorDimension
+      || scalarSize != sizeof( ScalarType ) )
+    {
+    itkExceptionMacro( << filename << " holds a field of another type" );
+    }
+
+  // Registration state. The counts are checked against the length of the
+  // file before resizing, so that a corrupted file does not allocate
+  vxl_uint_32 value = 0;
+  vxl_uint_32 count = 0;
+  ReadCheckpointValue( is, value );
+  m_Level = value;
+  ReadCheckpointValue( is, count );
+  if( count > RemainingCheckpointElements( is, fileLength, sizeof( vxl_uint_32 ) ) )
+    {
+    itkExceptionMacro( << "Invalid number of levels in " << filename );
+    }
+  m_ElapsedIterations.resize( count );
+  for( unsigned int i = 0; i < count; ++i )
+    {
+    ReadCheckpointValue( is, value );
+    m_ElapsedIterations[i] = value;
+    }
+  ReadCheckpointValue( is, count );
+  if( count > RemainingCheckpointElements( is, fileLength, sizeof( double ) ) )
+    {
+    itkExceptionMacro( << "Invalid metric history in " << filename );
+    }
+  m_MetricHistory.resize( count );
+  for( unsigned int i = 0; i < count; ++i )
+    {
+    ReadCheckpointValue( is, m_MetricHistory[i] );
+    }
+  ReadCheckpointValue( is, count );
+  if( count > RemainingCheckpointElements( is, fileLength, sizeof( double ) ) )
+    {
+    itkExceptionMacro( << "Invalid RMS change history in " << filename );
+    }
+  m_RMSChangeHistory.resize( count );
+  for( unsigned int i = 0; i < count; ++i )
+    {
+    ReadCheckpointValue( is, m_RMSChangeHistory[i] );
+    }
+
+  // Problem the registration was run on
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    vxl_uint_64 size = 0;
+    double      x = 0.0;
+    ReadCheckpointValue( is, size );
+    ReadCheckpointValue( is, x );
+    m_FixedImageSize[j] = size;
+    m_FixedImageSpacing[j] = x;
+    }
+  vxl_uint_32 rows = 0;
+  vxl_uint_32 cols = 0;
+  ReadCheckpointValue( is, rows );
+  ReadCheckpointValue( is, cols );
+  if( static_cast<vxl_uint_64>( rows ) * cols
+      > RemainingCheckpointElements( is, fileLength, sizeof( vxl_uint_32 ) ) )
+    {
+    itkExceptionMacro( << "Invalid schedule in " << filename );
+    }
+  m_Schedule.SetSize( rows, cols );
+  for( unsigned int i = 0; i < rows; ++i )
+    {
+    for( unsigned int j = 0; j < cols; ++j )
+      {
+      ReadCheckpointValue( is, value );
+      m_Schedule(i, j) = value;
+      }
+    }
+
+  // Geometry
+  typename VelocityFieldType::RegionType    region;
+  typename VelocityFieldType::SpacingType   spacing;
+  typename VelocityFieldType::PointType     origin;
+  typename VelocityFieldType::DirectionType direction;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    vxl_int_64  index = 0;
+    vxl_uint_64 size = 0;
+    double      x = 0.0;
+    ReadCheckpointValue( is, index );
+    ReadCheckpointValue( is, size );
+    region.SetIndex( j, index );
+    region.SetSize( j, size );
+    ReadCheckpointValue( is, x );
+    spacing[j] = x;
+    ReadCheckpointValue( is, x );
+    origin[j] = x;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      ReadCheckpointValue( is, x );
+      direction(j, k) = x;
+      }
+    }
+  if( !is )
+    {
+    itkExceptionMacro( << "Could not read the header of " << filename );
+    }
+
+  // The buffer must fit in the rest of the file
+  const vxl_uint_64 remainingPixels = RemainingCheckpointElements( is, fileLength, sizeof( PixelType ) );
+  vxl_uint_64       numberOfPixels = 1;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    const vxl_uint_64 size = region.GetSize()[j];
+    if( size == 0 || numberOfPixels > remainingPixels / size )
+      {
+      itkExceptionMacro( << "Invalid velocity field size in " << filename );
+      }
+    numberOfPixels *= size;
+    }
+
+  if( !m_VelocityField )
+    {
+    m_VelocityField = VelocityFieldType::New();
+    }
+  m_VelocityField->SetRegions( region );
+  m_VelocityField->SetSpacing( spacing );
+  m_VelocityField->SetOrigin( origin );
+  m_VelocityField->SetDirection( direction );
+  m_VelocityField->Allocate();
+
+  is.read( reinterpret_cast<char *>( m_VelocityField->GetBufferPointer() ),
+           region.GetNumberOfPixels() * sizeof( PixelType ) );
+  if( !is )
+    {
+    itkExceptionMacro( << "Could not read the velocity field of " << filename );
+    }
+
+  this->Modified();
+}
+
+template <class TField>
+ITK_THREAD_RETURN_TYPE
+VelocityFieldCheckpoint<TField>
+::WriterThreaderCallback(void *arg)
+{
+  MultiThreader::ThreadInfoStruct * info = static_cast<MultiThreader::ThreadInfoStruct *>( arg );
+  Self *                            checkpoint = static_cast<Self *>( info->UserData );
+
+  checkpoint->m_WriteError = checkpoint->WriteFile( checkpoint->m_PendingFileName );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TField>
+void
+VelocityFieldCheckpoint<TField>
+::WriteAsynchronously(const std::string & filename)
+{
+  this->Wait();
+
+  m_PendingFileName = filename;
+  m_WriteError.clear();
+  m_WriterThreadId = m_Threader->SpawnThread( this->WriterThreaderCallback, this );
+}
+
+template <class TField>
+void
+VelocityFieldCheckpoint<TField>
+::Wait()
+{
+  if( m_WriterThreadId < 0 )
+    {
+    return;
+    }
+
+  // Joins the writer thread
+  m_Threader->TerminateThread( m_WriterThreadId );
+  m_WriterThreadId = -1;
+
+  if( !m_WriteError.empty() )
+    {
+    const std::string error = m_WriteError;
+    m_WriteError.clear();
+    itkExceptionMacro( << error );
+    }
+}
+
+} // end namespace itk
+
+#endif
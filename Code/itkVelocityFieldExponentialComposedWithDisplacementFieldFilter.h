@@ -2,7 +2,10 @@
 #define __itkVelocityFieldExponentialComposedWithDisplacementFieldFilter_h_
 
 #include "itkImageToImageFilter.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
 #include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
+
+#include <vector>
 // #include "itkVectorLinearInterpolateImageFunction.h"
 
 namespace itk
@@ -24,6 +27,29 @@ namespace itk
    Moreover, a forward Euler method is used to compute the exponential, as it was shown
    to be more accurate than the scaling and squaring method.
 
+   The Euler integration interpolates the velocity field NumberOfIntegrationSteps times
+   per voxel. With the ScalingAndSquaring integration method, exp(u) or exp(-u) is
+   instead computed once over the whole grid by an ExponentialDisplacementFieldImageFilter
+   and composed with \phi with a single interpolation per voxel. Its cost no longer
+   depends on NumberOfIntegrationSteps. The result is then resampled twice, once by the
+   squarings and once by the composition. For smooth velocity fields the difference with
+   a fine Euler integration is of the order of the linear interpolation error of the
+   exponential, i.e. a fraction of a voxel that decreases with the second derivatives of
+   the field, see itkVelocityFieldExponentialComposedWithDisplacementFieldFilterTest.
+   Euler integration remains the default as the most accurate engine.
+
+   Where the trajectories are still wanted, RungeKutta4Integration takes
+   NumberOfIntegrationSteps fourth order steps, i.e. four interpolations per step, which
+   reaches the accuracy of many more Euler steps. AdaptiveRungeKutta45Integration uses the
+   embedded Dormand-Prince 5(4) pair with a step size chosen per voxel: a step is accepted
+   when the estimate of its local error is below IntegrationTolerance, in physical units,
+   and the next step is scaled from this estimate. The first step is
+   1/NumberOfIntegrationSteps. Voxels in smooth, slow regions then take few steps while
+   the others are refined. The numbers of accepted and rejected steps and of
+   interpolations of the velocity field are counted per thread during the update and
+   summed by GetNumberOfAcceptedSteps, GetNumberOfRejectedSteps and
+   GetNumberOfVelocityEvaluations, so that the tolerance can be traded for speed.
+
    \author Pierre Fillard, INRIA Paris
  */
 
@@ -58,6 +84,22 @@ public:
   typedef VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<VelocityFieldType>
   VelocityFieldInterpolatorType;
 
+  /** Exponential used by the scaling and squaring integration. */
+  typedef ExponentialDisplacementFieldImageFilter<VelocityFieldType, VelocityFieldType>
+  ExponentiatorType;
+
+  /** Methods to integrate the velocity field. */
+  typedef enum
+    {
+    EulerIntegration = 0,
+    ScalingAndSquaringIntegration,
+    RungeKutta4Integration,
+    AdaptiveRungeKutta45Integration
+    } IntegrationMethodType;
+
+  /** Vector type of the interpolated velocities. */
+  typedef typename VelocityFieldInterpolatorType::OutputType VelocityVectorType;
+
   itkSetObjectMacro(VelocityField, VelocityFieldType);
   itkGetObjectMacro(VelocityField, VelocityFieldType);
 
@@ -67,6 +109,31 @@ public:
   itkSetMacro(NumberOfIntegrationSteps, int);
   itkGetMacro(NumberOfIntegrationSteps, int);
 
+  /**
+   * Set/Get the method used to integrate the velocity field.
+   * Default is EulerIntegration.
+   */
+  itkSetMacro(IntegrationMethod, IntegrationMethodType);
+  itkGetConstMacro(IntegrationMethod, IntegrationMethodType);
+
+  /**
+   * Set/Get the largest local error, in physical units, of a step of the
+   * adaptive integration. Default is 1e-3.
+   */
+  itkSetMacro(IntegrationTolerance, double);
+  itkGetConstMacro(IntegrationTolerance, double);
+
+  /** Get the number of integration steps accepted by the last update. */
+  unsigned long GetNumberOfAcceptedSteps() const;
+
+  /** Get the number of integration steps rejected by the adaptive
+   * integration during the last update. */
+  unsigned long GetNumberOfRejectedSteps() const;
+
+  /** Get the number of interpolations of the velocity field, or of its
+   * exponential, during the last update. */
+  unsigned long GetNumberOfVelocityEvaluations() const;
+
   /**
    * If On, compute exp(-u)o\phi instead of exp(u)o\phi
    */
@@ -83,6 +150,25 @@ protected:
 
   void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId);
 
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Counters of a thread, kept in local variables during its region. */
+  struct IntegrationCounters
+    {
+    unsigned long m_AcceptedSteps;
+    unsigned long m_RejectedSteps;
+    unsigned long m_VelocityEvaluations;
+    };
+
+  /** Velocity, or its opposite, at the given point. */
+  VelocityVectorType EvaluateVelocity(const PointType & point, IntegrationCounters & counters) const;
+
+  /** Integrate the trajectory starting at the given point over the unit
+   * time interval, returning the displacement. */
+  VelocityVectorType IntegrateRungeKutta4(const PointType & point, IntegrationCounters & counters) const;
+
+  VelocityVectorType IntegrateAdaptiveRungeKutta45(const PointType & point, IntegrationCounters & counters) const;
+
 private:
   VelocityFieldExponentialComposedWithDisplacementFieldFilter(const Self &);
   void operator=(const Self &);
@@ -90,8 +176,18 @@ private:
   typename VelocityFieldType::Pointer m_VelocityField;
   typename VelocityFieldInterpolatorType::Pointer m_VelocityFieldInterpolator;
 
-  int  m_NumberOfIntegrationSteps;
-  bool m_ComputeInverse;
+  typename ExponentiatorType::Pointer m_Exponentiator;
+
+  int                   m_NumberOfIntegrationSteps;
+  bool                  m_ComputeInverse;
+  IntegrationMethodType m_IntegrationMethod;
+  double                m_IntegrationTolerance;
+
+  /** Counters of the threads, written once at the end of their region
+   * and summed by the Get methods. */
+  std::vector<unsigned long> m_ThreadNumberOfAcceptedSteps;
+  std::vector<unsigned long> m_ThreadNumberOfRejectedSteps;
+  std::vector<unsigned long> m_ThreadNumberOfVelocityEvaluations;
 };
 }
 
@@ -6,6 +6,8 @@
 #include <itkImageRegionConstIteratorWithIndex.h>
 #include <itkImageRegionIteratorWithIndex.h>
 
+#include "vnl/vnl_math.h"
+
 namespace itk
 {
 template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
@@ -16,7 +18,10 @@ VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInp
   m_NumberOfIntegrationSteps = 10;
   m_VelocityField = 0;
   m_ComputeInverse = false;
+  m_IntegrationMethod = EulerIntegration;
+  m_IntegrationTolerance = 1e-3;
   m_VelocityFieldInterpolator = VelocityFieldInterpolatorType::New();
+  m_Exponentiator = ExponentiatorType::New();
 }
 
 template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
@@ -30,11 +35,31 @@ VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInp
     itkExceptionMacro(<< "Velocity field must be set");
     }
 
+  m_ThreadNumberOfAcceptedSteps.assign( this->GetNumberOfThreads(), 0 );
+  m_ThreadNumberOfRejectedSteps.assign( this->GetNumberOfThreads(), 0 );
+  m_ThreadNumberOfVelocityEvaluations.assign( this->GetNumberOfThreads(), 0 );
+
+  if( m_IntegrationMethod == ScalingAndSquaringIntegration )
+    {
+    // exp(u) or exp(-u) is computed once and interpolated instead of u
+    m_Exponentiator->SetInput(m_VelocityField);
+    m_Exponentiator->SetComputeInverse(m_ComputeInverse);
+    m_Exponentiator->Modified();
+    m_Exponentiator->UpdateLargestPossibleRegion();
+    m_VelocityFieldInterpolator->SetInputImage(m_Exponentiator->GetOutput() );
+    return;
+    }
+
   if( m_NumberOfIntegrationSteps <= 0 )
     {
     itkExceptionMacro(<< "Number of integration step cannot be null or negative");
     }
 
+  if( m_IntegrationMethod == AdaptiveRungeKutta45Integration && !( m_IntegrationTolerance > 0.0 ) )
+    {
+    itkExceptionMacro(<< "Integration tolerance must be positive");
+    }
+
   m_VelocityFieldInterpolator->SetInputImage(m_VelocityField);
 }
 
@@ -42,7 +67,7 @@ template <class TVelocityField, class TInputDisplacementField, class TOutputDisp
 void
 VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
                                                             TOutputDisplacementField>
-::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType /* threadId */)
+::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId)
 {
   typename InputImageType::ConstPointer inputField = this->GetInput();
   typename OutputImageType::Pointer     outputField = this->GetOutput();
@@ -56,6 +81,11 @@ VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInp
 
   double dt = 1.0 / static_cast<double>(m_NumberOfIntegrationSteps);
 
+  IntegrationCounters counters;
+  counters.m_AcceptedSteps = 0;
+  counters.m_RejectedSteps = 0;
+  counters.m_VelocityEvaluations = 0;
+
   while( !itOut.IsAtEnd() )
     {
     InputPixelType vecIn = itIn.Value();
@@ -67,18 +97,46 @@ VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInp
     pointIn = pointIn + vecIn;
 
     OutputPixelType vecOut(0.0);
-    for( int i = 0; i < m_NumberOfIntegrationSteps; i++ )
+    switch( m_IntegrationMethod )
       {
-      PointType pointOut = pointIn + vecOut;
-
-      OutputPixelType vec = m_VelocityFieldInterpolator->Evaluate(pointOut);
-      if( m_ComputeInverse )
+      case ScalingAndSquaringIntegration:
+        {
+        const OutputPixelType vec = m_VelocityFieldInterpolator->Evaluate(pointIn);
+        vecOut = vec;
+        ++counters.m_AcceptedSteps;
+        ++counters.m_VelocityEvaluations;
+        break;
+        }
+      case RungeKutta4Integration:
         {
-        vecOut -= vec * dt;
+        const OutputPixelType vec = this->IntegrateRungeKutta4(pointIn, counters);
+        vecOut = vec;
+        break;
         }
-      else
+      case AdaptiveRungeKutta45Integration:
         {
-        vecOut += vec * dt;
+        const OutputPixelType vec = this->IntegrateAdaptiveRungeKutta45(pointIn, counters);
+        vecOut = vec;
+        break;
+        }
+      default:
+        {
+        for( int i = 0; i < m_NumberOfIntegrationSteps; i++ )
+          {
+          PointType pointOut = pointIn + vecOut;
+
+          OutputPixelType vec = m_VelocityFieldInterpolator->Evaluate(pointOut);
+          if( m_ComputeInverse )
+            {
+            vecOut -= vec * dt;
+            }
+          else
+            {
+            vecOut += vec * dt;
+            }
+          }
+        counters.m_AcceptedSteps += m_NumberOfIntegrationSteps;
+        counters.m_VelocityEvaluations += m_NumberOfIntegrationSteps;
         }
       }
 
@@ -87,6 +145,191 @@ VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInp
     ++itIn;
     ++itOut;
     }
+
+  m_ThreadNumberOfAcceptedSteps[threadId] += counters.m_AcceptedSteps;
+  m_ThreadNumberOfRejectedSteps[threadId] += counters.m_RejectedSteps;
+  m_ThreadNumberOfVelocityEvaluations[threadId] += counters.m_VelocityEvaluations;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+typename VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::VelocityVectorType
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::EvaluateVelocity(const PointType & point, IntegrationCounters & counters) const
+{
+  ++counters.m_VelocityEvaluations;
+
+  VelocityVectorType vec = m_VelocityFieldInterpolator->Evaluate(point);
+  if( m_ComputeInverse )
+    {
+    vec *= -1.0;
+    }
+  return vec;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+typename VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::VelocityVectorType
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::IntegrateRungeKutta4(const PointType & point, IntegrationCounters & counters) const
+{
+  const double dt = 1.0 / static_cast<double>(m_NumberOfIntegrationSteps);
+
+  VelocityVectorType x;
+  x.Fill(0.0);
+  for( int i = 0; i < m_NumberOfIntegrationSteps; i++ )
+    {
+    const VelocityVectorType k1 = this->EvaluateVelocity(point + x, counters);
+    const VelocityVectorType k2 = this->EvaluateVelocity(point + ( x + k1 * ( 0.5 * dt ) ), counters);
+    const VelocityVectorType k3 = this->EvaluateVelocity(point + ( x + k2 * ( 0.5 * dt ) ), counters);
+    const VelocityVectorType k4 = this->EvaluateVelocity(point + ( x + k3 * dt ), counters);
+    x += ( k1 + k2 * 2.0 + k3 * 2.0 + k4 ) * ( dt / 6.0 );
+    }
+  counters.m_AcceptedSteps += m_NumberOfIntegrationSteps;
+
+  return x;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+typename VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::VelocityVectorType
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::IntegrateAdaptiveRungeKutta45(const PointType & point, IntegrationCounters & counters) const
+{
+  // Dormand-Prince 5(4) coefficients, the fifth order solution is kept
+  static const double a21 = 1.0 / 5.0;
+  static const double a31 = 3.0 / 40.0, a32 = 9.0 / 40.0;
+  static const double a41 = 44.0 / 45.0, a42 = -56.0 / 15.0, a43 = 32.0 / 9.0;
+  static const double a51 = 19372.0 / 6561.0, a52 = -25360.0 / 2187.0, a53 = 64448.0 / 6561.0,
+                      a54 = -212.0 / 729.0;
+  static const double a61 = 9017.0 / 3168.0, a62 = -355.0 / 33.0, a63 = 46732.0 / 5247.0,
+                      a64 = 49.0 / 176.0, a65 = -5103.0 / 18656.0;
+  static const double b1 = 35.0 / 384.0, b3 = 500.0 / 1113.0, b4 = 125.0 / 192.0,
+                      b5 = -2187.0 / 6784.0, b6 = 11.0 / 84.0;
+  // Difference between the fifth and fourth order solutions
+  static const double e1 = 71.0 / 57600.0, e3 = -71.0 / 16695.0, e4 = 71.0 / 1920.0,
+                      e5 = -17253.0 / 339200.0, e6 = 22.0 / 525.0, e7 = -1.0 / 40.0;
+
+  // Smallest step, always accepted so that the integration ends
+  const double minimumStep = 1e-6;
+
+  double h = 1.0 / static_cast<double>(m_NumberOfIntegrationSteps);
+  double t = 0.0;
+
+  VelocityVectorType x;
+  x.Fill(0.0);
+
+  // The last stage of an accepted step is the first stage of the next one
+  VelocityVectorType k1 = this->EvaluateVelocity(point + x, counters);
+  while( t < 1.0 )
+    {
+    h = vnl_math_min( h, 1.0 - t );
+
+    const VelocityVectorType k2 = this->EvaluateVelocity(point + ( x + k1 * ( h * a21 ) ), counters);
+    const VelocityVectorType k3 = this->EvaluateVelocity(point + ( x + ( k1 * a31 + k2 * a32 ) * h ), counters);
+    const VelocityVectorType k4 = this->EvaluateVelocity(
+        point + ( x + ( k1 * a41 + k2 * a42 + k3 * a43 ) * h ), counters);
+    const VelocityVectorType k5 = this->EvaluateVelocity(
+        point + ( x + ( k1 * a51 + k2 * a52 + k3 * a53 + k4 * a54 ) * h ), counters);
+    const VelocityVectorType k6 = this->EvaluateVelocity(
+        point + ( x + ( k1 * a61 + k2 * a62 + k3 * a63 + k4 * a64 + k5 * a65 ) * h ), counters);
+    const VelocityVectorType x5 = x + ( k1 * b1 + k3 * b3 + k4 * b4 + k5 * b5 + k6 * b6 ) * h;
+    const VelocityVectorType k7 = this->EvaluateVelocity(point + x5, counters);
+
+    const VelocityVectorType errorVector = ( k1 * e1 + k3 * e3 + k4 * e4 + k5 * e5 + k6 * e6 + k7 * e7 ) * h;
+    double                   error = 0.0;
+    for( unsigned int j = 0; j < VelocityVectorType::Dimension; j++ )
+      {
+      error = vnl_math_max( error, vnl_math_abs( errorVector[j] ) );
+      }
+
+    if( error <= m_IntegrationTolerance || h <= minimumStep )
+      {
+      t += h;
+      x = x5;
+      k1 = k7;
+      ++counters.m_AcceptedSteps;
+      }
+    else
+      {
+      ++counters.m_RejectedSteps;
+      }
+
+    // Scale the step by the usual safety factor, within [1/5, 5]
+    double factor = 5.0;
+    if( error > 0.0 )
+      {
+      factor = vnl_math_max( 0.2, vnl_math_min( 5.0, 0.9 * vcl_pow( m_IntegrationTolerance / error, 0.2 ) ) );
+      }
+    h = vnl_math_max( h * factor, minimumStep );
+    }
+
+  return x;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+unsigned long
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::GetNumberOfAcceptedSteps() const
+{
+  unsigned long count = 0;
+  for( unsigned int i = 0; i < m_ThreadNumberOfAcceptedSteps.size(); ++i )
+    {
+    count += m_ThreadNumberOfAcceptedSteps[i];
+    }
+  return count;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+unsigned long
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::GetNumberOfRejectedSteps() const
+{
+  unsigned long count = 0;
+  for( unsigned int i = 0; i < m_ThreadNumberOfRejectedSteps.size(); ++i )
+    {
+    count += m_ThreadNumberOfRejectedSteps[i];
+    }
+  return count;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+unsigned long
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::GetNumberOfVelocityEvaluations() const
+{
+  unsigned long count = 0;
+  for( unsigned int i = 0; i < m_ThreadNumberOfVelocityEvaluations.size(); ++i )
+    {
+    count += m_ThreadNumberOfVelocityEvaluations[i];
+    }
+  return count;
+}
+
+template <class TVelocityField, class TInputDisplacementField, class TOutputDisplacementField>
+void
+VelocityFieldExponentialComposedWithDisplacementFieldFilter<TVelocityField, TInputDisplacementField,
+                                                            TOutputDisplacementField>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+  os << indent << "VelocityField: " << m_VelocityField.GetPointer() << std::endl;
+  os << indent << "NumberOfIntegrationSteps: " << m_NumberOfIntegrationSteps << std::endl;
+  os << indent << "ComputeInverse: " << m_ComputeInverse << std::endl;
+  os << indent << "IntegrationMethod: " << m_IntegrationMethod << std::endl;
+  os << indent << "IntegrationTolerance: " << m_IntegrationTolerance << std::endl;
+  os << indent << "NumberOfAcceptedSteps: " << this->GetNumberOfAcceptedSteps() << std::endl;
+  os << indent << "NumberOfRejectedSteps: " << this->GetNumberOfRejectedSteps() << std::endl;
+  os << indent << "NumberOfVelocityEvaluations: " << this->GetNumberOfVelocityEvaluations() << std::endl;
 }
 
 } // end namespace itk
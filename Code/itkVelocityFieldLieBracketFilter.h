@@ -35,6 +35,13 @@ namespace itk
  * This class is templated over the input field type and the output
  * field type.
  *
+ * The Jacobians are computed with central differences, set to zero at the
+ * border of the buffered region, as done by VectorCentralDifferenceImageFunction.
+ * The filter does not call the gradient calculators for each pixel but
+ * walks the raw buffers row by row with precomputed strides and spacing
+ * reciprocals. The pixels of a row that are not on the border of the
+ * inputs are processed by a branch-free loop.
+ *
  * \warning This filter assumes that the input field type and velocity field type
  * both have the same number of dimensions.
  *
@@ -57,6 +64,9 @@ public:
   typedef typename InputFieldType::Pointer      InputFieldPointer;
   typedef typename InputFieldType::ConstPointer InputFieldConstPointer;
   typedef typename InputFieldType::RegionType   InputFieldRegionType;
+  typedef typename InputFieldType::IndexType    InputFieldIndexType;
+  typedef typename InputFieldType::OffsetValueType OffsetValueType;
+  typedef typename InputFieldType::IndexValueType  IndexValueType;
 
   typedef TOutputImage                           OutputFieldType;
   typedef typename OutputFieldType::PixelType    OutputFieldPixelType;
@@ -128,6 +138,34 @@ protected:
 
   void BeforeThreadedGenerateData();
 
+  /** Description of the geometry of an input field used by the row kernel. */
+  struct FieldGeometryType
+    {
+    const InputFieldPixelType *m_Buffer;
+    OffsetValueType m_Strides[InputFieldDimension];
+    IndexValueType  m_Start[InputFieldDimension];
+    IndexValueType  m_End[InputFieldDimension];
+    /** 0.5 / spacing */
+    double m_Weights[InputFieldDimension];
+    /** m_WeightedDirection[j][k] = direction[k][j] * m_Weights[j], maps a
+     * vector to the weights of the differences along each dimension */
+    double m_WeightedDirection[InputFieldDimension][InputFieldDimension];
+    };
+
+  /** Fill the geometry of a field for the given gradient calculator. */
+  void InitializeFieldGeometry(const InputFieldType * field,
+                               const InputFieldGradientCalculatorType * calculator,
+                               FieldGeometryType & geometry) const;
+
+  /** Compute the Lie bracket at a single pixel. The derivative along a
+   * dimension is only computed if the pixel is not on the border of the
+   * corresponding input along that dimension. */
+  inline void EvaluateAtBorderPixel(const InputFieldPixelType * left,
+                                    const InputFieldPixelType * right,
+                                    const bool leftInside[],
+                                    const bool rightInside[],
+                                    OutputFieldPixelType & out) const;
+
   /** Set right and left gradient calculators. */
   itkSetObjectMacro( RightGradientCalculator, InputFieldGradientCalculatorType );
   itkSetObjectMacro( LeftGradientCalculator,  InputFieldGradientCalculatorType );
@@ -142,6 +180,8 @@ private:
   typename InputFieldGradientCalculatorType::Pointer m_RightGradientCalculator;
   typename InputFieldGradientCalculatorType::Pointer m_LeftGradientCalculator;
 
+  FieldGeometryType m_LeftGeometry;
+  FieldGeometryType m_RightGeometry;
 };
 
 } // end namespace itk
@@ -3,8 +3,11 @@
 #include "itkVelocityFieldLieBracketFilter.h"
 
 #include <itkImageRegionIterator.h>
+#include <itkImageLinearIteratorWithIndex.h>
 #include <itkProgressReporter.h>
 
+#include "vnl/vnl_math.h"
+
 namespace itk
 {
 
@@ -113,6 +116,45 @@ throw (InvalidRequestedRegionError)
     }
 }
 
+template <class TInputImage, class TOutputImage>
+void
+VelocityFieldLieBracketFilter<TInputImage, TOutputImage>
+::InitializeFieldGeometry(const InputFieldType * field,
+                          const InputFieldGradientCalculatorType * calculator,
+                          FieldGeometryType & geometry) const
+{
+  const InputFieldRegionType & region = field->GetBufferedRegion();
+  const OffsetValueType *      offsetTable = field->GetOffsetTable();
+
+  geometry.m_Buffer = field->GetBufferPointer();
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    geometry.m_Strides[j] = offsetTable[j];
+    geometry.m_Start[j] = region.GetIndex()[j];
+    geometry.m_End[j] = region.GetIndex()[j] + static_cast<IndexValueType>( region.GetSize()[j] );
+    geometry.m_Weights[j] = 0.5 / field->GetSpacing()[j];
+    }
+
+  // Same convention as VectorCentralDifferenceImageFunction
+  const bool useImageDirection = calculator->GetUseImageDirection();
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    for( unsigned int k = 0; k < InputFieldDimension; k++ )
+      {
+      double dir;
+      if( useImageDirection )
+        {
+        dir = field->GetDirection()[k][j];
+        }
+      else
+        {
+        dir = ( j == k ) ? 1.0 : 0.0;
+        }
+      geometry.m_WeightedDirection[j][k] = dir * geometry.m_Weights[j];
+      }
+    }
+}
+
 template <class TInputImage, class TOutputImage>
 void
 VelocityFieldLieBracketFilter<TInputImage, TOutputImage>
@@ -121,6 +163,69 @@ VelocityFieldLieBracketFilter<TInputImage, TOutputImage>
   // Initialize gradient calculators
   m_LeftGradientCalculator->SetInputImage( this->GetInput(0) );
   m_RightGradientCalculator->SetInputImage( this->GetInput(1) );
+
+  this->InitializeFieldGeometry( this->GetInput(0), m_LeftGradientCalculator, m_LeftGeometry );
+  this->InitializeFieldGeometry( this->GetInput(1), m_RightGradientCalculator, m_RightGeometry );
+}
+
+template <class TInputImage, class TOutputImage>
+inline void
+VelocityFieldLieBracketFilter<TInputImage, TOutputImage>
+::EvaluateAtBorderPixel(const InputFieldPixelType * left,
+                        const InputFieldPixelType * right,
+                        const bool leftInside[],
+                        const bool rightInside[],
+                        OutputFieldPixelType & out) const
+{
+  const InputFieldPixelType & leftval = *left;
+  const InputFieldPixelType & rightval = *right;
+
+  double acc[InputFieldDimension];
+  for( unsigned int d = 0; d < InputFieldDimension; d++ )
+    {
+    acc[d] = 0.0;
+    }
+
+  for( unsigned int j = 0; j < InputFieldDimension; j++ )
+    {
+    if( leftInside[j] )
+      {
+      // Jac(v).u along dimension j
+      double w = 0.0;
+      for( unsigned int k = 0; k < InputFieldDimension; k++ )
+        {
+        w += m_LeftGeometry.m_WeightedDirection[j][k] * rightval[k];
+        }
+      const OffsetValueType        stride = m_LeftGeometry.m_Strides[j];
+      const InputFieldPixelType & fwd = left[stride];
+      const InputFieldPixelType & bwd = left[-stride];
+      for( unsigned int d = 0; d < InputFieldDimension; d++ )
+        {
+        acc[d] += w * ( fwd[d] - bwd[d] );
+        }
+      }
+    if( rightInside[j] )
+      {
+      // Jac(u).v along dimension j
+      double w = 0.0;
+      for( unsigned int k = 0; k < InputFieldDimension; k++ )
+        {
+        w += m_RightGeometry.m_WeightedDirection[j][k] * leftval[k];
+        }
+      const OffsetValueType        stride = m_RightGeometry.m_Strides[j];
+      const InputFieldPixelType & fwd = right[stride];
+      const InputFieldPixelType & bwd = right[-stride];
+      for( unsigned int d = 0; d < InputFieldDimension; d++ )
+        {
+        acc[d] -= w * ( fwd[d] - bwd[d] );
+        }
+      }
+    }
+
+  for( unsigned int d = 0; d < InputFieldDimension; d++ )
+    {
+    out[d] = acc[d];
+    }
 }
 
 /**
@@ -132,45 +237,121 @@ VelocityFieldLieBracketFilter<TInputImage, TOutputImage>
 ::ThreadedGenerateData( const OutputFieldRegionType & outputRegionForThread,
                         ThreadIdType threadId)
 {
-  // Get the input and output pointers
-  InputFieldConstPointer leftField = this->GetInput(0);
-  InputFieldConstPointer rightField = this->GetInput(1);
-  OutputFieldPointer     outputPtr = this->GetOutput();
+  OutputFieldPointer outputPtr = this->GetOutput();
+
+  const unsigned long rowLength = outputRegionForThread.GetSize()[0];
+  if( rowLength == 0 )
+    {
+    return;
+    }
 
-  // Progress tracking
-  ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels() );
+  // Progress tracking, one row at a time
+  ProgressReporter progress(this, threadId,
+                            outputRegionForThread.GetNumberOfPixels() / rowLength );
 
-  // Input and output iterators/
-  typedef ImageRegionConstIterator<InputFieldType> InputFieldIteratorType;
-  typedef ImageRegionIterator<OutputFieldType>     OutputFieldIteratorType;
-  InputFieldIteratorType  leftIter(   leftField,  outputRegionForThread );
-  InputFieldIteratorType  rightIter(  rightField, outputRegionForThread );
-  OutputFieldIteratorType outputIter( outputPtr,  outputRegionForThread );
+  const FieldGeometryType & lg = m_LeftGeometry;
+  const FieldGeometryType & rg = m_RightGeometry;
 
-  InputFieldGradientType leftgrad, rightgrad;
+  // Range of the first index for which both inputs are inside along the
+  // first dimension
+  const IndexValueType rowStart = outputRegionForThread.GetIndex()[0];
+  const IndexValueType rowEnd = rowStart + static_cast<IndexValueType>( rowLength );
+  const IndexValueType innerStart = vnl_math_min( rowEnd, vnl_math_max(
+                                                    rowStart,
+                                                    vnl_math_max( lg.m_Start[0], rg.m_Start[0] ) + 1 ) );
+  const IndexValueType innerEnd = vnl_math_max( innerStart, vnl_math_min(
+                                                  rowEnd,
+                                                  vnl_math_min( lg.m_End[0], rg.m_End[0] ) - 1 ) );
 
-  while( !leftIter.IsAtEnd() )
+  typedef ImageLinearIteratorWithIndex<OutputFieldType> RowIteratorType;
+  RowIteratorType rowIt( outputPtr, outputRegionForThread );
+  rowIt.SetDirection( 0 );
+
+  bool leftInside[InputFieldDimension];
+  bool rightInside[InputFieldDimension];
+
+  for( rowIt.GoToBegin(); !rowIt.IsAtEnd(); rowIt.NextLine() )
     {
-    leftgrad = m_LeftGradientCalculator->EvaluateAtIndex(leftIter.GetIndex() );
-    rightgrad = m_RightGradientCalculator->EvaluateAtIndex(rightIter.GetIndex() );
+    const InputFieldIndexType rowIndex = rowIt.GetIndex();
+
+    // The border tests along the other dimensions are constant on a row
+    bool rowInside = true;
+    for( unsigned int j = 1; j < InputFieldDimension; j++ )
+      {
+      leftInside[j] = ( rowIndex[j] > lg.m_Start[j] && rowIndex[j] < lg.m_End[j] - 1 );
+      rightInside[j] = ( rowIndex[j] > rg.m_Start[j] && rowIndex[j] < rg.m_End[j] - 1 );
+      rowInside = rowInside && leftInside[j] && rightInside[j];
+      }
+
+    OffsetValueType leftOffset = 0;
+    OffsetValueType rightOffset = 0;
+    for( unsigned int j = 0; j < InputFieldDimension; j++ )
+      {
+      leftOffset += ( rowIndex[j] - lg.m_Start[j] ) * lg.m_Strides[j];
+      rightOffset += ( rowIndex[j] - rg.m_Start[j] ) * rg.m_Strides[j];
+      }
+    const InputFieldPixelType * left = lg.m_Buffer + leftOffset;
+    const InputFieldPixelType * right = rg.m_Buffer + rightOffset;
+    OutputFieldPixelType *      out = &( rowIt.Value() );
 
-    const InputFieldPixelType & leftval = leftIter.Value();
-    const InputFieldPixelType & rightval = rightIter.Value();
-    OutputFieldPixelType &      outVal = outputIter.Value();
-    for( unsigned int d = 0; d < InputFieldDimension; d++ )
+    IndexValueType x = rowStart;
+
+    // Border pixels before the inner part of the row
+    const IndexValueType borderEnd = rowInside ? innerStart : rowEnd;
+    for( ; x < borderEnd; ++x, ++left, ++right, ++out )
+      {
+      leftInside[0] = ( x > lg.m_Start[0] && x < lg.m_End[0] - 1 );
+      rightInside[0] = ( x > rg.m_Start[0] && x < rg.m_End[0] - 1 );
+      this->EvaluateAtBorderPixel( left, right, leftInside, rightInside, *out );
+      }
+
+    // Inner part of the row: no border test
+    if( rowInside )
       {
-      outVal[d] = ( leftgrad(d, 0) * rightval[0]
-                    - rightgrad(d, 0) * leftval[0] );
-      for( unsigned int dd = 1; dd < InputFieldDimension; dd++ )
+      for( ; x < innerEnd; ++x, ++left, ++right, ++out )
+        {
+        const InputFieldPixelType & leftval = *left;
+        const InputFieldPixelType & rightval = *right;
+
+        double acc[InputFieldDimension];
+        for( unsigned int d = 0; d < InputFieldDimension; d++ )
+          {
+          acc[d] = 0.0;
+          }
+        for( unsigned int j = 0; j < InputFieldDimension; j++ )
+          {
+          double lw = 0.0;
+          double rw = 0.0;
+          for( unsigned int k = 0; k < InputFieldDimension; k++ )
+            {
+            lw += lg.m_WeightedDirection[j][k] * rightval[k];
+            rw += rg.m_WeightedDirection[j][k] * leftval[k];
+            }
+          const InputFieldPixelType & lf = left[lg.m_Strides[j]];
+          const InputFieldPixelType & lb = left[-lg.m_Strides[j]];
+          const InputFieldPixelType & rf = right[rg.m_Strides[j]];
+          const InputFieldPixelType & rb = right[-rg.m_Strides[j]];
+          for( unsigned int d = 0; d < InputFieldDimension; d++ )
+            {
+            acc[d] += lw * ( lf[d] - lb[d] ) - rw * ( rf[d] - rb[d] );
+            }
+          }
+        OutputFieldPixelType & outVal = *out;
+        for( unsigned int d = 0; d < InputFieldDimension; d++ )
+          {
+          outVal[d] = acc[d];
+          }
+        }
+
+      // Border pixels after the inner part of the row
+      for( ; x < rowEnd; ++x, ++left, ++right, ++out )
         {
-        outVal[d] += ( leftgrad(d, dd) * rightval[dd]
-                       - rightgrad(d, dd) * leftval[dd] );
+        leftInside[0] = ( x > lg.m_Start[0] && x < lg.m_End[0] - 1 );
+        rightInside[0] = ( x > rg.m_Start[0] && x < rg.m_End[0] - 1 );
+        this->EvaluateAtBorderPixel( left, right, leftInside, rightInside, *out );
         }
       }
 
-    ++leftIter;
-    ++rightIter;
-    ++outputIter;
     progress.CompletedPixel(); // potential exception thrown here
     }
 }
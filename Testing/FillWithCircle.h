@@ -0,0 +1,62 @@
+#ifndef __FillWithCircle_h
+#define __FillWithCircle_h
+
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+// Template function to fill in an image with a circle.
+template <class TImage>
+void
+FillWithCircle(typename TImage::Pointer image,
+               const double * const center,
+               const double radius,
+               const typename TImage::PixelType foregnd,
+               const typename TImage::PixelType backgnd )
+{
+  const double r2 = vnl_math_sqr( radius );
+
+  typedef itk::ImageRegionIteratorWithIndex<TImage> Iterator;
+  for( Iterator it( image, image->GetBufferedRegion() ); !it.IsAtEnd(); ++it )
+    {
+    const typename TImage::IndexType & index = it.GetIndex();
+    double d2 = 0.0;
+    for( unsigned int j = 0; j < TImage::ImageDimension; j++ )
+      {
+      d2 += vnl_math_sqr( (double) index[j] - center[j]);
+      }
+    if( d2 <= r2 )
+      {
+      it.Set( foregnd );
+      }
+    else
+      {
+      it.Set( backgnd );
+      }
+    }
+}
+
+// Template function to create a fixed and a moving image on the given
+// region, each filled in with a circle of the given radius around its
+// own center.
+template <class TImage>
+void
+CreateShiftedCircles(const typename TImage::RegionType & region,
+                     const double * const fixedCenter,
+                     const double * const movingCenter,
+                     const double radius,
+                     typename TImage::Pointer & fixed,
+                     typename TImage::Pointer & moving)
+{
+  fixed = TImage::New();
+  fixed->SetRegions( region );
+  fixed->Allocate();
+
+  moving = TImage::New();
+  moving->SetRegions( region );
+  moving->Allocate();
+
+  FillWithCircle<TImage>( fixed, fixedCenter, radius, 250.0, 15.0 );
+  FillWithCircle<TImage>( moving, movingCenter, radius, 250.0, 15.0 );
+}
+
+#endif
@@ -138,6 +138,155 @@ int main(int, char * [] )
     testPassed = false;
     }
 
+  // =============================================================
+
+  std::cout << "Log the deformation field up to a tolerance." << std::endl;
+
+  // A smooth velocity field, for which the iterations converge
+  FieldType::Pointer smoothField = FieldType::New();
+  smoothField->SetRegions( region );
+  smoothField->Allocate();
+  for( FieldIterator it( smoothField, region ); !it.IsAtEnd(); ++it )
+    {
+    const IndexType & idx = it.GetIndex();
+    PixelType         value;
+    value[0] = 2.0 * vcl_sin( 2.0 * vnl_math::pi * idx[1] / size[1] );
+    value[1] = 1.5 * vcl_cos( 2.0 * vnl_math::pi * idx[0] / size[0] );
+    it.Set( value );
+    }
+
+  ExpFilterType::Pointer smoothExper = ExpFilterType::New();
+  smoothExper->SetInput( smoothField );
+  smoothExper->Update();
+
+  LogFilterType::Pointer convergingLoger = LogFilterType::New();
+  convergingLoger->SetInput( smoothExper->GetOutput() );
+  convergingLoger->SetNumberOfIterations( 50 );
+  convergingLoger->SetTolerance( 1e-2 );
+  convergingLoger->SmoothVelocityFieldOff();
+  convergingLoger->Update();
+
+  const std::vector<double> & residuals = convergingLoger->GetResidualHistory();
+  std::cout << "Elapsed iterations: " << convergingLoger->GetElapsedIterations() << ", residuals:";
+  for( unsigned int i = 0; i < residuals.size(); ++i )
+    {
+    std::cout << " " << residuals[i];
+    }
+  std::cout << std::endl;
+
+  // The iterations stop at the first residual below the tolerance
+  if( convergingLoger->GetElapsedIterations() >= 50
+      || residuals.size() != convergingLoger->GetElapsedIterations() + 1
+      || residuals.back() >= 1e-2 || residuals.front() <= residuals.back() )
+    {
+    testPassed = false;
+    }
+  for( unsigned int i = 0; i + 1 < residuals.size(); ++i )
+    {
+    if( residuals[i] < 1e-2 )
+      {
+      testPassed = false;
+      }
+    }
+
+  // =============================================================
+
+  std::cout << "Log the deformation field with Anderson acceleration." << std::endl;
+
+  LogFilterType::Pointer andersonLoger = LogFilterType::New();
+  andersonLoger->SetInput( smoothExper->GetOutput() );
+  andersonLoger->SetNumberOfIterations( 50 );
+  andersonLoger->SetTolerance( 1e-2 );
+  andersonLoger->SmoothVelocityFieldOff();
+  andersonLoger->UseAndersonAccelerationOn();
+  andersonLoger->SetAndersonWindowSize( 3 );
+  andersonLoger->Update();
+
+  const std::vector<double> & andersonResiduals = andersonLoger->GetResidualHistory();
+  std::cout << "Elapsed iterations: " << andersonLoger->GetElapsedIterations() << ", residuals:";
+  for( unsigned int i = 0; i < andersonResiduals.size(); ++i )
+    {
+    std::cout << " " << andersonResiduals[i];
+    }
+  std::cout << std::endl;
+
+  // Not slower than the plain iterations, and the same logarithm
+  if( andersonResiduals.back() >= 1e-2
+      || andersonLoger->GetElapsedIterations() > convergingLoger->GetElapsedIterations() )
+    {
+    testPassed = false;
+    }
+
+  double andersonSquareDiff = 0.0;
+  FieldIterator smoothIt( smoothField, region );
+  FieldIterator andersonIt( andersonLoger->GetOutput(), region );
+  for( ; !smoothIt.IsAtEnd(); ++smoothIt, ++andersonIt )
+    {
+    andersonSquareDiff += ( smoothIt.Get() - andersonIt.Get() ).GetSquaredNorm();
+    }
+  andersonSquareDiff /= region.GetNumberOfPixels();
+  std::cout << "Mean squared difference to the velocity field: " << andersonSquareDiff << std::endl;
+  if( andersonSquareDiff > 0.006 )
+    {
+    testPassed = false;
+    }
+
+  // =============================================================
+
+  std::cout << "Smooth a 3D field along the last dimension." << std::endl;
+  {
+  typedef itk::Vector<double, 3>                   VectorType3D;
+  typedef itk::Image<VectorType3D, 3>              FieldType3D;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType3D> FieldIterator3D;
+  typedef itk::DisplacementToVelocityFieldLogFilter<FieldType3D, FieldType3D> LogFilterType3D;
+
+  FieldType3D::RegionType region3D;
+  FieldType3D::SizeType   size3D = {{6, 6, 32}};
+  region3D.SetSize( size3D );
+
+  // A displacement field that only varies along z
+  FieldType3D::Pointer displacement3D = FieldType3D::New();
+  displacement3D->SetRegions( region3D );
+  displacement3D->Allocate();
+  for( FieldIterator3D it( displacement3D, region3D ); !it.IsAtEnd(); ++it )
+    {
+    VectorType3D value;
+    value.Fill( 0.0 );
+    value[2] = 0.3 * vcl_sin( 0.5 * vnl_math::pi * it.GetIndex()[2] );
+    it.Set( value );
+    }
+
+  FieldType3D::Pointer logs[2];
+  for( unsigned int smooth = 0; smooth < 2; ++smooth )
+    {
+    LogFilterType3D::Pointer loger3D = LogFilterType3D::New();
+    loger3D->SetInput( displacement3D );
+    loger3D->SetNumberOfIterations( 2 );
+    loger3D->SetSmoothVelocityField( smooth == 1 );
+    loger3D->SetSigma( 2.0 );
+    loger3D->SetNumberOfExponentialIntegrationSteps( 50 );
+    loger3D->Update();
+    logs[smooth] = loger3D->GetOutput();
+    logs[smooth]->DisconnectPipeline();
+    }
+
+  // The smoothing attenuates the oscillations along z
+  double amplitudes[2] = {0.0, 0.0};
+  for( unsigned int smooth = 0; smooth < 2; ++smooth )
+    {
+    for( FieldIterator3D it( logs[smooth], region3D ); !it.IsAtEnd(); ++it )
+      {
+      amplitudes[smooth] = vnl_math_max( amplitudes[smooth], vnl_math_abs( it.Get()[2] ) );
+      }
+    }
+  std::cout << "Amplitude along z: " << amplitudes[0] << " without smoothing, "
+            << amplitudes[1] << " with smoothing" << std::endl;
+  if( amplitudes[1] > 0.5 * amplitudes[0] )
+    {
+    testPassed = false;
+    }
+  }
+
   if( !testPassed )
     {
     std::cout << "Test failed." << std::endl;
@@ -0,0 +1,142 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
+#include "itkForwardInverseExponentialDisplacementFieldImageFilter.h"
+
+#include "vnl/vnl_math.h"
+
+#include <iostream>
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+
+  typedef itk::Vector<double, ImageDimension>          PixelType;
+  typedef itk::Image<PixelType, ImageDimension>        ImageType;
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> IteratorType;
+
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{32, 24}};
+  region.SetSize( size );
+
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.5;
+  spacing[1] = 0.75;
+
+  ImageType::Pointer inputImage = ImageType::New();
+  inputImage->SetRegions( region );
+  inputImage->SetSpacing( spacing );
+  inputImage->Allocate();
+
+  // Smooth non-constant velocity field
+  for( IteratorType it( inputImage, region ); !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType & idx = it.GetIndex();
+    const double                 x = static_cast<double>( idx[0] ) / size[0];
+    const double                 y = static_cast<double>( idx[1] ) / size[1];
+    PixelType                    v;
+    v[0] = 4.0 * vcl_sin( vnl_math::pi * x ) * vcl_cos( vnl_math::pi * y );
+    v[1] = -3.0 * vcl_cos( vnl_math::pi * x ) * vcl_sin( 2.0 * vnl_math::pi * y );
+    it.Set( v );
+    }
+
+  typedef itk::ExponentialDisplacementFieldImageFilter<ImageType, ImageType> ExponentiatorType;
+  ExponentiatorType::Pointer forward = ExponentiatorType::New();
+  forward->SetInput( inputImage );
+  forward->Update();
+
+  ExponentiatorType::Pointer inverse = ExponentiatorType::New();
+  inverse->SetInput( inputImage );
+  inverse->ComputeInverseOn();
+  inverse->Update();
+
+  typedef itk::ForwardInverseExponentialDisplacementFieldImageFilter<ImageType, ImageType> FilterType;
+  FilterType::Pointer filter = FilterType::New();
+  filter->SetInput( inputImage );
+  filter->Update();
+
+  std::cout << "Number of squarings: " << filter->GetNumberOfIterations() << std::endl;
+
+  double maxForwardDiff = 0.0;
+  double maxInverseDiff = 0.0;
+
+  IteratorType ref0( forward->GetOutput(), region );
+  IteratorType ref1( inverse->GetOutput(), region );
+  IteratorType out0( filter->GetOutput(), region );
+  IteratorType out1( filter->GetInverseOutput(), region );
+  for( ; !ref0.IsAtEnd(); ++ref0, ++ref1, ++out0, ++out1 )
+    {
+    maxForwardDiff = vnl_math_max( maxForwardDiff, ( ref0.Get() - out0.Get() ).GetNorm() );
+    maxInverseDiff = vnl_math_max( maxInverseDiff, ( ref1.Get() - out1.Get() ).GetNorm() );
+    }
+
+  std::cout << "Max forward difference: " << maxForwardDiff << std::endl;
+  std::cout << "Max inverse difference: " << maxInverseDiff << std::endl;
+
+  const double epsilon = 1e-6;
+  if( maxForwardDiff > epsilon || maxInverseDiff > epsilon )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // A float field squared in double precision is only rounded once
+  typedef itk::Vector<float, ImageDimension>                FloatPixelType;
+  typedef itk::Image<FloatPixelType, ImageDimension>        FloatImageType;
+  typedef itk::ImageRegionIteratorWithIndex<FloatImageType> FloatIteratorType;
+
+  FloatImageType::Pointer floatImage = FloatImageType::New();
+  floatImage->SetRegions( region );
+  floatImage->SetSpacing( spacing );
+  floatImage->Allocate();
+  IteratorType      in( inputImage, region );
+  FloatIteratorType floatIt( floatImage, region );
+  for( ; !in.IsAtEnd(); ++in, ++floatIt )
+    {
+    FloatPixelType v;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      v[j] = static_cast<float>( in.Get()[j] );
+      }
+    floatIt.Set( v );
+    }
+
+  typedef itk::ForwardInverseExponentialDisplacementFieldImageFilter<FloatImageType, FloatImageType> FloatFilterType;
+  double maxFloatDiff[2] = { 0.0, 0.0 };
+  for( unsigned int precision = 0; precision < 2; ++precision )
+    {
+    FloatFilterType::Pointer floatFilter = FloatFilterType::New();
+    floatFilter->SetInput( floatImage );
+    floatFilter->SetUseDoublePrecisionSquaring( precision == 1 );
+    floatFilter->Update();
+
+    FloatIteratorType floatOut0( floatFilter->GetOutput(), region );
+    FloatIteratorType floatOut1( floatFilter->GetInverseOutput(), region );
+    for( ref0.GoToBegin(), ref1.GoToBegin(); !ref0.IsAtEnd(); ++ref0, ++ref1, ++floatOut0, ++floatOut1 )
+      {
+      for( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        maxFloatDiff[precision] = vnl_math_max( maxFloatDiff[precision],
+                                                vnl_math_abs( ref0.Get()[j] - floatOut0.Get()[j] ) );
+        maxFloatDiff[precision] = vnl_math_max( maxFloatDiff[precision],
+                                                vnl_math_abs( ref1.Get()[j] - floatOut1.Get()[j] ) );
+        }
+      }
+    }
+
+  std::cout << "Max float difference: " << maxFloatDiff[0]
+            << ", with double precision squarings: " << maxFloatDiff[1] << std::endl;
+  if( maxFloatDiff[1] > 1e-5 )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
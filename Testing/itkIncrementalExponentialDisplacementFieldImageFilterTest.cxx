@@ -0,0 +1,129 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
+#include "itkIncrementalExponentialDisplacementFieldImageFilter.h"
+
+#include "vnl/vnl_math.h"
+
+#include <iostream>
+
+const unsigned int ImageDimension = 2;
+
+typedef itk::Vector<float, ImageDimension>           PixelType;
+typedef itk::Image<PixelType, ImageDimension>        ImageType;
+typedef itk::ImageRegionIteratorWithIndex<ImageType> IteratorType;
+
+// Fill the field with a smooth velocity scaled by the given amplitude
+// and shifted in phase
+void FillVelocity( ImageType * field, double amplitude, double phase )
+{
+  const ImageType::SizeType size = field->GetLargestPossibleRegion().GetSize();
+  for( IteratorType it( field, field->GetLargestPossibleRegion() ); !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType & idx = it.GetIndex();
+    const double                 x = static_cast<double>( idx[0] ) / size[0];
+    const double                 y = static_cast<double>( idx[1] ) / size[1];
+    PixelType                    v;
+    v[0] = amplitude * vcl_sin( vnl_math::pi * x + phase ) * vcl_cos( vnl_math::pi * y );
+    v[1] = -amplitude * vcl_cos( vnl_math::pi * x ) * vcl_sin( 2.0 * vnl_math::pi * y + phase );
+    it.Set( v );
+    }
+  field->Modified();
+}
+
+double MaxDifference( ImageType * a, ImageType * b )
+{
+  double maxDiff = 0.0;
+  IteratorType ita( a, a->GetLargestPossibleRegion() );
+  IteratorType itb( b, b->GetLargestPossibleRegion() );
+  for( ; !ita.IsAtEnd(); ++ita, ++itb )
+    {
+    maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( ita.Get() - itb.Get() ).GetNorm() ) );
+    }
+  return maxDiff;
+}
+
+int main(int, char * [] )
+{
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{48, 40}};
+  region.SetSize( size );
+
+  ImageType::Pointer velocity = ImageType::New();
+  velocity->SetRegions( region );
+  velocity->Allocate();
+
+  typedef itk::ExponentialDisplacementFieldImageFilter<ImageType, ImageType> ExponentiatorType;
+  ExponentiatorType::Pointer reference = ExponentiatorType::New();
+  reference->SetInput( velocity );
+
+  typedef itk::IncrementalExponentialDisplacementFieldImageFilter<ImageType, ImageType> FilterType;
+  FilterType::Pointer filter = FilterType::New();
+  filter->SetInput( velocity );
+  filter->SetMaximumIncrementalUpdateNorm( 0.5 );
+
+  bool testPassed = true;
+
+  // A sequence of slowly varying velocity fields: the first one requires
+  // a full computation, the following ones should be incremental
+  const unsigned int numberOfSteps = 4;
+  for( unsigned int step = 0; step < numberOfSteps; ++step )
+    {
+    FillVelocity( velocity, 3.0 + 0.1 * step, 0.01 * step );
+
+    filter->Modified();
+    filter->Update();
+    reference->Update();
+
+    const double diff = MaxDifference( filter->GetOutput(), reference->GetOutput() );
+    std::cout << "Step " << step
+              << "  incremental: " << filter->GetLastUpdateWasIncremental()
+              << "  squarings: " << filter->GetNumberOfSquarings()
+              << "  max difference: " << diff << std::endl;
+
+    if( diff > 0.05 )
+      {
+      testPassed = false;
+      }
+    if( filter->GetLastUpdateWasIncremental() != ( step > 0 ) )
+      {
+      testPassed = false;
+      }
+    }
+
+  // A large change of the velocity field triggers a full computation
+  FillVelocity( velocity, 6.0, 0.5 );
+  filter->Modified();
+  filter->Update();
+  reference->Update();
+
+  const double diff = MaxDifference( filter->GetOutput(), reference->GetOutput() );
+  std::cout << "Large update  incremental: " << filter->GetLastUpdateWasIncremental()
+            << "  max difference: " << diff << std::endl;
+  if( filter->GetLastUpdateWasIncremental() || diff > 1e-5 )
+    {
+    testPassed = false;
+    }
+
+  std::cout << "Incremental exponentials: " << filter->GetNumberOfIncrementalExponentials() << std::endl;
+  std::cout << "Full exponentials: " << filter->GetNumberOfFullExponentials() << std::endl;
+  if( filter->GetNumberOfIncrementalExponentials() != numberOfSteps - 1
+      || filter->GetNumberOfFullExponentials() != 2 )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkVectorResampleImageFilter.h"
+#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
+#include "itkIntegerFactorVectorFieldExpandFilter.h"
+
+#include "vnl/vnl_math.h"
+
+#include <iostream>
+
+const unsigned int ImageDimension = 3;
+
+typedef itk::Vector<float, ImageDimension>           PixelType;
+typedef itk::Image<PixelType, ImageDimension>        ImageType;
+typedef itk::ImageRegionIteratorWithIndex<ImageType> IteratorType;
+
+int main(int, char * [] )
+{
+  ImageType::RegionType region;
+  ImageType::IndexType  start = {{2, 0, 1}};
+  ImageType::SizeType   size = {{13, 9, 7}};
+  region.SetIndex( start );
+  region.SetSize( size );
+
+  ImageType::SpacingType spacing;
+  spacing[0] = 2.0;
+  spacing[1] = 3.0;
+  spacing[2] = 1.5;
+
+  ImageType::PointType origin;
+  origin[0] = 1.0;
+  origin[1] = -2.0;
+  origin[2] = 0.5;
+
+  // A rotation around the last axis
+  ImageType::DirectionType direction;
+  direction.SetIdentity();
+  direction(0, 0) = vcl_cos( 0.3 );
+  direction(0, 1) = -vcl_sin( 0.3 );
+  direction(1, 0) = vcl_sin( 0.3 );
+  direction(1, 1) = vcl_cos( 0.3 );
+
+  ImageType::Pointer field = ImageType::New();
+  field->SetRegions( region );
+  field->SetSpacing( spacing );
+  field->SetOrigin( origin );
+  field->SetDirection( direction );
+  field->Allocate();
+
+  // A non smooth field with a different pattern on each component
+  for( IteratorType it( field, region ); !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType & idx = it.GetIndex();
+    PixelType                    v;
+    v[0] = static_cast<float>( ( 7 * idx[0] + 3 * idx[1] + idx[2] ) % 11 );
+    v[1] = static_cast<float>( vcl_sin( 0.9 * idx[0] ) * vcl_cos( 1.3 * idx[2] ) );
+    v[2] = static_cast<float>( idx[1] * idx[2] % 5 ) - 2.0f;
+    it.Set( v );
+    }
+
+  // The grid of the next level of a pyramid with these shrink factors
+  const unsigned int factors[ImageDimension] = {2, 3, 1};
+
+  ImageType::SizeType    outputSize;
+  ImageType::IndexType   outputStart;
+  ImageType::SpacingType outputSpacing;
+  ImageType::SpacingType spacingDifference;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    outputSize[j] = size[j] * factors[j];
+    outputStart[j] = start[j] * factors[j];
+    outputSpacing[j] = spacing[j] / factors[j];
+    spacingDifference[j] = spacing[j] - outputSpacing[j];
+    }
+  const ImageType::PointType::VectorType originOffset = ( direction * spacingDifference ) * 0.5;
+  ImageType::PointType outputOrigin = origin - originOffset;
+
+  // Reference: the generic resampler
+  typedef itk::VectorResampleImageFilter<ImageType, ImageType> ResamplerType;
+  typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<
+    ImageType, double>                                         InterpolatorType;
+
+  ResamplerType::Pointer resampler = ResamplerType::New();
+  resampler->SetInterpolator( InterpolatorType::New() );
+  resampler->SetInput( field );
+  resampler->SetSize( outputSize );
+  resampler->SetOutputStartIndex( outputStart );
+  resampler->SetOutputOrigin( outputOrigin );
+  resampler->SetOutputSpacing( outputSpacing );
+  resampler->SetOutputDirection( direction );
+  resampler->Update();
+
+  typedef itk::IntegerFactorVectorFieldExpandFilter<ImageType, ImageType> ExpanderType;
+
+  bool testPassed = true;
+
+  // The result should not depend on the number of threads
+  const unsigned int numberOfThreads[2] = {1, 3};
+  for( unsigned int t = 0; t < 2; ++t )
+    {
+    ExpanderType::Pointer expander = ExpanderType::New();
+    expander->SetInput( field );
+    expander->SetSize( outputSize );
+    expander->SetOutputStartIndex( outputStart );
+    expander->SetOutputOrigin( outputOrigin );
+    expander->SetOutputSpacing( outputSpacing );
+    expander->SetOutputDirection( direction );
+    expander->SetNumberOfThreads( numberOfThreads[t] );
+
+    if( !expander->CanExpand( field ) )
+      {
+      std::cout << "Integer factor expansion not detected" << std::endl;
+      testPassed = false;
+      break;
+      }
+    expander->Update();
+
+    ImageType * output = expander->GetOutput();
+    if( output->GetLargestPossibleRegion() != resampler->GetOutput()->GetLargestPossibleRegion() )
+      {
+      std::cout << "Wrong output region" << std::endl;
+      testPassed = false;
+      }
+
+    double maxDiff = 0.0;
+    IteratorType refIt( resampler->GetOutput(), resampler->GetOutput()->GetLargestPossibleRegion() );
+    IteratorType it( output, resampler->GetOutput()->GetLargestPossibleRegion() );
+    for( ; !it.IsAtEnd(); ++it, ++refIt )
+      {
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( it.Get() - refIt.Get() ).GetNorm() ) );
+      }
+    std::cout << "Threads: " << numberOfThreads[t] << "  max difference: " << maxDiff << std::endl;
+    if( maxDiff > 1e-4 )
+      {
+      testPassed = false;
+      }
+    }
+
+  // Non integer factors are rejected
+  ExpanderType::Pointer expander = ExpanderType::New();
+  ImageType::SpacingType wrongSpacing = outputSpacing;
+  wrongSpacing[1] = 0.4 * spacing[1];
+  expander->SetInput( field );
+  expander->SetSize( outputSize );
+  expander->SetOutputOrigin( outputOrigin );
+  expander->SetOutputSpacing( wrongSpacing );
+  expander->SetOutputDirection( direction );
+  if( expander->CanExpand( field ) )
+    {
+    std::cout << "Non integer factor not detected" << std::endl;
+    testPassed = false;
+    }
+
+  bool caught = false;
+  try
+    {
+    expander->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Caught expected exception: " << err.GetDescription() << std::endl;
+    caught = true;
+    }
+  if( !caught )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkLogDomainDemonsRegistrationFilter.h"
+#include "itkSymmetricLogDomainDemonsRegistrationFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "FillWithCircle.h"
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::LogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType>          RegistrationType;
+  typedef itk::SymmetricLogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType> SymmetricRegistrationType;
+
+  // Create two shifted circles, the size is not a multiple of the factor
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{65, 63}};
+  region.SetSize( size );
+
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.5;
+  spacing[1] = 1.0;
+
+  const double       fixedCenter[ImageDimension] = {30.0, 32.0};
+  const double       movingCenter[ImageDimension] = {33.0, 30.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 15.0, fixed, moving );
+  fixed->SetSpacing( spacing );
+  moving->SetSpacing( spacing );
+
+  // Metric of the identity transformation
+  double initialMetric = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
+  for( Iterator fIt( fixed, region ), mIt( moving, region ); !fIt.IsAtEnd(); ++fIt, ++mIt )
+    {
+    initialMetric += vnl_math_sqr( fIt.Get() - mIt.Get() );
+    }
+  initialMetric /= region.GetNumberOfPixels();
+
+  const unsigned int shrinkFactor = 2;
+
+  RegistrationType::Pointer registrator = RegistrationType::New();
+  registrator->SetMovingImage( moving );
+  registrator->SetFixedImage( fixed );
+  registrator->SetNumberOfIterations( 30 );
+  registrator->SetStandardDeviations( 2.0 );
+  registrator->SetMaximumUpdateStepLength( 2.0 );
+  registrator->SetVelocityFieldShrinkFactor( shrinkFactor );
+  registrator->Update();
+
+  bool testPassed = true;
+
+  // The velocity field lives on the coarse grid
+  const FieldType * velocity = registrator->GetOutput();
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    if( velocity->GetLargestPossibleRegion().GetSize()[j] != ( size[j] + shrinkFactor - 1 ) / shrinkFactor
+        || vnl_math_abs( velocity->GetSpacing()[j] - shrinkFactor * spacing[j] ) > 1e-10 )
+      {
+      std::cout << "Wrong velocity field grid: " << velocity->GetLargestPossibleRegion()
+                << velocity->GetSpacing() << std::endl;
+      testPassed = false;
+      }
+    }
+
+  // The first cell is centered on the first voxels of the fixed image
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    if( vnl_math_abs( velocity->GetOrigin()[j] - 0.5 * ( shrinkFactor - 1.0 ) * spacing[j] ) > 1e-10 )
+      {
+      std::cout << "Wrong velocity field origin: " << velocity->GetOrigin() << std::endl;
+      testPassed = false;
+      }
+    }
+
+  // The deformation field lives on the fixed image grid
+  FieldType::Pointer deformation = registrator->GetDeformationField();
+  if( deformation->GetLargestPossibleRegion() != region
+      || deformation->GetSpacing() != spacing
+      || deformation->GetOrigin() != fixed->GetOrigin() )
+    {
+    std::cout << "Wrong deformation field grid" << std::endl;
+    testPassed = false;
+    }
+
+  // The registration is still effective
+  const double metric = registrator->GetMetric();
+  std::cout << "Initial metric: " << initialMetric << "  final metric: " << metric << std::endl;
+  if( metric > 0.25 * initialMetric )
+    {
+    testPassed = false;
+    }
+
+  // The symmetric update does not support a coarse velocity field
+  SymmetricRegistrationType::Pointer symmetric = SymmetricRegistrationType::New();
+  symmetric->SetMovingImage( moving );
+  symmetric->SetFixedImage( fixed );
+  symmetric->SetNumberOfIterations( 2 );
+  symmetric->SetVelocityFieldShrinkFactor( shrinkFactor );
+
+  bool caught = false;
+  try
+    {
+    symmetric->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Caught expected exception: " << err.GetDescription() << std::endl;
+    caught = true;
+    }
+  if( !caught )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkLogDomainDemonsRegistrationFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "FillWithCircle.h"
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::LogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType> RegistrationType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{64, 64}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {30.0, 32.0};
+  const double       movingCenter[ImageDimension] = {33.0, 31.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 15.0, fixed, moving );
+
+  const unsigned int maximumNumberOfIterations = 200;
+  const unsigned int windowSize = 10;
+
+  RegistrationType::Pointer registrator = RegistrationType::New();
+  registrator->SetMovingImage( moving );
+  registrator->SetFixedImage( fixed );
+  registrator->SetStandardDeviations( 1.0 );
+  registrator->SetMaximumUpdateStepLength( 2.0 );
+
+  bool testPassed = true;
+
+  // Without the convergence criterion, all the iterations are run
+  registrator->SetNumberOfIterations( windowSize );
+  registrator->UseConvergenceCriterionOff();
+  registrator->Update();
+
+  const double fixedBudgetMetric = registrator->GetMetric();
+  std::cout << "Fixed budget  iterations: " << registrator->GetElapsedIterations()
+            << "  metric: " << fixedBudgetMetric << std::endl;
+  if( registrator->GetElapsedIterations() != windowSize || registrator->GetConverged() )
+    {
+    testPassed = false;
+    }
+
+  // With the convergence criterion, the registration stops once the metric
+  // plateaus, well before the maximum number of iterations
+  registrator->SetNumberOfIterations( maximumNumberOfIterations );
+  registrator->UseConvergenceCriterionOn();
+  registrator->SetConvergenceWindowSize( windowSize );
+  registrator->SetConvergenceTolerance( 1e-3 );
+  registrator->Modified();
+  registrator->Update();
+
+  const double convergedMetric = registrator->GetMetric();
+  std::cout << "Convergence   iterations: " << registrator->GetElapsedIterations()
+            << "  metric: " << convergedMetric
+            << "  converged: " << registrator->GetConverged() << std::endl;
+  if( !registrator->GetConverged()
+      || registrator->GetElapsedIterations() < windowSize
+      || registrator->GetElapsedIterations() >= maximumNumberOfIterations
+      || convergedMetric > 1.01 * fixedBudgetMetric )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,243 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkLogDomainDemonsRegistrationFilter.h"
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "FillWithCircle.h"
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::LogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType>              RegistrationType;
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef RegistrationType::MaskImageType                                                      MaskImageType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{64, 64}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {32.0, 32.0};
+  const double       movingCenter[ImageDimension] = {34.0, 31.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 12.0, fixed, moving );
+
+  // The mask covers both circles
+  const double           maskRadius = 16.0;
+  MaskImageType::Pointer mask = MaskImageType::New();
+  mask->SetRegions( region );
+  mask->Allocate();
+  FillWithCircle<MaskImageType>( mask, fixedCenter, maskRadius, 1, 0 );
+
+  // Sum of squared differences of the identity transformation, all of it
+  // lies in the mask
+  double initialSSD = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
+  for( Iterator fIt( fixed, region ), mIt( moving, region ); !fIt.IsAtEnd(); ++fIt, ++mIt )
+    {
+    initialSSD += vnl_math_sqr( fIt.Get() - mIt.Get() );
+    }
+
+  RegistrationType::Pointer registrator = RegistrationType::New();
+  registrator->SetMovingImage( moving );
+  registrator->SetFixedImage( fixed );
+  registrator->SetNumberOfIterations( 30 );
+  registrator->SetStandardDeviations( 1.0 );
+  registrator->SetMaximumUpdateStepLength( 2.0 );
+  registrator->SetSmoothingEngine( RegistrationType::LineBufferGaussianSmoothing );
+  registrator->SetFixedImageMask( mask );
+  registrator->Update();
+
+  bool testPassed = true;
+
+  // The dilated mask is smaller than the image
+  const RegistrationType::SizeValueType numberOfActivePixels = registrator->GetNumberOfActivePixels();
+  std::cout << "Active pixels: " << numberOfActivePixels << " / " << region.GetNumberOfPixels() << std::endl;
+  if( numberOfActivePixels == 0 || numberOfActivePixels >= region.GetNumberOfPixels() )
+    {
+    testPassed = false;
+    }
+
+  // The velocity field is zero outside of the bounding box of the dilated
+  // mask: the radius of the function and of the smoothing kernel
+  const double dilatedRadius = maskRadius + 1.0 + 3.0;
+  double       maxOutside = 0.0;
+  double       maxInside = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIterator;
+  for( FieldIterator it( registrator->GetOutput(), region ); !it.IsAtEnd(); ++it )
+    {
+    bool outside = false;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( vnl_math_abs( it.GetIndex()[j] - fixedCenter[j] ) > dilatedRadius )
+        {
+        outside = true;
+        }
+      }
+    if( outside )
+      {
+      maxOutside = vnl_math_max( maxOutside, static_cast<double>( it.Get().GetNorm() ) );
+      }
+    else
+      {
+      maxInside = vnl_math_max( maxInside, static_cast<double>( it.Get().GetNorm() ) );
+      }
+    }
+  std::cout << "Max velocity inside: " << maxInside << "  outside: " << maxOutside << std::endl;
+  if( maxOutside != 0.0 || maxInside < 0.5 )
+    {
+    testPassed = false;
+    }
+
+  // The metric is computed over the active set
+  const double initialMetric = initialSSD / numberOfActivePixels;
+  const double metric = registrator->GetMetric();
+  std::cout << "Initial metric: " << initialMetric << "  final metric: " << metric << std::endl;
+  if( metric > 0.25 * initialMetric )
+    {
+    testPassed = false;
+    }
+
+  // Starting from a velocity field that is not zero outside of the bounding
+  // box of the active set, as one from a coarser level, the line buffer
+  // engine gives the results of the operator engine inside of the box
+  {
+  FieldType::Pointer initialField = FieldType::New();
+  initialField->SetRegions( region );
+  initialField->Allocate();
+  for( FieldIterator it( initialField, region ); !it.IsAtEnd(); ++it )
+    {
+    VectorType v;
+    v[0] = 1.5 * vcl_sin( 2.0 * vnl_math::pi * it.GetIndex()[1] / size[1] );
+    v[1] = 1.0 * vcl_cos( 2.0 * vnl_math::pi * it.GetIndex()[0] / size[0] );
+    it.Set( v );
+    }
+
+  const RegistrationType::SmoothingEngineType engines[2] =
+    {
+    RegistrationType::GaussianOperatorSmoothing,
+    RegistrationType::LineBufferGaussianSmoothing
+    };
+  FieldType::Pointer velocities[2];
+  for( unsigned int e = 0; e < 2; ++e )
+    {
+    RegistrationType::Pointer engineRegistrator = RegistrationType::New();
+    engineRegistrator->SetMovingImage( moving );
+    engineRegistrator->SetFixedImage( fixed );
+    engineRegistrator->SetInitialVelocityField( initialField );
+    engineRegistrator->SetNumberOfIterations( 1 );
+    engineRegistrator->SetStandardDeviations( 1.0 );
+    engineRegistrator->SetMaximumUpdateStepLength( 2.0 );
+    engineRegistrator->SetSmoothingEngine( engines[e] );
+    engineRegistrator->SetFixedImageMask( mask );
+    engineRegistrator->Update();
+    velocities[e] = engineRegistrator->GetOutput();
+    velocities[e]->DisconnectPipeline();
+    }
+
+  // The square of the mask lies in the bounding box of the active set
+  double maxDiff = 0.0;
+  for( FieldIterator opIt( velocities[0], region ), lbIt( velocities[1], region ); !opIt.IsAtEnd(); ++opIt, ++lbIt )
+    {
+    bool inside = true;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      inside = inside && vnl_math_abs( opIt.GetIndex()[j] - fixedCenter[j] ) <= maskRadius;
+      }
+    if( inside )
+      {
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( opIt.Get() - lbIt.Get() ).GetNorm() ) );
+      }
+    }
+  std::cout << "Max difference between the engines in the box: " << maxDiff << std::endl;
+  if( maxDiff > 1e-4 )
+    {
+    testPassed = false;
+    }
+  }
+
+  // The moving mask is tested at the points the voxels are mapped to:
+  // with a translation of -10 along x, a moving mask centered at x = 36
+  // activates the voxels around x = 46, so that the edge of the moving
+  // circle at x = 46 drives the update around x = 56, away from the mask
+  {
+  const double translation = -10.0;
+  FieldType::Pointer translationField = FieldType::New();
+  translationField->SetRegions( region );
+  translationField->Allocate();
+  VectorType t;
+  t[0] = translation;
+  t[1] = 0.0;
+  translationField->FillBuffer( t );
+
+  const double           movingMaskCenter[ImageDimension] = {36.0, 32.0};
+  MaskImageType::Pointer movingMask = MaskImageType::New();
+  movingMask->SetRegions( region );
+  movingMask->Allocate();
+  FillWithCircle<MaskImageType>( movingMask, movingMaskCenter, 8.0, 1, 0 );
+
+  RegistrationType::Pointer movingMaskRegistrator = RegistrationType::New();
+  movingMaskRegistrator->SetMovingImage( moving );
+  movingMaskRegistrator->SetFixedImage( fixed );
+  movingMaskRegistrator->SetInitialVelocityField( translationField );
+  movingMaskRegistrator->SetNumberOfIterations( 1 );
+  movingMaskRegistrator->SetStandardDeviations( 1.0 );
+  movingMaskRegistrator->SetMaximumUpdateStepLength( 2.0 );
+  movingMaskRegistrator->SetMovingImageMask( movingMask );
+  movingMaskRegistrator->Update();
+
+  double maxChange = 0.0;
+  for( FieldIterator it( movingMaskRegistrator->GetOutput(), region ); !it.IsAtEnd(); ++it )
+    {
+    if( it.GetIndex()[0] >= 54 && it.GetIndex()[0] <= 58 && vnl_math_abs( it.GetIndex()[1] - 32 ) <= 2 )
+      {
+      maxChange = vnl_math_max( maxChange, static_cast<double>( ( it.Get() - t ).GetNorm() ) );
+      }
+    }
+  std::cout << "Max change beside the mapped moving mask: " << maxChange << std::endl;
+  if( maxChange < 0.05 )
+    {
+    testPassed = false;
+    }
+  }
+
+  // The multi-resolution filter passes the masks to each level and
+  // restores the ones of the registration filter
+  const unsigned int numberOfIterations[2] = {10, 10};
+
+  MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+  multires->SetFixedImage( fixed );
+  multires->SetMovingImage( moving );
+  multires->SetNumberOfLevels( 2 );
+  multires->SetNumberOfIterations( numberOfIterations );
+  multires->SetFixedImageMask( mask );
+  multires->SetMovingImageMask( mask );
+  multires->UpdateLargestPossibleRegion();
+
+  const MultiResRegistrationType::RegistrationType * levelRegistrator = multires->GetRegistrationFilter();
+  std::cout << "Multi-resolution metric: " << levelRegistrator->GetMetric() << std::endl;
+  if( levelRegistrator->GetFixedImageMask() || levelRegistrator->GetMovingImageMask()
+      || levelRegistrator->GetNumberOfActivePixels() == 0
+      || levelRegistrator->GetMetric() > 0.25 * initialMetric )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
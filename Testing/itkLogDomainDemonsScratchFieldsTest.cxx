@@ -0,0 +1,78 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkLogDomainDemonsRegistrationFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "FillWithCircle.h"
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::LogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType> RegistrationType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{64, 64}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {30.0, 32.0};
+  const double       movingCenter[ImageDimension] = {33.0, 31.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 15.0, fixed, moving );
+
+  bool testPassed = true;
+
+  for( unsigned int engine = 0; engine < 2; ++engine )
+    {
+    // The number of allocations should not depend on the number of
+    // iterations once the scratch fields are allocated
+    unsigned long allocations[2];
+    const unsigned int numberOfIterations[2] = {2, 20};
+    for( unsigned int run = 0; run < 2; ++run )
+      {
+      RegistrationType::Pointer registrator = RegistrationType::New();
+      registrator->SetMovingImage( moving );
+      registrator->SetFixedImage( fixed );
+      registrator->SetNumberOfIterations( numberOfIterations[run] );
+      registrator->SetStandardDeviations( 1.0 );
+      registrator->SmoothUpdateFieldOn();
+      registrator->SetUpdateFieldStandardDeviations( 0.8 );
+      registrator->SetMaximumUpdateStepLength( 2.0 );
+      registrator->SetNumberOfBCHApproximationTerms( 3 );
+      registrator->UseFusedUpdateOn();
+      registrator->SetSmoothingEngine(
+        static_cast<RegistrationType::SmoothingEngineType>( engine ) );
+      registrator->Update();
+
+      allocations[run] = registrator->GetNumberOfScratchAllocations();
+
+      std::cout << "Engine: " << engine
+                << "  iterations: " << numberOfIterations[run]
+                << "  metric: " << registrator->GetMetric()
+                << "  scratch allocations: " << allocations[run]
+                << std::endl;
+      }
+
+    if( allocations[0] != allocations[1] )
+      {
+      testPassed = false;
+      }
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkVector.h"
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
+#include "itkMultiResolutionDisplacementToVelocityFieldLogFilter.h"
+#include "vnl/vnl_math.h"
+
+// Mean squared difference between two fields, away from the borders
+template <class TField>
+double
+ComputeMeanSquaredDifference(TField * field1, TField * field2, unsigned int margin)
+{
+  typedef itk::ImageRegionIteratorWithIndex<TField> FieldIterator;
+
+  const typename TField::RegionType & region = field1->GetLargestPossibleRegion();
+
+  double       squareDiff = 0.0;
+  unsigned int count = 0;
+  FieldIterator it1( field1, region );
+  FieldIterator it2( field2, region );
+  for( ; !it1.IsAtEnd(); ++it1, ++it2 )
+    {
+    bool inside = true;
+    for( unsigned int j = 0; j < TField::ImageDimension; j++ )
+      {
+      inside = inside && it1.GetIndex()[j] >= static_cast<typename TField::IndexValueType>( margin )
+        && it1.GetIndex()[j] < static_cast<typename TField::IndexValueType>( region.GetSize()[j] - margin );
+      }
+    if( inside )
+      {
+      squareDiff += ( it1.Get() - it2.Get() ).GetSquaredNorm();
+      ++count;
+      }
+    }
+  return squareDiff / count;
+}
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+
+  typedef itk::Vector<double, ImageDimension>    VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+
+  typedef itk::ImageRegionIteratorWithIndex<FieldType>                                   FieldIterator;
+  typedef itk::ExponentialDisplacementFieldImageFilter<FieldType, FieldType>             ExpFilterType;
+  typedef itk::MultiResolutionDisplacementToVelocityFieldLogFilter<FieldType, FieldType> MultiResLogFilterType;
+  typedef MultiResLogFilterType::LogFilterType                                           LogFilterType;
+
+  bool testPassed = true;
+
+  // A large and smooth velocity field
+  FieldType::RegionType region;
+  FieldType::SizeType   size = {{96, 96}};
+  region.SetSize( size );
+
+  FieldType::Pointer velocity = FieldType::New();
+  velocity->SetRegions( region );
+  velocity->Allocate();
+  for( FieldIterator it( velocity, region ); !it.IsAtEnd(); ++it )
+    {
+    const FieldType::IndexType & idx = it.GetIndex();
+    VectorType                   value;
+    value[0] = 5.0 * vcl_sin( 2.0 * vnl_math::pi * idx[1] / size[1] );
+    value[1] = 4.0 * vcl_cos( 2.0 * vnl_math::pi * idx[0] / size[0] );
+    it.Set( value );
+    }
+
+  ExpFilterType::Pointer exper = ExpFilterType::New();
+  exper->SetInput( velocity );
+  exper->Update();
+
+  // Reference: a few iterations at full resolution only
+  const unsigned int numberOfFinestIterations = 2;
+
+  LogFilterType::Pointer singleResolution = LogFilterType::New();
+  singleResolution->SetInput( exper->GetOutput() );
+  singleResolution->SetNumberOfIterations( numberOfFinestIterations );
+  singleResolution->SetNumberOfExponentialIntegrationSteps( 100 );
+  singleResolution->Update();
+
+  const double singleResolutionError =
+    ComputeMeanSquaredDifference<FieldType>( velocity, singleResolution->GetOutput(), 8 );
+
+  // The same full resolution iterations after the coarser levels
+  const unsigned int numberOfIterations[3] = {10, 10, numberOfFinestIterations};
+
+  MultiResLogFilterType::Pointer multiResolution = MultiResLogFilterType::New();
+  multiResolution->SetInput( exper->GetOutput() );
+  multiResolution->SetNumberOfLevels( 3 );
+  multiResolution->SetNumberOfIterations( numberOfIterations );
+  multiResolution->GetLogFilter()->SetNumberOfExponentialIntegrationSteps( 100 );
+  multiResolution->Update();
+
+  const double multiResolutionError =
+    ComputeMeanSquaredDifference<FieldType>( velocity, multiResolution->GetOutput(), 8 );
+
+  std::cout << "Mean squared error with " << numberOfFinestIterations << " iterations: "
+            << singleResolutionError << " at full resolution only, "
+            << multiResolutionError << " after the coarser levels" << std::endl;
+  std::cout << "Elapsed iterations:";
+  for( unsigned int level = 0; level < 3; level++ )
+    {
+    std::cout << " " << multiResolution->GetElapsedIterations()[level];
+    if( multiResolution->GetElapsedIterations()[level] != numberOfIterations[level] )
+      {
+      testPassed = false;
+      }
+    }
+  std::cout << std::endl;
+
+  // The output is at full resolution and the coarse levels help
+  if( multiResolution->GetOutput()->GetLargestPossibleRegion() != region
+      || multiResolutionError >= singleResolutionError
+      || multiResolutionError > 0.05 )
+    {
+    testPassed = false;
+    }
+
+  // Starting from the logarithm itself, the tolerance is met at once
+  LogFilterType::Pointer initialized = LogFilterType::New();
+  initialized->SetInput( exper->GetOutput() );
+  initialized->SetInitialVelocityField( velocity );
+  initialized->SetNumberOfIterations( 10 );
+  initialized->SetNumberOfExponentialIntegrationSteps( 100 );
+  initialized->SetTolerance( 0.1 );
+  initialized->Update();
+
+  std::cout << "Iterations from the exact logarithm: " << initialized->GetElapsedIterations()
+            << ", residual " << initialized->GetResidualHistory().front() << std::endl;
+  if( initialized->GetElapsedIterations() != 0 )
+    {
+    testPassed = false;
+    }
+
+  // The output is a copy of the initial velocity field, not its buffer
+  if( initialized->GetOutput()->GetBufferPointer() == velocity->GetBufferPointer()
+      || ComputeMeanSquaredDifference<FieldType>( velocity, initialized->GetOutput(), 0 ) != 0.0 )
+    {
+    std::cout << "The output shares the buffer of the initial velocity field" << std::endl;
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
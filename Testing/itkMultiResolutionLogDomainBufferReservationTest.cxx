@@ -0,0 +1,145 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkCommand.h"
+#include "FillWithCircle.h"
+
+#include <vector>
+
+// Record the number of buffer allocations of the registration filter
+// at the end of each level
+template <class TMultiRes>
+class AllocationCountObserver : public itk::Command
+{
+public:
+  typedef AllocationCountObserver  Self;
+  typedef itk::Command             Superclass;
+  typedef itk::SmartPointer<Self>  Pointer;
+  itkNewMacro( Self );
+
+  void Execute(const itk::Object *, const itk::EventObject & )
+  {
+    std::cout << "Should not be called on a const object" << std::endl;
+  }
+
+  void Execute(itk::Object * caller, const itk::EventObject & event)
+  {
+    if( !itk::IterationEvent().CheckEvent( &event ) )
+      {
+      return;
+      }
+    TMultiRes * multires = dynamic_cast<TMultiRes *>( caller );
+    const typename TMultiRes::RegistrationType * filter = multires->GetRegistrationFilter();
+    m_Counts.push_back( filter->GetNumberOfBufferAllocations() + filter->GetNumberOfScratchAllocations() );
+    std::cout << "  level " << multires->GetCurrentLevel()
+              << "  allocations: " << m_Counts.back() << std::endl;
+  }
+
+  std::vector<unsigned long> m_Counts;
+protected:
+  AllocationCountObserver()
+  {
+  }
+};
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::DefaultRegistrationType                                 RegistrationType;
+  typedef AllocationCountObserver<MultiResRegistrationType>                                 ObserverType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{96, 80}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {46.0, 40.0};
+  const double       movingCenter[ImageDimension] = {50.0, 38.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 20.0, fixed, moving );
+
+  const unsigned int numberOfIterations[3] = {5, 5, 5};
+
+  FieldType::Pointer    fields[2];
+  ObserverType::Pointer observers[2];
+  for( unsigned int reserve = 0; reserve < 2; ++reserve )
+    {
+    // Smoothing the update field also uses a scratch field
+    RegistrationType::Pointer filter = RegistrationType::New();
+    filter->SmoothUpdateFieldOn();
+
+    observers[reserve] = ObserverType::New();
+
+    MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+    multires->SetRegistrationFilter( filter );
+    multires->SetFixedImage( fixed );
+    multires->SetMovingImage( moving );
+    multires->SetNumberOfLevels( 3 );
+    multires->SetNumberOfIterations( numberOfIterations );
+    multires->SetReserveRegistrationBuffers( reserve == 1 );
+    multires->AddObserver( itk::IterationEvent(), observers[reserve] );
+
+    std::cout << "Reserve registration buffers: " << reserve << std::endl;
+    multires->UpdateLargestPossibleRegion();
+
+    fields[reserve] = multires->GetVelocityField();
+    fields[reserve]->DisconnectPipeline();
+    }
+
+  bool testPassed = true;
+
+  // The reservation does not change the result
+  double maxDiff = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIterator;
+  FieldIterator defaultIt( fields[0], fields[0]->GetLargestPossibleRegion() );
+  FieldIterator reservedIt( fields[1], fields[1]->GetLargestPossibleRegion() );
+  for( ; !defaultIt.IsAtEnd(); ++defaultIt, ++reservedIt )
+    {
+    maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( defaultIt.Get() - reservedIt.Get() ).GetNorm() ) );
+    }
+  std::cout << "Max difference between the velocity fields: " << maxDiff << std::endl;
+  if( maxDiff > 1e-6 )
+    {
+    testPassed = false;
+    }
+
+  // Without reservation the buffers grow at each level, with it they are
+  // all allocated at the first level
+  const std::vector<unsigned long> & defaultCounts = observers[0]->m_Counts;
+  const std::vector<unsigned long> & reservedCounts = observers[1]->m_Counts;
+  if( defaultCounts.size() != 3 || reservedCounts.size() != 3 )
+    {
+    testPassed = false;
+    }
+  else
+    {
+    if( reservedCounts[0] == 0 || reservedCounts[2] != reservedCounts[0] )
+      {
+      testPassed = false;
+      }
+    if( defaultCounts[2] <= defaultCounts[0] )
+      {
+      testPassed = false;
+      }
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
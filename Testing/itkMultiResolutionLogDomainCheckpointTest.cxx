@@ -0,0 +1,250 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkCommand.h"
+#include "FillWithCircle.h"
+
+#include <cstdio>
+
+// Stop the multi-resolution registration after the given iteration of
+// the given level, as an interruption would
+template <class TMultiRes>
+class StopObserver : public itk::Command
+{
+public:
+  typedef StopObserver            Self;
+  typedef itk::Command            Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  itkNewMacro( Self );
+
+  void Execute(const itk::Object *, const itk::EventObject & )
+  {
+    std::cout << "Should not be called on a const object" << std::endl;
+  }
+
+  void Execute(itk::Object *, const itk::EventObject & event)
+  {
+    if( !itk::IterationEvent().CheckEvent( &event ) )
+      {
+      return;
+      }
+    if( m_MultiRes->GetCurrentLevel() == m_Level
+        && m_MultiRes->GetRegistrationFilter()->GetElapsedIterations() == m_Iteration )
+      {
+      std::cout << "  stopping at level " << m_Level << ", iteration " << m_Iteration << std::endl;
+      m_MultiRes->StopRegistration();
+      }
+  }
+
+  TMultiRes *  m_MultiRes;
+  unsigned int m_Level;
+  unsigned int m_Iteration;
+protected:
+  StopObserver()
+  {
+    m_MultiRes = 0;
+    m_Level = 0;
+    m_Iteration = 0;
+  }
+};
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::DefaultRegistrationType                                 RegistrationType;
+  typedef StopObserver<MultiResRegistrationType>                                            ObserverType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{96, 80}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {46.0, 40.0};
+  const double       movingCenter[ImageDimension] = {50.0, 38.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 20.0, fixed, moving );
+
+  const unsigned int numberOfIterations[3] = {6, 6, 6};
+  const char *       checkpointFileName = "itkMultiResolutionLogDomainCheckpointTest.ckpt";
+
+  bool testPassed = true;
+
+  // Reference run, not interrupted
+  FieldType::Pointer referenceField;
+  {
+  MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+  multires->SetFixedImage( fixed );
+  multires->SetMovingImage( moving );
+  multires->SetNumberOfLevels( 3 );
+  multires->SetNumberOfIterations( numberOfIterations );
+  multires->UpdateLargestPossibleRegion();
+
+  referenceField = multires->GetVelocityField();
+  referenceField->DisconnectPipeline();
+  }
+
+  // Interrupt at the end of the first level and in the middle of the
+  // second one, then resume from the checkpoint
+  const unsigned int stopLevels[2] = {0, 1};
+  const unsigned int stopIterations[2] = {6, 4};
+  const unsigned int expectedNumberOfCheckpoints[2] = {1, 5};
+  for( unsigned int run = 0; run < 2; ++run )
+    {
+    std::cout << "Interrupted run " << run << std::endl;
+
+    RegistrationType::Pointer filter = RegistrationType::New();
+
+    MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+    multires->SetRegistrationFilter( filter );
+    multires->SetFixedImage( fixed );
+    multires->SetMovingImage( moving );
+    multires->SetNumberOfLevels( 3 );
+    multires->SetNumberOfIterations( numberOfIterations );
+    multires->SetCheckpointFileName( checkpointFileName );
+    multires->SetCheckpointInterval( 2 * run );
+
+    ObserverType::Pointer observer = ObserverType::New();
+    observer->m_MultiRes = multires;
+    observer->m_Level = stopLevels[run];
+    observer->m_Iteration = stopIterations[run];
+    filter->AddObserver( itk::IterationEvent(), observer );
+
+    multires->UpdateLargestPossibleRegion();
+
+    std::cout << "  checkpoints: " << multires->GetNumberOfCheckpoints() << std::endl;
+    if( multires->GetNumberOfCheckpoints() != expectedNumberOfCheckpoints[run] )
+      {
+      testPassed = false;
+      }
+
+    // Resume with a new registration
+    MultiResRegistrationType::Pointer resumed = MultiResRegistrationType::New();
+    resumed->SetFixedImage( fixed );
+    resumed->SetMovingImage( moving );
+    resumed->SetNumberOfLevels( 3 );
+    resumed->SetNumberOfIterations( numberOfIterations );
+    resumed->SetResumeFileName( checkpointFileName );
+    resumed->UpdateLargestPossibleRegion();
+
+    // The levels before the checkpoint are not run again
+    std::cout << "  elapsed iterations:";
+    for( unsigned int level = 0; level < 3; ++level )
+      {
+      std::cout << " " << resumed->GetElapsedIterations()[level];
+      if( resumed->GetElapsedIterations()[level] != numberOfIterations[level] )
+        {
+        testPassed = false;
+        }
+      }
+    std::cout << std::endl;
+
+    // The resumed registration ends where the reference one does
+    FieldType::Pointer resumedField = resumed->GetVelocityField();
+    double             maxDiff = 0.0;
+    typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIterator;
+    FieldIterator referenceIt( referenceField, referenceField->GetLargestPossibleRegion() );
+    FieldIterator resumedIt( resumedField, resumedField->GetLargestPossibleRegion() );
+    for( ; !referenceIt.IsAtEnd(); ++referenceIt, ++resumedIt )
+      {
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( referenceIt.Get() - resumedIt.Get() ).GetNorm() ) );
+      }
+    std::cout << "  max difference with the reference velocity field: " << maxDiff << std::endl;
+    if( maxDiff > 1e-5 )
+      {
+      testPassed = false;
+      }
+    }
+
+  // A checkpoint is not resumed on another fixed image
+  {
+  ImageType::RegionType otherRegion;
+  ImageType::SizeType   otherSize = {{80, 80}};
+  otherRegion.SetSize( otherSize );
+
+  ImageType::Pointer otherFixed = ImageType::New();
+  otherFixed->SetRegions( otherRegion );
+  otherFixed->Allocate();
+  FillWithCircle<ImageType>( otherFixed, fixedCenter, 20.0, 250.0, 15.0 );
+
+  MultiResRegistrationType::Pointer resumed = MultiResRegistrationType::New();
+  resumed->SetFixedImage( otherFixed );
+  resumed->SetMovingImage( moving );
+  resumed->SetNumberOfLevels( 3 );
+  resumed->SetNumberOfIterations( numberOfIterations );
+  resumed->SetResumeFileName( checkpointFileName );
+  try
+    {
+    resumed->UpdateLargestPossibleRegion();
+    std::cout << "A checkpoint was resumed on another fixed image" << std::endl;
+    testPassed = false;
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Other fixed image rejected: " << err.GetDescription() << std::endl;
+    }
+  }
+
+  typedef itk::VelocityFieldCheckpoint<FieldType> CheckpointType;
+
+  // A count larger than the file is rejected before any allocation
+  {
+  std::FILE * file = std::fopen( checkpointFileName, "r+b" );
+  // magic string, five 32-bit header values and the level
+  std::fseek( file, 8 + 6 * 4, SEEK_SET );
+  const unsigned char hugeCount[4] = { 0xff, 0xff, 0xff, 0x7f };
+  std::fwrite( hugeCount, 1, sizeof( hugeCount ), file );
+  std::fclose( file );
+
+  CheckpointType::Pointer checkpoint = CheckpointType::New();
+  try
+    {
+    checkpoint->Read( checkpointFileName );
+    std::cout << "A corrupted checkpoint was read" << std::endl;
+    testPassed = false;
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Corrupted checkpoint rejected: " << err.GetDescription() << std::endl;
+    }
+  }
+
+  // A file that is not a checkpoint is rejected
+  {
+  std::FILE * file = std::fopen( checkpointFileName, "wb" );
+  std::fputs( "not a checkpoint", file );
+  std::fclose( file );
+
+  CheckpointType::Pointer checkpoint = CheckpointType::New();
+  try
+    {
+    checkpoint->Read( checkpointFileName );
+    std::cout << "An invalid checkpoint was read" << std::endl;
+    testPassed = false;
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Invalid checkpoint rejected: " << err.GetDescription() << std::endl;
+    }
+  }
+  std::remove( checkpointFileName );
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
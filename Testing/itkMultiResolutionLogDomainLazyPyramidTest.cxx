@@ -0,0 +1,205 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIterator.h"
+#include "FillWithCircle.h"
+
+// Compare the images of each level given to the registration filter with
+// the outputs of reference pyramids, at the first iteration of the level
+template <class TMultiRes, class TPyramid>
+class LevelObserver : public itk::Command
+{
+public:
+  typedef LevelObserver           Self;
+  typedef itk::Command            Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  itkNewMacro( Self );
+
+  void Execute(const itk::Object *, const itk::EventObject & )
+  {
+    std::cout << "Should not be called on a const object" << std::endl;
+  }
+
+  void Execute(itk::Object *, const itk::EventObject & event)
+  {
+    if( !itk::IterationEvent().CheckEvent( &event )
+        || m_MultiRes->GetRegistrationFilter()->GetElapsedIterations() != 1 )
+      {
+      return;
+      }
+    const unsigned int level = m_MultiRes->GetCurrentLevel();
+    this->Compare( m_MultiRes->GetRegistrationFilter()->GetFixedImage(), m_FixedPyramid->GetOutput( level ) );
+    this->Compare( m_MultiRes->GetRegistrationFilter()->GetMovingImage(), m_MovingPyramid->GetOutput( level ) );
+    ++m_NumberOfLevels;
+  }
+
+  template <class TImage>
+  void Compare(const TImage * image, const TImage * reference)
+  {
+    if( image->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion() )
+      {
+      m_MaxDifference = itk::NumericTraits<double>::max();
+      return;
+      }
+    typedef itk::ImageRegionConstIterator<TImage> Iterator;
+    Iterator imageIt( image, image->GetLargestPossibleRegion() );
+    Iterator referenceIt( reference, reference->GetLargestPossibleRegion() );
+    for( ; !imageIt.IsAtEnd(); ++imageIt, ++referenceIt )
+      {
+      m_MaxDifference = vnl_math_max( m_MaxDifference,
+                                      static_cast<double>( vnl_math_abs( imageIt.Get() - referenceIt.Get() ) ) );
+      }
+  }
+
+  TMultiRes *  m_MultiRes;
+  TPyramid *   m_FixedPyramid;
+  TPyramid *   m_MovingPyramid;
+  double       m_MaxDifference;
+  unsigned int m_NumberOfLevels;
+protected:
+  LevelObserver()
+  {
+    m_MultiRes = 0;
+    m_FixedPyramid = 0;
+    m_MovingPyramid = 0;
+    m_MaxDifference = 0.0;
+    m_NumberOfLevels = 0;
+  }
+};
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::FixedImagePyramidType                                   PyramidType;
+  typedef LevelObserver<MultiResRegistrationType, PyramidType>                              ObserverType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{96, 80}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {46.0, 40.0};
+  const double       movingCenter[ImageDimension] = {50.0, 38.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 20.0, fixed, moving );
+
+  const unsigned int numberOfIterations[3] = {5, 5, 5};
+
+  // Pyramids whose configuration differs from the default one
+  PyramidType::ScheduleType schedule( 3, ImageDimension );
+  schedule[0][0] = 4;
+  schedule[0][1] = 2;
+  schedule[1][0] = 2;
+  schedule[1][1] = 2;
+  schedule[2][0] = 1;
+  schedule[2][1] = 1;
+
+  PyramidType::Pointer referencePyramids[2];
+  ImageType::Pointer   images[2] = { fixed, moving };
+  for( unsigned int i = 0; i < 2; ++i )
+    {
+    referencePyramids[i] = PyramidType::New();
+    referencePyramids[i]->SetNumberOfLevels( 3 );
+    referencePyramids[i]->SetSchedule( schedule );
+#if (ITK_VERSION_MAJOR >= 4)
+    referencePyramids[i]->SetMaximumError( 0.01 );
+    referencePyramids[i]->UseShrinkImageFilterOn();
+#endif
+    referencePyramids[i]->SetInput( images[i] );
+    referencePyramids[i]->UpdateLargestPossibleRegion();
+    }
+
+  bool testPassed = true;
+
+  FieldType::Pointer fields[2];
+  MultiResRegistrationType::SizeValueType peakMemory[2];
+  for( unsigned int lazy = 0; lazy < 2; ++lazy )
+    {
+    PyramidType::Pointer pyramids[2];
+    for( unsigned int i = 0; i < 2; ++i )
+      {
+      pyramids[i] = PyramidType::New();
+      pyramids[i]->SetNumberOfLevels( 3 );
+      pyramids[i]->SetSchedule( schedule );
+#if (ITK_VERSION_MAJOR >= 4)
+      pyramids[i]->SetMaximumError( 0.01 );
+      pyramids[i]->UseShrinkImageFilterOn();
+#endif
+      }
+
+    MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+    multires->SetFixedImage( fixed );
+    multires->SetMovingImage( moving );
+    multires->SetFixedImagePyramid( pyramids[0] );
+    multires->SetMovingImagePyramid( pyramids[1] );
+    multires->SetNumberOfLevels( 3 );
+    multires->SetNumberOfIterations( numberOfIterations );
+    multires->SetUseLazyPyramid( lazy == 1 );
+
+    ObserverType::Pointer observer = ObserverType::New();
+    observer->m_MultiRes = multires;
+    observer->m_FixedPyramid = referencePyramids[0];
+    observer->m_MovingPyramid = referencePyramids[1];
+    multires->GetRegistrationFilter()->AddObserver( itk::IterationEvent(), observer );
+
+    multires->UpdateLargestPossibleRegion();
+
+    fields[lazy] = multires->GetVelocityField();
+    fields[lazy]->DisconnectPipeline();
+    peakMemory[lazy] = multires->GetPeakPyramidMemory();
+
+    std::cout << "Lazy pyramid: " << lazy
+              << "  peak pyramid memory: " << peakMemory[lazy] << " bytes"
+              << "  max difference with the reference levels: " << observer->m_MaxDifference << std::endl;
+
+    // The levels are those of the customized pyramids, voxel by voxel
+    if( observer->m_NumberOfLevels != 3 || observer->m_MaxDifference > 0.0 )
+      {
+      testPassed = false;
+      }
+    }
+
+  // Both modes compute the same levels
+  double maxDiff = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIterator;
+  FieldIterator eagerIt( fields[0], fields[0]->GetLargestPossibleRegion() );
+  FieldIterator lazyIt( fields[1], fields[1]->GetLargestPossibleRegion() );
+  for( ; !eagerIt.IsAtEnd(); ++eagerIt, ++lazyIt )
+    {
+    maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( eagerIt.Get() - lazyIt.Get() ).GetNorm() ) );
+    }
+  std::cout << "Max difference between the velocity fields: " << maxDiff << std::endl;
+  if( maxDiff > 1e-4 )
+    {
+    testPassed = false;
+    }
+
+  // The finest level holds the images at full resolution, the other
+  // levels only add to the eager peak
+  const MultiResRegistrationType::SizeValueType finestLevelMemory =
+    2 * region.GetNumberOfPixels() * sizeof( float );
+  if( peakMemory[1] != finestLevelMemory || peakMemory[0] <= peakMemory[1] )
+    {
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
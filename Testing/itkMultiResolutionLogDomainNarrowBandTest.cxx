@@ -0,0 +1,127 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkWarpImageFilter.h"
+#include "FillWithCircle.h"
+
+// Mean squared difference between the fixed image and the moving image
+// warped by the given field
+template <class TImage, class TField>
+double
+ComputeMeanSquaredError(TImage * fixed, TImage * moving, TField * field)
+{
+  typedef itk::WarpImageFilter<TImage, TImage, TField>                           WarperType;
+  typedef itk::LinearInterpolateImageFunction<TImage, typename WarperType::CoordRepType> InterpolatorType;
+
+  typename WarperType::Pointer warper = WarperType::New();
+  warper->SetInput( moving );
+#if (ITK_VERSION_MAJOR < 4)
+  warper->SetDeformationField( field );
+#else
+  warper->SetDisplacementField( field );
+#endif
+  warper->SetInterpolator( InterpolatorType::New() );
+  warper->SetOutputSpacing( fixed->GetSpacing() );
+  warper->SetOutputOrigin( fixed->GetOrigin() );
+  warper->SetOutputDirection( fixed->GetDirection() );
+  warper->SetEdgePaddingValue( 15.0 );
+  warper->Update();
+
+  double mse = 0.0;
+  typedef itk::ImageRegionIteratorWithIndex<TImage> Iterator;
+  Iterator fixedIt( fixed, fixed->GetBufferedRegion() );
+  Iterator warpedIt( warper->GetOutput(), fixed->GetBufferedRegion() );
+  for( ; !fixedIt.IsAtEnd(); ++fixedIt, ++warpedIt )
+    {
+    mse += vnl_math_sqr( static_cast<double>( fixedIt.Get() ) - warpedIt.Get() );
+    }
+  return mse / fixed->GetBufferedRegion().GetNumberOfPixels();
+}
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::DefaultRegistrationType                                 RegistrationType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{128, 128}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {62.0, 64.0};
+  const double       movingCenter[ImageDimension] = {66.0, 61.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 30.0, fixed, moving );
+
+  FieldType::Pointer zeroField = FieldType::New();
+  zeroField->SetRegions( region );
+  zeroField->Allocate();
+  zeroField->FillBuffer( VectorType( 0.0f ) );
+  const double initialError = ComputeMeanSquaredError<ImageType, FieldType>( fixed, moving, zeroField );
+
+  const unsigned int numberOfIterations[3] = {10, 10, 20};
+
+  bool   testPassed = true;
+  double errors[2];
+  for( unsigned int run = 0; run < 2; ++run )
+    {
+    RegistrationType::Pointer filter = RegistrationType::New();
+
+    MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+    multires->SetRegistrationFilter( filter );
+    multires->SetFixedImage( fixed );
+    multires->SetMovingImage( moving );
+    multires->SetNumberOfLevels( 3 );
+    multires->SetNumberOfIterations( numberOfIterations );
+    if( run == 1 )
+      {
+      multires->UseNarrowBandAtFinestLevelOn();
+      multires->SetNarrowBandThreshold( 5.0 );
+      multires->SetNarrowBandUpdateInterval( 4 );
+      }
+    multires->UpdateLargestPossibleRegion();
+
+    errors[run] = ComputeMeanSquaredError<ImageType, FieldType>( fixed, moving, multires->GetDeformationField() );
+    std::cout << ( run == 1 ? "Narrow band" : "Full image" )
+              << "  MSE: " << errors[run] << " (initial " << initialError << ")"
+              << "  active voxels: " << filter->GetNumberOfActivePixels()
+              << " of " << region.GetNumberOfPixels()
+              << "  active set built in " << filter->GetActiveSetBuildTime() << " s" << std::endl;
+
+    // The narrow band is restricted to the edges of the circles
+    if( run == 1 && ( filter->GetNumberOfActivePixels() == 0
+                      || filter->GetNumberOfActivePixels() >= region.GetNumberOfPixels() / 2 ) )
+      {
+      std::cout << "The narrow band does not leave the matched voxels out" << std::endl;
+      testPassed = false;
+      }
+    }
+
+  // The narrow band leaves the accuracy unchanged
+  if( errors[0] > 0.5 * initialError || vnl_math_abs( errors[1] - errors[0] ) > 0.01 * initialError )
+    {
+    std::cout << "The narrow band changed the accuracy" << std::endl;
+    testPassed = false;
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+// Template function to fill in an image with an ellipse, given in
+// physical coordinates.
+template <class TImage>
+void
+FillWithEllipse(typename TImage::Pointer image,
+                const double * const center,
+                const double radius,
+                const typename TImage::PixelType foregnd,
+                const typename TImage::PixelType backgnd )
+{
+  const double r2 = vnl_math_sqr( radius );
+
+  typedef itk::ImageRegionIteratorWithIndex<TImage> Iterator;
+  for( Iterator it( image, image->GetBufferedRegion() ); !it.IsAtEnd(); ++it )
+    {
+    typename TImage::PointType point;
+    image->TransformIndexToPhysicalPoint( it.GetIndex(), point );
+    double d2 = 0.0;
+    for( unsigned int j = 0; j < TImage::ImageDimension; j++ )
+      {
+      d2 += vnl_math_sqr( point[j] - center[j]);
+      }
+    if( d2 <= r2 )
+      {
+      it.Set( foregnd );
+      }
+    else
+      {
+      it.Set( backgnd );
+      }
+    }
+}
+
+int main(int, char * [] )
+{
+  bool testPassed = true;
+
+  // The factors of an anisotropic 3D image
+  {
+  typedef itk::Image<float, 3>                                                            ImageType;
+  typedef itk::Image<itk::Vector<float, 3>, 3>                                            FieldType;
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+
+  MultiResRegistrationType::SpacingType spacing;
+  spacing[0] = 0.7;
+  spacing[1] = 0.7;
+  spacing[2] = 3.0;
+  const MultiResRegistrationType::ScheduleType schedule =
+    MultiResRegistrationType::ComputeSpacingAwareSchedule( spacing, 3 );
+
+  const unsigned int expected[3][3] = {{4, 4, 1}, {2, 2, 1}, {1, 1, 1}};
+  std::cout << "Schedule:" << std::endl << schedule;
+  for( unsigned int level = 0; level < 3; level++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      if( schedule[level][j] != expected[level][j] )
+        {
+        testPassed = false;
+        }
+      }
+    }
+
+  // An isotropic image gets the default schedule
+  spacing.Fill( 1.5 );
+  const MultiResRegistrationType::ScheduleType isotropicSchedule =
+    MultiResRegistrationType::ComputeSpacingAwareSchedule( spacing, 3 );
+  for( unsigned int level = 0; level < 3; level++ )
+    {
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      if( isotropicSchedule[level][j] != ( 1u << ( 2 - level ) ) )
+        {
+        testPassed = false;
+        }
+      }
+    }
+  }
+
+  // A registration of anisotropic 2D images
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::DefaultRegistrationType                                 RegistrationType;
+
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{128, 32}};
+  region.SetSize( size );
+  ImageType::SpacingType imageSpacing;
+  imageSpacing[0] = 0.5;
+  imageSpacing[1] = 2.0;
+
+  ImageType::Pointer fixed = ImageType::New();
+  fixed->SetRegions( region );
+  fixed->SetSpacing( imageSpacing );
+  fixed->Allocate();
+
+  ImageType::Pointer moving = ImageType::New();
+  moving->SetRegions( region );
+  moving->SetSpacing( imageSpacing );
+  moving->Allocate();
+
+  const double fixedCenter[ImageDimension] = {32.0, 32.0};
+  const double movingCenter[ImageDimension] = {34.0, 30.0};
+  FillWithEllipse<ImageType>( fixed, fixedCenter, 18.0, 250.0, 15.0 );
+  FillWithEllipse<ImageType>( moving, movingCenter, 18.0, 250.0, 15.0 );
+
+  RegistrationType::Pointer filter = RegistrationType::New();
+  filter->StandardDeviationsInPhysicalUnitsOn();
+  filter->SetStandardDeviations( 1.0 );
+
+  const unsigned int                numberOfIterations[3] = {10, 10, 10};
+  MultiResRegistrationType::Pointer multires = MultiResRegistrationType::New();
+  multires->SetRegistrationFilter( filter );
+  multires->SetFixedImage( fixed );
+  multires->SetMovingImage( moving );
+  multires->SetNumberOfLevels( 3 );
+  multires->SetNumberOfIterations( numberOfIterations );
+  multires->UseSpacingAwareScheduleOn();
+  multires->UpdateLargestPossibleRegion();
+
+  // The coarsest level is shrunk along the first axis only
+  std::cout << "Fixed pyramid schedule:" << std::endl << multires->GetFixedImagePyramid()->GetSchedule();
+  if( multires->GetFixedImagePyramid()->GetSchedule()[0][0] != 4
+      || multires->GetFixedImagePyramid()->GetSchedule()[0][1] != 1 )
+    {
+    testPassed = false;
+    }
+
+  // The standard deviations of the finest level are restored
+  if( filter->GetStandardDeviations()[0] != 1.0 || filter->GetStandardDeviations()[1] != 1.0 )
+    {
+    testPassed = false;
+    }
+
+  // The ellipses are brought closer: the edges move along both axes
+  FieldType::Pointer field = multires->GetDeformationField();
+  if( field->GetLargestPossibleRegion() != fixed->GetLargestPossibleRegion() )
+    {
+    testPassed = false;
+    }
+  else
+    {
+    double maxDisplacement = 0.0;
+    double minDisplacement = 0.0;
+    typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIterator;
+    for( FieldIterator it( field, field->GetLargestPossibleRegion() ); !it.IsAtEnd(); ++it )
+      {
+      maxDisplacement = vnl_math_max( maxDisplacement, static_cast<double>( it.Get()[0] ) );
+      minDisplacement = vnl_math_min( minDisplacement, static_cast<double>( it.Get()[1] ) );
+      }
+    std::cout << "Largest displacements: " << maxDisplacement << ", " << minDisplacement << std::endl;
+    if( maxDisplacement < 0.5 || minDisplacement > -0.5 )
+      {
+      testPassed = false;
+      }
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
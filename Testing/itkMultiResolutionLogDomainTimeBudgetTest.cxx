@@ -0,0 +1,207 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkMultiResolutionLogDomainDeformableRegistration.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkCommand.h"
+#include "itksys/SystemTools.hxx"
+#include "FillWithCircle.h"
+
+#include <cstdio>
+
+// Multi-resolution registration whose clock only advances with the
+// simulated cost of the iterations, so that the time budget does not
+// depend on the speed of the machine
+template <class TMultiRes>
+class SimulatedClockRegistration : public TMultiRes
+{
+public:
+  typedef SimulatedClockRegistration Self;
+  typedef TMultiRes                  Superclass;
+  typedef itk::SmartPointer<Self>    Pointer;
+  itkNewMacro( Self );
+
+  double m_Clock;
+protected:
+  SimulatedClockRegistration()
+  {
+    m_Clock = 0.0;
+  }
+
+  virtual double GetWallClockTime() const
+  {
+    return m_Clock;
+  }
+};
+
+// Advance the simulated clock by the cost of each iteration of the
+// registration filter, given per voxel for each level
+template <class TMultiRes>
+class IterationCostObserver : public itk::Command
+{
+public:
+  typedef IterationCostObserver   Self;
+  typedef itk::Command            Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  itkNewMacro( Self );
+
+  void Execute(const itk::Object *, const itk::EventObject & )
+  {
+    std::cout << "Should not be called on a const object" << std::endl;
+  }
+
+  void Execute(itk::Object *, const itk::EventObject & event)
+  {
+    if( !itk::IterationEvent().CheckEvent( &event ) )
+      {
+      return;
+      }
+    const double numberOfPixels = static_cast<double>(
+        m_MultiRes->GetRegistrationFilter()->GetFixedImage()->GetLargestPossibleRegion().GetNumberOfPixels() );
+    m_MultiRes->m_Clock += m_Costs[m_MultiRes->GetCurrentLevel()] * numberOfPixels;
+  }
+
+  SimulatedClockRegistration<TMultiRes> * m_MultiRes;
+  const double *                          m_Costs;
+protected:
+  IterationCostObserver()
+  {
+    m_MultiRes = 0;
+    m_Costs = 0;
+  }
+};
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::MultiResolutionLogDomainDeformableRegistration<ImageType, ImageType, FieldType> MultiResRegistrationType;
+  typedef MultiResRegistrationType::DefaultRegistrationType                                 RegistrationType;
+  typedef SimulatedClockRegistration<MultiResRegistrationType>                              SimulatedRegistrationType;
+  typedef IterationCostObserver<MultiResRegistrationType>                                   ObserverType;
+
+  // Create two shifted circles. With the default schedule, the levels
+  // have 48x48, 96x96 and 192x192 voxels
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{192, 192}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {94.0, 96.0};
+  const double       movingCenter[ImageDimension] = {100.0, 92.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 40.0, fixed, moving );
+
+  // A power of two, so that the simulated times are exact
+  const double cost = 1.0 / 1048576.0;
+  const double costs[3][3] = {{cost, cost, cost}, {cost, cost, cost}, {cost, 20.0 * cost, cost}};
+  const char * checkpointFileName = "itkMultiResolutionLogDomainTimeBudgetTest.ckpt";
+
+  // A budget twice too short for the requested iterations, the pyramids
+  // taking no time on the simulated clock, one that is not limiting, and
+  // the first one with the second level much slower than planned
+  const unsigned int numberOfIterations[3][3] = {{100, 100, 100}, {5, 5, 5}, {100, 100, 100}};
+  const double       shortBudget = 0.5 * 100.0 * ( 48 * 48 + 96 * 96 + 192 * 192 ) * cost;
+  const double       timeBudgets[3] = {shortBudget, 1.0, shortBudget};
+
+  // After the first iteration, the levels are given the same share of the
+  // remaining time, which is replanned exactly at the start of each level.
+  // In the last run, the second level only has time for 12 of its 50
+  // iterations and is stopped at the deadline, the budget being kept
+  const unsigned int expectedBudgets[3][3] = {{50, 50, 50}, {5, 5, 5}, {50, 50, 50}};
+  const unsigned int expectedIterations[3][3] = {{50, 50, 50}, {5, 5, 5}, {50, 12, 0}};
+  const unsigned int expectedDeadlineIterations[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 12, 0}};
+  const double       expectedLevelTimes[3][3] =
+    {
+      {50.0 * 48 * 48 * cost, 50.0 * 96 * 96 * cost, 50.0 * 192 * 192 * cost},
+      {5.0 * 48 * 48 * cost, 5.0 * 96 * 96 * cost, 5.0 * 192 * 192 * cost},
+      {50.0 * 48 * 48 * cost, 12.0 * 20.0 * 96 * 96 * cost, 0.0}
+    };
+
+  // The incomplete second level must not be checkpointed as completed
+  const unsigned int expectedNumberOfCheckpoints[3] = {0, 0, 1};
+
+  bool testPassed = true;
+  for( unsigned int run = 0; run < 3; ++run )
+    {
+    RegistrationType::Pointer filter = RegistrationType::New();
+
+    SimulatedRegistrationType::Pointer multires = SimulatedRegistrationType::New();
+    multires->SetRegistrationFilter( filter );
+    multires->SetFixedImage( fixed );
+    multires->SetMovingImage( moving );
+    multires->SetNumberOfLevels( 3 );
+    multires->SetNumberOfIterations( numberOfIterations[run] );
+    multires->SetTimeBudget( timeBudgets[run] );
+    if( run == 2 )
+      {
+      multires->SetCheckpointFileName( checkpointFileName );
+      }
+
+    // Added before the observer of the multi-resolution registration, the
+    // clock is advanced before the budget is checked
+    ObserverType::Pointer observer = ObserverType::New();
+    observer->m_MultiRes = multires;
+    observer->m_Costs = costs[run];
+    filter->AddObserver( itk::IterationEvent(), observer );
+
+    // The wall-clock time is only informative
+    const double startTime = itksys::SystemTools::GetTime();
+    multires->UpdateLargestPossibleRegion();
+    const double elapsedTime = itksys::SystemTools::GetTime() - startTime;
+
+    std::cout << "Run " << run << ": simulated time " << multires->m_Clock << " s for a budget of "
+              << timeBudgets[run] << " s (" << elapsedTime << " s of wall-clock time)" << std::endl;
+    for( unsigned int level = 0; level < 3; level++ )
+      {
+      std::cout << "  level " << level
+                << "  budgeted: " << multires->GetBudgetedIterations()[level]
+                << "  run: " << multires->GetElapsedIterations()[level]
+                << "  stopped at: " << multires->GetDeadlineIterations()[level]
+                << "  time: " << multires->GetLevelTimes()[level] << " s" << std::endl;
+      if( multires->GetBudgetedIterations()[level] != expectedBudgets[run][level]
+          || multires->GetElapsedIterations()[level] != expectedIterations[run][level]
+          || multires->GetDeadlineIterations()[level] != expectedDeadlineIterations[run][level]
+          || multires->GetLevelTimes()[level] != expectedLevelTimes[run][level] )
+        {
+        testPassed = false;
+        }
+      }
+
+    std::cout << "  checkpoints: " << multires->GetNumberOfCheckpoints() << std::endl;
+    if( multires->GetNumberOfCheckpoints() != expectedNumberOfCheckpoints[run] )
+      {
+      testPassed = false;
+      }
+
+    if( multires->m_Clock > timeBudgets[run] )
+      {
+      std::cout << "The deadline was missed" << std::endl;
+      testPassed = false;
+      }
+
+    // The output is a valid field at full resolution
+    FieldType::Pointer field = multires->GetVelocityField();
+    if( field->GetLargestPossibleRegion() != fixed->GetLargestPossibleRegion() )
+      {
+      testPassed = false;
+      }
+    }
+
+  std::remove( checkpointFileName );
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkGaussianOperator.h"
+#include "itkVectorNeighborhoodOperatorImageFilter.h"
+#include "itkSeparableVectorFieldSmoothingFilter.h"
+
+#include "vnl/vnl_math.h"
+
+#include <iostream>
+
+const unsigned int ImageDimension = 3;
+
+typedef itk::Vector<float, ImageDimension>           PixelType;
+typedef itk::Image<PixelType, ImageDimension>        ImageType;
+typedef itk::ImageRegionIteratorWithIndex<ImageType> IteratorType;
+
+int main(int, char * [] )
+{
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{23, 17, 12}};
+  region.SetSize( size );
+
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 0.5;
+  spacing[2] = 2.0;
+
+  ImageType::Pointer field = ImageType::New();
+  field->SetRegions( region );
+  field->SetSpacing( spacing );
+  field->Allocate();
+
+  // A non smooth field with a different pattern on each component
+  for( IteratorType it( field, region ); !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType & idx = it.GetIndex();
+    PixelType                    v;
+    v[0] = static_cast<float>( ( 7 * idx[0] + 3 * idx[1] + idx[2] ) % 11 );
+    v[1] = static_cast<float>( vcl_sin( 0.9 * idx[0] ) * vcl_cos( 1.3 * idx[2] ) );
+    v[2] = static_cast<float>( idx[1] * idx[2] % 5 ) - 2.0f;
+    it.Set( v );
+    }
+
+  const double standardDeviations[ImageDimension] = {1.5, 0.8, 2.5};
+  const double maximumError = 0.05;
+  const unsigned int maximumKernelWidth = 20;
+
+  // Reference: one VectorNeighborhoodOperatorImageFilter pass per dimension
+  typedef itk::GaussianOperator<float, ImageDimension> OperatorType;
+  typedef itk::VectorNeighborhoodOperatorImageFilter<ImageType, ImageType> ReferenceSmootherType;
+
+  ImageType::Pointer reference = field;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    OperatorType oper;
+    oper.SetDirection( j );
+    oper.SetVariance( vnl_math_sqr( standardDeviations[j] ) );
+    oper.SetMaximumError( maximumError );
+    oper.SetMaximumKernelWidth( maximumKernelWidth );
+    oper.CreateDirectional();
+
+    ReferenceSmootherType::Pointer smoother = ReferenceSmootherType::New();
+    smoother->SetOperator( oper );
+    smoother->SetInput( reference );
+    smoother->Update();
+    reference = smoother->GetOutput();
+    reference->DisconnectPipeline();
+    }
+
+  typedef itk::SeparableVectorFieldSmoothingFilter<ImageType> SmootherType;
+
+  bool testPassed = true;
+
+  // Blocks that do not divide the image size exercise the partial blocks
+  const unsigned int linesPerBlock[3] = {1, 5, 16};
+  for( unsigned int b = 0; b < 3; ++b )
+    {
+    // The filter runs in place, work on a copy of the field
+    ImageType::Pointer result = ImageType::New();
+    result->SetRegions( region );
+    result->SetSpacing( spacing );
+    result->Allocate();
+    IteratorType srcIt( field, region );
+    IteratorType dstIt( result, region );
+    for( ; !srcIt.IsAtEnd(); ++srcIt, ++dstIt )
+      {
+      dstIt.Set( srcIt.Get() );
+      }
+
+    SmootherType::Pointer smoother = SmootherType::New();
+    smoother->SetStandardDeviations( const_cast<double *>( standardDeviations ) );
+    smoother->SetMaximumError( maximumError );
+    smoother->SetMaximumKernelWidth( maximumKernelWidth );
+    smoother->SetNumberOfLinesPerBlock( linesPerBlock[b] );
+    smoother->SetInput( result );
+    smoother->Update();
+
+    if( smoother->GetOutput()->GetBufferPointer() != result->GetBufferPointer() )
+      {
+      std::cout << "The filter did not run in place." << std::endl;
+      testPassed = false;
+      }
+
+    double maxDiff = 0.0;
+    IteratorType refIt( reference, region );
+    IteratorType resIt( result, region );
+    for( ; !refIt.IsAtEnd(); ++refIt, ++resIt )
+      {
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( refIt.Get() - resIt.Get() ).GetNorm() ) );
+      }
+
+    std::cout << "Lines per block: " << linesPerBlock[b]
+              << "  max difference: " << maxDiff << std::endl;
+    if( maxDiff > 1e-4 )
+      {
+      testPassed = false;
+      }
+    }
+
+  // A smoothing region gets the values of the whole smoothing and the
+  // field is unchanged outside of it
+  {
+  ImageType::Pointer result = ImageType::New();
+  result->SetRegions( region );
+  result->SetSpacing( spacing );
+  result->Allocate();
+  IteratorType srcIt( field, region );
+  IteratorType dstIt( result, region );
+  for( ; !srcIt.IsAtEnd(); ++srcIt, ++dstIt )
+    {
+    dstIt.Set( srcIt.Get() );
+    }
+
+  ImageType::RegionType box;
+  ImageType::IndexType  boxIndex = {{6, 4, 3}};
+  ImageType::SizeType   boxSize = {{9, 7, 5}};
+  box.SetIndex( boxIndex );
+  box.SetSize( boxSize );
+
+  SmootherType::Pointer smoother = SmootherType::New();
+  smoother->SetStandardDeviations( const_cast<double *>( standardDeviations ) );
+  smoother->SetMaximumError( maximumError );
+  smoother->SetMaximumKernelWidth( maximumKernelWidth );
+  smoother->SetSmoothingRegion( box );
+  smoother->SetInput( result );
+  smoother->Update();
+
+  double maxDiffInside = 0.0;
+  double maxDiffOutside = 0.0;
+  IteratorType refIt( reference, region );
+  IteratorType resIt( result, region );
+  IteratorType fieldIt( field, region );
+  for( ; !refIt.IsAtEnd(); ++refIt, ++resIt, ++fieldIt )
+    {
+    if( box.IsInside( resIt.GetIndex() ) )
+      {
+      maxDiffInside = vnl_math_max( maxDiffInside, static_cast<double>( ( refIt.Get() - resIt.Get() ).GetNorm() ) );
+      }
+    else
+      {
+      maxDiffOutside = vnl_math_max( maxDiffOutside,
+                                     static_cast<double>( ( fieldIt.Get() - resIt.Get() ).GetNorm() ) );
+      }
+    }
+
+  std::cout << "Smoothing region  max difference inside: " << maxDiffInside
+            << "  max change outside: " << maxDiffOutside << std::endl;
+  if( maxDiffInside > 1e-4 || maxDiffOutside != 0.0 )
+    {
+    testPassed = false;
+    }
+  }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include <iostream>
+
+#include "itkSymmetricLogDomainDemonsRegistrationFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "FillWithCircle.h"
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+  typedef itk::Vector<float, ImageDimension>     VectorType;
+  typedef itk::Image<VectorType, ImageDimension> FieldType;
+  typedef itk::Image<float, ImageDimension>      ImageType;
+
+  typedef itk::SymmetricLogDomainDemonsRegistrationFilter<ImageType, ImageType, FieldType> RegistrationType;
+
+  // Create two shifted circles
+  ImageType::RegionType region;
+  ImageType::SizeType   size = {{64, 64}};
+  region.SetSize( size );
+
+  const double       fixedCenter[ImageDimension] = {30.0, 32.0};
+  const double       movingCenter[ImageDimension] = {33.0, 31.0};
+  ImageType::Pointer fixed;
+  ImageType::Pointer moving;
+  CreateShiftedCircles<ImageType>( region, fixedCenter, movingCenter, 15.0, fixed, moving );
+
+  bool testPassed = true;
+
+  for( unsigned int numTerms = 2; numTerms <= 3; ++numTerms )
+    {
+    FieldType::Pointer results[2];
+    for( unsigned int symmetric = 0; symmetric < 2; ++symmetric )
+      {
+      RegistrationType::Pointer registrator = RegistrationType::New();
+      registrator->SetMovingImage( moving );
+      registrator->SetFixedImage( fixed );
+      registrator->SetNumberOfIterations( 20 );
+      registrator->SetStandardDeviations( 1.0 );
+      registrator->SetMaximumUpdateStepLength( 2.0 );
+      registrator->SetNumberOfBCHApproximationTerms( numTerms );
+      registrator->SetUseSymmetricForceFunction( symmetric == 1 );
+      registrator->Update();
+
+      std::cout << "BCH terms: " << numTerms << "  symmetric function: " << symmetric
+                << "  metric: " << registrator->GetMetric()
+                << "  RMS change: " << registrator->GetRMSChange()
+                << std::endl;
+
+      results[symmetric] = registrator->GetOutput();
+      results[symmetric]->DisconnectPipeline();
+      }
+
+    // Both force computations should give the same velocity field
+    double maxDiff = 0.0;
+    itk::ImageRegionConstIterator<FieldType> it0( results[0], region );
+    itk::ImageRegionConstIterator<FieldType> it1( results[1], region );
+    for( ; !it0.IsAtEnd(); ++it0, ++it1 )
+      {
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( it0.Get() - it1.Get() ).GetNorm() ) );
+      }
+
+    std::cout << "Max difference between separate and symmetric force functions: " << maxDiff << std::endl;
+    if( maxDiff > 1e-3 )
+      {
+      testPassed = false;
+      }
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
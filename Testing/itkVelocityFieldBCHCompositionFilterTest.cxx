@@ -13,6 +13,7 @@
 #include "itkDisplacementFieldCompositionFilter.h"
 #include "itkSmoothingRecursiveGaussianImageFilter.h"
 #include "itkVelocityFieldBCHCompositionFilter.h"
+#include "itkVelocityFieldLieBracketFilter.h"
 #include "itkStreamingImageFilter.h"
 #include "vnl/vnl_math.h"
 #include <vnl/vnl_random.h>
@@ -306,6 +307,60 @@ int main(int, char * [] )
       }
     }
 
+  // =============================================================
+
+  std::cout << "3) Checking against explicit Lie brackets." << std::endl;
+
+  typedef itk::VelocityFieldLieBracketFilter<FieldType, FieldType> LieBracketFilterType;
+
+  LieBracketFilterType::Pointer bracketFilter = LieBracketFilterType::New();
+  bracketFilter->SetInput( 0, leftfield );
+  bracketFilter->SetInput( 1, rightfield );
+  bracketFilter->Update();
+
+  // [lf,[lf,rf]] and [rf,[lf,rf]]
+  LieBracketFilterType::Pointer leftBracketFilter = LieBracketFilterType::New();
+  leftBracketFilter->SetInput( 0, leftfield );
+  leftBracketFilter->SetInput( 1, bracketFilter->GetOutput() );
+  leftBracketFilter->Update();
+
+  LieBracketFilterType::Pointer rightBracketFilter = LieBracketFilterType::New();
+  rightBracketFilter->SetInput( 0, rightfield );
+  rightBracketFilter->SetInput( 1, bracketFilter->GetOutput() );
+  rightBracketFilter->Update();
+
+  for( unsigned int num_bch_terms = 3; num_bch_terms < 5; ++num_bch_terms )
+    {
+    composer->SetNumberOfApproximationTerms( num_bch_terms );
+    composer->Update();
+
+    FieldIterator outIter( composer->GetOutput(), leftregion );
+    FieldIterator leftIter2( leftfield, leftregion );
+    FieldIterator rightIter2( rightfield, leftregion );
+    FieldIterator bracketIter( bracketFilter->GetOutput(), leftregion );
+    FieldIterator leftBracketIter( leftBracketFilter->GetOutput(), leftregion );
+    FieldIterator rightBracketIter( rightBracketFilter->GetOutput(), leftregion );
+
+    double maxDiff = 0.0;
+    for( ; !outIter.IsAtEnd(); ++outIter, ++leftIter2, ++rightIter2, ++bracketIter,
+         ++leftBracketIter, ++rightBracketIter )
+      {
+      PixelType expected = leftIter2.Get() + rightIter2.Get() + bracketIter.Get() * 0.5;
+      if( num_bch_terms == 4 )
+        {
+        // 1/12 [lf,[lf,rf]] + 1/12 [rf,[rf,lf]]
+        expected += ( leftBracketIter.Get() - rightBracketIter.Get() ) / 12.0;
+        }
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( outIter.Get() - expected ).GetNorm() ) );
+      }
+
+    std::cout << "Max difference with number of terms = " << num_bch_terms << ": " << maxDiff << std::endl;
+    if( maxDiff > 1e-4 )
+      {
+      testPassed = false;
+      }
+    }
+
   std::cout << std::endl;
   std::cout << "Comparing errors." << std::endl;
   std::cout << "MSE with number of terms = " << 2 << " :  MSE = " << MSEs[0] << std::endl;
@@ -0,0 +1,153 @@
+#if defined(_MSC_VER)
+#pragma warning ( disable : 4786 )
+#endif
+
+#include "itkImage.h"
+#include "itkVector.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkVelocityFieldExponentialComposedWithDisplacementFieldFilter.h"
+
+#include "vnl/vnl_math.h"
+
+#include <iostream>
+
+int main(int, char * [] )
+{
+  const unsigned int ImageDimension = 2;
+
+  typedef itk::Vector<double, ImageDimension>          PixelType;
+  typedef itk::Image<PixelType, ImageDimension>        FieldType;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType> IteratorType;
+
+  typedef itk::VelocityFieldExponentialComposedWithDisplacementFieldFilter<FieldType, FieldType, FieldType>
+  FilterType;
+
+  FieldType::RegionType region;
+  FieldType::SizeType   size = {{48, 40}};
+  region.SetSize( size );
+
+  FieldType::Pointer velocity = FieldType::New();
+  velocity->SetRegions( region );
+  velocity->Allocate();
+
+  FieldType::Pointer displacement = FieldType::New();
+  displacement->SetRegions( region );
+  displacement->Allocate();
+
+  // Smooth velocity and displacement fields of a few voxels
+  IteratorType velIt( velocity, region );
+  IteratorType dispIt( displacement, region );
+  for( ; !velIt.IsAtEnd(); ++velIt, ++dispIt )
+    {
+    const FieldType::IndexType & idx = velIt.GetIndex();
+    const double                 x = static_cast<double>( idx[0] ) / size[0];
+    const double                 y = static_cast<double>( idx[1] ) / size[1];
+    PixelType                    v;
+    v[0] = 3.0 * vcl_sin( vnl_math::pi * x ) * vcl_cos( vnl_math::pi * y );
+    v[1] = -2.0 * vcl_cos( vnl_math::pi * x ) * vcl_sin( 2.0 * vnl_math::pi * y );
+    velIt.Set( v );
+
+    PixelType d;
+    d[0] = 1.5 * vcl_sin( 2.0 * vnl_math::pi * y );
+    d[1] = 1.0 * vcl_cos( vnl_math::pi * x );
+    dispIt.Set( d );
+    }
+
+  bool testPassed = true;
+  for( unsigned int inverse = 0; inverse < 2; ++inverse )
+    {
+    // Reference: fine forward Euler integration
+    FilterType::Pointer euler = FilterType::New();
+    euler->SetInput( displacement );
+    euler->SetVelocityField( velocity );
+    euler->SetComputeInverse( inverse == 1 );
+    euler->SetNumberOfIntegrationSteps( 500 );
+    euler->Update();
+
+    // Methods compared to the reference, with their tolerances
+    const FilterType::IntegrationMethodType methods[3] =
+      {
+      FilterType::ScalingAndSquaringIntegration,
+      FilterType::RungeKutta4Integration,
+      FilterType::AdaptiveRungeKutta45Integration
+      };
+    const char * const methodNames[3] = {"scaling and squaring", "RK4", "adaptive RK45"};
+    const double       maxMeanDiff[3] = {0.05, 0.01, 0.01};
+    const double       maxMaxDiff[3] = {0.25, 0.05, 0.05};
+
+    for( unsigned int m = 0; m < 3; ++m )
+      {
+      FilterType::Pointer filter = FilterType::New();
+      filter->SetInput( displacement );
+      filter->SetVelocityField( velocity );
+      filter->SetComputeInverse( inverse == 1 );
+      filter->SetIntegrationMethod( methods[m] );
+      if( methods[m] == FilterType::RungeKutta4Integration )
+        {
+        filter->SetNumberOfIntegrationSteps( 4 );
+        }
+      else if( methods[m] == FilterType::AdaptiveRungeKutta45Integration )
+        {
+        filter->SetNumberOfIntegrationSteps( 2 );
+        filter->SetIntegrationTolerance( 1e-3 );
+        }
+      filter->Update();
+
+      // Compare away from the borders, where both extrapolate differently
+      double       maxDiff = 0.0;
+      double       meanDiff = 0.0;
+      unsigned int count = 0;
+      IteratorType eulerIt( euler->GetOutput(), region );
+      IteratorType filterIt( filter->GetOutput(), region );
+      for( ; !eulerIt.IsAtEnd(); ++eulerIt, ++filterIt )
+        {
+        const FieldType::IndexType & idx = eulerIt.GetIndex();
+        bool                         inside = true;
+        for( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          inside = inside && idx[j] >= 8 && idx[j] < static_cast<FieldType::IndexValueType>( size[j] ) - 8;
+          }
+        if( inside )
+          {
+          const double diff = ( eulerIt.Get() - filterIt.Get() ).GetNorm();
+          maxDiff = vnl_math_max( maxDiff, diff );
+          meanDiff += diff;
+          ++count;
+          }
+        }
+      meanDiff /= count;
+
+      std::cout << ( inverse ? "exp(-v)o phi" : "exp(v)o phi" ) << ", " << methodNames[m]
+                << ": mean difference to 500 Euler steps " << meanDiff
+                << ", max " << maxDiff
+                << ", velocity evaluations per voxel "
+                << static_cast<double>( filter->GetNumberOfVelocityEvaluations() ) / region.GetNumberOfPixels()
+                << std::endl;
+      if( meanDiff > maxMeanDiff[m] || maxDiff > maxMaxDiff[m] )
+        {
+        testPassed = false;
+        }
+
+      // The adaptive integration is cheaper than the reference
+      if( methods[m] == FilterType::AdaptiveRungeKutta45Integration )
+        {
+        std::cout << "  accepted steps " << filter->GetNumberOfAcceptedSteps()
+                  << ", rejected steps " << filter->GetNumberOfRejectedSteps() << std::endl;
+        if( filter->GetNumberOfAcceptedSteps() < region.GetNumberOfPixels()
+            || filter->GetNumberOfVelocityEvaluations() >= 500 * region.GetNumberOfPixels() )
+          {
+          testPassed = false;
+          }
+        }
+      }
+    }
+
+  if( !testPassed )
+    {
+    std::cout << "Test failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkVectorCastImageFilter.h"
 #include "itkVelocityFieldLieBracketFilter.h"
+#include "itkVectorCentralDifferenceImageFunction.h"
 #include "itkSmoothingRecursiveGaussianImageFilter.h"
 #include "itkStreamingImageFilter.h"
 #include "itkAddImageFilter.h"
@@ -441,6 +442,74 @@ int main(int, char * [] )
 
     }
 
+  // ------------------------------------
+    {
+    std::cout << "5) Checking against the formula using gradient calculators." << std::endl;
+
+    // Use an anisotropic spacing and a rotated frame
+    FieldType::SpacingType spacing;
+    spacing[0] = 0.7;
+    spacing[1] = 1.6;
+
+    FieldType::DirectionType direction;
+    const double             angle = 0.3;
+    direction[0][0] = vcl_cos( angle );
+    direction[0][1] = -vcl_sin( angle );
+    direction[1][0] = vcl_sin( angle );
+    direction[1][1] = vcl_cos( angle );
+
+    FieldType::Pointer u_field = FieldType::New();
+    u_field->Graft( leftfield );
+    u_field->SetSpacing( spacing );
+    u_field->SetDirection( direction );
+
+    FieldType::Pointer v_field = FieldType::New();
+    v_field->Graft( rightfield );
+    v_field->SetSpacing( spacing );
+    v_field->SetDirection( direction );
+
+    ComposerType::Pointer uv_comp = ComposerType::New();
+    uv_comp->SetInput( 0, u_field );
+    uv_comp->SetInput( 1, v_field );
+    uv_comp->Update();
+
+    typedef itk::VectorCentralDifferenceImageFunction<FieldType> GradientCalculatorType;
+    GradientCalculatorType::Pointer u_grad = GradientCalculatorType::New();
+    GradientCalculatorType::Pointer v_grad = GradientCalculatorType::New();
+    u_grad->SetInputImage( u_field );
+    v_grad->SetInputImage( v_field );
+
+    double maxDiff = 0.0;
+    for( FieldIterator it( uv_comp->GetOutput(), uv_comp->GetOutput()->GetBufferedRegion() );
+         !it.IsAtEnd(); ++it )
+      {
+      const IndexType &                        index = it.GetIndex();
+      const GradientCalculatorType::OutputType ugrad = u_grad->EvaluateAtIndex( index );
+      const GradientCalculatorType::OutputType vgrad = v_grad->EvaluateAtIndex( index );
+      const PixelType &                        uval = u_field->GetPixel( index );
+      const PixelType &                        vval = v_field->GetPixel( index );
+
+      PixelType expected;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        double val = 0.0;
+        for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+          {
+          val += ugrad(d, dd) * vval[dd] - vgrad(d, dd) * uval[dd];
+          }
+        expected[d] = val;
+        }
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( ( expected - it.Get() ).GetNorm() ) );
+      }
+
+    std::cout << "  max difference: " << maxDiff << std::endl;
+    if( maxDiff > 1e-4 )
+      {
+      testPassed = false;
+      std::cout << "Failed: the Lie bracket differs from the formula." << std::endl;
+      }
+    }
+
   // =============================================================
 
   std::cout << "Run Filter with streamer";